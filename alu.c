@@ -0,0 +1,297 @@
+/*
+ * Data Processing instructions (AND ... MVN)
+ *
+ * Each opcode has its own handler which is stored in the DECODED record, so the opcode does not have to be switched on
+ * every time an instruction executes.
+ *
+ * -------------------------------------------------------------------------------
+ * | Cond | 00 | I | OpCode | S | Rn | Rd | Operand 2                            |
+ * -------------------------------------------------------------------------------
+ *
+ * and MUL and MLA, which sit in the same space with bits 7..4 set to 1001.
+ */
+
+#include <stdio.h>
+
+#include "flags.h"
+#include "shifter.h"
+
+
+/*
+ * The 4096 rotated immediates (see shifter.h), worked out by the compiler. Bits 8..11 of n are half the rotate.
+ */
+#define IMMEDIATE_ROTATE(n)  (((n) >> 7) & 30)
+#define IMMEDIATE_VALUE(n)   ((((n) & 0xffu) >> IMMEDIATE_ROTATE(n)) | (((n) & 0xffu) << ((32 - IMMEDIATE_ROTATE(n)) & 31)))
+#define IMMEDIATES_1(n)      { IMMEDIATE_VALUE(n), IMMEDIATE_ROTATE(n)? IMMEDIATE_VALUE(n) >> 31 : SHIFTER_CARRY_UNCHANGED },
+#define IMMEDIATES_2(n)      IMMEDIATES_1(n) IMMEDIATES_1((n) + 1)
+#define IMMEDIATES_4(n)      IMMEDIATES_2(n) IMMEDIATES_2((n) + 2)
+#define IMMEDIATES_8(n)      IMMEDIATES_4(n) IMMEDIATES_4((n) + 4)
+#define IMMEDIATES_16(n)     IMMEDIATES_8(n) IMMEDIATES_8((n) + 8)
+#define IMMEDIATES_32(n)     IMMEDIATES_16(n) IMMEDIATES_16((n) + 16)
+#define IMMEDIATES_64(n)     IMMEDIATES_32(n) IMMEDIATES_32((n) + 32)
+#define IMMEDIATES_128(n)    IMMEDIATES_64(n) IMMEDIATES_64((n) + 64)
+#define IMMEDIATES_256(n)    IMMEDIATES_128(n) IMMEDIATES_128((n) + 128)
+#define IMMEDIATES_512(n)    IMMEDIATES_256(n) IMMEDIATES_256((n) + 256)
+#define IMMEDIATES_1024(n)   IMMEDIATES_512(n) IMMEDIATES_512((n) + 512)
+#define IMMEDIATES_2048(n)   IMMEDIATES_1024(n) IMMEDIATES_1024((n) + 1024)
+
+const IMMEDIATE immediateTable[4096] = {
+    IMMEDIATES_2048(0u)
+    IMMEDIATES_2048(2048u)
+};
+
+/*
+ * Operand 2 is either the rotated 8 bit immediate (already worked out when the instruction was decoded) or register Rm
+ * passed through the barrel shifter kernel the decoder picked. carry holds the current C flag on entry and the shifter
+ * carry out on return.
+ */
+REGISTER getOperand2(CPU *cpu, const DECODED *decoded, int *carry) {
+    if(decoded->immediate) {
+        if(decoded->immediateCarry != SHIFTER_CARRY_UNCHANGED)
+            *carry = decoded->immediateCarry;
+        return decoded->operand2;
+    }
+
+    // LSR #0 and ASR #0 mean #32 (LSL #0 and ROR #0 have kernels of their own)
+    REGISTER value = cpu->registers[decoded->regM];
+    uint32_t amount = decoded->shiftByRegister? cpu->registers[decoded->regS] & BITMASK_8_BIT
+                                              : decoded->shiftAmount | (uint32_t)(decoded->shiftAmount == 0) << 5;
+
+    switch(decoded->shifter) {
+        case SHIFTER_LSL:
+            return shiftLSL(value, amount, carry);
+        case SHIFTER_LSR:
+            return shiftLSR(value, amount, carry);
+        case SHIFTER_ASR:
+            return shiftASR(value, amount, carry);
+        case SHIFTER_ROR:
+            return shiftROR(value, amount, carry);
+        case SHIFTER_RRX:
+            return shiftRRX(value, carry);
+        default: // SHIFTER_NONE
+            return value;
+    }
+}
+
+const HANDLER aluHandlers[16] = {
+    doAND, doEOR, doSUB, doRSB, doADD, doADC, doSBC, doRSC,
+    doTST, doTEQ, doCMP, doCMN, doORR, doMOV, doBIC, doMVN
+};
+
+/*
+ * Handler for data processing instructions with R15 as an operand. Because of the pipeline R15 reads as the address
+ * of the instruction + 8, or + 12 when there is a shift by register, rather than the + 4 the PC holds while an
+ * instruction executes. As Rm it comes with the PSR (modes.c), as Rn or Rs it is the PC alone; an instruction with R15
+ * as both Rn and Rm gets the PC alone for both. The decoder only gives this handler to instructions that read R15, so
+ * the rest don't pay.
+ */
+void doReadingPc(CPU *cpu, const DECODED *decoded) {
+    REGISTER next = cpu->registers[PROGRAM_COUNTER];
+    REGISTER pc = next + ((decoded->shiftByRegister && !decoded->immediate)? 8 : 4);
+
+    if(!decoded->immediate && decoded->regM == PROGRAM_COUNTER
+            && (decoded->regN != PROGRAM_COUNTER || decoded->opCode == OP_MOV || decoded->opCode == OP_MVN))
+        pc = pcWithPsr(cpu, pc);
+    cpu->registers[PROGRAM_COUNTER] = pc;
+    aluHandlers[decoded->opCode](cpu, decoded);
+    if(decoded->regDest != PROGRAM_COUNTER || (decoded->opCode >= OP_TST && decoded->opCode <= OP_CMN))
+        cpu->registers[PROGRAM_COUNTER] = next;
+}
+
+/*
+ * Handler for data processing instructions with R15 as the destination. Only the PC bits of the result go to the PC.
+ * With the S bit the rest of it goes to the PSR rather than the flags being set the usual way, which is how MOVS PC, R14
+ * and SUBS PC, R14, #4 return from exceptions. TEQP and the other tests (R15 as the destination of a test) write the
+ * PSR from what they compute and leave the PC alone.
+ */
+void doWritingPc(CPU *cpu, const DECODED *decoded) {
+    static const BYTE computes[4] = { OP_AND, OP_EOR, OP_SUB, OP_ADD }; // for TST TEQ CMP CMN
+    REGISTER next = cpu->registers[PROGRAM_COUNTER];
+    bool test = decoded->opCode >= OP_TST && decoded->opCode <= OP_CMN;
+    bool writesPsr = test || decoded->updateStatus;
+    DECODED writing;
+
+    if(writesPsr) {
+        writing = *decoded;
+        writing.opCode = test? computes[decoded->opCode - OP_TST] : decoded->opCode;
+        writing.updateStatus = false;
+        decoded = &writing;
+    }
+
+    doReadingPc(cpu, decoded); // with R15 as the destination the result is left in it, whatever is read
+    REGISTER result = cpu->registers[PROGRAM_COUNTER];
+    cpu->registers[PROGRAM_COUNTER] = test? next : result & PC_MASK;
+    if(writesPsr)
+        restorePsr(cpu, result);
+}
+
+static void writeResult(CPU *cpu, const DECODED *decoded, REGISTER result) {
+    cpu->registers[decoded->regDest] = result;
+}
+
+void doAND(CPU *cpu, const DECODED *decoded) {
+    if(TRACE)
+        printf("\tProcessing AND function\n");
+    int carry = carryFlag(cpu);
+    REGISTER result = cpu->registers[decoded->regN] & getOperand2(cpu, decoded, &carry);
+    writeResult(cpu, decoded, result);
+    if(decoded->updateStatus)
+        setLogicalFlags(cpu, result, carry);
+}
+
+void doEOR(CPU *cpu, const DECODED *decoded) {
+    if(TRACE)
+        printf("\tProcessing Exclusive-OR function\n");
+    int carry = carryFlag(cpu);
+    REGISTER result = cpu->registers[decoded->regN] ^ getOperand2(cpu, decoded, &carry);
+    writeResult(cpu, decoded, result);
+    if(decoded->updateStatus)
+        setLogicalFlags(cpu, result, carry);
+}
+
+void doSUB(CPU *cpu, const DECODED *decoded) {
+    if(TRACE)
+        printf("\tProcessing SUB function\n");
+    int carry = carryFlag(cpu);
+    REGISTER op2 = getOperand2(cpu, decoded, &carry);
+    writeResult(cpu, decoded, addWithCarry(cpu, cpu->registers[decoded->regN], ~op2, 1, decoded->updateStatus));
+}
+
+void doRSB(CPU *cpu, const DECODED *decoded) {
+    if(TRACE)
+        printf("\tProcessing RSB function\n");
+    int carry = carryFlag(cpu);
+    REGISTER op2 = getOperand2(cpu, decoded, &carry);
+    writeResult(cpu, decoded, addWithCarry(cpu, op2, ~cpu->registers[decoded->regN], 1, decoded->updateStatus));
+}
+
+void doADD(CPU *cpu, const DECODED *decoded) {
+    if(TRACE)
+        printf("\tProcessing ADD function\n");
+    int carry = carryFlag(cpu);
+    REGISTER op2 = getOperand2(cpu, decoded, &carry);
+    writeResult(cpu, decoded, addWithCarry(cpu, cpu->registers[decoded->regN], op2, 0, decoded->updateStatus));
+}
+
+void doADC(CPU *cpu, const DECODED *decoded) {
+    if(TRACE)
+        printf("\tProcessing ADC function\n");
+    int carryIn = carryFlag(cpu);
+    int carry = carryIn;
+    REGISTER op2 = getOperand2(cpu, decoded, &carry);
+    writeResult(cpu, decoded, addWithCarry(cpu, cpu->registers[decoded->regN], op2, carryIn, decoded->updateStatus));
+}
+
+void doSBC(CPU *cpu, const DECODED *decoded) {
+    if(TRACE)
+        printf("\tProcessing SBC function\n");
+    int carryIn = carryFlag(cpu);
+    int carry = carryIn;
+    REGISTER op2 = getOperand2(cpu, decoded, &carry);
+    writeResult(cpu, decoded, addWithCarry(cpu, cpu->registers[decoded->regN], ~op2, carryIn, decoded->updateStatus));
+}
+
+void doRSC(CPU *cpu, const DECODED *decoded) {
+    if(TRACE)
+        printf("\tProcessing RSC function\n");
+    int carryIn = carryFlag(cpu);
+    int carry = carryIn;
+    REGISTER op2 = getOperand2(cpu, decoded, &carry);
+    writeResult(cpu, decoded, addWithCarry(cpu, op2, ~cpu->registers[decoded->regN], carryIn, decoded->updateStatus));
+}
+
+void doTST(CPU *cpu, const DECODED *decoded) {
+    if(TRACE)
+        printf("\tProcessing TST function\n");
+    int carry = carryFlag(cpu);
+    REGISTER result = cpu->registers[decoded->regN] & getOperand2(cpu, decoded, &carry);
+    setLogicalFlags(cpu, result, carry);
+}
+
+void doTEQ(CPU *cpu, const DECODED *decoded) {
+    if(TRACE)
+        printf("\tProcessing TEQ function\n");
+    int carry = carryFlag(cpu);
+    REGISTER result = cpu->registers[decoded->regN] ^ getOperand2(cpu, decoded, &carry);
+    setLogicalFlags(cpu, result, carry);
+}
+
+void doCMP(CPU *cpu, const DECODED *decoded) {
+    if(TRACE)
+        printf("\tProcessing Compare function\n");
+    int carry = carryFlag(cpu);
+    REGISTER op2 = getOperand2(cpu, decoded, &carry);
+    addWithCarry(cpu, cpu->registers[decoded->regN], ~op2, 1, true);
+}
+
+void doCMN(CPU *cpu, const DECODED *decoded) {
+    if(TRACE)
+        printf("\tProcessing CMN function\n");
+    int carry = carryFlag(cpu);
+    REGISTER op2 = getOperand2(cpu, decoded, &carry);
+    addWithCarry(cpu, cpu->registers[decoded->regN], op2, 0, true);
+}
+
+void doORR(CPU *cpu, const DECODED *decoded) {
+    if(TRACE)
+        printf("\tProcessing ORR function\n");
+    int carry = carryFlag(cpu);
+    REGISTER result = cpu->registers[decoded->regN] | getOperand2(cpu, decoded, &carry);
+    writeResult(cpu, decoded, result);
+    if(decoded->updateStatus)
+        setLogicalFlags(cpu, result, carry);
+}
+
+void doMOV(CPU *cpu, const DECODED *decoded) {
+    if(TRACE)
+        printf("\tProcessing MOV function\n");
+    int carry = carryFlag(cpu);
+    REGISTER result = getOperand2(cpu, decoded, &carry);
+    writeResult(cpu, decoded, result);
+    if(decoded->updateStatus)
+        setLogicalFlags(cpu, result, carry);
+}
+
+void doBIC(CPU *cpu, const DECODED *decoded) {
+    if(TRACE)
+        printf("\tProcessing BIC function\n");
+    int carry = carryFlag(cpu);
+    REGISTER result = cpu->registers[decoded->regN] & ~getOperand2(cpu, decoded, &carry);
+    writeResult(cpu, decoded, result);
+    if(decoded->updateStatus)
+        setLogicalFlags(cpu, result, carry);
+}
+
+void doMVN(CPU *cpu, const DECODED *decoded) {
+    if(TRACE)
+        printf("\tProcessing MVN function\n");
+    int carry = carryFlag(cpu);
+    REGISTER result = ~getOperand2(cpu, decoded, &carry);
+    writeResult(cpu, decoded, result);
+    if(decoded->updateStatus)
+        setLogicalFlags(cpu, result, carry);
+}
+
+/*
+ * MUL and MLA: Rd = Rm * Rs (+ Rn). With S, N and Z come from the result; C is meaningless after a multiply on the
+ * ARM2 and V is unaffected, so both are left as they were. R15 shouldn't be used at all (the assembler refuses it): as
+ * an operand it reads as the address of the instruction + 8, as the destination the result is thrown away.
+ */
+void doMultiply(CPU *cpu, const DECODED *decoded) {
+    REGISTER *registers = cpu->registers;
+    REGISTER pc = registers[PROGRAM_COUNTER] + 4;
+    REGISTER rm = (decoded->regM == PROGRAM_COUNTER)? pc : registers[decoded->regM];
+    REGISTER rs = (decoded->regS == PROGRAM_COUNTER)? pc : registers[decoded->regS];
+    REGISTER result = rm * rs;
+
+    if((decoded->instruction.data32 >> 21) & BITMASK_1_BIT)
+        result += (decoded->regN == PROGRAM_COUNTER)? pc : registers[decoded->regN];
+    if(TRACE)
+        printf("	%s R%d = %08X\n", ((decoded->instruction.data32 >> 21) & BITMASK_1_BIT)? "MLA" : "MUL",
+               decoded->regDest, result);
+
+    if(decoded->regDest != PROGRAM_COUNTER)
+        registers[decoded->regDest] = result;
+    if(decoded->updateStatus)
+        setLogicalFlags(cpu, result, carryFlag(cpu));
+}
@@ -0,0 +1,260 @@
+/*
+ * The AOT engine: runs code translated ahead of time by armpit-aot (see aot.h and aotcompile.c).
+ *
+ * A translation is a shared object with a C function for each basic block armpit-aot found in the image. Loading one
+ * checks it against the machine's memory first: the hash of the instructions it was made from has to match what is
+ * there now, otherwise it is turned away and nothing changes. Its blocks then go in a table per page of memory, keyed
+ * by the address of their first instruction, much as the JIT's are.
+ *
+ * Running, the PC is looked up in the table. A block is run if it is there, it hasn't been written over, it fits in
+ * what is left of the instruction budget and the halt address isn't inside it; each block returns the one that
+ * follows it when it knows, so a run of blocks goes from one to the next without a lookup. Everything else, which is
+ * code armpit-aot didn't find (jumps through registers to somewhere it didn't reach) and blocks that can't be used,
+ * is run by the reference interpreter an instruction at a time.
+ *
+ * The pages blocks cover are marked as holding code, so a store to any of them comes here (invalidateAot()) and a
+ * block it lands in is never run again. A block checks whether that has happened to itself after each of its stores.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+
+#include "aot.h"
+#include "flags.h"
+#include "memory.h"
+
+
+struct AOT {
+    void *library;
+    const AOT_IMAGE *image;
+    uint8_t *live;          // a byte per block, see AOT_CONTEXT
+    int32_t **pageBlocks;   // per page, NULL if no block covers it, otherwise the block starting at each word + 1
+    AOT_CONTEXT context;
+};
+
+
+/*
+ * What blocks call back into, the same handlers and memory functions the interpreter uses
+ */
+static uint32_t loadFromBlock(void *context, uint32_t address, int size) {
+    CPU *cpu = context;
+
+    if(size == 1)
+        return readMemoryByte(cpu, address);
+    int rotate = (address & 3) * 8;
+    uint32_t value = readMemoryWord(cpu, address);
+    return (value >> rotate) | (value << ((32 - rotate) & 31));
+}
+
+static void storeFromBlock(void *context, uint32_t address, uint32_t value, int size) {
+    CPU *cpu = context;
+
+    if(size == 1)
+        writeMemoryByte(cpu, address, (BYTE)value);
+    else
+        writeMemory(cpu, address, (INSTRUCTION){ .data32 = value });
+}
+
+static void interpretFromBlock(void *context, uint32_t address) {
+    CPU *cpu = context;
+    const DECODED *decoded = lookupDecoded(cpu, address);
+
+    decoded->handler(cpu, decoded);
+    getNZCV(cpu); // the block reads the flags back from the status register
+}
+
+// the block starting at address, or AOT_EXIT
+static int32_t blockAt(const AOT *aot, CPU *cpu, REGISTER address) {
+    const int32_t *blocks = aot->pageBlocks[(address & cpu->memoryMask) >> GUEST_PAGE_SHIFT];
+    return (blocks == NULL)? AOT_EXIT : blocks[(address >> 2) & (WORDS_PER_PAGE - 1)] - 1;
+}
+
+/*
+ * Checks each block lies in memory after the one before it, and returns the hash of what they cover
+ */
+static bool hashBlocks(CPU *cpu, const AOT_IMAGE *image, uint64_t *hash) {
+    REGISTER previousEnd = 0;
+
+    *hash = AOT_HASH_START;
+    for(uint32_t i = 0; i < image->blockCount; i++) {
+        const AOT_BLOCK *block = &image->blocks[i];
+        if(block->length == 0 || (block->start & 3) != 0 || block->start < previousEnd
+                || block->start >= cpu->memorySize || block->length > (cpu->memorySize - block->start) / 4)
+            return false;
+        previousEnd = block->start + block->length * 4;
+
+        *hash = aotHash(aotHash(*hash, block->start), block->length);
+        for(REGISTER address = block->start; address != previousEnd; address += 4)
+            *hash = aotHash(*hash, memoryWord(cpu, address));
+    }
+    return true;
+}
+
+static bool indexBlocks(CPU *cpu, AOT *aot) {
+    for(uint32_t i = 0; i < aot->image->blockCount; i++) {
+        const AOT_BLOCK *block = &aot->image->blocks[i];
+        uint32_t firstPage = block->start >> GUEST_PAGE_SHIFT;
+        uint32_t lastPage = (block->start + block->length * 4 - 1) >> GUEST_PAGE_SHIFT;
+
+        for(uint32_t page = firstPage; page <= lastPage; page++) {
+            if(aot->pageBlocks[page] == NULL && (aot->pageBlocks[page] = calloc(WORDS_PER_PAGE, sizeof(int32_t))) == NULL)
+                return false;
+            cpu->pages[page].flags |= PAGE_CODE; // so stores to it are seen
+        }
+        aot->pageBlocks[firstPage][(block->start >> 2) & (WORDS_PER_PAGE - 1)] = (int32_t)i + 1;
+    }
+    return true;
+}
+
+static void releaseAot(CPU *cpu, AOT *aot) {
+    if(aot == NULL)
+        return;
+    if(aot->pageBlocks != NULL) {
+        for(uint32_t i = 0; i < (cpu->memorySize >> GUEST_PAGE_SHIFT); i++)
+            free(aot->pageBlocks[i]);
+    }
+    free(aot->pageBlocks);
+    free(aot->live);
+    dlclose(aot->library);
+    free(aot);
+}
+
+/*
+ * Loads the translation in fileName for the image in memory. Returns false, with the machine as it was, if it can't
+ * be loaded or was made from something else.
+ */
+bool loadAot(CPU *cpu, const char *fileName) {
+    // dlopen() searches the library path for a name without a '/', this is a file name
+    char *path = malloc(strlen(fileName) + 3);
+    if(path == NULL) {
+        printf("Out of memory loading %s\n", fileName);
+        return false;
+    }
+    sprintf(path, "%s%s", strchr(fileName, '/')? "" : "./", fileName);
+
+    void *library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    free(path);
+    if(library == NULL) {
+        printf("Error loading %s: %s\n", fileName, dlerror());
+        return false;
+    }
+
+    const AOT_IMAGE *image = dlsym(library, AOT_SYMBOL);
+    uint64_t hash;
+    if(image == NULL || image->version != AOT_VERSION) {
+        printf("%s isn't a translation armpit-aot made for this version of armpit\n", fileName);
+        dlclose(library);
+        return false;
+    }
+    if(!hashBlocks(cpu, image, &hash) || hash != image->hash) {
+        printf("%s was translated from a different image\n", fileName);
+        dlclose(library);
+        return false;
+    }
+
+    AOT *aot = calloc(1, sizeof(AOT));
+    if(aot != NULL) {
+        aot->library = library;
+        aot->image = image;
+        aot->live = malloc(image->blockCount + 1);
+        aot->pageBlocks = calloc(cpu->memorySize >> GUEST_PAGE_SHIFT, sizeof(int32_t *));
+    }
+    if(aot == NULL || aot->live == NULL || aot->pageBlocks == NULL || !indexBlocks(cpu, aot)) {
+        printf("Out of memory loading %s\n", fileName);
+        if(aot == NULL)
+            dlclose(library);
+        releaseAot(cpu, aot);
+        return false;
+    }
+    memset(aot->live, 1, image->blockCount + 1);
+
+    aot->context = (AOT_CONTEXT){
+        .registers = cpu->registers,
+        .status = &cpu->statusRegister,
+        .live = aot->live,
+        .cpu = cpu,
+        .load = loadFromBlock,
+        .store = storeFromBlock,
+        .interpret = interpretFromBlock
+    };
+
+    freeAot(cpu);
+    cpu->aot = aot;
+    if(VERBOSE)
+        printf("Loaded %u translated blocks from %s\n", image->blockCount, fileName);
+    return true;
+}
+
+void freeAot(CPU *cpu) {
+    releaseAot(cpu, cpu->aot);
+    cpu->aot = NULL;
+}
+
+/*
+ * Called for stores to pages that have been executed or translated, a block with the word in it is never run again
+ */
+void invalidateAot(CPU *cpu, REGISTER address) {
+    AOT *aot = cpu->aot;
+
+    address &= cpu->memoryMask;
+    if(aot == NULL || aot->pageBlocks[address >> GUEST_PAGE_SHIFT] == NULL)
+        return;
+
+    // the last block starting at or before the address
+    const AOT_BLOCK *blocks = aot->image->blocks;
+    uint32_t low = 0, high = aot->image->blockCount;
+    while(high - low > 1) {
+        uint32_t middle = (low + high) / 2;
+        if(blocks[middle].start <= address)
+            low = middle;
+        else
+            high = middle;
+    }
+    if(blocks[low].start <= address && address - blocks[low].start < blocks[low].length * 4)
+        aot->live[low] = 0;
+}
+
+/*
+ * Runs until halt or until maxSteps instructions have been executed (0 means no limit), with translated blocks where
+ * there are any. The threaded interpreter if no translation has been loaded.
+ */
+uint64_t runAot(CPU *cpu, uint64_t maxSteps) {
+    AOT *aot = cpu->aot;
+    uint64_t executed = 0;
+
+    if(aot == NULL)
+        return runThreaded(cpu, maxSteps);
+    if(maxSteps == 0 || maxSteps > INT64_MAX)
+        maxSteps = INT64_MAX;
+
+    AOT_CONTEXT *context = &aot->context;
+    while(executed < maxSteps && cpu->registers[PROGRAM_COUNTER] != cpu->programEnd) {
+        int32_t next = blockAt(aot, cpu, cpu->registers[PROGRAM_COUNTER]);
+
+        if(next != AOT_EXIT) {
+            int64_t budget = (int64_t)(maxSteps - executed);
+            context->budget = budget;
+            getNZCV(cpu); // blocks keep the flags in the status register
+            do {
+                const AOT_BLOCK *block = &aot->image->blocks[next];
+                if(!aot->live[next] || context->budget < block->length
+                        || cpu->programEnd - block->start < block->length * 4)
+                    break;
+                context->budget -= block->length;
+                next = block->function(context);
+            } while(next != AOT_EXIT);
+
+            if(context->budget != budget) {
+                executed += (uint64_t)(budget - context->budget);
+                continue;
+            }
+            // the block can't be run, the interpreter does its first instruction
+        }
+
+        step(cpu);
+        executed++;
+    }
+    return executed;
+}
@@ -0,0 +1,70 @@
+#ifndef __AOT_H__
+#define __AOT_H__
+
+#include <stdint.h>
+
+
+/*
+ * Ahead of time translation
+ *
+ * armpit-aot (aotcompile.c) finds the code of a loaded image by following its branches from the entry point and writes
+ * each basic block out as a C function, which the host compiler builds into a shared object. armpitLoadAot() (aot.c)
+ * loads that back into a machine holding the same image and the AOT engine then runs the functions in place of the
+ * instructions they were made from.
+ *
+ * This is what passes between the two. Generated code has to build without this header, so aotcompile.c writes the
+ * same declarations into every file it generates: a change here needs the same change there, and AOT_VERSION bumped so
+ * that shared objects built before it are turned away.
+ */
+#define AOT_VERSION 1
+#define AOT_SYMBOL  "armpitAotImage"    // the AOT_IMAGE a shared object exports
+#define AOT_EXIT    (-1)                // a block returns this when it doesn't know which block comes next
+
+typedef struct AOT_CONTEXT AOT_CONTEXT;
+
+// runs a block, returns the block to run next (its start is in R15) or AOT_EXIT
+typedef int32_t (*AOT_FUNCTION)(AOT_CONTEXT *);
+
+/*
+ * What a block is handed. The registers are those of the current mode and the flags are in the status register, up
+ * to date, on entry and exit. The caller takes the block's length off the budget before running it; a block that
+ * stops early gives back what it didn't run. Anything a block doesn't do itself goes back to the emulator through
+ * load, store and interpret.
+ */
+struct AOT_CONTEXT {
+    uint32_t *registers;    // R15 is the address of the next instruction
+    uint8_t *status;
+    int64_t budget;         // instructions left to run
+    const uint8_t *live;    // a byte per block, 0 once the guest has written over any of it
+    void *cpu;              // for the functions below
+    uint32_t (*load)(void *cpu, uint32_t address, int size); // size 1 (LDRB) or 4 (LDR, rotated as LDR does)
+    void (*store)(void *cpu, uint32_t address, uint32_t value, int size);
+    void (*interpret)(void *cpu, uint32_t address); // the instruction at address, with R15 already past it
+};
+
+typedef struct AOT_BLOCK {
+    uint32_t start;
+    uint32_t length;        // instructions, the block covers start to start + 4 * length
+    AOT_FUNCTION function;
+} AOT_BLOCK;
+
+typedef struct AOT_IMAGE {
+    uint32_t version;       // AOT_VERSION
+    uint32_t blockCount;
+    uint64_t hash;          // aotHash() of the instructions the blocks were made from
+    const AOT_BLOCK *blocks; // in address order, none overlapping
+} AOT_IMAGE;
+
+
+/*
+ * FNV-1a, a word at a time. An image's hash runs over the start, length and instructions of each block in turn.
+ */
+#define AOT_HASH_START 14695981039346656037ull
+
+static inline uint64_t aotHash(uint64_t hash, uint32_t word) {
+    for(int i = 0; i < 4; i++, word >>= 8)
+        hash = (hash ^ (word & 0xff)) * 1099511628211ull;
+    return hash;
+}
+
+#endif
@@ -0,0 +1,684 @@
+/*
+ * armpit-aot - translates a program ahead of time into native code for the AOT engine.
+ *
+ * Compile using:
+ * 			cmake --build <build directory> --target armpit-aot
+ *
+ * The program is loaded just as armpit loads it, then its code is found by following branches from the entry point
+ * (and from any exception vectors that are set). Every instruction reached is put in a basic block, which ends at a
+ * branch, a SWI, an instruction that always writes R15 or the start of another block. Each block is written out as a
+ * C function and the host C compiler builds the lot into a shared object:
+ *
+ *      armpit-aot -f program.s -o program.so
+ *      armpit -f program.s --aot program.so
+ *
+ * Data processing, single loads and stores and branches are done by the generated code itself, working on the
+ * machine's registers in place and keeping the flags in locals in between. Everything else (block transfers, SWIs,
+ * anything touching R15 that isn't a branch) is handed back to the emulator's own handler for that one instruction,
+ * and the block carries on after it unless the instruction went somewhere else. What the search doesn't find, which is where jumps through registers go to when
+ * nothing branches there directly, isn't translated and runs in the interpreter. aot.h describes the interface the
+ * generated code is built against and aot.c how it is run.
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fork and waitpid when compiling with -std=c11
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "libarmpit.h"
+#include "armpit.h"
+#include "memory.h"
+#include "shifter.h"
+#include "aot.h"
+
+
+#define MAX_BLOCK_LENGTH    256     // instructions, a block longer than what is left of a slice isn't run
+#define TRANSFER_PRE        (1u << 24) // as in transfer.c
+#define TRANSFER_UP         (1u << 23)
+#define TRANSFER_BYTE       (1u << 22)
+#define TRANSFER_WRITEBACK  (1u << 21)
+#define TRANSFER_LOAD       (1u << 20)
+#define SWI_X_BIT           (1u << 17)
+#define OS_EXIT             0x11
+
+#define WORD_CODE           (1 << 0) // reached by following the program
+#define WORD_LEADER         (1 << 1) // something branches or returns here
+
+char USAGE[] = "\nUsage: armpit-aot [arguments]\n\nArguments:\n -f <filename>\tprogram to translate: ARM assembly (.s or .asm), a 32 bit ARM ELF executable, or a flat binary\n -o, --output <file>\tshared object to write (default the program's name ending .so)\n -m, --memory-size <size>\tguest memory in bytes as for armpit (default 64M)\n --load-address <address>\twhere assembly or a flat binary is loaded and starts, as for armpit (default 0x8000)\n --cc <compiler>\thost C compiler (default $CC, or cc)\n -k, --keep-c\tkeep the generated C next to the shared object\n -v\t\tverbose output, lists the blocks\n -h\t\thelp";
+
+#define OPTION_LOAD_ADDRESS 256 // long options without a short form
+#define OPTION_CC 257
+
+static const char *optString = "f:o:m:kvh";
+static const struct option longOptions[] = {
+    { "output", required_argument, NULL, 'o' },
+    { "memory-size", required_argument, NULL, 'm' },
+    { "load-address", required_argument, NULL, OPTION_LOAD_ADDRESS },
+    { "cc", required_argument, NULL, OPTION_CC },
+    { "keep-c", no_argument, NULL, 'k' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+typedef struct BLOCK {
+    REGISTER start;
+    uint32_t length;
+} BLOCK;
+
+typedef struct TRANSLATOR {
+    CPU *cpu;
+    uint8_t *words;         // WORD_ flags for each word of memory
+    REGISTER *pending;      // leaders still to be followed
+    uint32_t pendingCount, pendingSize;
+    BLOCK *blocks;
+    uint32_t blockCount, blockSize;
+    uint32_t native;        // instructions the generated code does itself
+} TRANSLATOR;
+
+static bool verbose = false; // -v option
+
+
+/*
+ * The declarations of aot.h and the barrel shifter kernels of shifter.h, which every generated file starts with so it
+ * builds on its own, followed by what the blocks use to get at the registers and flags.
+ */
+static const char *preamble[] = {
+    "#include <stdint.h>",
+    "",
+    "#define AOT_VERSION 1",
+    "#define AOT_EXIT (-1)",
+    "",
+    "typedef struct AOT_CONTEXT AOT_CONTEXT;",
+    "typedef int32_t (*AOT_FUNCTION)(AOT_CONTEXT *);",
+    "",
+    "struct AOT_CONTEXT {",
+    "    uint32_t *registers;",
+    "    uint8_t *status;",
+    "    int64_t budget;",
+    "    const uint8_t *live;",
+    "    void *cpu;",
+    "    uint32_t (*load)(void *cpu, uint32_t address, int size);",
+    "    void (*store)(void *cpu, uint32_t address, uint32_t value, int size);",
+    "    void (*interpret)(void *cpu, uint32_t address);",
+    "};",
+    "",
+    "typedef struct AOT_BLOCK {",
+    "    uint32_t start;",
+    "    uint32_t length;",
+    "    AOT_FUNCTION function;",
+    "} AOT_BLOCK;",
+    "",
+    "typedef struct AOT_IMAGE {",
+    "    uint32_t version;",
+    "    uint32_t blockCount;",
+    "    uint64_t hash;",
+    "    const AOT_BLOCK *blocks;",
+    "} AOT_IMAGE;",
+    "",
+    "static inline uint32_t shifterCarry(uint32_t amount, uint32_t shifted, uint32_t carry) {",
+    "    uint32_t keep = (uint32_t)(amount == 0) - 1;",
+    "    return (shifted & keep) | (carry & ~keep);",
+    "}",
+    "",
+    "static inline uint32_t shiftLSL(uint32_t value, uint32_t amount, uint32_t *carry) {",
+    "    uint64_t wide = (uint64_t)value << (amount > 33? 33 : amount);",
+    "    *carry = shifterCarry(amount, (uint32_t)(wide >> 32) & 1, *carry);",
+    "    return (uint32_t)wide;",
+    "}",
+    "",
+    "static inline uint32_t shiftLSR(uint32_t value, uint32_t amount, uint32_t *carry) {",
+    "    uint64_t wide = ((uint64_t)value << 32) >> (amount > 33? 33 : amount);",
+    "    *carry = shifterCarry(amount, (uint32_t)(wide >> 31) & 1, *carry);",
+    "    return (uint32_t)(wide >> 32);",
+    "}",
+    "",
+    "static inline uint32_t shiftASR(uint32_t value, uint32_t amount, uint32_t *carry) {",
+    "    int64_t wide = (int64_t)((uint64_t)value << 32) >> (amount > 32? 32 : amount);",
+    "    *carry = shifterCarry(amount, (uint32_t)(wide >> 31) & 1, *carry);",
+    "    return (uint32_t)((uint64_t)wide >> 32);",
+    "}",
+    "",
+    "static inline uint32_t shiftROR(uint32_t value, uint32_t amount, uint32_t *carry) {",
+    "    uint32_t rotate = amount & 31;",
+    "    uint32_t result = (value >> rotate) | (value << ((32 - rotate) & 31));",
+    "    *carry = shifterCarry(amount, result >> 31, *carry);",
+    "    return result;",
+    "}",
+    "",
+    "static inline uint32_t shiftRRX(uint32_t value, uint32_t *carry) {",
+    "    uint32_t result = (value >> 1) | (*carry << 31);",
+    "    *carry = value & 1;",
+    "    return result;",
+    "}",
+    "",
+    "#define LOAD_FLAGS() (n = *context->status >> 7 & 1, z = *context->status >> 6 & 1, c = *context->status >> 5 & 1, \\",
+    "                      v = *context->status >> 4 & 1)",
+    "#define SAVE_FLAGS() (*context->status = (uint8_t)((*context->status & 0x0f) | n << 7 | z << 6 | c << 5 | v << 4))",
+    "#define PSR_BITS()   (n << 31 | z << 30 | c << 29 | v << 28 | (uint32_t)(*context->status & 0x0c) << 24 \\",
+    "                      | (*context->status & 3))",
+    "#define EXIT(next)   do { SAVE_FLAGS(); return next; } while(0)",
+    "",
+    NULL
+};
+
+static const char *conditions[14] = {
+    "z", "!z", "c", "!c", "n", "!n", "v", "!v", "c && !z", "!c || z", "n == v", "n != v", "!z && n == v", "z || n != v"
+};
+
+static const char *shiftFunctions[] = { NULL, "shiftLSL", "shiftLSR", "shiftASR", "shiftROR" };
+
+
+void displayUsage() {
+    puts(USAGE);
+}
+
+static bool push(void **array, uint32_t *size, uint32_t count, size_t elementSize) {
+    if(count < *size)
+        return true;
+    uint32_t newSize = *size? *size * 2 : 256;
+    void *grown = realloc(*array, newSize * elementSize);
+    if(grown == NULL) {
+        printf("Out of memory\n");
+        return false;
+    }
+    *array = grown;
+    *size = newSize;
+    return true;
+}
+
+static bool addLeader(TRANSLATOR *translator, REGISTER address) {
+    if(address >= translator->cpu->memorySize || (translator->words[address >> 2] & WORD_LEADER))
+        return true;
+    translator->words[address >> 2] |= WORD_LEADER;
+    if(!push((void **)&translator->pending, &translator->pendingSize, translator->pendingCount, sizeof(REGISTER)))
+        return false;
+    translator->pending[translator->pendingCount++] = address;
+    return true;
+}
+
+static void decodeAt(CPU *cpu, REGISTER address, DECODED *decoded) {
+    decodeInstruction((INSTRUCTION){ .data32 = memoryWord(cpu, address) }, decoded);
+}
+
+static bool isTest(const DECODED *decoded) {
+    return decoded->opCode >= OP_TST && decoded->opCode <= OP_CMN;
+}
+
+// true if the instruction puts something new in R15 when it runs (other than a branch)
+static bool writesPc(const DECODED *decoded) {
+    uint32_t word = decoded->instruction.data32;
+
+    if(decoded->handler == doWritingPc)
+        return !isTest(decoded);
+    if(decoded->handler == doDataTransfer)
+        return (word & TRANSFER_LOAD) && decoded->regDest == PROGRAM_COUNTER;
+    if(decoded->handler == doBlockTransfer)
+        return ((word & TRANSFER_LOAD) && (word & (1u << PROGRAM_COUNTER)))
+               || ((word & TRANSFER_WRITEBACK) && decoded->regN == PROGRAM_COUNTER);
+    return false;
+}
+
+// true if the block the instruction is in has to end with it
+static bool endsBlock(const DECODED *decoded) {
+    return decoded->type == BRANCH || decoded->type == INTERUPT
+           || (decoded->condition == CONDITION_ALWAYS && writesPc(decoded));
+}
+
+/*
+ * Follows the program from each leader until it can't be sure what comes next. Memory that is still 0 (ANDEQ R0, R0,
+ * R0 in every word) is taken to be where nothing was loaded, rather than code.
+ */
+static bool findCode(TRANSLATOR *translator) {
+    CPU *cpu = translator->cpu;
+
+    while(translator->pendingCount > 0) {
+        REGISTER address = translator->pending[--translator->pendingCount];
+
+        while(address < cpu->memorySize && address != cpu->programEnd && !(translator->words[address >> 2] & WORD_CODE)
+                && memoryWord(cpu, address) != 0) {
+            DECODED decoded;
+            decodeAt(cpu, address, &decoded);
+            translator->words[address >> 2] |= WORD_CODE;
+
+            if(decoded.type == BRANCH) {
+                if(!addLeader(translator, (address + 4 + decoded.operand2) & PC_MASK))
+                    return false;
+                if((decoded.link || decoded.condition != CONDITION_ALWAYS) && !addLeader(translator, address + 4))
+                    return false;
+                break;
+            }
+            if(decoded.type == INTERUPT) {
+                if(decoded.condition == CONDITION_ALWAYS && (decoded.operand2 & ~SWI_X_BIT) == OS_EXIT)
+                    break;
+                if(!addLeader(translator, address + 4))
+                    return false;
+                break;
+            }
+            if(decoded.condition == CONDITION_ALWAYS && writesPc(&decoded))
+                break;
+            address += 4;
+        }
+    }
+    return true;
+}
+
+/*
+ * Splits the code found into blocks, in address order
+ */
+static bool findBlocks(TRANSLATOR *translator) {
+    CPU *cpu = translator->cpu;
+    BLOCK *block = NULL;
+    bool ended = true;
+
+    for(REGISTER address = 0; address < cpu->memorySize; address += 4) {
+        uint8_t flags = translator->words[address >> 2];
+        if(!(flags & WORD_CODE)) {
+            ended = true;
+            continue;
+        }
+        if(ended || (flags & WORD_LEADER) || block->length == MAX_BLOCK_LENGTH) {
+            if(!push((void **)&translator->blocks, &translator->blockSize, translator->blockCount, sizeof(BLOCK)))
+                return false;
+            block = &translator->blocks[translator->blockCount++];
+            *block = (BLOCK){ address, 0 };
+        }
+        block->length++;
+
+        DECODED decoded;
+        decodeAt(cpu, address, &decoded);
+        ended = endsBlock(&decoded);
+    }
+    return true;
+}
+
+// the index of the block starting at address, or AOT_EXIT if there isn't one
+static int32_t blockIndex(const TRANSLATOR *translator, REGISTER address) {
+    uint32_t low = 0, high = translator->blockCount;
+
+    while(low < high) {
+        uint32_t middle = (low + high) / 2;
+        if(translator->blocks[middle].start < address)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return (low < translator->blockCount && translator->blocks[low].start == address)? (int32_t)low : AOT_EXIT;
+}
+
+/*
+ * Operand 2 (or the offset of a load or store) as a C expression, with the shifter carry going to sc
+ */
+static void writeOperand2(FILE *out, const DECODED *decoded) {
+    if(decoded->immediate) {
+        if(decoded->immediateCarry != SHIFTER_CARRY_UNCHANGED)
+            fprintf(out, "        sc = %u;\n", decoded->immediateCarry);
+        fprintf(out, "        uint32_t b = 0x%Xu;\n", decoded->operand2);
+    } else if(decoded->shifter == SHIFTER_NONE) {
+        fprintf(out, "        uint32_t b = r[%d];\n", decoded->regM);
+    } else if(decoded->shifter == SHIFTER_RRX) {
+        fprintf(out, "        uint32_t b = shiftRRX(r[%d], &sc);\n", decoded->regM);
+    } else if(decoded->shiftByRegister) {
+        fprintf(out, "        uint32_t b = %s(r[%d], r[%d] & 0xff, &sc);\n", shiftFunctions[decoded->shifter],
+                decoded->regM, decoded->regS);
+    } else {
+        // LSR #0 and ASR #0 mean #32
+        fprintf(out, "        uint32_t b = %s(r[%d], %u, &sc);\n", shiftFunctions[decoded->shifter], decoded->regM,
+                decoded->shiftAmount | (uint32_t)(decoded->shiftAmount == 0) << 5);
+    }
+}
+
+static void writeAlu(FILE *out, const DECODED *decoded) {
+    // arithmetic is x + y + carry in, as addWithCarry() does it
+    static const char *arithmetic[16][3] = {
+        [OP_SUB] = { "a", "~b", "1" }, [OP_RSB] = { "b", "~a", "1" }, [OP_ADD] = { "a", "b", "0" },
+        [OP_ADC] = { "a", "b", "c" }, [OP_SBC] = { "a", "~b", "c" }, [OP_RSC] = { "b", "~a", "c" },
+        [OP_CMP] = { "a", "~b", "1" }, [OP_CMN] = { "a", "b", "0" }
+    };
+    static const char *logical[16] = {
+        [OP_AND] = "a & b", [OP_EOR] = "a ^ b", [OP_TST] = "a & b", [OP_TEQ] = "a ^ b", [OP_ORR] = "a | b",
+        [OP_MOV] = "b", [OP_BIC] = "a & ~b", [OP_MVN] = "~b"
+    };
+    bool flags = decoded->updateStatus || isTest(decoded);
+
+    fprintf(out, "        uint32_t sc = c; (void)sc; // the shifter carry\n");
+    writeOperand2(out, decoded);
+    if(decoded->opCode != OP_MOV && decoded->opCode != OP_MVN)
+        fprintf(out, "        uint32_t a = r[%d];\n", decoded->regN);
+
+    if(logical[decoded->opCode] != NULL) {
+        fprintf(out, "        uint32_t result = %s;\n", logical[decoded->opCode]);
+        if(flags)
+            fprintf(out, "        n = result >> 31; z = result == 0; c = sc;\n");
+    } else {
+        const char **operands = arithmetic[decoded->opCode];
+        fprintf(out, "        uint32_t x = %s, y = %s;\n", operands[0], operands[1]);
+        fprintf(out, "        uint32_t result = x + y + %s;\n", operands[2]);
+        if(flags)
+            fprintf(out, "        n = result >> 31; z = result == 0; c = ((x & y) | ((x | y) & ~result)) >> 31; "
+                         "v = ((x ^ result) & (y ^ result)) >> 31;\n");
+    }
+    if(!isTest(decoded))
+        fprintf(out, "        r[%d] = result;\n", decoded->regDest);
+    else
+        fprintf(out, "        (void)result;\n");
+}
+
+// LDR, STR, LDRB and STRB, as doDataTransfer() does them. Returns true if it was a store.
+static bool writeTransfer(FILE *out, const DECODED *decoded, REGISTER address) {
+    uint32_t word = decoded->instruction.data32;
+    bool load = word & TRANSFER_LOAD;
+    bool writeBack = (!(word & TRANSFER_PRE) || (word & TRANSFER_WRITEBACK)) && decoded->regN != PROGRAM_COUNTER;
+
+    fprintf(out, "        uint32_t sc = c; (void)sc; // the shifter carry\n");
+    writeOperand2(out, decoded);
+    if(decoded->regN == PROGRAM_COUNTER)
+        fprintf(out, "        uint32_t base = 0x%Xu;\n", address + 8);
+    else
+        fprintf(out, "        uint32_t base = r[%d];\n", decoded->regN);
+    fprintf(out, "        uint32_t indexed = base %c b;\n", (word & TRANSFER_UP)? '+' : '-');
+    fprintf(out, "        (void)sc; (void)indexed;\n");
+    if(!load)
+        fprintf(out, "        uint32_t value = r[%d];\n", decoded->regDest);
+    if(writeBack)
+        fprintf(out, "        r[%d] = indexed;\n", decoded->regN);
+
+    const char *at = (word & TRANSFER_PRE)? "indexed" : "base";
+    int size = (word & TRANSFER_BYTE)? 1 : 4;
+    if(load)
+        fprintf(out, "        r[%d] = context->load(context->cpu, %s, %d);\n", decoded->regDest, at, size);
+    else
+        fprintf(out, "        context->store(context->cpu, %s, value, %d);\n", at, size);
+    return !load;
+}
+
+// true if the generated code can do the instruction without the emulator
+static bool translatable(const DECODED *decoded) {
+    if(decoded->type == ALU)
+        return decoded->handler == aluHandlers[decoded->opCode];
+    if(decoded->type == BRANCH)
+        return true;
+    return decoded->handler == doDataTransfer && decoded->regDest != PROGRAM_COUNTER
+           && (decoded->immediate || (decoded->regM != PROGRAM_COUNTER && !decoded->shiftByRegister));
+}
+
+/*
+ * Writes the function for one block. Whenever it stops before its end it sets R15 and gives back the instructions it
+ * didn't get to, as AOT_CONTEXT asks.
+ */
+static void writeBlock(TRANSLATOR *translator, FILE *out, int32_t index) {
+    CPU *cpu = translator->cpu;
+    const BLOCK *block = &translator->blocks[index];
+    REGISTER end = block->start + block->length * 4;
+    bool fallsThrough = true;
+
+    fprintf(out, "static int32_t block%08X(AOT_CONTEXT *context) {\n", block->start);
+    fprintf(out, "    uint32_t *r = context->registers;\n");
+    fprintf(out, "    uint32_t n, z, c, v;\n");
+    fprintf(out, "    LOAD_FLAGS();\n");
+
+    for(uint32_t i = 0; i < block->length; i++) {
+        REGISTER address = block->start + i * 4;
+        uint32_t left = block->length - i - 1;
+        DECODED decoded;
+        decodeAt(cpu, address, &decoded);
+
+        fprintf(out, "\n    // %08X: %08X\n", address, decoded.instruction.data32);
+        if(decoded.condition == CONDITION_NEVER)
+            continue;
+        if(translatable(&decoded))
+            translator->native++;
+
+        if(decoded.condition == CONDITION_ALWAYS)
+            fprintf(out, "    {\n");
+        else
+            fprintf(out, "    if(%s) {\n", conditions[decoded.condition]);
+        if(decoded.type == BRANCH) {
+            REGISTER target = (address + 4 + decoded.operand2) & PC_MASK;
+            if(decoded.link)
+                fprintf(out, "        r[14] = 0x%Xu | PSR_BITS();\n", (address + 4) & PC_MASK);
+            fprintf(out, "        r[15] = 0x%Xu;\n", target);
+            fprintf(out, "        EXIT(%d);\n", blockIndex(translator, target));
+            fallsThrough = decoded.condition != CONDITION_ALWAYS;
+        } else if(decoded.type == ALU && translatable(&decoded)) {
+            writeAlu(out, &decoded);
+        } else if(translatable(&decoded)) {
+            if(writeTransfer(out, &decoded, address)) {
+                // the store may have written over this block
+                fprintf(out, "        if(!context->live[%d]) {\n", index);
+                fprintf(out, "            r[15] = 0x%Xu;\n", address + 4);
+                fprintf(out, "            context->budget += %u;\n", left);
+                fprintf(out, "            EXIT(AOT_EXIT);\n");
+                fprintf(out, "        }\n");
+            }
+        } else {
+            fprintf(out, "        SAVE_FLAGS();\n");
+            fprintf(out, "        r[15] = 0x%Xu;\n", address + 4);
+            fprintf(out, "        context->interpret(context->cpu, 0x%Xu);\n", address);
+            fprintf(out, "        LOAD_FLAGS();\n");
+            fprintf(out, "        if(r[15] != 0x%Xu || !context->live[%d]) {\n", address + 4, index);
+            fprintf(out, "            context->budget += %u;\n", left);
+            fprintf(out, "            return AOT_EXIT;\n");
+            fprintf(out, "        }\n");
+        }
+        fprintf(out, "    }\n");
+    }
+
+    if(fallsThrough) {
+        fprintf(out, "\n    r[15] = 0x%Xu;\n", end);
+        fprintf(out, "    EXIT(%d);\n", blockIndex(translator, end));
+    }
+    fprintf(out, "}\n\n");
+}
+
+/*
+ * Writes the C for every block, then the AOT_IMAGE aot.c looks for, with the same hash hashBlocks() works out
+ */
+static bool writeSource(TRANSLATOR *translator, const char *fileName) {
+    CPU *cpu = translator->cpu;
+    FILE *out = fopen(fileName, "w");
+    if(out == NULL) {
+        printf("Unable to write %s\n", fileName);
+        return false;
+    }
+
+    fprintf(out, "// Generated by armpit-aot, do not edit\n\n");
+    for(int i = 0; preamble[i] != NULL; i++)
+        fprintf(out, "%s\n", preamble[i]);
+    fprintf(out, "\n");
+
+    uint64_t hash = AOT_HASH_START;
+    for(uint32_t i = 0; i < translator->blockCount; i++) {
+        const BLOCK *block = &translator->blocks[i];
+        writeBlock(translator, out, (int32_t)i);
+
+        hash = aotHash(aotHash(hash, block->start), block->length);
+        for(uint32_t j = 0; j < block->length; j++)
+            hash = aotHash(hash, memoryWord(cpu, block->start + j * 4));
+        if(verbose)
+            printf("Block %08X, %u instructions\n", block->start, block->length);
+    }
+
+    fprintf(out, "static const AOT_BLOCK blocks[] = {\n");
+    for(uint32_t i = 0; i < translator->blockCount; i++)
+        fprintf(out, "    { 0x%Xu, %u, block%08X },\n", translator->blocks[i].start, translator->blocks[i].length,
+                translator->blocks[i].start);
+    fprintf(out, "};\n\n");
+    fprintf(out, "const AOT_IMAGE armpitAotImage = { AOT_VERSION, %u, 0x%016llXull, blocks };\n",
+            translator->blockCount, (unsigned long long)hash);
+
+    bool written = !ferror(out);
+    if(fclose(out) != 0 || !written) {
+        printf("Unable to write %s\n", fileName);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Builds the shared object with the host compiler
+ */
+static bool compile(const char *compiler, const char *source, const char *output) {
+    char *const arguments[] = { (char *)compiler, "-O2", "-shared", "-fPIC", "-o", (char *)output, (char *)source, NULL };
+
+    if(verbose)
+        printf("%s -O2 -shared -fPIC -o %s %s\n", compiler, output, source);
+    fflush(stdout);
+
+    pid_t child = fork();
+    if(child < 0) {
+        printf("Unable to start %s\n", compiler);
+        return false;
+    }
+    if(child == 0) {
+        execvp(compiler, arguments);
+        printf("Unable to run %s\n", compiler);
+        _exit(127);
+    }
+
+    int status;
+    if(waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("%s failed to build %s\n", compiler, output);
+        return false;
+    }
+    return true;
+}
+
+// name with its extension (if any) replaced by extension
+static char *replaceExtension(const char *name, const char *extension) {
+    const char *slash = strrchr(name, '/');
+    const char *dot = strrchr(name, '.');
+    size_t length = (dot != NULL && (slash == NULL || dot > slash) && dot != name)? (size_t)(dot - name) : strlen(name);
+    char *replaced = malloc(length + strlen(extension) + 1);
+
+    if(replaced != NULL) {
+        memcpy(replaced, name, length);
+        strcpy(replaced + length, extension);
+    }
+    return replaced;
+}
+
+int main(int argc, char *argv[]) {
+    const char *fileName = NULL;
+    const char *outputName = NULL;
+    const char *compiler = getenv("CC");
+    uint32_t memorySize = ADDRESS_SPACE_SIZE;
+    REGISTER loadAddress = 0x8000;
+    bool keepSource = false;
+    char *endPtr;
+    unsigned long value;
+
+    int opt;
+    while((opt = getopt_long(argc, argv, optString, longOptions, NULL)) != -1) {
+        switch(opt) {
+            case 'f':
+                fileName = optarg;
+                break;
+            case 'o':
+                outputName = optarg;
+                break;
+            case 'm':
+                value = strtoul(optarg, &endPtr, 0);
+                if(*endPtr == 'K' || *endPtr == 'k') {
+                    value <<= 10;
+                    endPtr++;
+                } else if(*endPtr == 'M' || *endPtr == 'm') {
+                    value <<= 20;
+                    endPtr++;
+                }
+                if(*optarg == '\0' || *endPtr != '\0' || value < GUEST_PAGE_SIZE || value > ADDRESS_SPACE_SIZE
+                        || (value & (value - 1)) != 0) {
+                    printf("Invalid memory size: %s (must be a power of 2 from 4K to 64M)\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                memorySize = (uint32_t)value;
+                break;
+            case OPTION_LOAD_ADDRESS:
+                value = strtoul(optarg, &endPtr, 0);
+                if(*optarg == '\0' || *endPtr != '\0' || value >= ADDRESS_SPACE_SIZE || (value & 3) != 0) {
+                    printf("Invalid address: %s (must be word aligned and below 0x4000000)\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                loadAddress = (REGISTER)value;
+                break;
+            case OPTION_CC:
+                compiler = optarg;
+                break;
+            case 'k':
+                keepSource = true;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'h':
+                displayUsage();
+                return EXIT_SUCCESS;
+            default:
+                displayUsage();
+                return EXIT_FAILURE;
+        }
+    }
+    if(fileName == NULL) {
+        displayUsage();
+        return EXIT_FAILURE;
+    }
+    if(compiler == NULL || *compiler == '\0')
+        compiler = "cc";
+
+    ARMPIT *armpit = armpitCreate(memorySize);
+    if(armpit == NULL) {
+        printf("Unable to reserve %u bytes of guest memory\n", memorySize);
+        return EXIT_FAILURE;
+    }
+    armpitSetRegister(armpit, ARMPIT_PC, loadAddress);
+    if(!armpitLoadImage(armpit, fileName, loadAddress))
+        return EXIT_FAILURE;
+
+    TRANSLATOR translator = { .cpu = armpit };
+    translator.words = calloc(armpit->memorySize / 4, 1);
+    if(translator.words == NULL) {
+        printf("Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    // the entry point and whichever exception vectors have something in them
+    bool found = addLeader(&translator, armpitGetRegister(armpit, ARMPIT_PC));
+    for(REGISTER vector = 0; found && vector < 0x20; vector += 4) {
+        if(memoryWord(armpit, vector) != 0)
+            found = addLeader(&translator, vector);
+    }
+    if(!found || !findCode(&translator) || !findBlocks(&translator))
+        return EXIT_FAILURE;
+
+    char *output = (outputName != NULL)? strdup(outputName) : replaceExtension(fileName, ".so");
+    char *source = (output != NULL)? replaceExtension(output, ".c") : NULL;
+    if(source == NULL || strcmp(source, output) == 0) {
+        printf("Unable to name the generated C after %s\n", output? output : fileName);
+        return EXIT_FAILURE;
+    }
+
+    if(!writeSource(&translator, source) || !compile(compiler, source, output)) {
+        if(!keepSource)
+            remove(source);
+        return EXIT_FAILURE;
+    }
+    if(!keepSource)
+        remove(source);
+
+    uint32_t instructions = 0;
+    for(uint32_t i = 0; i < translator.blockCount; i++)
+        instructions += translator.blocks[i].length;
+    printf("Translated %u blocks, %u instructions (%u run natively) into %s\n", translator.blockCount, instructions,
+           translator.native, output);
+
+    free(source);
+    free(output);
+    free(translator.words);
+    free(translator.pending);
+    free(translator.blocks);
+    armpitDestroy(armpit);
+    return EXIT_SUCCESS;
+}
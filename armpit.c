@@ -1,39 +1,27 @@
 /*
  * Compile using:
- * 			gcc armpit.c -std=c11 -o armpit
+ * 			gcc armpit.c alu.c aot.c assembler.c batch.c bus.c checkpoint.c cpu.c decode.c devices.c flags.c jit.c lanes.c libarmpit.c loader.c memory.c modes.c profile.c scheduler.c snapshot.c swi.c threaded.c trace.c transfer.c -std=c11 -pthread -ldl -o armpit
+ *
+ * This is the command line front end. The emulator itself is the library (libarmpit.h), which this drives through the
+ * same calls any other program would use.
  */
 
+#define _POSIX_C_SOURCE 200809L // for clock_gettime when compiling with -std=c11
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>     // for strcat
 #include <stdbool.h>	// requires c11 and is considered the "standard way" to do booleans
 #include <getopt.h>		// convenient argument parsing. Works on Linux and Mac OSX
+#include <time.h>       // for clock_gettime, used to time batch runs
 //#include <unistd.h>	// can either use unistd.h or getopt.h for handling args.
 
+#include "libarmpit.h"
 #include "armpit.h"     // contains some defines and my function prototypes.
+#include "memory.h"     // for the memory size limits
 
 
-// registers:
-REGISTER registers[16] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
-
-REGISTER* R0 = &registers[0];
-REGISTER* R1 = &registers[1];
-REGISTER* R2 = &registers[2];
-REGISTER* R3 = &registers[3];
-REGISTER* R4 = &registers[4];
-REGISTER* R5 = &registers[5];
-REGISTER* R6 = &registers[6];
-REGISTER* R7 = &registers[7];
-REGISTER* R8 = &registers[8];
-REGISTER* R9 = &registers[9];
-REGISTER* R10 = &registers[10];
-REGISTER* R11 = &registers[11]; 
-REGISTER* R12 = &registers[12];  
-REGISTER* STACK_POINTER = &registers[13];     // R13 is the SP (stack pointer)
-REGISTER* LINK_REGISTER = &registers[14];     // R14 is general purpose or the LR (link register)
-REGISTER* PROGRAM_COUNTER = &registers[15];   // R15 is used as program counter
-
 // (note: the bottom 2 bits of the PC are always 0 0 when memory is accessed.
 //                  i.e. memory is implicitly accessed on a word aligned boundary.)
 
@@ -42,14 +30,83 @@ REGISTER* PROGRAM_COUNTER = &registers[15];   // R15 is used as program counter
 /*
  * Global Variables:
  */
-char USAGE[] = "\nARMpit - ARM processor imitation technology (2013 - Samael Bate)\n\nUsage: armpit [arguments] [file ..]\n\nArguments:\n -f <filename>\tspecify a file of ARM assembly to be processed.\n -v\t\tverbose output\n -h\t\thelp";
+char USAGE[] = "\nARMpit - ARM processor imitation technology (2013 - Samael Bate)\n\nUsage: armpit [arguments] [file ..]\n\nArguments:\n -f <filename>\tprogram to run: ARM assembly (.s or .asm), a 32 bit ARM ELF executable, or a flat binary\n -b, --batch\trun without stopping after each instruction, then report throughput\n -n, --steps <N>\tstop after N instructions (implies -b). Default is to run until halt\n -e, --engine <name>\tbatch interpreter: reference (default), threaded or jit\n --jit\t\tsame as --engine jit\n --jit-check\trun the program with both the reference loop and the JIT and compare the results\n -m, --memory-size <size>\tguest memory in bytes, K or M suffix allowed, a power of 2 up to 64M (default 64M)\n --load-address <address>\twhere assembly or a flat binary is loaded and starts (default 0x8000)\n --stack-top <address>\tinitial value of SP (default the top of memory)\n --batch-list <file>\trun every program named in file (one per line) in batch mode, in parallel\n -j, --jobs <N>\tthreads for --batch-list (default one per core)\n --save-checkpoint <file>\tsave the machine to file when the program stops\n --restore-checkpoint <file>\tstart from a saved machine instead of loading a program\n --profile\tcount instructions by address, type and opcode and estimate cycles, report them at exit (needs a profiler build)\n --profile-folded <file>\talso write folded call stacks for flamegraph.pl to file (implies --profile)\n --trace <file>\twrite a binary trace of every instruction executed to file, read it with armpit-trace\n --trace-range <start>:<end>\tonly trace instructions from start up to end (can be given more than once)\n --uart <address>\tattach a UART on standard input and output at address (a page, see devices.c)\n --timer <address>\tattach a microsecond counter and IRQ timer at address (a page)\n --lanes <file>\trun the program once per input in file, several at a time on vector registers (implies -b, see lanes.c)\n --lane-output <file>\twhere --lanes writes the registers each run ends with\n --lane-registers <N>\twords in each input and output, which go in and come out of R0 upwards (default 4)\n --aot <file>\trun with native code armpit-aot translated from the same program, an error if it is from another (implies -b, see aotcompile.c)\n --no-fusion\trun every instruction on its own in the threaded interpreter (-v reports how often each fused pattern ran)\n -v\t\tverbose output\n -h\t\thelp";
 
-static bool VERBOSE = false;	// -v option
+static bool VERBOSE_LOGGING = false; // -v option
+static bool BATCH = false;      // -b or -n option
+static uint64_t MAX_STEPS = 0;  // -n option, 0 means run until halt
 const char *fileName;			// -f option
-FILE *file;
-static const char *optString = "f:vh"; // requires <getopt.h> or <unistd.h>
-
-INSTRUCTION memory[1024]; // 4 kilobytes of RAM in this example (since 1 instruction = 4 bytes)
+static const char *batchList;   // --batch-list option
+static int JOBS = 0;            // -j option, 0 means one thread per core
+static const char *saveCheckpointFile;      // --save-checkpoint option
+static const char *restoreCheckpointFile;   // --restore-checkpoint option
+static bool PROFILING = false;              // --profile option
+static const char *profileFoldedFile;       // --profile-folded option
+static const char *traceFile;               // --trace option
+#define MAX_TRACE_RANGES 16
+static REGISTER traceRanges[MAX_TRACE_RANGES][2]; // --trace-range options, start and end
+static int traceRangeCount = 0;
+static bool NO_FUSION = false;              // --no-fusion option
+static long UART_ADDRESS = -1;              // --uart option, -1 for none
+static long TIMER_ADDRESS = -1;             // --timer option, -1 for none
+static const char *laneInputFile;           // --lanes option
+static const char *laneOutputFile;          // --lane-output option
+static int LANE_REGISTERS = 4;              // --lane-registers option, words in each input and output
+static const char *aotFile;                 // --aot option
+static const char *optString = "f:bn:e:j:m:vh"; // requires <getopt.h> or <unistd.h>
+#define OPTION_JIT 256         // long options without a short form
+#define OPTION_JIT_CHECK 257
+#define OPTION_LOAD_ADDRESS 258
+#define OPTION_STACK_TOP 259
+#define OPTION_BATCH_LIST 260
+#define OPTION_SAVE_CHECKPOINT 261
+#define OPTION_RESTORE_CHECKPOINT 262
+#define OPTION_PROFILE 263
+#define OPTION_PROFILE_FOLDED 264
+#define OPTION_TRACE 265
+#define OPTION_TRACE_RANGE 266
+#define OPTION_NO_FUSION 267
+#define OPTION_UART 268
+#define OPTION_TIMER 269
+#define OPTION_LANES 270
+#define OPTION_LANE_OUTPUT 271
+#define OPTION_LANE_REGISTERS 272
+#define OPTION_AOT 273
+static const struct option longOptions[] = {
+    { "batch", no_argument, NULL, 'b' },
+    { "steps", required_argument, NULL, 'n' },
+    { "engine", required_argument, NULL, 'e' },
+    { "jit", no_argument, NULL, OPTION_JIT },
+    { "jit-check", no_argument, NULL, OPTION_JIT_CHECK },
+    { "memory-size", required_argument, NULL, 'm' },
+    { "load-address", required_argument, NULL, OPTION_LOAD_ADDRESS },
+    { "stack-top", required_argument, NULL, OPTION_STACK_TOP },
+    { "batch-list", required_argument, NULL, OPTION_BATCH_LIST },
+    { "jobs", required_argument, NULL, 'j' },
+    { "save-checkpoint", required_argument, NULL, OPTION_SAVE_CHECKPOINT },
+    { "restore-checkpoint", required_argument, NULL, OPTION_RESTORE_CHECKPOINT },
+    { "profile", no_argument, NULL, OPTION_PROFILE },
+    { "profile-folded", required_argument, NULL, OPTION_PROFILE_FOLDED },
+    { "trace", required_argument, NULL, OPTION_TRACE },
+    { "trace-range", required_argument, NULL, OPTION_TRACE_RANGE },
+    { "no-fusion", no_argument, NULL, OPTION_NO_FUSION },
+    { "uart", required_argument, NULL, OPTION_UART },
+    { "timer", required_argument, NULL, OPTION_TIMER },
+    { "lanes", required_argument, NULL, OPTION_LANES },
+    { "lane-output", required_argument, NULL, OPTION_LANE_OUTPUT },
+    { "lane-registers", required_argument, NULL, OPTION_LANE_REGISTERS },
+    { "aot", required_argument, NULL, OPTION_AOT },
+    { "verbose", no_argument, NULL, 'v' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static ARMPIT_ENGINE ENGINE = ARMPIT_ENGINE_REFERENCE; // -e option
+static bool JIT_CHECK = false;                        // --jit-check option
+
+static uint32_t MEMORY_SIZE = ADDRESS_SPACE_SIZE;  // -m option
+static REGISTER LOAD_ADDRESS = 0x8000;             // --load-address option, where RISC OS loads applications
+static REGISTER STACK_TOP = 0;                     // --stack-top option, 0 means the top of memory
 
 
 
@@ -77,23 +134,152 @@ INSTRUCTION memory[1024]; // 4 kilobytes of RAM in this example (since 1 instruc
  * -v should activate verbose logging output and -h should show the usage.
  */
 int main(int argc, char *argv[]) {
-    printf("\nStarting ARMpit...\n\n");
+    char *endPtr;
+    unsigned long value;
 
-    int opt = getopt( argc, argv, optString );
+    int opt = getopt_long( argc, argv, optString, longOptions, NULL );
     while( opt != -1 ) {
         switch( opt ) {                
             case 'f':
                 fileName = optarg;
-                file = fopen(fileName, "r"); // r indicates opening for Read Only
-                if(file == NULL) {
-                    printf("Error opening %s\n", fileName);
+                break;
+            case 'b':
+                BATCH = true;
+                break;
+            case 'n':
+                MAX_STEPS = strtoull(optarg, &endPtr, 10);
+                if(*optarg == '\0' || *endPtr != '\0') {
+                    printf("Invalid number of steps: %s\n", optarg);
                     exit(EXIT_FAILURE);
                 }
-                printf("\n\tAT THIS TIME INPUT FILES ARE UNSUPPORTED\n\n");
-                exit(EXIT_FAILURE);
+                BATCH = true;
+                break;
+            case 'e':
+                if(strcmp(optarg, "reference") == 0) {
+                    ENGINE = ARMPIT_ENGINE_REFERENCE;
+                } else if(strcmp(optarg, "threaded") == 0) {
+                    ENGINE = ARMPIT_ENGINE_THREADED;
+                } else if(strcmp(optarg, "jit") == 0) {
+                    ENGINE = ARMPIT_ENGINE_JIT;
+                } else {
+                    printf("Unknown engine: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPTION_BATCH_LIST:
+                batchList = optarg;
+                BATCH = true;
+                break;
+            case 'j':
+                value = strtoul(optarg, &endPtr, 10);
+                if(*optarg == '\0' || *endPtr != '\0' || value < 1 || value > 1024) {
+                    printf("Invalid number of jobs: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                JOBS = (int)value;
+                break;
+            case OPTION_SAVE_CHECKPOINT:
+                saveCheckpointFile = optarg;
+                break;
+            case OPTION_RESTORE_CHECKPOINT:
+                restoreCheckpointFile = optarg;
+                break;
+            case OPTION_PROFILE_FOLDED:
+                profileFoldedFile = optarg;
+                PROFILING = true;
+                break;
+            case OPTION_PROFILE:
+                PROFILING = true;
+                break;
+            case OPTION_TRACE:
+                traceFile = optarg;
+                break;
+            case OPTION_TRACE_RANGE:
+                if(traceRangeCount == MAX_TRACE_RANGES) {
+                    printf("At most %d trace ranges can be given\n", MAX_TRACE_RANGES);
+                    exit(EXIT_FAILURE);
+                }
+                traceRanges[traceRangeCount][0] = strtoul(optarg, &endPtr, 0);
+                if(*optarg == '\0' || *endPtr != ':'
+                        || (traceRanges[traceRangeCount][1] = strtoul(endPtr + 1, &endPtr, 0)) == 0 || *endPtr != '\0'
+                        || traceRanges[traceRangeCount][1] <= traceRanges[traceRangeCount][0]) {
+                    printf("Invalid trace range: %s (must be <start>:<end> with end after start)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                traceRangeCount++;
+                break;
+            case OPTION_NO_FUSION:
+                NO_FUSION = true;
+                break;
+            case OPTION_JIT:
+                ENGINE = ARMPIT_ENGINE_JIT;
+                BATCH = true;
+                break;
+            case OPTION_JIT_CHECK:
+                JIT_CHECK = true;
+                BATCH = true;
+                break;
+            case 'm':
+                value = strtoul(optarg, &endPtr, 0);
+                if(*endPtr == 'K' || *endPtr == 'k') {
+                    value <<= 10;
+                    endPtr++;
+                } else if(*endPtr == 'M' || *endPtr == 'm') {
+                    value <<= 20;
+                    endPtr++;
+                }
+                if(*optarg == '\0' || *endPtr != '\0' || value < GUEST_PAGE_SIZE || value > ADDRESS_SPACE_SIZE
+                        || (value & (value - 1)) != 0) {
+                    printf("Invalid memory size: %s (must be a power of 2 from 4K to 64M)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                MEMORY_SIZE = value;
+                break;
+            case OPTION_LOAD_ADDRESS:
+            case OPTION_STACK_TOP:
+                value = strtoul(optarg, &endPtr, 0);
+                if(*optarg == '\0' || *endPtr != '\0' || value >= ADDRESS_SPACE_SIZE || (value & 3) != 0) {
+                    printf("Invalid address: %s (must be word aligned and below 0x4000000)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                if(opt == OPTION_LOAD_ADDRESS)
+                    LOAD_ADDRESS = value;
+                else
+                    STACK_TOP = value;
+                break;
+            case OPTION_UART:
+            case OPTION_TIMER:
+                value = strtoul(optarg, &endPtr, 0);
+                if(*optarg == '\0' || *endPtr != '\0' || value >= ADDRESS_SPACE_SIZE || (value & (GUEST_PAGE_SIZE - 1)) != 0) {
+                    printf("Invalid device address: %s (must be a multiple of 0x1000 below 0x4000000)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                if(opt == OPTION_UART)
+                    UART_ADDRESS = (long)value;
+                else
+                    TIMER_ADDRESS = (long)value;
+                break;
+            case OPTION_LANES:
+                laneInputFile = optarg;
+                BATCH = true;
+                break;
+            case OPTION_LANE_OUTPUT:
+                laneOutputFile = optarg;
+                break;
+            case OPTION_LANE_REGISTERS:
+                value = strtoul(optarg, &endPtr, 10);
+                if(*optarg == '\0' || *endPtr != '\0' || value < 1 || value > 15) {
+                    printf("Invalid number of lane registers: %s (must be 1 to 15)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                LANE_REGISTERS = (int)value;
+                break;
+            case OPTION_AOT:
+                aotFile = optarg;
+                BATCH = true;
                 break;
             case 'v':
-                VERBOSE = true;
+                VERBOSE_LOGGING = true;
                 break;
             case 'h':
                 displayUsage();
@@ -104,387 +290,258 @@ int main(int argc, char *argv[]) {
                 exit(EXIT_FAILURE);
                 break;
         }
-        opt = getopt( argc, argv, optString );
+        opt = getopt_long( argc, argv, optString, longOptions, NULL );
     }
-    
-    printf("Verbose Logging: %s\n", VERBOSE? "true" : "false");
-    printf("Input File: %s\n\n", fileName? fileName : "none");
 
-    init(); // load instructions onto stack
+    armpitSetLogging(VERBOSE_LOGGING, !BATCH); // trace each instruction when stepping through
 
-    // fetch
-    INSTRUCTION instruction;
-    int amountOfInstructions = *PROGRAM_COUNTER;
-    
-    for(int counter = 0; counter < amountOfInstructions; counter++) {
-        instruction = fetchInstruction();
-
-        // check 1st 4 bits (if 1110 execute)
-        if(shouldExecute(instruction)) {
-
-            InstructionType type = getInstructionType(instruction);
-
-            switch(type) {
-                case ALU:
-                    doDataProcessing(instruction);
-                    break;
-                case BRANCH:
-                    doBranch();
-                    break;
-                case DATA_TRANSFER:
-                    doDataTransfer();
-                    break;
-                case INTERUPT:
-                    doInterupt();
-                    break;
-            }
-
-        } else {
-            if(VERBOSE) {
-                printf("\tInstruction %i skipped!\n", counter);
-            }
-        }
-        printf("\nPress Enter key to continue\n");
-        getchar();
-    }   
+    if(!BATCH) {
+        printf("\nStarting ARMpit...\n\n");
+        printf("Verbose Logging: %s\n", VERBOSE_LOGGING? "true" : "false");
+        printf("Input File: %s\n\n", fileName? fileName : "none");
+    }
 
-    printf("\nExiting program\n\n");
-    exit(EXIT_SUCCESS);
-}
+    if(batchList != NULL) {
+        if(PROFILING)
+            printf("--profile profiles a single program, it is ignored with --batch-list\n");
+        exit(runBatchList(batchList, JOBS, ENGINE, MEMORY_SIZE, MAX_STEPS)? EXIT_SUCCESS : EXIT_FAILURE);
+    }
 
-void init() {
+    ARMPIT *armpit;
+    if(restoreCheckpointFile != NULL) {
+        // the checkpoint has the memory size, registers and program
+        armpit = armpitRestoreCheckpoint(restoreCheckpointFile);
+        if(armpit == NULL)
+            exit(EXIT_FAILURE);
+    } else {
+        armpit = armpitCreate(MEMORY_SIZE);
+        if(armpit == NULL) {
+            printf("Unable to reserve %u bytes of guest memory\n", MEMORY_SIZE);
+            exit(EXIT_FAILURE);
+        }
+        if(!init(armpit, fileName)) // load the program into memory
+            exit(EXIT_FAILURE);
+    }
 
-    STATUS_REGISTER = 0;
-    *LINK_REGISTER = 0;
-    *STACK_POINTER = 0;
-    *PROGRAM_COUNTER = 0;
+    if((UART_ADDRESS >= 0 && !armpitAttachUart(armpit, (uint32_t)UART_ADDRESS))
+            || (TIMER_ADDRESS >= 0 && !armpitAttachTimer(armpit, (uint32_t)TIMER_ADDRESS)))
+        exit(EXIT_FAILURE);
 
-    INSTRUCTION instruction;
-    instruction.data32 = 0xE3A00001;	// MOV R0, #1 	; 11100011 10100000 00000000 00000001
-    loadInstruction(instruction);
+    if(traceFile != NULL) {
+        if(!armpitStartTrace(armpit, traceFile))
+            exit(EXIT_FAILURE);
+        for(int i = 0; i < traceRangeCount; i++)
+            armpitTraceRange(armpit, traceRanges[i][0], traceRanges[i][1]);
+    }
 
-    instruction.data32 = 0xF0000000; // never execute;
-    loadInstruction(instruction);
+    if(PROFILING && !armpitStartProfile(armpit)) {
+        printf("The profiler is not built in, rebuild with -DARMPIT_PROFILER=ON (or make profile)\n");
+        exit(EXIT_FAILURE);
+    }
 
-    instruction.data32 = 0xE4000000; // dummy branch - 01
-    loadInstruction(instruction);
+    if(!BATCH) {
+        while(armpitStep(armpit).executed > 0) {
+            printf("\nPress Enter key to continue\n");
+            getchar();
+        }
+        printf("\nExiting program\n\n");
+        armpitStopTrace(armpit);
+        if(PROFILING)
+            armpitReportProfile(armpit, profileFoldedFile);
+        if(saveCheckpointFile != NULL && !armpitSaveCheckpoint(armpit, saveCheckpointFile))
+            exit(EXIT_FAILURE);
+        exit(EXIT_SUCCESS);
+    }
 
-    instruction.data32 = 0xE8000000; // dummy transfer - 10
-    loadInstruction(instruction);
+    armpitSetFusion(armpit, !NO_FUSION);
+    if(!armpitSetEngine(armpit, ENGINE)) {
+        printf("The JIT is not supported on this host, using the threaded interpreter\n");
+    }
+    if(aotFile != NULL) {
+        if(!armpitLoadAot(armpit, aotFile)) {
+            armpitDestroy(armpit);
+            exit(EXIT_FAILURE);
+        }
+        armpitSetEngine(armpit, ARMPIT_ENGINE_AOT);
+    }
 
-    instruction.data32 = 0xEF000000; // dummy interupt - 11
-    loadInstruction(instruction);
+    if(laneInputFile != NULL) {
+        bool ran = runLaneFiles(armpit, laneInputFile, laneOutputFile, LANE_REGISTERS);
+        armpitDestroy(armpit);
+        exit(ran? EXIT_SUCCESS : EXIT_FAILURE);
+    }
 
-    instruction.data32 = 0xE3f3fa02;    // MOV R1, #2       ; 1110 0011 1010 0000 0001 0000 0000 0010
-    loadInstruction(instruction);
+    if(JIT_CHECK) {
+        bool passed = checkJit(armpit, MAX_STEPS);
+        armpitDestroy(armpit); // finishes the trace, if there is one
+        exit(passed? EXIT_SUCCESS : EXIT_FAILURE);
+    }
 
-    instruction.data32 = 0xE0802001;    // ADD R2, R0, R1   ; 1110 0000 1000 0000 0010 0000 0000 0001
-    loadInstruction(instruction);
+    struct timespec startTime, endTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
 
-    instruction.data32 = 0xE2822001;    // ADD R2, R2, #5   ; 1110 0010 1000 0010 0010 0000 0000 0101
-    loadInstruction(instruction);
-}
+    ARMPIT_RESULT result = armpitRun(armpit, MAX_STEPS);
 
-void displayUsage() {
-	puts(USAGE);
-}
+    clock_gettime(CLOCK_MONOTONIC, &endTime);
+    double seconds = (double)(endTime.tv_sec - startTime.tv_sec) + (double)(endTime.tv_nsec - startTime.tv_nsec) / 1e9;
 
-void loadInstruction(INSTRUCTION i) {
-	if(VERBOSE)
-		printf("\tLoading Instruction: %04X onto stack at position %i\n", i.data32, *PROGRAM_COUNTER);
+    displayRegisters(armpit);
+    displayThroughput(result.executed, seconds);
+    if(VERBOSE_LOGGING)
+        displayFusionHits(armpit);
+    if(PROFILING)
+        armpitReportProfile(armpit, profileFoldedFile);
 
-	// now to place it onto my virtual stack
-    memory[*PROGRAM_COUNTER] = i;
-    (*PROGRAM_COUNTER)++;
-}
+    if(saveCheckpointFile != NULL && !armpitSaveCheckpoint(armpit, saveCheckpointFile))
+        exit(EXIT_FAILURE);
 
-INSTRUCTION fetchInstruction() {
-    if(PROGRAM_COUNTER > 0)
-        (*PROGRAM_COUNTER)--; // as the position is incremented after loading each instruction, it needs to be decreased 
-    INSTRUCTION instruction = memory[*PROGRAM_COUNTER];
-    printf("\n\tFetching instruction: %04X from position %i\n", instruction.data32, *PROGRAM_COUNTER);
-    return instruction;
+    int exitCode = (int)armpitExitCode(armpit); // from OS_Exit
+    armpitDestroy(armpit);
+    exit(exitCode);
 }
 
-InstructionType getInstructionType(INSTRUCTION instruction) {
-    InstructionType type;
+/*
+ * Sets up the registers and loads the program in fileName, or the built in example if it is NULL.
+ * Returns false if the program couldn't be loaded.
+ */
+bool init(ARMPIT *armpit, const char *fileName) {
 
-    type = (instruction.data32 >> 26) & BITMASK_2_BIT;
+    // a new machine starts with the status register clear and SP at the top of memory (full descending stack)
+    if(STACK_TOP)
+        armpitSetRegister(armpit, ARMPIT_SP, STACK_TOP);
+    armpitSetRegister(armpit, ARMPIT_PC, LOAD_ADDRESS);
 
-    if(VERBOSE) {
-        char *typeName;
+    if(fileName != NULL)
+        return armpitLoadImage(armpit, fileName, LOAD_ADDRESS);
 
-        switch(type) {
-            case ALU: typeName = "ALU"; break;
-            case BRANCH: typeName = "Branch"; break;
-            case DATA_TRANSFER: typeName = "Data Transfer"; break;
-            case INTERUPT: typeName = "Interupt"; break;
-        }
-    
-        printf("\tInstruction is type %d:\t%s\n", type, typeName);
-    }
-    return type; // returns 0, 1, 2, or 3 for ALU, BRANCH, DATA_TRANSFER, or INTERUPT
-}
+    // no program given, run the built in example
+    INSTRUCTION instruction;
+    instruction.data32 = 0xE3A00001;	// MOV R0, #1 	; 11100011 10100000 00000000 00000001
+    loadInstruction(armpit, instruction);
 
+    instruction.data32 = 0xF0000000; // never execute;
+    loadInstruction(armpit, instruction);
 
-/*
- * All instructions are 32 bits in length.  Bit 31-28 of all instructions contain a condition code which is used to decide 
- * whether the instruction will execute.
- * This condition code identifies the required state of the status register (SR) in order for execution to take place.
- *
- * The table below shows each condition code value (stored in top 4 bits of the instruction) and the status flags which are
- * tested to see whether the condition is true.  If a status flag is blank then that means its value doesn't matter for that
- * condition to be true.
- *
- * -------------------------------------------------------------------------------
- *               Condition   Status Reg Flags
- *                  Code    | N | Z | C | V |
- * -------------------------------------------------------------------------------
- * Equal            0000    |   | 1 |   |   | Execute the instruction if the Z flag is set.
- * Not Equal        0001    |   | 0 |   |   | Execute the instruction is the Z flag is clear.
- * Carry Set        0010    |   |   | 1 |   | Execute the instruction if the C flag is set. Provides >= test (unsigned).
- * Carry Clear      0011    |   |   | 0 |   | Execute if the C flag is clear. Provides < test for unsigned comparison.
- * Minus            0100    | 1 |   |   |   | Execute if the N flag is set.
- * Plus             0101    | 0 |   |   |   | Execute if the N flag is clear.
- * Overflow Set     0110    |   |   |   | 1 | Execute if the V flag is set.
- * Overflow Clear   0111    |   |   |   | 0 | Execute if the V flag is clear.
- * Higher           1000    |   | 0 | 1 |   | Execute if the C flag is set and Z flag is clear. Provides > test (unsigned).
- * Lower or Same    1001    |   | 1 | 0 |   | Execute if the C flag is clear and Z flag is set. Provides <= test (unsigned).
- * Greater or Equal 1010    | 0 |   |   | 0 | Execute if the N flag is clear and V flag is clear, 
- *                          | 1 |   |   | 1 |  or N flag is set and V flag is set. Provides >= test for signed comparison.
- *              
- * Less Than        1011    | 0 |   |   | 1 | Execute if the N flag is clear and V flag is set, 
- *                          | 1 |   |   | 0 |  or N flag is set and V flag is clear. Provides a < test for signed comparison.
- *                          
- * Greater Than     1100    | 0 | 0 |   | 0 | Same as GE but Z flag must be clear. Provides > test for signed comparison.
- *                          | 1 | 0 |   | 1 |
- * Less or Equal    1101    | 0 |   |   | 1 | Same as LT but also true if Z flag is set.
- *                          | 1 |   |   | 0 |
- *                          |   | 1 |   |   |
- * Always           1110    |   |   |   |   | Instruction always executes. Flags irrelevant.
- * Never            1111    |   |   |   |   | Instruction never executes. Flags irrelevant.
- *
- */ 
-bool shouldExecute(INSTRUCTION instruction) {
-    bool execute = false;
-    int conditionCode = instruction.data32 >> COND_CODE_POS;
-
-    switch (conditionCode) {
-        case CONDITION_EQUAL: // 0000
-            // Execute the instruction is the Z flag is set.
-            execute = isSet(STATUS_Z);
-            break;
-        case CONDITION_NOT_EQUAL: // 0001
-            // Execute the instruction is the Z flag is clear.
-            execute = isClear(STATUS_Z);
-            break;
-        case CONDITION_CARRY_SET: // 0010
-            // Execute the instruction if the C flag is set. Provides >= test (unsigned).
-            execute = isSet(STATUS_C);
-            break;
-        case CONDITION_CARRY_CLEAR: // 0011
-            // Execute if the C flag is clear. Provides < test for unsigned comparison.
-            execute = isClear(STATUS_C);
-            break;
-        case CONDITION_MINUS: // 0100
-            // Execute if the N flag is set.
-            execute = isSet(STATUS_N);
-            break;
-        case CONDITION_PLUS: // 0101
-            // Execute if the N flag is clear.
-            execute = isClear(STATUS_N);
-            break;
-        case CONDITION_OVERFLOW_SET: // 0110
-            // Execute if the V flag is set.
-            execute = isSet(STATUS_V);
-            break;
-        case CONDITION_OVERFLOW_CLEAR: // 0111
-            // Execute if the V flag is clear.
-            execute = isClear(STATUS_V);
-            break;
-        case CONDITION_HIGHER: // 1000
-            // Execute if the C flag is set and Z flag is clear. Provides > test (unsigned).
-            execute = ( isSet(STATUS_C) && isClear(STATUS_Z) );
-            break;
-        case CONDITION_LOWER_OR_SAME: // 1001
-            // Execute if the C flag is clear and Z flag is set. Provides <= test (unsigned).
-            execute = ( isClear(STATUS_C) && isSet(STATUS_Z) );
-            break;
-        case CONDITION_GREATER_OR_EQUAL: // 1010
-            // Execute if the N flag is clear and V flag is clear, or N flag is set and V flag is set. 
-            // Provides >= test for signed comparison.
-            execute = ( isClear(STATUS_N) && isClear(STATUS_V) ) || ( isSet(STATUS_N) && isSet(STATUS_V) );
-            break;
-        case CONDITION_LESS_THAN: // 1011
-            // Execute if the N flag is clear and V flag is set, or N flag is set and V flag is clear. 
-            // Provides a < test for signed comparison.
-            execute = ( isSet(STATUS_N) && isClear(STATUS_V) ) || ( isClear(STATUS_N) && isSet(STATUS_V) );
-            break;
-        case CONDITION_GREATER_THAN: // 1100
-            // Same as GE but Z flag must be clear. Provides > test for signed comparison.
-            execute = ( isClear(STATUS_N) && isClear(STATUS_V) && isClear(STATUS_Z) ) || ( isSet(STATUS_N) && isSet(STATUS_V) && isClear(STATUS_Z));
-            break;
-        case CONDITION_LESS_OR_EQUAL: // 1101
-            // Same as LT but also true if Z flag is set.
-            execute = ( isSet(STATUS_N) && isClear(STATUS_V) ) || ( isClear(STATUS_N) && isSet(STATUS_V) ) || isSet(STATUS_Z);
-            break;
-        case CONDITION_ALWAYS: // 1110
-            execute = true;
-            break;
-        case CONDITION_NEVER: // 1111
-            execute = false;
-            break;
-    }
+    instruction.data32 = 0xEAFFFFFF; // dummy branch to the next instruction - 101
+    loadInstruction(armpit, instruction);
 
-    if(VERBOSE) {
-        printf("\tshould execute?: %s - %04X\n", execute? "true" : "false", instruction.data32);
-    }
-    return execute; 
-}
+    instruction.data32 = 0xE59F3000; // dummy transfer, LDR R3, [PC] - 01
+    loadInstruction(armpit, instruction);
 
-bool isImmediateValue(INSTRUCTION instruction) {
-    bool immediate = (instruction.data32 >> 25) & BITMASK_1_BIT;
-    printf("\tImmediate Bit:\t%s \n", immediate? "set" : "not set");
-    return immediate;
-}
+    instruction.data32 = 0xEF000000; // dummy interupt, SWI 0 - 1111
+    loadInstruction(armpit, instruction);
 
-bool statusBitSet(INSTRUCTION instruction) {
-    bool updateStatus = (instruction.data32 >> 20) & BITMASK_1_BIT;
-    printf("\tStatus Bit:\t%s \n", updateStatus? "set" : "not set");
-    return updateStatus;
-}
+    instruction.data32 = 0xE3A01002;    // MOV R1, #2       ; 1110 0011 1010 0000 0001 0000 0000 0010
+    loadInstruction(armpit, instruction);
 
-REGISTER getRegister(INSTRUCTION instruction, int shiftAmount) {
-    int regNo = (instruction.data32 >> shiftAmount) & BITMASK_4_BIT;
-    printf("\tRegister:\t%i \n", regNo);
+    instruction.data32 = 0xE0802001;    // ADD R2, R0, R1   ; 1110 0000 1000 0000 0010 0000 0000 0001
+    loadInstruction(armpit, instruction);
 
-    return registers[regNo];
-}
+    instruction.data32 = 0xE2822005;    // ADD R2, R2, #5   ; 1110 0010 1000 0010 0010 0000 0000 0101
+    loadInstruction(armpit, instruction);
 
-int isSet(int flag) {
-    return (STATUS_REGISTER & flag);
+    // execution starts from the first instruction that was loaded
+    armpitSetHaltAddress(armpit, armpitGetRegister(armpit, ARMPIT_PC));
+    armpitSetRegister(armpit, ARMPIT_PC, LOAD_ADDRESS);
+    return true;
 }
 
-int isClear(int flag) {
-    return ((~STATUS_REGISTER) & flag);
+void displayUsage() {
+	puts(USAGE);
 }
 
-void setFlag(int flag) {
-    STATUS_REGISTER = STATUS_REGISTER | flag;
+void displayRegisters(ARMPIT *armpit) {
+    for(int i = 0; i < 16; i++) {
+        printf("R%-2i %08X%s", i, armpitGetRegister(armpit, i), (i % 4 == 3)? "\n" : "    ");
+    }
+    printf("Status Register: %02X\n", armpitGetStatus(armpit));
 }
 
-void clearFlag(int flag) {
-    STATUS_REGISTER = STATUS_REGISTER & (~flag);
+/*
+ * End of run summary for batch mode: instructions executed, wall time and MIPS
+ * (millions of instructions per second).
+ */
+void displayThroughput(uint64_t executed, double seconds) {
+    double mips = seconds > 0 ? (double)executed / seconds / 1e6 : 0.0;
+    printf("Instructions executed: %llu\n", (unsigned long long)executed);
+    printf("Wall time: %.6f s\n", seconds);
+    printf("MIPS: %.2f\n", mips);
 }
 
-void doDataProcessing(INSTRUCTION instruction) {
-    printf("\tData Processing...\n");
-    
-    bool immediate = isImmediateValue(instruction);
-    bool updateStatus = statusBitSet(instruction);
-
-    REGISTER regN = getRegister(instruction, 16); // bits 16 to 19
-    REGISTER regDest = getRegister(instruction, 12); // bits 12 to 15
-
-    int opCode = (instruction.data32 >> OP_CODE_POS) & BITMASK_4_BIT;
-
-    printf("\tOp Code:\t%i\n", opCode);
-
-    switch (opCode) {
-        case OP_AND: // 0000
-            // doAND();
-            printf("\tProcessing AND function\n");
-            break;
-        case OP_EOR: // 0001
-            printf("\tProcessing Exclusive-OR function\n");
-            break;
-        case OP_SUB: // 0010
-            printf("\tProcessing SUB function\n");
-            break;
-        case OP_RSB: // 0011
-            printf("\tProcessing RSB function\n");
-            break;
-        case OP_ADD: // 0100
-            printf("\tProcessing ADD function\n");
-
-            // todo, something like:
-            // if(immediate) { doAdd(updateStatus, regDest, regN, shiftAmount, value); } else {doAdd(updateStatus, regDest, regN, shiftAmount, register);}
-            break;
-        case OP_ADC: // 0101
-            printf("\tProcessing ADC function\n");
-            break;
-        case OP_SBC: // 0110
-            printf("\tProcessing SBC function\n");
-            break;
-        case OP_RSC: // 0111
-            printf("\tProcessing RSC function\n");
-            break;
-        case OP_TST: // 1000
-            printf("\tProcessing TST function\n");
-            break;
-        case OP_TEQ: // 1001
-            printf("\tProcessing TEQ function\n");
-            break;
-        case OP_CMP: // 1010
-            printf("\tProcessing Compare function\n");
-            break;
-        case OP_CMN: // 1011
-            printf("\tProcessing CMN function\n");
-            break;
-        case OP_ORR: // 1100
-            printf("\tProcessing ORR function\n");
-            break;
-        case OP_MOV: // 1101
-            printf("\tProcessing MOV function\n");
-            break;
-        case OP_BIC: // 1110
-            printf("\tProcessing BIC function\n");
-            break;
-        case OP_MVN: // 1111
-            printf("\tProcessing MVN function\n");
-            break;
+/*
+ * --lanes: runs the program once for each record in inputFile, words in host byte order which go into R0 upwards, and
+ * writes the same registers after each run to outputFile, record for record
+ */
+bool runLaneFiles(ARMPIT *armpit, const char *inputFile, const char *outputFile, int registers) {
+    size_t recordSize = (size_t)registers * sizeof(uint32_t);
+
+    if(outputFile == NULL) {
+        printf("--lanes needs --lane-output for the results\n");
+        return false;
+    }
+    FILE *file = fopen(inputFile, "rb");
+    if(file == NULL || fseek(file, 0, SEEK_END) != 0) {
+        printf("Error opening %s\n", inputFile);
+        if(file != NULL)
+            fclose(file);
+        return false;
+    }
+    long size = ftell(file);
+    rewind(file);
+    if(size < 0 || (size_t)size % recordSize != 0) {
+        printf("%s isn't a whole number of %zu byte inputs\n", inputFile, recordSize);
+        fclose(file);
+        return false;
     }
-}
 
-void doBranch() {
-    printf("\tBranch\n");
-    // todo
-}
+    uint64_t count = (uint64_t)size / recordSize;
+    uint32_t *inputs = malloc((size_t)size + 1);
+    uint32_t *outputs = malloc((size_t)size + 1);
+    bool read = inputs != NULL && outputs != NULL && fread(inputs, 1, (size_t)size, file) == (size_t)size;
+    fclose(file);
+    if(!read) {
+        printf("Error reading %s\n", inputFile);
+        free(inputs);
+        free(outputs);
+        return false;
+    }
 
-void doDataTransfer() {
-    printf("\tData Transfer\n");
-    // todo
+    struct timespec startTime, endTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    uint64_t executed = armpitRunLanes(armpit, inputs, outputs, count, registers);
+    clock_gettime(CLOCK_MONOTONIC, &endTime);
+    double seconds = (double)(endTime.tv_sec - startTime.tv_sec) + (double)(endTime.tv_nsec - startTime.tv_nsec) / 1e9;
+
+    file = fopen(outputFile, "wb");
+    bool written = file != NULL && fwrite(outputs, 1, (size_t)size, file) == (size_t)size;
+    if(file != NULL && fclose(file) != 0)
+        written = false;
+    if(!written)
+        printf("Error writing %s\n", outputFile);
+
+    printf("Inputs: %llu\n", (unsigned long long)count);
+    displayThroughput(executed, seconds);
+    free(inputs);
+    free(outputs);
+    return written;
 }
 
-void doInterupt() {
-    printf("\tInterupt\n");
-    // todo
+void displayFusionHits(ARMPIT *armpit) {
+    static const char *names[ARMPIT_FUSION_COUNT] = { "compare and branch", "counted loop", "move and add",
+                                                      "condition run" };
+    printf("Fused:");
+    for(int i = 0; i < ARMPIT_FUSION_COUNT; i++)
+        printf("%s %s %llu", (i == 0)? "" : ",", names[i], (unsigned long long)armpitFusionHits(armpit, i));
+    printf("\n");
 }
 
+void loadInstruction(ARMPIT *armpit, INSTRUCTION i) {
+    REGISTER address = armpitGetRegister(armpit, ARMPIT_PC);
 
+	if(VERBOSE)
+		printf("\tLoading Instruction: %04X into memory at address %08X\n", i.data32, address);
 
-
-/*
- * Adds op1Value to op2Value and stores in the specified register
- *
- * enter:   regNumber - the number of the destination register (0-15)
- *          op1Value  - the first value to be added
- *          op2Value  -  the second value to be added
- *          setSR     - flag, if non-zero then the status register should be updated, else it shouldn't
- */
-// void doAdd(int regNumber, REGISTER op1Value, REGISTER op2Value, bool setSR) {
-//     REGISTER result = op1Value + op2Value;
-
-//     registers[ regNumber ] = result;
-
-//     if ( setSR ) {
-//         // set the SR flags by examining the result. This can be difficult for certain flags!
-
-//         // some are simple, e.g. to set or clear the Zero flag, could use -
-//         if ( result == 0 ) {
-//             setFlag(STAT_Z);
-//         } else {
-//             clearFlag(STAT_Z);
-//         }
-//     }
-// }
\ No newline at end of file
+	// now to place it into my virtual memory
+    armpitMapMemory(armpit, address, &i.data32, 4);
+    armpitSetRegister(armpit, ARMPIT_PC, address + 4);
+}
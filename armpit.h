@@ -1,6 +1,11 @@
 #ifndef __ARMPIT_H__
 #define __ARMPIT_H__
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "libarmpit.h"  // the public interface, ARMPIT is a CPU
 
 typedef uint8_t BYTE;
 
@@ -13,11 +18,22 @@ typedef enum InstructionType {
     ALU = 0,
     BRANCH,
     DATA_TRANSFER,
-    INTERUPT
+    INTERUPT,
+    UNDEFINED       // multiply (decoded to doMultiply()), coprocessor and undefined instruction space
 } InstructionType;
 
 typedef uint32_t REGISTER;
 
+// register numbers with a special use
+#define STACK_POINTER 13    // R13 is the SP (stack pointer)
+#define LINK_REGISTER 14    // R14 is general purpose or the LR (link register)
+#define PROGRAM_COUNTER 15  // R15 is used as program counter
+
+#define PC_MASK 0x03fffffc  // the PC bits of R15, the rest hold the PSR when R15 is stored
+
+extern bool VERBOSE;   // -v option
+extern bool TRACE;     // per-instruction output, turned off in batch mode
+
 
 #define BITMASK_1_BIT 0X1
 #define BITMASK_2_BIT 0X3
@@ -87,8 +103,10 @@ typedef uint32_t REGISTER;
  *
  * bit 1   Processor mode bit
  * bit 0   Processor mode bit
+ *
+ * The register is held in the CPU (statusRegister). The NZCV flags are evaluated lazily (see flags.h), use
+ * getStatusRegister() to read the register with them up to date.
 */
-BYTE STATUS_REGISTER;
 
 #define STATUS_N	(1<<7) // negative
 #define STATUS_Z	(1<<6) // zero flag
@@ -100,6 +118,12 @@ BYTE STATUS_REGISTER;
 #define STATUS_S1	(1<<1) // processor mode
 #define STATUS_S0	(1<<0) // processor mode
 
+#define MODE_MASK   (STATUS_S1 | STATUS_S0)
+#define MODE_USER   0
+#define MODE_FIQ    1
+#define MODE_IRQ    2
+#define MODE_SVC    3
+
 
 /* -------------------------------------------------------------------------------
  * 	 OpCode (21..24) - Identifies the specific Data Processing Instruction
@@ -125,33 +149,280 @@ BYTE STATUS_REGISTER;
 #define OP_MVN	(0xf) // 1111
 
 
+/* -------------------------------------------------------------------------------
+ * 	 Shift Type (5..6) - How operand 2 is passed through the barrel shifter
+ * -------------------------------------------------------------------------------
+ */
+#define SHIFT_LSL	(0x0) // 00 logical shift left
+#define SHIFT_LSR	(0x1) // 01 logical shift right
+#define SHIFT_ASR	(0x2) // 10 arithmetic shift right
+#define SHIFT_ROR	(0x3) // 11 rotate right (ROR #0 encodes RRX)
+
+#define SHIFTER_CARRY_UNCHANGED (2) // the shifter leaves the C flag as it is
+
+
+/*
+ * Predecoded Instruction
+ *
+ * Every word of executed memory has a matching entry in the decode cache. The first time a word is executed its bitfields are
+ * extracted once into one of these records, which also holds the handler that executes it. Subsequent executions of the
+ * same address skip straight to the handler. Writing to a word of memory invalidates its entry (handler set to NULL).
+ */
+typedef struct CPU CPU;
+typedef struct DECODED DECODED;
+typedef void (*HANDLER)(CPU *, const DECODED *);
+
+/*
+ * Handler variants used by the threaded interpreter (threaded.c). Data processing instructions have one variant per
+ * (opcode, register/immediate operand 2, S bit) so that flag setting and flag free forms are separate code paths.
+ * The ALU variant of an instruction is (opCode << 2) | (immediate << 1) | updateStatus.
+ */
+#define ALU_OPS(X) X(AND) X(EOR) X(SUB) X(RSB) X(ADD) X(ADC) X(SBC) X(RSC) \
+                   X(TST) X(TEQ) X(CMP) X(CMN) X(ORR) X(MOV) X(BIC) X(MVN)
+
+#define ALU_VARIANTS(OP) VARIANT_##OP##_REG, VARIANT_##OP##_REG_S, VARIANT_##OP##_IMM, VARIANT_##OP##_IMM_S,
+
+typedef enum Variant {
+    ALU_OPS(ALU_VARIANTS)
+    VARIANT_BRANCH,
+    VARIANT_RETURN,         // MOV PC, LR and loads of the PC, checked against the threaded interpreter's return stack
+    VARIANT_DATA_TRANSFER,
+    VARIANT_HANDLER,        // anything else that just calls its handler, such as data processing that reads R15
+    VARIANT_INTERUPT,
+    VARIANT_UNDEFINED,
+    VARIANT_FUSED,          // the first instruction of a fused pair or run, the record's variant is still its own
+    VARIANT_COUNT
+} Variant;
+
+struct DECODED {
+    HANDLER handler;        // function that executes this instruction, NULL if not decoded yet
+    const void *threaded;   // address of the threaded interpreter code for this variant (computed goto builds only)
+    uint16_t variant;       // Variant
+    INSTRUCTION instruction;// the raw instruction word
+    uint32_t operand2;      // immediate value already rotated into place (when immediate is set)
+    BYTE condition;         // bits 28..31
+    BYTE type;              // InstructionType
+    BYTE opCode;            // bits 21..24
+    BYTE regN;              // bits 16..19
+    BYTE regDest;           // bits 12..15
+    BYTE regM;              // bits 0..3, register operand 2
+    BYTE regS;              // bits 8..11, register holding the shift amount
+    BYTE shiftType;         // bits 5..6
+    BYTE shiftAmount;       // bits 7..11, immediate shift amount
+    BYTE shifter;           // barrel shifter kernel for a register operand 2, SHIFTER_NONE ... SHIFTER_RRX (shifter.h)
+    BYTE immediateCarry;    // carry out of the rotated immediate: 0, 1 or SHIFTER_CARRY_UNCHANGED
+    bool immediate;         // bit 25
+    bool updateStatus;      // bit 20
+    bool shiftByRegister;   // bit 4
+    bool link;              // BL
+    const DECODED *chained; // a branch's target, once the threaded interpreter has taken it (NULL until then)
+    BYTE fusion;            // ARMPIT_FUSION pattern starting here, if fusedLength is 2 or more
+    BYTE fusedLength;       // instructions from here the pattern covers, all in this page
+};
+
+#define MAX_FUSED 8         // longest run of instructions fused together
+
+
+/*
+ * CPU Context
+ *
+ * Everything belonging to one emulated machine: registers, status register, memory and the caches built from that
+ * memory. Every function that touches machine state is given the CPU to work on, so a process can hold any number of
+ * machines and run them on different threads.
+ */
+typedef struct PAGE PAGE;   // memory.h
+typedef struct JIT JIT;     // jit.c
+typedef struct SNAPSHOT SNAPSHOT; // snapshot.c
+typedef struct PROFILE PROFILE; // profile.c
+typedef struct TRACE_LOG TRACE_LOG; // trace.c
+typedef struct BUS BUS;     // bus.c
+typedef struct SCHEDULER SCHEDULER; // scheduler.c
+typedef struct AOT AOT;     // aot.c
+
+typedef struct LAZY_FLAGS { // see flags.h
+    REGISTER result;
+    REGISTER op1;
+    REGISTER op2;
+    REGISTER sum;
+    BYTE carry;
+    BYTE pending;
+} LAZY_FLAGS;
+
+struct CPU {
+    REGISTER registers[16]; // those of the current mode
+    BYTE statusRegister;    // NZCV may be out of date, see flags.h
+    REGISTER bankedRegisters[4][7]; // R8..R14 of the other modes (modes.c)
+    LAZY_FLAGS flags;
+    REGISTER programEnd;    // the program halts when the PC reaches this address
+    ARMPIT_ENGINE engine;   // used by armpitRun()
+
+    char imageName[256];    // the program loadImage() loaded, kept in checkpoints
+    REGISTER loadAddress;
+    REGISTER entryPoint;
+
+    BYTE *memoryBase;       // guest memory, see memory.h
+    uint32_t memorySize;
+    uint32_t memoryMask;
+    PAGE *pages;
+    BUS *bus;               // devices, NULL until one is attached
+    uint32_t *dirtyPages;   // pages written since the last snapshot (snapshot.c)
+    uint32_t dirtyCount;
+    uint64_t snapshotSerial; // the snapshot the dirty list is relative to, 0 for none
+
+    const void *const *threadedTargets; // label table of the threaded interpreter, once it has run
+    JIT *jit;               // code cache, NULL until the JIT first runs
+    AOT *aot;               // code translated ahead of time, NULL unless armpitLoadAot() has loaded some
+    SCHEDULER *scheduler;   // events and interrupt lines, NULL until something needs them
+    uint64_t cycles;        // instructions executed by armpitRun() and armpitStep() over the machine's life
+    PROFILE *profile;       // NULL unless the guest is being profiled (profile.h)
+    TRACE_LOG *traceLog;    // NULL unless execution is being traced (trace.h)
+    bool noFusion;          // armpitSetFusion(), decode without looking for fused patterns
+    uint64_t fusionHits[ARMPIT_FUSION_COUNT];
+
+    BYTE *output;           // guest output waiting to be written (swi.c), NULL until there is some
+    uint32_t outputLength;
+    uint32_t exitCode;      // set by OS_Exit
+    uint64_t clockStart;    // host time the machine was created, in centiseconds, for OS_ReadMonotonicTime
+};
+
+
 
 /*  ------------------------------------------------------------------------
  *		Function Prototypes
  *  ----------------------------------------------------------------------*/
 
-void init();
+// cpu.c
+CPU *createCpu(uint32_t); // memory size in bytes, NULL if it can't be reserved
+void destroyCpu(CPU *);
+
+bool init(CPU *, const char *); // loads the program in the file, or the built in example if NULL
 void displayUsage();
+void displayRegisters(CPU *);
+void displayThroughput(uint64_t, double);
+void displayFusionHits(CPU *);
+bool runLaneFiles(CPU *, const char *, const char *, int); // input file, output file, registers in each
+
+bool step(CPU *); // returns false once the program has halted
+uint64_t run(CPU *, uint64_t); // reference loop, returns the number of instructions executed
+uint64_t runEngine(CPU *, ARMPIT_ENGINE, uint64_t);
+uint64_t runSlice(CPU *, ARMPIT_ENGINE, uint64_t); // runEngine() without events, counts cycles
+
+bool checkJit(CPU *, uint64_t);
+
+// threaded.c
+uint64_t runThreaded(CPU *, uint64_t);
+
+// jit.c
+bool jitAvailable(CPU *);
+uint64_t runJit(CPU *, uint64_t);
+void invalidateJit(CPU *, REGISTER);
+void freeJit(CPU *);
+
+// aot.c
+bool loadAot(CPU *, const char *); // shared object made by armpit-aot
+uint64_t runAot(CPU *, uint64_t);
+void invalidateAot(CPU *, REGISTER);
+void freeAot(CPU *);
 
-void loadInstruction(INSTRUCTION);
+// snapshot.c
+SNAPSHOT *takeSnapshot(CPU *);
+bool restoreSnapshot(CPU *, const SNAPSHOT *);
+void freeSnapshot(SNAPSHOT *);
 
-INSTRUCTION fetchInstruction();
+// lanes.c
+uint64_t runLanes(CPU *, const uint32_t *, uint32_t *, uint64_t, int); // inputs, outputs, count, registers each
 
-bool shouldExecute();
+// checkpoint.c
+bool saveCheckpoint(CPU *, const char *);
+CPU *restoreCheckpoint(const char *);
+
+// batch.c
+bool runBatchList(const char *, int, ARMPIT_ENGINE, uint32_t, uint64_t); // list file, threads (0 for one per core),
+                                                                         // engine, memory size, max steps
+
+void loadInstruction(CPU *, INSTRUCTION);
+
+// assembler.c
+bool assemble(CPU *, const char *, const char *, size_t, REGISTER); // file name (for errors), source, length, address
+
+// loader.c
+bool loadImage(CPU *, const char *, REGISTER); // file name and load address for flat binaries
+
+// memory.c
+void writeMemory(CPU *, REGISTER, INSTRUCTION); // stores a word and invalidates its decode cache entry and JIT blocks
+
+const DECODED *fetchInstruction(CPU *);
+
+bool shouldExecute(CPU *, int);
 InstructionType getInstructionType(INSTRUCTION); // returns enum value
 
-void doDataProcessing();
-void doBranch();
-void doDataTransfer();
-void doInterupt();
+// decode.c
+void decodeInstruction(INSTRUCTION, DECODED *);
+const DECODED *lookupDecoded(CPU *, REGISTER);
+void invalidateDecoded(CPU *, REGISTER);
+void flushDecodeCache(CPU *);
+void setThreadedTargets(CPU *, const void *const *);
+
+// alu.c
+extern const HANDLER aluHandlers[16];
+REGISTER getOperand2(CPU *, const DECODED *, int *);
+void doReadingPc(CPU *, const DECODED *);
+void doWritingPc(CPU *, const DECODED *);
+void doAND(CPU *, const DECODED *);
+void doEOR(CPU *, const DECODED *);
+void doSUB(CPU *, const DECODED *);
+void doRSB(CPU *, const DECODED *);
+void doADD(CPU *, const DECODED *);
+void doADC(CPU *, const DECODED *);
+void doSBC(CPU *, const DECODED *);
+void doRSC(CPU *, const DECODED *);
+void doTST(CPU *, const DECODED *);
+void doTEQ(CPU *, const DECODED *);
+void doCMP(CPU *, const DECODED *);
+void doCMN(CPU *, const DECODED *);
+void doORR(CPU *, const DECODED *);
+void doMOV(CPU *, const DECODED *);
+void doBIC(CPU *, const DECODED *);
+void doMVN(CPU *, const DECODED *);
+void doMultiply(CPU *, const DECODED *); // MUL, MLA
+
+void doBranch(CPU *, const DECODED *);
+void doUndefined(CPU *, const DECODED *);
+
+// modes.c
+REGISTER *modeRegister(CPU *, BYTE, int); // a register of any mode, current or not
+REGISTER pcWithPsr(CPU *, REGISTER); // R15 as instructions see it
+void restorePsr(CPU *, REGISTER);
+void switchMode(CPU *, BYTE); // swaps in the new mode's banked registers and sets the mode bits
+void enterException(CPU *, BYTE, REGISTER, REGISTER, BYTE); // mode, vector, return address, bits of I F to set
+
+// scheduler.c
+SCHEDULER *startScheduler(CPU *);
+void scheduleEvent(CPU *, uint64_t, ARMPIT_EVENT, void *); // delay in cycles, callback, context
+void cancelEvents(CPU *, ARMPIT_EVENT, void *);
+void setInterrupt(CPU *, bool, uint32_t, bool); // FIQ rather than IRQ, mask of sources, raised
+uint32_t allocateInterruptSource(CPU *);
+uint64_t runScheduled(CPU *, ARMPIT_ENGINE, uint64_t);
+void freeScheduler(CPU *);
+
+// swi.c
+void doInterupt(CPU *, const DECODED *); // SWI, a host call or supervisor mode entry
+void writeOutput(CPU *, const BYTE *, uint32_t);
+void flushOutput(CPU *);
+void freeOutput(CPU *); // flushes first
+uint64_t hostCentiseconds(void);
+
+// transfer.c
+void doDataTransfer(CPU *, const DECODED *); // LDR, STR
+void doBlockTransfer(CPU *, const DECODED *); // LDM, STM
 
 bool isImmediateValue(INSTRUCTION);
 bool statusBitSet(INSTRUCTION);
-REGISTER getRegister(INSTRUCTION, int);
+BYTE getRegisterNumber(INSTRUCTION, int);
 
-int isSet(int);
-int isClear(int);
-void setFlag(int);
-void clearFlag(int);
+int isSet(CPU *, int);
+int isClear(CPU *, int);
+void setFlag(CPU *, int);
+void clearFlag(CPU *, int);
 
 #endif
@@ -0,0 +1,1098 @@
+/*
+ * Single pass assembler for ARMv2 assembly source (.s and .asm files given to -f).
+ *
+ * The source is read straight from the mapped file, one statement at a time, and each instruction is encoded and
+ * written into guest memory as soon as it has been parsed. Nothing is built up in between: there is no token list and
+ * no second pass over the source.
+ *
+ *      Mnemonics, shift names and condition codes are found with perfect hashes: the first three letters of a mnemonic
+ *      (or the two letters of a condition) are packed into a number which a multiply and shift turns into a table
+ *      slot no other name shares. The rest of the mnemonic is the condition and the S, P, B, T or LDM/STM mode
+ *      suffixes (P makes TST, TEQ, CMP or CMN write the PSR, as TEQP).
+ *
+ *      Labels go in a hash table. A reference to a label that hasn't been defined yet leaves the field it goes in
+ *      empty and records a fixup, which is patched once the end of the source is reached.
+ *
+ *      Immediates are encoded as an 8 bit value rotated right by an even amount. A value that can't be encoded is
+ *      tried with the complementary instruction (MOV/MVN, ADD/SUB, CMP/CMN, AND/BIC, ADC/SBC) before giving up.
+ *
+ *      LDR Rd, =value uses MOV or MVN when it can, otherwise the value goes in a literal pool which is placed at the
+ *      next .ltorg (or .pool) and at the end of the program.
+ *
+ * Comments start with ; or @ or //. Mnemonics, registers and directives are not case sensitive, labels are.
+ *
+ * Supported directives: .word .long .byte .ascii .asciz .string .align .balign .space .skip .equ .set .ltorg .pool
+ * and .end, DCD and DCB. Section and symbol directives (.text, .global and so on) are accepted and ignored.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <pthread.h>
+
+#include "memory.h"
+
+
+/*
+ * Mnemonics
+ */
+typedef enum MnemonicKind {
+    KIND_ALU,       // bits is the opcode
+    KIND_MULTIPLY,  // bits is the accumulate bit
+    KIND_TRANSFER,  // LDR and STR, bits is the load bit
+    KIND_BLOCK,     // LDM and STM, bits is the load bit
+    KIND_SWI,
+    KIND_ADR,
+    KIND_NOP,
+    KIND_SHIFT,     // bits is the shift type, only valid as part of operand 2
+    KIND_RRX,
+    KIND_DCD,
+    KIND_DCB
+} MnemonicKind;
+
+typedef struct MNEMONIC {
+    char name[4];
+    BYTE kind;
+    uint32_t bits;
+} MNEMONIC;
+
+static const MNEMONIC mnemonics[] = {
+    { "AND", KIND_ALU, OP_AND }, { "EOR", KIND_ALU, OP_EOR }, { "SUB", KIND_ALU, OP_SUB }, { "RSB", KIND_ALU, OP_RSB },
+    { "ADD", KIND_ALU, OP_ADD }, { "ADC", KIND_ALU, OP_ADC }, { "SBC", KIND_ALU, OP_SBC }, { "RSC", KIND_ALU, OP_RSC },
+    { "TST", KIND_ALU, OP_TST }, { "TEQ", KIND_ALU, OP_TEQ }, { "CMP", KIND_ALU, OP_CMP }, { "CMN", KIND_ALU, OP_CMN },
+    { "ORR", KIND_ALU, OP_ORR }, { "MOV", KIND_ALU, OP_MOV }, { "BIC", KIND_ALU, OP_BIC }, { "MVN", KIND_ALU, OP_MVN },
+    { "MUL", KIND_MULTIPLY, 0 }, { "MLA", KIND_MULTIPLY, 1 },
+    { "LDR", KIND_TRANSFER, 1 }, { "STR", KIND_TRANSFER, 0 },
+    { "LDM", KIND_BLOCK, 1 }, { "STM", KIND_BLOCK, 0 },
+    { "SWI", KIND_SWI, 0 }, { "SVC", KIND_SWI, 0 },
+    { "ADR", KIND_ADR, 0 }, { "NOP", KIND_NOP, 0 },
+    { "LSL", KIND_SHIFT, SHIFT_LSL }, { "ASL", KIND_SHIFT, SHIFT_LSL }, { "LSR", KIND_SHIFT, SHIFT_LSR },
+    { "ASR", KIND_SHIFT, SHIFT_ASR }, { "ROR", KIND_SHIFT, SHIFT_ROR }, { "RRX", KIND_RRX, SHIFT_ROR },
+    { "DCD", KIND_DCD, 0 }, { "DCB", KIND_DCB, 0 }
+};
+
+static const char conditionNames[][3] = {
+    "EQ", "NE", "CS", "CC", "MI", "PL", "VS", "VC", "HI", "LS", "GE", "LT", "GT", "LE", "AL", "NV"
+};
+
+// hash multipliers chosen so that none of the names above share a slot
+#define MNEMONIC_HASH_BITS 6
+#define MNEMONIC_HASH_MULTIPLIER 0xcad02a43u
+#define CONDITION_HASH_BITS 5
+#define CONDITION_HASH_MULTIPLIER 0x3a5a1869u
+
+static const MNEMONIC *mnemonicTable[1 << MNEMONIC_HASH_BITS];
+static BYTE conditionTableKey[1 << CONDITION_HASH_BITS][2];     // the name in each slot, to check for a match
+static BYTE conditionTableCode[1 << CONDITION_HASH_BITS];
+static pthread_once_t tablesBuilt = PTHREAD_ONCE_INIT;
+
+// LDM/STM addressing modes, the P and U bits for loads and stores
+static const struct { char name[3]; BYTE load; BYTE store; } blockModes[] = {
+    { "IA", 0x1, 0x1 }, { "IB", 0x3, 0x3 }, { "DA", 0x0, 0x0 }, { "DB", 0x2, 0x2 },
+    { "FD", 0x1, 0x2 }, { "ED", 0x3, 0x0 }, { "FA", 0x0, 0x3 }, { "EA", 0x2, 0x1 }
+};
+
+
+/*
+ * Assembler state
+ */
+typedef struct SYMBOL {
+    const char *name;       // points into the source
+    uint32_t length;
+    uint32_t hash;
+    REGISTER value;
+    bool defined;
+} SYMBOL;
+
+typedef struct EXPRESSION {
+    int32_t value;
+    int symbol;             // index of a symbol not defined yet which is added to value, or -1
+} EXPRESSION;
+
+typedef enum FixupKind {
+    FIXUP_BRANCH,           // 24 bit word offset of B and BL
+    FIXUP_LOAD,             // 12 bit offset from the PC of LDR and STR
+    FIXUP_ADR,              // ADD or SUB from the PC
+    FIXUP_WORD              // the whole word
+} FixupKind;
+
+typedef struct FIXUP {
+    REGISTER address;
+    int symbol;
+    int32_t addend;
+    uint32_t line;
+    BYTE kind;
+} FIXUP;
+
+typedef struct LITERAL {
+    EXPRESSION value;
+    REGISTER address;       // the LDR which loads it
+    uint32_t line;
+} LITERAL;
+
+/*
+ * Each thread assembles into its own CPU, so the state is per thread
+ */
+static _Thread_local struct {
+    CPU *cpu;               // whose memory the program goes in
+    const char *fileName;
+    const char *p;          // the next character to be read
+    const char *end;
+    uint32_t line;
+    REGISTER location;      // where the next instruction or data goes
+
+    SYMBOL *symbols;
+    uint32_t symbolCount, symbolCapacity;
+    uint32_t *symbolTable;  // open addressing, index + 1 of the symbol in each slot or 0
+    uint32_t symbolTableSize;
+
+    FIXUP *fixups;
+    uint32_t fixupCount, fixupCapacity;
+    LITERAL *literals;
+    uint32_t literalCount, literalCapacity;
+
+    jmp_buf failed;         // errors longjmp back to assemble()
+} as;
+
+
+static void fail(const char *format, ...) {
+    va_list arguments;
+
+    printf("%s:%u: error: ", as.fileName, as.line);
+    va_start(arguments, format);
+    vprintf(format, arguments);
+    va_end(arguments);
+    printf("\n");
+    longjmp(as.failed, 1);
+}
+
+static void *grow(void *array, uint32_t *capacity, size_t size) {
+    *capacity = *capacity? *capacity * 2 : 256;
+    array = realloc(array, *capacity * size);
+    if(array == NULL)
+        fail("out of memory");
+    return array;
+}
+
+static void buildTables() {
+    for(size_t i = 0; i < sizeof(mnemonics) / sizeof(mnemonics[0]); i++) {
+        const char *name = mnemonics[i].name;
+        uint32_t key = (uint32_t)(name[0] - 'A') << 10 | (uint32_t)(name[1] - 'A') << 5 | (uint32_t)(name[2] - 'A');
+        mnemonicTable[(key * MNEMONIC_HASH_MULTIPLIER) >> (32 - MNEMONIC_HASH_BITS)] = &mnemonics[i];
+    }
+    for(int i = 0; i < 18; i++) {
+        // HS and LO are other names for CS and CC
+        const char *name = (i < 16)? conditionNames[i] : (i == 16)? "HS" : "LO";
+        uint32_t key = (uint32_t)(name[0] - 'A') << 5 | (uint32_t)(name[1] - 'A');
+        uint32_t slot = (key * CONDITION_HASH_MULTIPLIER) >> (32 - CONDITION_HASH_BITS);
+        conditionTableKey[slot][0] = name[0];
+        conditionTableKey[slot][1] = name[1];
+        conditionTableCode[slot] = (i < 16)? i : (i == 16)? CONDITION_CARRY_SET : CONDITION_CARRY_CLEAR;
+    }
+}
+
+/*
+ * name is upper case. Returns NULL if the first three letters aren't a mnemonic.
+ */
+static const MNEMONIC *lookupMnemonic(const char *name) {
+    if(name[0] < 'A' || name[0] > 'Z' || name[1] < 'A' || name[1] > 'Z' || name[2] < 'A' || name[2] > 'Z')
+        return NULL;
+    uint32_t key = (uint32_t)(name[0] - 'A') << 10 | (uint32_t)(name[1] - 'A') << 5 | (uint32_t)(name[2] - 'A');
+    const MNEMONIC *mnemonic = mnemonicTable[(key * MNEMONIC_HASH_MULTIPLIER) >> (32 - MNEMONIC_HASH_BITS)];
+    if(mnemonic == NULL || memcmp(mnemonic->name, name, 3) != 0)
+        return NULL;
+    return mnemonic;
+}
+
+/*
+ * name is upper case. Returns the condition code or -1.
+ */
+static int lookupCondition(const char *name) {
+    if(name[0] < 'A' || name[0] > 'Z' || name[1] < 'A' || name[1] > 'Z')
+        return -1;
+    uint32_t key = (uint32_t)(name[0] - 'A') << 5 | (uint32_t)(name[1] - 'A');
+    uint32_t slot = (key * CONDITION_HASH_MULTIPLIER) >> (32 - CONDITION_HASH_BITS);
+    if(conditionTableKey[slot][0] != name[0] || conditionTableKey[slot][1] != name[1])
+        return -1;
+    return conditionTableCode[slot];
+}
+
+
+/*
+ * Symbols
+ */
+static uint32_t hashName(const char *name, uint32_t length) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for(uint32_t i = 0; i < length; i++)
+        hash = (hash ^ (BYTE)name[i]) * 16777619u;
+    return hash;
+}
+
+static void growSymbolTable() {
+    uint32_t size = as.symbolTableSize? as.symbolTableSize * 2 : 1024;
+    uint32_t *table = calloc(size, sizeof(uint32_t));
+    if(table == NULL)
+        fail("out of memory");
+
+    for(uint32_t i = 0; i < as.symbolCount; i++) {
+        uint32_t slot = as.symbols[i].hash & (size - 1);
+        while(table[slot] != 0)
+            slot = (slot + 1) & (size - 1);
+        table[slot] = i + 1;
+    }
+    free(as.symbolTable);
+    as.symbolTable = table;
+    as.symbolTableSize = size;
+}
+
+/*
+ * Returns the index of the symbol, adding it (undefined) if it hasn't been seen before
+ */
+static int findSymbol(const char *name, uint32_t length) {
+    if((as.symbolCount + 1) * 2 > as.symbolTableSize)
+        growSymbolTable();
+
+    uint32_t hash = hashName(name, length);
+    uint32_t slot = hash & (as.symbolTableSize - 1);
+    while(as.symbolTable[slot] != 0) {
+        SYMBOL *symbol = &as.symbols[as.symbolTable[slot] - 1];
+        if(symbol->hash == hash && symbol->length == length && memcmp(symbol->name, name, length) == 0)
+            return as.symbolTable[slot] - 1;
+        slot = (slot + 1) & (as.symbolTableSize - 1);
+    }
+
+    if(as.symbolCount == as.symbolCapacity)
+        as.symbols = grow(as.symbols, &as.symbolCapacity, sizeof(SYMBOL));
+    as.symbols[as.symbolCount] = (SYMBOL){ .name = name, .length = length, .hash = hash };
+    as.symbolTable[slot] = ++as.symbolCount;
+    return as.symbolCount - 1;
+}
+
+static void defineSymbol(const char *name, uint32_t length, REGISTER value) {
+    int index = findSymbol(name, length); // may move the symbols
+    SYMBOL *symbol = &as.symbols[index];
+    if(symbol->defined)
+        fail("%.*s is already defined", (int)length, name);
+    symbol->value = value;
+    symbol->defined = true;
+}
+
+
+/*
+ * Tokenizer
+ */
+static bool isIdentifierStart(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '.' || c == '$';
+}
+
+static bool isIdentifierCharacter(char c) {
+    return isIdentifierStart(c) || (c >= '0' && c <= '9');
+}
+
+static char upper(char c) {
+    return (c >= 'a' && c <= 'z')? c - ('a' - 'A') : c;
+}
+
+static void skipSpaces() {
+    while(as.p < as.end && (*as.p == ' ' || *as.p == '\t' || *as.p == '\r'))
+        as.p++;
+}
+
+static bool atEndOfStatement() {
+    skipSpaces();
+    return as.p == as.end || *as.p == '\n' || *as.p == ';' || *as.p == '@' || (*as.p == '/' && as.p + 1 < as.end && as.p[1] == '/');
+}
+
+static bool accept(char c) {
+    skipSpaces();
+    if(as.p < as.end && *as.p == c) {
+        as.p++;
+        return true;
+    }
+    return false;
+}
+
+static void expect(char c) {
+    if(!accept(c))
+        fail("expected '%c'", c);
+}
+
+static uint32_t scanIdentifier() {
+    const char *start = as.p;
+    while(as.p < as.end && isIdentifierCharacter(*as.p))
+        as.p++;
+    return (uint32_t)(as.p - start);
+}
+
+/*
+ * Compares an identifier with a lower case word ignoring case
+ */
+static bool identifierIs(const char *name, uint32_t length, const char *word) {
+    uint32_t i = 0;
+    for(; i < length && word[i] != '\0'; i++) {
+        if((name[i] | 0x20) != word[i])
+            return false;
+    }
+    return i == length && word[i] == '\0';
+}
+
+/*
+ * Returns the register number at the cursor and moves past it, or -1 (without moving) if there isn't one
+ */
+static int tryRegister() {
+    skipSpaces();
+    const char *start = as.p;
+    uint32_t length = scanIdentifier();
+    int number = -1;
+
+    if(length >= 2 && length <= 3 && (start[0] | 0x20) == 'r') {
+        number = 0;
+        for(uint32_t i = 1; i < length; i++) {
+            if(start[i] < '0' || start[i] > '9') {
+                number = -1;
+                break;
+            }
+            number = number * 10 + (start[i] - '0');
+        }
+        if(number > 15 || (length == 3 && start[1] == '0'))
+            number = -1;
+    } else if(identifierIs(start, length, "sp")) {
+        number = 13;
+    } else if(identifierIs(start, length, "lr")) {
+        number = 14;
+    } else if(identifierIs(start, length, "pc")) {
+        number = 15;
+    } else if(identifierIs(start, length, "fp")) {
+        number = 11;
+    } else if(identifierIs(start, length, "ip")) {
+        number = 12;
+    } else if(identifierIs(start, length, "sl")) {
+        number = 10;
+    }
+
+    if(number < 0)
+        as.p = start;
+    return number;
+}
+
+static uint32_t parseRegister() {
+    int number = tryRegister();
+    if(number < 0)
+        fail("expected a register");
+    return (uint32_t)number;
+}
+
+static EXPRESSION parseExpression();
+
+static int32_t parseNumber() {
+    uint32_t base = 10;
+    uint32_t value = 0;
+    bool digits = false;
+
+    if(*as.p == '&') {
+        base = 16;
+        as.p++;
+    } else if(*as.p == '0' && as.p + 1 < as.end && (as.p[1] | 0x20) == 'x') {
+        base = 16;
+        as.p += 2;
+    } else if(*as.p == '0' && as.p + 1 < as.end && (as.p[1] | 0x20) == 'b') {
+        base = 2;
+        as.p += 2;
+    }
+
+    for(; as.p < as.end; as.p++) {
+        char c = *as.p;
+        uint32_t digit;
+        if(c >= '0' && c <= '9')
+            digit = c - '0';
+        else if((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            digit = (c | 0x20) - 'a' + 10;
+        else
+            break;
+        if(digit >= base)
+            fail("bad digit in number");
+        value = value * base + digit;
+        digits = true;
+    }
+    if(!digits)
+        fail("expected a number");
+    return (int32_t)value;
+}
+
+static EXPRESSION parseTerm() {
+    EXPRESSION term = { 0, -1 };
+
+    skipSpaces();
+    if(as.p == as.end)
+        fail("expected an expression");
+
+    char c = *as.p;
+    if(c == '-' || c == '~' || c == '+') {
+        as.p++;
+        term = parseTerm();
+        if(term.symbol >= 0 && c != '+')
+            fail("can't negate or invert a label that hasn't been defined yet");
+        term.value = (c == '-')? -term.value : (c == '~')? ~term.value : term.value;
+    } else if(c == '(') {
+        as.p++;
+        term = parseExpression();
+        expect(')');
+    } else if((c >= '0' && c <= '9') || c == '&') {
+        term.value = parseNumber();
+    } else if(c == '\'' && as.p + 2 < as.end && as.p[2] == '\'') {
+        term.value = (BYTE)as.p[1];
+        as.p += 3;
+    } else if(isIdentifierStart(c)) {
+        const char *name = as.p;
+        uint32_t length = scanIdentifier();
+        int index = findSymbol(name, length);
+        if(as.symbols[index].defined)
+            term.value = (int32_t)as.symbols[index].value;
+        else
+            term.symbol = index;
+    } else {
+        fail("expected an expression");
+    }
+    return term;
+}
+
+/*
+ * Sums and differences of numbers and labels. Only one label which hasn't been defined yet is allowed, and it has to be
+ * added.
+ */
+static EXPRESSION parseExpression() {
+    EXPRESSION result = parseTerm();
+
+    for(;;) {
+        skipSpaces();
+        if(as.p == as.end || (*as.p != '+' && *as.p != '-'))
+            return result;
+
+        char operator = *as.p++;
+        EXPRESSION term = parseTerm();
+        if(term.symbol >= 0) {
+            if(operator == '-' || result.symbol >= 0)
+                fail("expression has to be a label that hasn't been defined yet plus or minus a number");
+            result.symbol = term.symbol;
+        }
+        result.value += (operator == '+')? term.value : -term.value;
+    }
+}
+
+static int32_t parseConstant() {
+    EXPRESSION expression = parseExpression();
+    if(expression.symbol >= 0)
+        fail("%.*s has to be defined before it is used here", (int)as.symbols[expression.symbol].length,
+             as.symbols[expression.symbol].name);
+    return expression.value;
+}
+
+
+/*
+ * Output
+ */
+static void checkLocation(uint32_t size) {
+    if(as.location >= as.cpu->memorySize || size > as.cpu->memorySize - as.location)
+        fail("program doesn't fit in memory");
+}
+
+static void emitByte(BYTE value) {
+    checkLocation(1);
+    writeMemoryByte(as.cpu, as.location++, value);
+}
+
+static void emitWord(uint32_t word) {
+    while(as.location & 3)
+        emitByte(0);
+    checkLocation(4);
+    writeMemory(as.cpu, as.location, (INSTRUCTION){ .data32 = word });
+    as.location += 4;
+}
+
+static void patchWord(REGISTER address, uint32_t bits) {
+    writeMemory(as.cpu, address, (INSTRUCTION){ .data32 = memoryWord(as.cpu, address) | bits });
+}
+
+static void addFixup(FixupKind kind, EXPRESSION expression) {
+    if(as.fixupCount == as.fixupCapacity)
+        as.fixups = grow(as.fixups, &as.fixupCapacity, sizeof(FIXUP));
+    as.fixups[as.fixupCount++] = (FIXUP){
+        .address = as.location, .symbol = expression.symbol, .addend = expression.value, .line = as.line, .kind = kind
+    };
+}
+
+/*
+ * Finds the 8 bit value and even rotate right that make value. Returns false if there aren't any.
+ */
+static bool encodeImmediate(uint32_t value, uint32_t *encoded) {
+    for(uint32_t rotate = 0; rotate < 32; rotate += 2) {
+        uint32_t unrotated = rotate? (value << rotate) | (value >> (32 - rotate)) : value;
+        if(unrotated <= BITMASK_8_BIT) {
+            *encoded = (rotate / 2) << 8 | unrotated;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Fills in the field a fixup was recorded for, once the value is known
+ */
+static void applyFixup(BYTE kind, REGISTER address, REGISTER target) {
+    int32_t offset = (int32_t)(target - (address + 8)); // the PC is 8 bytes ahead when the instruction runs
+    uint32_t encoded;
+
+    switch(kind) {
+        case FIXUP_BRANCH:
+            if(offset & 3)
+                fail("branch target %08X isn't word aligned", target);
+            patchWord(address, ((uint32_t)offset >> 2) & 0xFFFFFF);
+            break;
+        case FIXUP_LOAD:
+            if(offset < -4095 || offset > 4095)
+                fail("%08X is too far away to load from (more than 4095 bytes)", target);
+            patchWord(address, (offset < 0)? (uint32_t)-offset : (1u << 23) | (uint32_t)offset);
+            break;
+        case FIXUP_ADR:
+            if(!encodeImmediate((offset < 0)? (uint32_t)-offset : (uint32_t)offset, &encoded))
+                fail("ADR can't reach %08X", target);
+            patchWord(address, (1u << 25) | (uint32_t)((offset < 0)? OP_SUB : OP_ADD) << OP_CODE_POS | encoded);
+            break;
+        default:
+            patchWord(address, target);
+            break;
+    }
+}
+
+/*
+ * Emits an instruction with a field that depends on expression, leaving it to be fixed up later if need be
+ */
+static void emitWithFixup(uint32_t word, FixupKind kind, EXPRESSION expression) {
+    while(as.location & 3)
+        emitByte(0);
+
+    if(expression.symbol >= 0) {
+        addFixup(kind, expression);
+        emitWord(word);
+    } else {
+        emitWord(word);
+        applyFixup(kind, as.location - 4, (REGISTER)expression.value);
+    }
+}
+
+static void placeLiterals() {
+    for(uint32_t i = 0; i < as.literalCount; i++) {
+        LITERAL *literal = &as.literals[i];
+        uint32_t line = as.line;
+
+        as.line = literal->line; // report any problem against the LDR
+        emitWithFixup(0, FIXUP_WORD, literal->value);
+        applyFixup(FIXUP_LOAD, literal->address, as.location - 4);
+        as.line = line;
+    }
+    as.literalCount = 0;
+}
+
+
+/*
+ * Instructions
+ */
+typedef struct SUFFIXES {
+    uint32_t condition;
+    bool s, p, b, t;
+    int mode;               // index into blockModes or -1
+} SUFFIXES;
+
+/*
+ * Splits what follows the mnemonic into the condition code and the suffixes the kind of instruction allows
+ */
+static bool parseSuffixes(const char *suffix, BYTE kind, SUFFIXES *suffixes) {
+    bool conditionSeen = false;
+
+    *suffixes = (SUFFIXES){ .condition = CONDITION_ALWAYS, .mode = -1 };
+    while(*suffix != '\0') {
+        int condition = (!conditionSeen && suffix[1] != '\0')? lookupCondition(suffix) : -1;
+        if(condition >= 0) {
+            suffixes->condition = condition;
+            conditionSeen = true;
+            suffix += 2;
+            continue;
+        }
+        if(kind == KIND_BLOCK && suffixes->mode < 0 && suffix[1] != '\0') {
+            for(int i = 0; i < 8; i++) {
+                if(blockModes[i].name[0] == suffix[0] && blockModes[i].name[1] == suffix[1])
+                    suffixes->mode = i;
+            }
+            if(suffixes->mode >= 0) {
+                suffix += 2;
+                continue;
+            }
+        }
+        if(*suffix == 'S' && !suffixes->s && (kind == KIND_ALU || kind == KIND_MULTIPLY))
+            suffixes->s = true;
+        else if(*suffix == 'P' && !suffixes->p && kind == KIND_ALU)
+            suffixes->p = true;
+        else if(*suffix == 'B' && !suffixes->b && kind == KIND_TRANSFER)
+            suffixes->b = true;
+        else if(*suffix == 'T' && !suffixes->t && kind == KIND_TRANSFER)
+            suffixes->t = true;
+        else
+            return false;
+        suffix++;
+    }
+    return kind != KIND_BLOCK || suffixes->mode >= 0;
+}
+
+/*
+ * Register operand 2 with an optional shift: Rm{, LSL|LSR|ASR|ROR #amount | Rs}{, RRX}. Returns bits 11..0.
+ */
+static uint32_t parseShiftedRegister(bool allowRegisterShift) {
+    uint32_t rm = parseRegister();
+    const char *start;
+
+    skipSpaces();
+    start = as.p;
+    if(!accept(','))
+        return rm;
+
+    // operand 2 is the last operand, so a comma means a shift follows
+    char name[4] = { 0 };
+    skipSpaces();
+    for(int i = 0; i < 3 && as.p < as.end; i++)
+        name[i] = upper(*as.p++);
+    const MNEMONIC *shift = lookupMnemonic(name);
+    if(shift == NULL || (shift->kind != KIND_SHIFT && shift->kind != KIND_RRX) || (as.p < as.end && isIdentifierCharacter(*as.p))) {
+        as.p = start;
+        fail("expected a shift");
+    }
+    if(shift->kind == KIND_RRX)
+        return SHIFT_ROR << 5 | rm;
+
+    skipSpaces();
+    if(accept('#')) {
+        int32_t amount = parseConstant();
+        if(amount < 0 || amount > 32 || (amount == 32 && (shift->bits == SHIFT_LSL || shift->bits == SHIFT_ROR)))
+            fail("shift amount %d is out of range", amount);
+        if(amount == 0)
+            return rm; // LSL #0, also how LSR #0 and ASR #0 are written by some assemblers
+        return (uint32_t)(amount & BITMASK_5_BIT) << 7 | shift->bits << 5 | rm;
+    }
+    if(!allowRegisterShift)
+        fail("expected a shift amount");
+    return parseRegister() << 8 | shift->bits << 5 | 1u << 4 | rm;
+}
+
+/*
+ * Operand 2 of a data processing instruction. An immediate that can't be encoded is retried with the complementary
+ * opcode, which may change *opCode.
+ */
+static uint32_t parseOperand2(uint32_t *opCode) {
+    if(!accept('#'))
+        return parseShiftedRegister(true);
+
+    uint32_t value = (uint32_t)parseConstant();
+    uint32_t encoded;
+    if(encodeImmediate(value, &encoded))
+        return 1u << 25 | encoded;
+
+    uint32_t alternative = *opCode;
+    uint32_t alternativeValue = ~value;
+    switch(*opCode) {
+        case OP_MOV: alternative = OP_MVN; break;
+        case OP_MVN: alternative = OP_MOV; break;
+        case OP_AND: alternative = OP_BIC; break;
+        case OP_BIC: alternative = OP_AND; break;
+        case OP_ADC: alternative = OP_SBC; break;
+        case OP_SBC: alternative = OP_ADC; break;
+        case OP_ADD: alternative = OP_SUB; alternativeValue = -value; break;
+        case OP_SUB: alternative = OP_ADD; alternativeValue = -value; break;
+        case OP_CMP: alternative = OP_CMN; alternativeValue = -value; break;
+        case OP_CMN: alternative = OP_CMP; alternativeValue = -value; break;
+    }
+    if(alternative == *opCode || !encodeImmediate(alternativeValue, &encoded))
+        fail("immediate %08X can't be encoded as a rotated 8 bit value", value);
+    *opCode = alternative;
+    return 1u << 25 | encoded;
+}
+
+static void assembleALU(uint32_t opCode, const SUFFIXES *suffixes) {
+    uint32_t rd = 0, rn = 0;
+    bool test = opCode >= OP_TST && opCode <= OP_CMN;
+
+    if(suffixes->p && !test)
+        fail("only TST, TEQ, CMP and CMN take P");
+    if(opCode == OP_MOV || opCode == OP_MVN) {
+        rd = parseRegister();
+    } else if(test) {
+        rn = parseRegister();
+        rd = suffixes->p? PROGRAM_COUNTER : 0; // R15 as the destination writes the PSR
+    } else {
+        rd = parseRegister();
+        expect(',');
+        rn = parseRegister();
+    }
+    expect(',');
+    uint32_t operand2 = parseOperand2(&opCode);
+
+    emitWord(suffixes->condition << COND_CODE_POS | opCode << OP_CODE_POS | (uint32_t)(suffixes->s || test) << 20
+             | rn << 16 | rd << 12 | operand2);
+}
+
+static void assembleMultiply(bool accumulate, const SUFFIXES *suffixes) {
+    uint32_t rd = parseRegister();
+    expect(',');
+    uint32_t rm = parseRegister();
+    expect(',');
+    uint32_t rs = parseRegister();
+    uint32_t rn = 0;
+    if(accumulate) {
+        expect(',');
+        rn = parseRegister();
+    }
+    if(rd == rm)
+        fail("MUL and MLA can't use the same register for Rd and Rm");
+    if(rd == PROGRAM_COUNTER || rm == PROGRAM_COUNTER || rs == PROGRAM_COUNTER || (accumulate && rn == PROGRAM_COUNTER))
+        fail("MUL and MLA can't use R15");
+
+    emitWord(suffixes->condition << COND_CODE_POS | (uint32_t)accumulate << 21 | (uint32_t)suffixes->s << 20 | rd << 16
+             | rn << 12 | rs << 8 | 0x9u << 4 | rm);
+}
+
+/*
+ * LDR and STR. Addresses are [Rn], [Rn, offset]{!}, [Rn], offset, a label, or =value (LDR only) where offset is
+ * #{-}amount or {-}Rm{, shift #amount}.
+ */
+static void assembleTransfer(bool load, const SUFFIXES *suffixes) {
+    uint32_t rd = parseRegister();
+    uint32_t word = suffixes->condition << COND_CODE_POS | 1u << 26 | (uint32_t)suffixes->b << 22 | (uint32_t)load << 20
+                    | rd << 12;
+    expect(',');
+
+    if(accept('=')) {
+        if(!load)
+            fail("STR can't store to a literal");
+        EXPRESSION value = parseExpression();
+        uint32_t encoded;
+        if(value.symbol < 0 && encodeImmediate((uint32_t)value.value, &encoded)) {
+            emitWord(suffixes->condition << COND_CODE_POS | 1u << 25 | OP_MOV << OP_CODE_POS | rd << 12 | encoded);
+        } else if(value.symbol < 0 && encodeImmediate(~(uint32_t)value.value, &encoded)) {
+            emitWord(suffixes->condition << COND_CODE_POS | 1u << 25 | OP_MVN << OP_CODE_POS | rd << 12 | encoded);
+        } else {
+            if(as.literalCount == as.literalCapacity)
+                as.literals = grow(as.literals, &as.literalCapacity, sizeof(LITERAL));
+            emitWord(word | 1u << 24 | 15u << 16);
+            as.literals[as.literalCount++] = (LITERAL){ .value = value, .address = as.location - 4, .line = as.line };
+        }
+        return;
+    }
+
+    if(!accept('[')) {
+        // a label, addressed from the PC
+        if(suffixes->t)
+            fail("T can only be used with a post-indexed address");
+        emitWithFixup(word | 1u << 24 | 15u << 16, FIXUP_LOAD, parseExpression());
+        return;
+    }
+
+    uint32_t rn = parseRegister();
+    bool preIndexed = !accept(']');
+    word |= rn << 16;
+    if(preIndexed) {
+        expect(',');
+    } else if(!accept(',')) {
+        // [Rn] is [Rn, #0]
+        if(suffixes->t)
+            word |= 1u << 21;
+        emitWord(word | 1u << 24 | 1u << 23 | (uint32_t)accept('!') << 21);
+        return;
+    }
+
+    if(accept('#')) {
+        int32_t offset = parseConstant();
+        if(offset < -4095 || offset > 4095)
+            fail("offset %d is out of range (-4095 to 4095)", offset);
+        word |= (offset < 0)? (uint32_t)-offset : (1u << 23) | (uint32_t)offset;
+    } else {
+        bool down = accept('-');
+        if(!down)
+            accept('+');
+        word |= 1u << 25 | (uint32_t)!down << 23 | parseShiftedRegister(false);
+    }
+
+    if(preIndexed) {
+        expect(']');
+        if(suffixes->t)
+            fail("T can only be used with a post-indexed address");
+        word |= 1u << 24 | (uint32_t)accept('!') << 21;
+    } else if(suffixes->t) {
+        word |= 1u << 21;
+    }
+    emitWord(word);
+}
+
+static void assembleBlock(bool load, const SUFFIXES *suffixes) {
+    BYTE mode = load? blockModes[suffixes->mode].load : blockModes[suffixes->mode].store;
+    uint32_t rn = parseRegister();
+    uint32_t writeBack = accept('!');
+    uint32_t list = 0;
+
+    expect(',');
+    expect('{');
+    do {
+        uint32_t first = parseRegister();
+        uint32_t last = first;
+        if(accept('-'))
+            last = parseRegister();
+        if(last < first)
+            fail("register range goes backwards");
+        for(uint32_t r = first; r <= last; r++)
+            list |= 1u << r;
+    } while(accept(','));
+    expect('}');
+    uint32_t psr = accept('^');
+
+    emitWord(suffixes->condition << COND_CODE_POS | 1u << 27 | (uint32_t)mode << 23 | psr << 22 | writeBack << 21
+             | (uint32_t)load << 20 | rn << 16 | list);
+}
+
+/*
+ * B, BL and their conditional forms: B{L}{cond}. Returns false if the mnemonic isn't a branch.
+ */
+static bool assembleBranch(const char *name) {
+    uint32_t link = 0;
+    int condition = CONDITION_ALWAYS;
+
+    if(name[0] != 'B')
+        return false;
+    if(name[1] != '\0') {
+        // BLT, BLE and BLS are conditional branches, not BL with a suffix
+        condition = (name[3] == '\0')? lookupCondition(name + 1) : -1;
+        if(condition < 0 && name[1] == 'L') {
+            link = 1;
+            condition = (name[2] == '\0')? CONDITION_ALWAYS : (name[4] == '\0')? lookupCondition(name + 2) : -1;
+        }
+        if(condition < 0)
+            return false;
+    }
+
+    skipSpaces();
+    emitWithFixup((uint32_t)condition << COND_CODE_POS | 0x5u << 25 | link << 24, FIXUP_BRANCH, parseExpression());
+    return true;
+}
+
+static void assembleData(bool words) {
+    do {
+        skipSpaces();
+        if(!words && as.p < as.end && *as.p == '"') {
+            const char *string;
+            as.p++;
+            for(string = as.p; as.p < as.end && *as.p != '"' && *as.p != '\n'; as.p++)
+                ;
+            if(as.p == as.end || *as.p != '"')
+                fail("string isn't terminated");
+            for(; string < as.p; string++)
+                emitByte((BYTE)*string);
+            as.p++;
+        } else if(words) {
+            emitWithFixup(0, FIXUP_WORD, parseExpression());
+        } else {
+            emitByte((BYTE)parseConstant());
+        }
+    } while(accept(','));
+}
+
+static void assembleInstruction(const char *start, uint32_t length) {
+    char name[9] = { 0 };
+
+    if(length > 8)
+        fail("unknown instruction %.*s", (int)length, start);
+    for(uint32_t i = 0; i < length; i++)
+        name[i] = upper(start[i]);
+
+    const MNEMONIC *mnemonic = (length >= 3)? lookupMnemonic(name) : NULL;
+    SUFFIXES suffixes;
+
+    if(mnemonic == NULL || !parseSuffixes(name + 3, mnemonic->kind, &suffixes)) {
+        if(!assembleBranch(name))
+            fail("unknown instruction %.*s", (int)length, start);
+        return;
+    }
+
+    switch(mnemonic->kind) {
+        case KIND_ALU:
+            assembleALU(mnemonic->bits, &suffixes);
+            break;
+        case KIND_MULTIPLY:
+            assembleMultiply(mnemonic->bits, &suffixes);
+            break;
+        case KIND_TRANSFER:
+            assembleTransfer(mnemonic->bits, &suffixes);
+            break;
+        case KIND_BLOCK:
+            assembleBlock(mnemonic->bits, &suffixes);
+            break;
+        case KIND_SWI: {
+            accept('#');
+            int32_t number = parseConstant();
+            if(number < 0 || number > 0xFFFFFF)
+                fail("SWI number %d is out of range", number);
+            emitWord(suffixes.condition << COND_CODE_POS | 0xFu << 24 | (uint32_t)number);
+            break;
+        }
+        case KIND_ADR: {
+            uint32_t rd = parseRegister();
+            expect(',');
+            emitWithFixup(suffixes.condition << COND_CODE_POS | 15u << 16 | rd << 12, FIXUP_ADR, parseExpression());
+            break;
+        }
+        case KIND_NOP:
+            emitWord(suffixes.condition << COND_CODE_POS | OP_MOV << OP_CODE_POS); // MOV R0, R0
+            break;
+        case KIND_DCD:
+        case KIND_DCB:
+            if(length != 3)
+                fail("unknown instruction %.*s", (int)length, start);
+            assembleData(mnemonic->kind == KIND_DCD);
+            break;
+        default:
+            fail("unknown instruction %.*s", (int)length, start);
+    }
+}
+
+/*
+ * Returns false at .end
+ */
+static bool assembleDirective(const char *name, uint32_t length) {
+    if(identifierIs(name, length, ".word") || identifierIs(name, length, ".long") || identifierIs(name, length, ".4byte")) {
+        assembleData(true);
+    } else if(identifierIs(name, length, ".byte") || identifierIs(name, length, ".ascii")) {
+        assembleData(false);
+    } else if(identifierIs(name, length, ".asciz") || identifierIs(name, length, ".string")) {
+        assembleData(false);
+        emitByte(0);
+    } else if(identifierIs(name, length, ".align") || identifierIs(name, length, ".balign")) {
+        int32_t alignment = atEndOfStatement()? 2 : parseConstant();
+        if(name[1] == 'a' || name[1] == 'A') {
+            if(alignment < 0 || alignment > 16)
+                fail("alignment %d is out of range", alignment);
+            alignment = 1 << alignment;
+        } else if(alignment <= 0 || (alignment & (alignment - 1)) != 0) {
+            fail("alignment %d isn't a power of 2", alignment);
+        }
+        while(as.location & (uint32_t)(alignment - 1))
+            emitByte(0);
+    } else if(identifierIs(name, length, ".space") || identifierIs(name, length, ".skip")) {
+        int32_t size = parseConstant();
+        int32_t fill = accept(',')? parseConstant() : 0;
+        if(size < 0)
+            fail("size %d is negative", size);
+        checkLocation((uint32_t)size);
+        for(int32_t i = 0; i < size; i++)
+            emitByte((BYTE)fill);
+    } else if(identifierIs(name, length, ".equ") || identifierIs(name, length, ".set")) {
+        skipSpaces();
+        const char *symbol = as.p;
+        uint32_t symbolLength = scanIdentifier();
+        if(symbolLength == 0)
+            fail("expected a name");
+        expect(',');
+        defineSymbol(symbol, symbolLength, (REGISTER)parseConstant());
+    } else if(identifierIs(name, length, ".ltorg") || identifierIs(name, length, ".pool")) {
+        placeLiterals();
+    } else if(identifierIs(name, length, ".end")) {
+        return false;
+    } else if(identifierIs(name, length, ".text") || identifierIs(name, length, ".data")
+              || identifierIs(name, length, ".global") || identifierIs(name, length, ".globl")
+              || identifierIs(name, length, ".section") || identifierIs(name, length, ".arm")
+              || identifierIs(name, length, ".type") || identifierIs(name, length, ".size")
+              || identifierIs(name, length, ".syntax") || identifierIs(name, length, ".cpu")) {
+        while(!atEndOfStatement())
+            as.p++;
+    } else {
+        fail("unknown directive %.*s", (int)length, name);
+    }
+    return true;
+}
+
+/*
+ * Assembles one line: any number of labels, then an instruction or directive, then a comment. Returns false at .end
+ */
+static bool assembleLine() {
+    bool more = true;
+
+    while(!atEndOfStatement()) {
+        const char *start = as.p;
+        uint32_t length = scanIdentifier();
+        if(length == 0)
+            fail("unexpected '%c'", *as.p);
+
+        if(accept(':')) {
+            defineSymbol(start, length, as.location);
+            continue;
+        }
+        if(start[0] == '.')
+            more = assembleDirective(start, length);
+        else
+            assembleInstruction(start, length);
+
+        if(!atEndOfStatement())
+            fail("unexpected '%c' after the operands", *as.p);
+        break;
+    }
+
+    // skip the comment and the end of the line
+    while(as.p < as.end && *as.p != '\n')
+        as.p++;
+    if(as.p < as.end)
+        as.p++;
+    as.line++;
+    return more;
+}
+
+/*
+ * Assembles source into memory at address, then sets the PC to address and programEnd to the end of the program
+ * (before its last literal pool)
+ */
+bool assemble(CPU *cpu, const char *fileName, const char *source, size_t length, REGISTER address) {
+    bool assembled = false;
+
+    pthread_once(&tablesBuilt, buildTables);
+    memset(&as, 0, sizeof(as));
+    as.cpu = cpu;
+    as.fileName = fileName;
+    as.p = source;
+    as.end = source + length;
+    as.line = 1;
+    as.location = address;
+
+    if(setjmp(as.failed) == 0) {
+        while(as.p < as.end && assembleLine())
+            ;
+
+        REGISTER end = (as.location + 3) & ~3u; // the PC only ever holds word addresses
+        placeLiterals();
+
+        for(uint32_t i = 0; i < as.fixupCount; i++) {
+            FIXUP *fixup = &as.fixups[i];
+            SYMBOL *symbol = &as.symbols[fixup->symbol];
+            as.line = fixup->line;
+            if(!symbol->defined)
+                fail("%.*s is not defined", (int)symbol->length, symbol->name);
+            applyFixup(fixup->kind, fixup->address, symbol->value + (REGISTER)fixup->addend);
+        }
+
+        if(VERBOSE)
+            printf("\tAssembled %u bytes at %08X\n", as.location - address, address);
+
+        cpu->registers[PROGRAM_COUNTER] = address;
+        cpu->programEnd = end;
+        assembled = true;
+    }
+
+    free(as.symbols);
+    free(as.symbolTable);
+    free(as.fixups);
+    free(as.literals);
+    return assembled;
+}
@@ -0,0 +1,238 @@
+/*
+ * Parallel batch runner for --batch-list.
+ *
+ * The list file names one program per line (blank lines and lines starting with # are skipped). Every program is run
+ * to halt in batch mode on its own machine, so any number can run at once. The programs are shared out between a pool of
+ * threads, one per core unless -j says otherwise, and the results are reported in list order once they have all run.
+ *
+ * Programs can take very different times to run, so rather than handing them out from one shared counter (which every
+ * thread would be fighting over) each thread starts with an equal slice of the list and works through it from the
+ * front. A thread whose slice runs out steals the back half of another thread's remaining slice. A slice is a pair of
+ * 32 bit job numbers packed into one 64 bit atomic, next in the top half and end in the bottom, so both taking a job
+ * and stealing are a single compare and swap.
+ */
+
+#define _POSIX_C_SOURCE 200809L // for getline, clock_gettime and sysconf when compiling with -std=c11
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libarmpit.h"
+#include "armpit.h"
+
+
+typedef struct JOB {
+    char *fileName;
+    bool loaded;
+    uint64_t executed;
+    REGISTER registers[16];
+    BYTE statusRegister;
+    double seconds;
+} JOB;
+
+typedef struct WORKER {
+    _Atomic uint64_t range;     // next << 32 | end
+    pthread_t thread;
+    bool started;
+} WORKER;
+
+static struct {
+    JOB *jobs;
+    WORKER *workers;
+    int workerCount;
+    ARMPIT_ENGINE engine;
+    uint64_t maxSteps;
+    uint32_t memorySize;
+} batch;
+
+
+#define RANGE(next, end) ((uint64_t)(next) << 32 | (uint32_t)(end))
+#define RANGE_NEXT(range) ((uint32_t)((range) >> 32))
+#define RANGE_END(range) ((uint32_t)(range))
+
+static double secondsSince(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Takes the job at the front of the worker's own slice. Returns false if the slice is empty.
+ */
+static bool takeJob(WORKER *worker, uint32_t *job) {
+    uint64_t range = atomic_load(&worker->range);
+
+    while(RANGE_NEXT(range) < RANGE_END(range)) {
+        if(atomic_compare_exchange_weak(&worker->range, &range, RANGE(RANGE_NEXT(range) + 1, RANGE_END(range)))) {
+            *job = RANGE_NEXT(range);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Moves the back half of some other worker's slice into this worker's (empty) slice. Nothing ever steals from an empty
+ * slice, so the new slice can simply be stored. Returns false once every slice is empty.
+ */
+static bool stealJobs(WORKER *thief) {
+    for(int i = 1; i < batch.workerCount; i++) {
+        WORKER *victim = &batch.workers[(thief - batch.workers + i) % batch.workerCount];
+        uint64_t range = atomic_load(&victim->range);
+
+        while(RANGE_NEXT(range) < RANGE_END(range)) {
+            uint32_t remaining = RANGE_END(range) - RANGE_NEXT(range);
+            uint32_t split = RANGE_END(range) - (remaining + 1) / 2;
+            if(atomic_compare_exchange_weak(&victim->range, &range, RANGE(RANGE_NEXT(range), split))) {
+                atomic_store(&thief->range, RANGE(split, RANGE_END(range)));
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void runJob(JOB *job) {
+    struct timespec startTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+    ARMPIT *armpit = armpitCreate(batch.memorySize);
+    if(armpit == NULL) {
+        printf("%s: unable to reserve %u bytes of guest memory\n", job->fileName, batch.memorySize);
+        return;
+    }
+
+    job->loaded = init(armpit, job->fileName);
+    if(job->loaded) {
+        armpitSetEngine(armpit, batch.engine);
+        job->executed = armpitRun(armpit, batch.maxSteps).executed;
+        for(int i = 0; i < 16; i++)
+            job->registers[i] = armpitGetRegister(armpit, i);
+        job->statusRegister = armpitGetStatus(armpit);
+    }
+
+    armpitDestroy(armpit);
+    job->seconds = secondsSince(&startTime);
+}
+
+static void *runWorker(void *argument) {
+    WORKER *worker = argument;
+    uint32_t job;
+
+    do {
+        while(takeJob(worker, &job))
+            runJob(&batch.jobs[job]);
+    } while(stealJobs(worker));
+    return NULL;
+}
+
+/*
+ * Reads the names in the list file. Returns the number of jobs, or -1 if the file can't be read.
+ */
+static int readList(const char *listFile) {
+    FILE *file = fopen(listFile, "r");
+    if(file == NULL) {
+        printf("Error opening %s\n", listFile);
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t lineSize = 0;
+    int count = 0, capacity = 0;
+
+    while(getline(&line, &lineSize, file) != -1) {
+        char *name = line;
+        while(*name == ' ' || *name == '\t')
+            name++;
+        size_t length = strcspn(name, "\r\n");
+        while(length > 0 && (name[length - 1] == ' ' || name[length - 1] == '\t'))
+            length--;
+        if(length == 0 || *name == '#')
+            continue;
+
+        if(count == capacity) {
+            capacity = capacity? capacity * 2 : 64;
+            batch.jobs = realloc(batch.jobs, (size_t)capacity * sizeof(JOB));
+        }
+        memset(&batch.jobs[count], 0, sizeof(JOB));
+        batch.jobs[count++].fileName = strndup(name, length);
+    }
+
+    free(line);
+    fclose(file);
+    return count;
+}
+
+/*
+ * Runs every program in listFile and prints the results. Returns false if any of them couldn't be loaded.
+ */
+bool runBatchList(const char *listFile, int threads, ARMPIT_ENGINE engine, uint32_t memorySize, uint64_t maxSteps) {
+    int jobCount = readList(listFile);
+    if(jobCount < 0)
+        return false;
+
+    if(threads <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cores > 0)? (int)cores : 1;
+    }
+    if(threads > jobCount)
+        threads = (jobCount > 0)? jobCount : 1;
+
+    batch.engine = engine;
+    batch.maxSteps = maxSteps;
+    batch.memorySize = memorySize;
+    batch.workerCount = threads;
+    batch.workers = calloc((size_t)threads, sizeof(WORKER));
+
+    struct timespec startTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+    // equal slices to start with, the first few get one extra job
+    uint32_t next = 0;
+    for(int i = 0; i < threads; i++) {
+        uint32_t size = (uint32_t)(jobCount / threads + (i < jobCount % threads));
+        atomic_init(&batch.workers[i].range, RANGE(next, next + size));
+        next += size;
+    }
+    for(int i = 1; i < threads; i++) {
+        // if a thread can't be started its jobs get stolen by the others
+        batch.workers[i].started = pthread_create(&batch.workers[i].thread, NULL, runWorker, &batch.workers[i]) == 0;
+    }
+    runWorker(&batch.workers[0]);
+    for(int i = 1; i < threads; i++) {
+        if(batch.workers[i].started)
+            pthread_join(batch.workers[i].thread, NULL);
+    }
+
+    double seconds = secondsSince(&startTime);
+    uint64_t total = 0;
+    bool allLoaded = true;
+
+    for(int i = 0; i < jobCount; i++) {
+        JOB *job = &batch.jobs[i];
+        if(job->loaded) {
+            printf("%s: %llu instructions in %.6f s, R0 %08X PC %08X Status Register %02X\n", job->fileName,
+                   (unsigned long long)job->executed, job->seconds, job->registers[0],
+                   job->registers[PROGRAM_COUNTER], job->statusRegister);
+            total += job->executed;
+        } else {
+            printf("%s: not run\n", job->fileName);
+            allLoaded = false;
+        }
+        free(job->fileName);
+    }
+
+    printf("Programs: %i on %i threads\n", jobCount, threads);
+    displayThroughput(total, seconds);
+
+    free(batch.jobs);
+    free(batch.workers);
+    batch.jobs = NULL;
+    batch.workers = NULL;
+    return allLoaded;
+}
@@ -0,0 +1,490 @@
+/*
+ * armpit-bench - measures how fast each engine runs a set of synthetic guest workloads.
+ *
+ * Compile using:
+ * 			cmake --build <build directory> --target armpit-bench
+ *
+ * Each workload is a loop: a generated body followed by SUBS R10, R10, #1 and BNE back to the start, run LOOP_COUNT
+ * times. So the engines run the same code over and over, the way real programs spend their time, and what is measured
+ * is dispatch, condition checks and branches rather than decoding. The loop is run again and again from a snapshot of
+ * its starting state. The reset between runs is not timed; the first run of each engine isn't timed either so that
+ * decoding and translation aren't counted. The AOT engine runs code armpit-aot translates from each loop first.
+ *
+ * Every run of a workload has to execute the same number of instructions on every engine, since they all run the same
+ * program from the same state. If one doesn't, that engine is broken: it is reported and armpit-bench exits with 1.
+ *
+ * For each workload and engine it reports millions of guest instructions per second, nanoseconds per guest instruction
+ * and host cycles per guest instruction (from the time stamp counter on x86, which counts at a fixed rate rather than
+ * the core clock, so this is only comparable between runs on the same machine). With -o the results are also written
+ * as JSON so that runs from different commits can be compared.
+ */
+
+#define _POSIX_C_SOURCE 200809L // for clock_gettime, mkdtemp and fork when compiling with -std=c11
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> // for __rdtsc
+#define HAVE_CYCLE_COUNTER 1
+#endif
+
+#include "libarmpit.h"
+
+
+#define MEMORY_SIZE     (1 << 24)
+#define CODE_ADDRESS    0x8000
+#define BODY_LENGTH     256         // at most, instructions in a loop body
+#define LOOP_COUNT      4096        // times round the loop in a run
+#define COUNTER         10          // the loop counter register
+#define SOURCE_ADDRESS  0x100000    // buffers for the load/store workloads
+#define SOURCE_LENGTH   65536       // words, enough for every iteration of a workload to read fresh ones
+#define DEST_ADDRESS    0x400000
+
+char USAGE[] = "\nUsage: armpit-bench [arguments]\n\nArguments:\n -t, --time <seconds>\ttime to spend on each workload with each engine (default 0.5)\n -w, --workload <name>\tonly run this workload\n -o, --output <file>\twrite the results as JSON\n -l, --label <text>\tlabel for the JSON results, such as a commit id\n -a, --aot-tool <file>\tarmpit-aot, to translate the workloads for the AOT engine (default the one next to armpit-bench)\n -h\t\thelp";
+
+static const char *optString = "t:w:o:l:a:h";
+static const struct option longOptions[] = {
+    { "time", required_argument, NULL, 't' },
+    { "workload", required_argument, NULL, 'w' },
+    { "output", required_argument, NULL, 'o' },
+    { "label", required_argument, NULL, 'l' },
+    { "aot-tool", required_argument, NULL, 'a' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+
+/*
+ * Instruction encoders for the generators
+ */
+#define AL 0xe
+enum { EQ, NE, CS, CC, MI, PL, VS, VC, HI, LS, GE, LT, GT, LE };
+enum { AND, EOR, SUB, RSB, ADD, ADC, SBC, RSC, TST, TEQ, CMP, CMN, ORR, MOV, BIC, MVN };
+enum { LSL, LSR, ASR, ROR };
+
+static uint32_t dataImmediate(int cond, int opCode, int s, int rd, int rn, uint32_t immediate) {
+    return (uint32_t)cond << 28 | 1u << 25 | (uint32_t)opCode << 21 | (uint32_t)s << 20 | (uint32_t)rn << 16
+           | (uint32_t)rd << 12 | (immediate & 0xff);
+}
+
+static uint32_t dataRegister(int cond, int opCode, int s, int rd, int rn, int rm, int shift, int amount) {
+    return (uint32_t)cond << 28 | (uint32_t)opCode << 21 | (uint32_t)s << 20 | (uint32_t)rn << 16 | (uint32_t)rd << 12
+           | (uint32_t)amount << 7 | (uint32_t)shift << 5 | (uint32_t)rm;
+}
+
+static uint32_t branch(int cond, bool link, int32_t offset) { // offset in words from the branch + 8
+    return (uint32_t)cond << 28 | 5u << 25 | (uint32_t)link << 24 | ((uint32_t)offset & 0xffffff);
+}
+
+static uint32_t postIndexed(bool load, int rd, int rn, uint32_t offset) { // LDR/STR Rd, [Rn], #offset
+    return (uint32_t)AL << 28 | 1u << 26 | 1u << 23 | (uint32_t)load << 20 | (uint32_t)rn << 16 | (uint32_t)rd << 12
+           | offset;
+}
+
+static uint32_t blockTransfer(bool load, int rn, uint16_t registerList) { // LDMIA/STMIA Rn!, {list}
+    return (uint32_t)AL << 28 | 4u << 25 | 1u << 23 | 1u << 21 | (uint32_t)load << 20 | (uint32_t)rn << 16
+           | registerList;
+}
+
+
+/*
+ * Workloads. Each fills code[] with the body of its loop and returns the number of instructions it wrote (no more than
+ * BODY_LENGTH). None of them use the loop counter.
+ */
+
+// data processing only, with a long dependency chain through R0..R7
+static int aluLoop(uint32_t *code) {
+    int n = 0;
+    code[n++] = dataRegister(AL, ADD, 0, 0, 0, 1, LSL, 0);
+    code[n++] = dataRegister(AL, EOR, 0, 2, 2, 0, LSL, 0);
+    code[n++] = dataImmediate(AL, SUB, 0, 3, 3, 1);
+    code[n++] = dataRegister(AL, ORR, 0, 4, 4, 2, LSL, 3);
+    code[n++] = dataRegister(AL, MOV, 0, 5, 0, 4, ROR, 7);
+    code[n++] = dataRegister(AL, ADD, 1, 6, 6, 5, LSL, 0);
+    code[n++] = dataRegister(AL, AND, 0, 7, 7, 6, LSL, 0);
+    code[n++] = dataRegister(AL, RSB, 0, 1, 3, 7, LSR, 2);
+    return n;
+}
+
+// an xorshift generator sets the flags, then a run of instructions under every condition
+static int conditionalMix(uint32_t *code) {
+    int n = 0, cond = 0;
+    do { // until the conditions come round to the first again
+        code[n++] = dataRegister(AL, EOR, 0, 0, 0, 0, LSL, 13);
+        code[n++] = dataRegister(AL, EOR, 0, 0, 0, 0, LSR, 17);
+        code[n++] = dataRegister(AL, EOR, 1, 0, 0, 0, LSL, 5);        // N, Z and C from the new value
+        code[n++] = dataRegister(AL, CMN, 1, 0, 0, 0, ROR, 11);        // V as well
+        for(int i = 0; i < 4; i++, cond = (cond + 1) % 14)
+            code[n++] = dataImmediate(cond, (i & 1)? SUB : ADD, 0, 1 + i, 1 + i, (uint32_t)(cond + 1));
+    } while(cond != 0);
+    return n;
+}
+
+// short forward branches, taken or not depending on the bits of an xorshift value, and calls to the next instruction
+static int branchHeavy(uint32_t *code) {
+    int n = 0;
+    for(int bit = 0; bit < 8; bit++) {
+        code[n++] = dataRegister(AL, EOR, 0, 0, 0, 0, LSL, 13);
+        code[n++] = dataRegister(AL, EOR, 0, 0, 0, 0, LSR, 17);
+        code[n++] = dataImmediate(AL, TST, 1, 0, 0, 1u << bit);
+        code[n++] = branch(EQ, false, 0);                               // skip the next instruction
+        code[n++] = dataImmediate(AL, ADD, 0, 1, 1, 1);
+        code[n++] = branch(AL, false, -1);                              // to the next instruction
+        code[n++] = branch(NE, true, -1);
+        code[n++] = dataImmediate(AL, ADD, 0, 2, 2, 1);
+    }
+    return n;
+}
+
+// streams words from one buffer to another through a register
+static int loadStore(uint32_t *code) {
+    int n = 0;
+    for(int i = 0; i < 4; i++) {
+        code[n++] = postIndexed(true, 1, 8, 4);
+        code[n++] = dataImmediate(AL, ADD, 0, 1, 1, 1);
+        code[n++] = postIndexed(false, 1, 9, 4);
+    }
+    return n;
+}
+
+// copies eight words at a time
+static int blockCopy(uint32_t *code) {
+    int n = 0;
+    code[n++] = blockTransfer(true, 8, 0x00ff);
+    code[n++] = blockTransfer(false, 9, 0x00ff);
+    return n;
+}
+
+typedef struct WORKLOAD {
+    const char *name;
+    int (*generate)(uint32_t *);
+} WORKLOAD;
+
+static const WORKLOAD workloads[] = {
+    { "alu", aluLoop },
+    { "conditional", conditionalMix },
+    { "branch", branchHeavy },
+    { "load-store", loadStore },
+    { "block-copy", blockCopy }
+};
+
+static const struct {
+    const char *name;
+    ARMPIT_ENGINE engine;
+} engines[] = {
+    { "reference", ARMPIT_ENGINE_REFERENCE },
+    { "threaded", ARMPIT_ENGINE_THREADED },
+    { "jit", ARMPIT_ENGINE_JIT },
+    { "aot", ARMPIT_ENGINE_AOT }
+};
+
+#define ENGINE_COUNT (sizeof(engines) / sizeof(engines[0]))
+
+typedef struct RESULT {
+    uint64_t instructions;  // 0 if the engine isn't available
+    double seconds;
+    uint64_t cycles;
+    uint64_t perRun;        // instructions in each run, 0 if the runs didn't all execute the same number
+} RESULT;
+
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static uint64_t cycles() {
+#ifdef HAVE_CYCLE_COUNTER
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/*
+ * The workload's loop, returns its length in instructions
+ */
+static int loopCode(const WORKLOAD *workload, uint32_t *code) {
+    int length = workload->generate(code);
+    code[length++] = dataImmediate(AL, SUB, 1, COUNTER, COUNTER, 1);
+    code[length] = branch(NE, false, -(length + 2));
+    return length + 1;
+}
+
+/*
+ * Sets up a machine with the workload and its buffers, and returns a snapshot of it ready to run
+ */
+static ARMPIT_SNAPSHOT *prepare(ARMPIT *armpit, const WORKLOAD *workload) {
+    static uint32_t code[BODY_LENGTH + 2];
+    static uint32_t source[SOURCE_LENGTH];
+    int length = loopCode(workload, code);
+
+    for(int i = 0; i < SOURCE_LENGTH; i++)
+        source[i] = (uint32_t)i * 2654435761u;
+
+    armpitMapMemory(armpit, CODE_ADDRESS, code, (uint32_t)length * 4);
+    armpitMapMemory(armpit, SOURCE_ADDRESS, source, sizeof(source));
+    for(int i = 0; i < 8; i++)
+        armpitSetRegister(armpit, i, 0x9e3779b9u * (uint32_t)(i + 1));
+    armpitSetRegister(armpit, 8, SOURCE_ADDRESS);
+    armpitSetRegister(armpit, 9, DEST_ADDRESS);
+    armpitSetRegister(armpit, COUNTER, LOOP_COUNT);
+    armpitSetRegister(armpit, ARMPIT_PC, CODE_ADDRESS);
+    armpitSetHaltAddress(armpit, CODE_ADDRESS + (uint32_t)length * 4);
+    armpitSetStatus(armpit, 0);
+    return armpitSnapshot(armpit);
+}
+
+/*
+ * Writes the workload's loop to directory as a flat binary and runs armpit-aot on it. Returns the name of the shared
+ * object it made, NULL (having said why) if it couldn't be made.
+ */
+static char *translate(const WORKLOAD *workload, const char *tool, const char *directory) {
+    static uint32_t code[BODY_LENGTH + 2];
+    int length = loopCode(workload, code);
+    size_t nameLength = strlen(directory) + strlen(workload->name) + 8;
+    char *binary = malloc(nameLength), *library = malloc(nameLength);
+    if(binary == NULL || library == NULL) {
+        free(binary);
+        free(library);
+        return NULL;
+    }
+    snprintf(binary, nameLength, "%s/%s.bin", directory, workload->name);
+    snprintf(library, nameLength, "%s/%s.so", directory, workload->name);
+
+    FILE *file = fopen(binary, "wb");
+    bool written = file != NULL && fwrite(code, 4, (size_t)length, file) == (size_t)length;
+    if(file != NULL && fclose(file) != 0)
+        written = false;
+
+    char address[16], memorySize[16];
+    snprintf(address, sizeof(address), "0x%X", CODE_ADDRESS);
+    snprintf(memorySize, sizeof(memorySize), "%u", MEMORY_SIZE);
+    char *arguments[] = { (char *)tool, "-f", binary, "-o", library, "-m", memorySize, "--load-address", address,
+                          NULL };
+    int status = -1;
+
+    fflush(stdout);
+    pid_t child = written? fork() : -1;
+    if(child == 0) {
+        freopen("/dev/null", "w", stdout); // the table is all that should be printed
+        execv(tool, arguments);
+        _exit(127);
+    }
+    if(child > 0)
+        waitpid(child, &status, 0);
+    remove(binary);
+    free(binary);
+
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("Unable to translate %s with %s, there are no AOT results for it\n", workload->name, tool);
+        free(library);
+        return NULL;
+    }
+    return library;
+}
+
+static RESULT measure(const WORKLOAD *workload, ARMPIT_ENGINE engine, const char *aotFile, double target) {
+    RESULT result = { 0, 0.0, 0, 0 };
+    ARMPIT *armpit = armpitCreate(MEMORY_SIZE);
+    if(armpit == NULL)
+        return result;
+
+    ARMPIT_SNAPSHOT *snapshot = prepare(armpit, workload);
+    if((engine == ARMPIT_ENGINE_AOT && (aotFile == NULL || !armpitLoadAot(armpit, aotFile)))
+            || !armpitSetEngine(armpit, engine)) {
+        // no JIT on this host or no translation, report nothing rather than the threaded interpreter again
+        armpitFreeSnapshot(snapshot);
+        armpitDestroy(armpit);
+        return result;
+    }
+    result.perRun = armpitRun(armpit, 0).executed; // warm up
+
+    while(result.seconds < target) {
+        armpitReset(armpit, snapshot);
+
+        double start = now();
+        uint64_t startCycles = cycles();
+        uint64_t executed = armpitRun(armpit, 0).executed;
+        result.cycles += cycles() - startCycles;
+        result.seconds += now() - start;
+
+        result.instructions += executed;
+        if(executed != result.perRun)
+            result.perRun = 0;
+    }
+
+    armpitFreeSnapshot(snapshot);
+    armpitDestroy(armpit);
+    return result;
+}
+
+// text as a JSON string, quoted and escaped
+static void writeJsonString(FILE *file, const char *text) {
+    fputc('"', file);
+    for(const unsigned char *c = (const unsigned char *)text; *c != '\0'; c++) {
+        if(*c == '"' || *c == '\\')
+            fprintf(file, "\\%c", *c);
+        else if(*c < 0x20)
+            fprintf(file, "\\u%04x", *c);
+        else
+            fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+static void writeJson(FILE *file, const char *label, double target, RESULT results[][ENGINE_COUNT], const char *only) {
+    fprintf(file, "{\n  \"benchmark\": \"armpit-bench\",\n");
+    if(label != NULL) {
+        fprintf(file, "  \"label\": ");
+        writeJsonString(file, label);
+        fprintf(file, ",\n");
+    }
+    fprintf(file, "  \"seconds_per_measurement\": %g,\n", target);
+    fprintf(file, "  \"cycle_counter\": %s,\n", cycles() ? "\"tsc\"" : "null");
+    fprintf(file, "  \"results\": [");
+
+    bool first = true;
+    for(size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        if(only != NULL && strcmp(only, workloads[w].name) != 0)
+            continue;
+        for(size_t e = 0; e < ENGINE_COUNT; e++) {
+            RESULT *result = &results[w][e];
+            double instructions = (double)result->instructions;
+            fprintf(file, "%s\n    { \"workload\": \"%s\", \"engine\": \"%s\", ", first? "" : ",", workloads[w].name,
+                    engines[e].name);
+            first = false;
+            if(result->instructions == 0) {
+                // the engine isn't available here, so it wasn't measured
+                fprintf(file, "\"instructions\": null, \"instructions_per_run\": null, \"seconds\": null, "
+                        "\"mips\": null, \"ns_per_instruction\": null, \"cycles_per_instruction\": null }");
+                continue;
+            }
+            fprintf(file, "\"instructions\": %llu, \"instructions_per_run\": %llu, \"seconds\": %.6f, \"mips\": %.3f, "
+                    "\"ns_per_instruction\": %.4f, ", (unsigned long long)result->instructions,
+                    (unsigned long long)result->perRun, result->seconds, instructions / result->seconds / 1e6,
+                    result->seconds * 1e9 / instructions);
+            if(result->cycles)
+                fprintf(file, "\"cycles_per_instruction\": %.3f }", (double)result->cycles / instructions);
+            else
+                fprintf(file, "\"cycles_per_instruction\": null }");
+        }
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
+
+int main(int argc, char *argv[]) {
+    double target = 0.5;
+    const char *only = NULL, *output = NULL, *label = NULL, *aotTool = NULL;
+    char *endPtr;
+
+    int opt = getopt_long(argc, argv, optString, longOptions, NULL);
+    while(opt != -1) {
+        switch(opt) {
+            case 't':
+                target = strtod(optarg, &endPtr);
+                if(*optarg == '\0' || *endPtr != '\0' || target <= 0) {
+                    printf("Invalid time: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                only = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'l':
+                label = optarg;
+                break;
+            case 'a':
+                aotTool = optarg;
+                break;
+            case 'h':
+                puts(USAGE);
+                exit(EXIT_SUCCESS);
+            default:
+                puts(USAGE);
+                exit(EXIT_FAILURE);
+        }
+        opt = getopt_long(argc, argv, optString, longOptions, NULL);
+    }
+
+    static RESULT results[sizeof(workloads) / sizeof(workloads[0])][ENGINE_COUNT];
+    bool found = false, broken = false;
+
+    // armpit-aot is built next to armpit-bench
+    char *defaultTool = NULL;
+    if(aotTool == NULL) {
+        const char *slash = strrchr(argv[0], '/');
+        int directoryLength = slash? (int)(slash - argv[0]) : 1;
+        size_t toolLength = (size_t)directoryLength + sizeof("/armpit-aot");
+        if((defaultTool = malloc(toolLength)) != NULL)
+            snprintf(defaultTool, toolLength, "%.*s/armpit-aot", directoryLength, slash? argv[0] : ".");
+        aotTool = defaultTool;
+    }
+    char directory[] = "/tmp/armpit-bench-XXXXXX"; // for the translations
+    bool haveDirectory = aotTool != NULL && mkdtemp(directory) != NULL;
+
+    printf("%-12s %-10s %12s %10s %10s %14s\n", "workload", "engine", "instructions", "MIPS", "ns/instr", "cycles/instr");
+    for(size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        if(only != NULL && strcmp(only, workloads[w].name) != 0)
+            continue;
+        found = true;
+        char *aotFile = haveDirectory? translate(&workloads[w], aotTool, directory) : NULL;
+
+        for(size_t e = 0; e < ENGINE_COUNT; e++) {
+            RESULT *result = &results[w][e];
+            *result = measure(&workloads[w], engines[e].engine, aotFile, target);
+
+            if(result->instructions == 0) {
+                printf("%-12s %-10s %12s\n", workloads[w].name, engines[e].name, "unavailable");
+                continue;
+            }
+            if(result->perRun == 0 || result->perRun != results[w][0].perRun) {
+                // every engine runs the same program from the same state, so a different count means a broken engine
+                printf("%-12s %-10s didn't execute the %llu instructions a run the reference engine did\n",
+                       workloads[w].name, engines[e].name, (unsigned long long)results[w][0].perRun);
+                broken = true;
+            }
+
+            double instructions = (double)result->instructions;
+            printf("%-12s %-10s %12llu %10.2f %10.3f ", workloads[w].name, engines[e].name,
+                   (unsigned long long)result->instructions, instructions / result->seconds / 1e6,
+                   result->seconds * 1e9 / instructions);
+            if(result->cycles)
+                printf("%14.2f\n", (double)result->cycles / instructions);
+            else
+                printf("%14s\n", "-");
+        }
+
+        if(aotFile != NULL)
+            remove(aotFile);
+        free(aotFile);
+    }
+    if(haveDirectory)
+        rmdir(directory);
+    free(defaultTool);
+
+    if(!found) {
+        printf("Unknown workload: %s\n", only);
+        exit(EXIT_FAILURE);
+    }
+
+    if(output != NULL) {
+        FILE *file = fopen(output, "w");
+        if(file == NULL) {
+            printf("Error creating %s\n", output);
+            exit(EXIT_FAILURE);
+        }
+        writeJson(file, label, target, results, only);
+        fclose(file);
+    }
+    exit(broken? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,107 @@
+/*
+ * Device bus
+ *
+ * Devices attach a read and a write function to a range of whole pages. Attaching marks the pages PAGE_MMIO, which is
+ * the only thing a load or store looks at to decide between RAM and the bus (see memory.h), so the list of devices is
+ * only searched for accesses that are known to be for one of them. The RAM under a device's pages is hidden from the
+ * guest's loads and stores but is still where instructions are fetched from.
+ *
+ * A device is given the offset of the access from its start and the size, 1 for LDRB/STRB and 4 for words (always word
+ * aligned). Devices are not part of snapshots or checkpoints: resetting or restoring a machine leaves them as they are,
+ * and a restored machine has none until they are attached again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "memory.h"
+
+
+#define MAX_DEVICES 16
+
+typedef struct DEVICE {
+    REGISTER start;
+    REGISTER end;
+    ARMPIT_DEVICE_READ read;
+    ARMPIT_DEVICE_WRITE write;
+    void *context;
+    bool owned;             // the context is freed with the machine
+} DEVICE;
+
+struct BUS {
+    DEVICE devices[MAX_DEVICES];
+    int count;
+};
+
+
+static DEVICE *findDevice(CPU *cpu, REGISTER address) {
+    BUS *bus = cpu->bus;
+
+    address &= cpu->memoryMask;
+    for(int i = 0; i < bus->count; i++) {
+        if(address >= bus->devices[i].start && address < bus->devices[i].end)
+            return &bus->devices[i];
+    }
+    return NULL; // can't happen, only device pages are marked
+}
+
+uint32_t busRead(CPU *cpu, REGISTER address, int size) {
+    DEVICE *device = findDevice(cpu, address);
+    if(device == NULL || device->read == NULL)
+        return 0;
+    return device->read(device->context, (address & cpu->memoryMask) - device->start, size);
+}
+
+void busWrite(CPU *cpu, REGISTER address, uint32_t value, int size) {
+    DEVICE *device = findDevice(cpu, address);
+    if(device != NULL && device->write != NULL)
+        device->write(device->context, (address & cpu->memoryMask) - device->start, value, size);
+}
+
+/*
+ * Adds a device covering size bytes from address, both multiples of the page size. Returns false if the range isn't
+ * whole pages inside memory, overlaps another device, or the bus is full.
+ */
+bool attachDevice(CPU *cpu, REGISTER address, uint32_t size, ARMPIT_DEVICE_READ read, ARMPIT_DEVICE_WRITE write,
+                  void *context, bool owned) {
+    if(size == 0 || ((address | size) & (GUEST_PAGE_SIZE - 1)) != 0 || address >= cpu->memorySize
+            || size > cpu->memorySize - address) {
+        printf("A device must cover whole pages inside memory, %08X + %X doesn't\n", address, size);
+        return false;
+    }
+    for(REGISTER page = address; page < address + size; page += GUEST_PAGE_SIZE) {
+        if(pageOf(cpu, page)->flags & PAGE_MMIO) {
+            printf("The device at %08X overlaps another one\n", address);
+            return false;
+        }
+    }
+
+    if(cpu->bus == NULL)
+        cpu->bus = calloc(1, sizeof(BUS));
+    if(cpu->bus == NULL || cpu->bus->count == MAX_DEVICES) {
+        printf("No room for another device, there can be %d\n", MAX_DEVICES);
+        return false;
+    }
+
+    cpu->bus->devices[cpu->bus->count++] = (DEVICE){ address, address + size, read, write, context, owned };
+    startScheduler(cpu);
+    for(REGISTER page = address; page < address + size; page += GUEST_PAGE_SIZE)
+        pageOf(cpu, page)->flags |= PAGE_MMIO;
+
+    if(VERBOSE)
+        printf("\tDevice attached at %08X to %08X\n", address, address + size);
+    return true;
+}
+
+void freeBus(CPU *cpu) {
+    BUS *bus = cpu->bus;
+    if(bus == NULL)
+        return;
+
+    for(int i = 0; i < bus->count; i++) {
+        if(bus->devices[i].owned)
+            free(bus->devices[i].context);
+    }
+    free(bus);
+    cpu->bus = NULL;
+}
@@ -0,0 +1,219 @@
+/*
+ * Checkpoint files for --save-checkpoint and --restore-checkpoint.
+ *
+ * A checkpoint is a whole machine: registers (every mode's), status register, the halt address and what was loaded, and every page
+ * of memory that isn't zero. It is laid out so that restoring one costs next to nothing however big the program is:
+ *
+ *      CHECKPOINT_HEADER
+ *      page table          the page number of each saved page, in ascending order
+ *      padding             up to a multiple of GUEST_PAGE_SIZE
+ *      pages               GUEST_PAGE_SIZE bytes each, in the same order as the page table
+ *
+ * Because every page starts at a page aligned offset in the file, a restore maps each run of consecutive pages
+ * privately straight over guest memory (copy on write, the same as the loader does for images) instead of reading it.
+ * Nothing is read from disk until the guest touches it. Hosts whose pages are bigger than a guest page read the pages
+ * in instead.
+ *
+ * The header starts with a magic number and a version, and a checkpoint with any other version is refused. Numbers
+ * are stored in host byte order, the magic number catches a checkpoint taken on a host of the other byte order.
+ */
+
+#define _DEFAULT_SOURCE // for MAP_FIXED, pread and sysconf when compiling with -std=c11
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "flags.h"
+#include "memory.h"
+
+
+#define CHECKPOINT_MAGIC   0x43504d41u // "AMPC" when read in little endian byte order
+#define CHECKPOINT_VERSION 3 // 2 added the banked registers, 3 the exit code
+
+typedef struct CHECKPOINT_HEADER {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t pageSize;          // GUEST_PAGE_SIZE
+    uint32_t memorySize;
+    uint32_t pageCount;         // pages saved
+    uint64_t pageTableOffset;
+    uint64_t pageDataOffset;
+
+    REGISTER registers[16];
+    uint32_t statusRegister;
+    REGISTER programEnd;
+    REGISTER bankedRegisters[4][7];
+    uint32_t exitCode;          // from OS_Exit
+
+    // what the loader loaded
+    REGISTER loadAddress;
+    REGISTER entryPoint;
+    char imageName[256];
+} CHECKPOINT_HEADER;
+
+static const BYTE zeroPage[GUEST_PAGE_SIZE];
+
+
+static bool writeAll(FILE *file, const void *data, size_t size) {
+    return fwrite(data, 1, size, file) == size;
+}
+
+/*
+ * Writes the CPU to fileName. Returns false if the file can't be written.
+ */
+bool saveCheckpoint(CPU *cpu, const char *fileName) {
+    uint32_t pageCount = cpu->memorySize >> GUEST_PAGE_SHIFT;
+    uint32_t *pageTable = malloc(pageCount * sizeof(uint32_t));
+    CHECKPOINT_HEADER header;
+
+    if(pageTable == NULL)
+        return false;
+
+    // pages that were never written, or have gone back to zero, don't need saving
+    memset(&header, 0, sizeof(header));
+    for(uint32_t i = 0; i < pageCount; i++) {
+        if((cpu->pages[i].flags & PAGE_WRITTEN)
+                && memcmp(cpu->memoryBase + ((size_t)i << GUEST_PAGE_SHIFT), zeroPage, GUEST_PAGE_SIZE) != 0)
+            pageTable[header.pageCount++] = i;
+    }
+
+    header.magic = CHECKPOINT_MAGIC;
+    header.version = CHECKPOINT_VERSION;
+    header.headerSize = sizeof(header);
+    header.pageSize = GUEST_PAGE_SIZE;
+    header.memorySize = cpu->memorySize;
+    header.pageTableOffset = sizeof(header);
+    header.pageDataOffset = (sizeof(header) + (uint64_t)header.pageCount * sizeof(uint32_t) + GUEST_PAGE_SIZE - 1)
+                            & ~(uint64_t)(GUEST_PAGE_SIZE - 1);
+    memcpy(header.registers, cpu->registers, sizeof(header.registers));
+    header.statusRegister = getStatusRegister(cpu);
+    memcpy(header.bankedRegisters, cpu->bankedRegisters, sizeof(header.bankedRegisters));
+    header.programEnd = cpu->programEnd;
+    header.exitCode = cpu->exitCode;
+    header.loadAddress = cpu->loadAddress;
+    header.entryPoint = cpu->entryPoint;
+    memcpy(header.imageName, cpu->imageName, sizeof(header.imageName));
+
+    FILE *file = fopen(fileName, "wb");
+    if(file == NULL) {
+        printf("Error creating %s\n", fileName);
+        free(pageTable);
+        return false;
+    }
+
+    size_t padding = header.pageDataOffset - sizeof(header) - (size_t)header.pageCount * sizeof(uint32_t);
+    bool written = writeAll(file, &header, sizeof(header))
+                   && writeAll(file, pageTable, (size_t)header.pageCount * sizeof(uint32_t))
+                   && writeAll(file, zeroPage, padding);
+    for(uint32_t i = 0; written && i < header.pageCount; i++)
+        written = writeAll(file, cpu->memoryBase + ((size_t)pageTable[i] << GUEST_PAGE_SHIFT), GUEST_PAGE_SIZE);
+
+    if(fclose(file) != 0)
+        written = false;
+    if(!written)
+        printf("Error writing %s\n", fileName);
+    else if(VERBOSE)
+        printf("\tSaved %u pages to %s\n", header.pageCount, fileName);
+
+    free(pageTable);
+    return written;
+}
+
+/*
+ * Puts count pages, starting with page number first, in place from the file
+ */
+static bool placePages(CPU *cpu, int fd, uint32_t first, uint32_t count, uint64_t offset, bool canMap) {
+    BYTE *memory = cpu->memoryBase + ((size_t)first << GUEST_PAGE_SHIFT);
+    size_t size = (size_t)count << GUEST_PAGE_SHIFT;
+
+    if(!canMap || mmap(memory, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, (off_t)offset) == MAP_FAILED) {
+        if(pread(fd, memory, size, (off_t)offset) != (ssize_t)size)
+            return false;
+    }
+
+    for(uint32_t i = first; i < first + count; i++)
+        markWritten(cpu, &cpu->pages[i]);
+    return true;
+}
+
+/*
+ * Returns a new CPU in the state saved in fileName, or NULL if the file can't be read or isn't a checkpoint
+ */
+CPU *restoreCheckpoint(const char *fileName) {
+    CHECKPOINT_HEADER header;
+    int fd = open(fileName, O_RDONLY);
+
+    if(fd < 0) {
+        printf("Error opening %s\n", fileName);
+        return NULL;
+    }
+
+    if(pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || header.magic != CHECKPOINT_MAGIC) {
+        printf("%s is not an ARMpit checkpoint\n", fileName);
+        close(fd);
+        return NULL;
+    }
+    if(header.version != CHECKPOINT_VERSION || header.headerSize != sizeof(header) || header.pageSize != GUEST_PAGE_SIZE) {
+        printf("%s is a version %u checkpoint, only version %u is supported\n", fileName, header.version,
+               CHECKPOINT_VERSION);
+        close(fd);
+        return NULL;
+    }
+
+    CPU *cpu = createCpu(header.memorySize);
+    uint32_t *pageTable = malloc((size_t)header.pageCount * sizeof(uint32_t) + 1);
+    if(cpu == NULL || pageTable == NULL || header.pageCount > (header.memorySize >> GUEST_PAGE_SHIFT)) {
+        printf("Unable to restore %s\n", fileName);
+        destroyCpu(cpu);
+        free(pageTable);
+        close(fd);
+        return NULL;
+    }
+
+    // mapping pages beyond the end of the file would fault when the guest touched them, so check the size first
+    struct stat status;
+    bool restored = fstat(fd, &status) == 0
+                    && (uint64_t)status.st_size >= header.pageDataOffset + ((uint64_t)header.pageCount << GUEST_PAGE_SHIFT)
+                    && pread(fd, pageTable, (size_t)header.pageCount * sizeof(uint32_t), (off_t)header.pageTableOffset)
+                       == (ssize_t)(header.pageCount * sizeof(uint32_t));
+
+    // pages are mapped in runs of consecutive page numbers, which are also consecutive in the file
+    long hostPageSize = sysconf(_SC_PAGESIZE);
+    bool canMap = hostPageSize > 0 && GUEST_PAGE_SIZE % hostPageSize == 0;
+    for(uint32_t i = 0, run; restored && i < header.pageCount; i += run) {
+        for(run = 1; i + run < header.pageCount && pageTable[i + run] == pageTable[i] + run; run++)
+            ;
+        restored = pageTable[i] + run <= (header.memorySize >> GUEST_PAGE_SHIFT)
+                   && placePages(cpu, fd, pageTable[i], run, header.pageDataOffset + ((uint64_t)i << GUEST_PAGE_SHIFT),
+                                 canMap);
+    }
+
+    free(pageTable);
+    close(fd); // the mappings stay valid once the file is closed
+
+    if(!restored) {
+        printf("%s is truncated or corrupt\n", fileName);
+        destroyCpu(cpu);
+        return NULL;
+    }
+
+    memcpy(cpu->registers, header.registers, sizeof(cpu->registers));
+    setStatusRegister(cpu, (BYTE)header.statusRegister);
+    memcpy(cpu->bankedRegisters, header.bankedRegisters, sizeof(cpu->bankedRegisters));
+    cpu->programEnd = header.programEnd;
+    cpu->exitCode = header.exitCode;
+    cpu->loadAddress = header.loadAddress;
+    cpu->entryPoint = header.entryPoint;
+    memcpy(cpu->imageName, header.imageName, sizeof(cpu->imageName));
+    cpu->imageName[sizeof(cpu->imageName) - 1] = '\0';
+
+    if(VERBOSE)
+        printf("\tRestored %u pages from %s (image %s loaded at %08X, entry %08X)\n", header.pageCount, fileName,
+               cpu->imageName[0]? cpu->imageName : "none", cpu->loadAddress, cpu->entryPoint);
+    return cpu;
+}
@@ -0,0 +1,322 @@
+/*
+ * The core of the emulator: creating and destroying CPU contexts (see armpit.h), fetching and executing instructions
+ * and the reference loop.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "flags.h"
+#include "memory.h"
+#include "profile.h"
+#include "trace.h"
+
+
+#define UNDEFINED_VECTOR 0x04
+
+bool VERBOSE = false;   // set by -v or armpitSetLogging()
+bool TRACE = false;     // per-instruction output, the command line turns it on when not in batch mode
+
+/*
+ * Returns a CPU with its registers zeroed and size bytes of empty memory, or NULL if the memory can't be reserved
+ */
+CPU *createCpu(uint32_t size) {
+    CPU *cpu = calloc(1, sizeof(CPU));
+    if(cpu == NULL)
+        return NULL;
+
+    if(!initMemory(cpu, size)) {
+        free(cpu);
+        return NULL;
+    }
+    cpu->clockStart = hostCentiseconds();
+    return cpu;
+}
+
+void destroyCpu(CPU *cpu) {
+    if(cpu == NULL)
+        return;
+    freeJit(cpu);
+    freeAot(cpu);
+    freeProfile(cpu);
+    stopTrace(cpu);
+    freeBus(cpu);
+    freeScheduler(cpu);
+    freeOutput(cpu);
+    freeMemory(cpu);
+    free(cpu);
+}
+
+/*
+ * Fetches the instruction at the PC and executes it if its condition code is met.
+ * Returns false once the PC has reached the end of the program (halt).
+ */
+bool step(CPU *cpu) {
+    if(cpu->registers[PROGRAM_COUNTER] == cpu->programEnd) {
+        return false;
+    }
+
+    REGISTER address = cpu->registers[PROGRAM_COUNTER];
+    const DECODED *decoded = fetchInstruction(cpu);
+
+    // check 1st 4 bits (if 1110 execute)
+    bool passed = shouldExecute(cpu, decoded->condition);
+    if(passed) {
+        PROFILE(cpu, decoded, true);
+        decoded->handler(cpu, decoded);
+    } else {
+        PROFILE(cpu, decoded, false);
+        if(VERBOSE) {
+            printf("\tInstruction at %08X skipped!\n", cpu->registers[PROGRAM_COUNTER] - 4);
+        }
+    }
+
+    if(cpu->traceLog != NULL)
+        traceInstruction(cpu, address, decoded, passed);
+    return true;
+}
+
+/*
+ * The reference loop. Runs until halt or until maxSteps instructions have been executed (0 means no limit).
+ */
+uint64_t run(CPU *cpu, uint64_t maxSteps) {
+    uint64_t executed = 0;
+    while((maxSteps == 0 || executed < maxSteps) && step(cpu)) {
+        executed++;
+    }
+    return executed;
+}
+
+/*
+ * Runs the program with the chosen engine, returns the number of instructions executed. A machine with devices runs
+ * in slices between events (scheduler.c).
+ */
+uint64_t runEngine(CPU *cpu, ARMPIT_ENGINE engine, uint64_t maxSteps) {
+    if(cpu->scheduler != NULL)
+        return runScheduled(cpu, engine, maxSteps);
+    return runSlice(cpu, engine, maxSteps);
+}
+
+uint64_t runSlice(CPU *cpu, ARMPIT_ENGINE engine, uint64_t maxSteps) {
+    uint64_t executed;
+
+    if(cpu->traceLog != NULL)
+        executed = run(cpu, maxSteps); // only step() records a trace
+    else if(engine == ARMPIT_ENGINE_THREADED || (engine != ARMPIT_ENGINE_REFERENCE && cpu->profile != NULL))
+        executed = runThreaded(cpu, maxSteps); // translated blocks can't be profiled
+    else if(engine == ARMPIT_ENGINE_JIT)
+        executed = runJit(cpu, maxSteps);
+    else if(engine == ARMPIT_ENGINE_AOT)
+        executed = runAot(cpu, maxSteps);
+    else
+        executed = run(cpu, maxSteps);
+
+    cpu->cycles += executed;
+    return executed;
+}
+
+/*
+ * Runs the loaded program with the reference loop, then again from the same starting state with the JIT, and reports
+ * any difference in the registers, status register or number of instructions executed.
+ */
+bool checkJit(CPU *cpu, uint64_t maxSteps) {
+    REGISTER *registers = cpu->registers;
+    REGISTER referenceRegisters[16];
+    SNAPSHOT *start = takeSnapshot(cpu);
+
+    if(start == NULL) {
+        printf("JIT check: not enough memory to save the starting state\n");
+        return false;
+    }
+
+    uint64_t referenceExecuted = run(cpu, maxSteps);
+    BYTE referenceStatus = getStatusRegister(cpu);
+    memcpy(referenceRegisters, registers, sizeof(referenceRegisters));
+
+    restoreSnapshot(cpu, start);
+    freeSnapshot(start);
+
+    uint64_t jitExecuted = runJit(cpu, maxSteps);
+    BYTE jitStatus = getStatusRegister(cpu);
+    bool passed = true;
+
+    for(int i = 0; i < 16; i++) {
+        if(registers[i] != referenceRegisters[i]) {
+            printf("JIT check: R%i is %08X, reference is %08X\n", i, registers[i], referenceRegisters[i]);
+            passed = false;
+        }
+    }
+    if(jitStatus != referenceStatus) {
+        printf("JIT check: Status Register is %02X, reference is %02X\n", jitStatus, referenceStatus);
+        passed = false;
+    }
+    if(jitExecuted != referenceExecuted) {
+        printf("JIT check: executed %llu instructions, reference executed %llu\n",
+               (unsigned long long)jitExecuted, (unsigned long long)referenceExecuted);
+        passed = false;
+    }
+
+    printf("JIT check: %s (%llu instructions)\n", passed? "passed" : "FAILED", (unsigned long long)referenceExecuted);
+    return passed;
+}
+
+/*
+ * Returns the predecoded instruction at the PC (decoding it first if this is the first time it has been seen)
+ */
+const DECODED *fetchInstruction(CPU *cpu) {
+    const DECODED *decoded = lookupDecoded(cpu, cpu->registers[PROGRAM_COUNTER]);
+    if(TRACE)
+        printf("\n\tFetching instruction: %04X from address %08X\n", decoded->instruction.data32, cpu->registers[PROGRAM_COUNTER]);
+    cpu->registers[PROGRAM_COUNTER] += 4; // the PC always points at the next instruction to be fetched
+    return decoded;
+}
+
+InstructionType getInstructionType(INSTRUCTION instruction) {
+    InstructionType type;
+
+    /*
+     * bits 27..25  000, 001   data processing (a multiply has bits 7..4 set to 1001)
+     *              010, 011   single data transfer (011 with bit 4 set is undefined)
+     *              100        block data transfer
+     *              101        branch
+     *              110, 1110  coprocessor (unsupported)
+     *              1111       software interupt
+     */
+    switch((instruction.data32 >> 25) & BITMASK_3_BIT) {
+        case 0x0:
+            type = ((instruction.data32 & 0x0fc000f0) == 0x00000090)? UNDEFINED : ALU;
+            break;
+        case 0x1:
+            type = ALU;
+            break;
+        case 0x2:
+            type = DATA_TRANSFER;
+            break;
+        case 0x3:
+            type = ((instruction.data32 >> 4) & BITMASK_1_BIT)? UNDEFINED : DATA_TRANSFER;
+            break;
+        case 0x4:
+            type = DATA_TRANSFER;
+            break;
+        case 0x5:
+            type = BRANCH;
+            break;
+        case 0x7:
+            type = ((instruction.data32 >> 24) & BITMASK_1_BIT)? INTERUPT : UNDEFINED;
+            break;
+        default:
+            type = UNDEFINED;
+            break;
+    }
+
+    if(VERBOSE) {
+        char *typeName;
+
+        switch(type) {
+            case ALU: typeName = "ALU"; break;
+            case BRANCH: typeName = "Branch"; break;
+            case DATA_TRANSFER: typeName = "Data Transfer"; break;
+            case INTERUPT: typeName = "Interupt"; break;
+            default: typeName = "Undefined"; break;
+        }
+    
+        printf("\tInstruction is type %d:\t%s\n", type, typeName);
+    }
+    return type; // returns 0, 1, 2, 3 or 4 for ALU, BRANCH, DATA_TRANSFER, INTERUPT or UNDEFINED
+}
+
+
+/*
+ * All instructions are 32 bits in length.  Bit 31-28 of all instructions contain a condition code which is used to decide 
+ * whether the instruction will execute.
+ * This condition code identifies the required state of the status register (SR) in order for execution to take place.
+ *
+ * The table below shows each condition code value (stored in top 4 bits of the instruction) and the status flags which are
+ * tested to see whether the condition is true.  If a status flag is blank then that means its value doesn't matter for that
+ * condition to be true.
+ *
+ * -------------------------------------------------------------------------------
+ *               Condition   Status Reg Flags
+ *                  Code    | N | Z | C | V |
+ * -------------------------------------------------------------------------------
+ * Equal            0000    |   | 1 |   |   | Execute the instruction if the Z flag is set.
+ * Not Equal        0001    |   | 0 |   |   | Execute the instruction is the Z flag is clear.
+ * Carry Set        0010    |   |   | 1 |   | Execute the instruction if the C flag is set. Provides >= test (unsigned).
+ * Carry Clear      0011    |   |   | 0 |   | Execute if the C flag is clear. Provides < test for unsigned comparison.
+ * Minus            0100    | 1 |   |   |   | Execute if the N flag is set.
+ * Plus             0101    | 0 |   |   |   | Execute if the N flag is clear.
+ * Overflow Set     0110    |   |   |   | 1 | Execute if the V flag is set.
+ * Overflow Clear   0111    |   |   |   | 0 | Execute if the V flag is clear.
+ * Higher           1000    |   | 0 | 1 |   | Execute if the C flag is set and Z flag is clear. Provides > test (unsigned).
+ * Lower or Same    1001    |   |   | 0 |   | Execute if the C flag is clear or Z flag is set. Provides <= test (unsigned).
+ *                          |   | 1 |   |   |
+ * Greater or Equal 1010    | 0 |   |   | 0 | Execute if the N flag is clear and V flag is clear, 
+ *                          | 1 |   |   | 1 |  or N flag is set and V flag is set. Provides >= test for signed comparison.
+ *              
+ * Less Than        1011    | 0 |   |   | 1 | Execute if the N flag is clear and V flag is set, 
+ *                          | 1 |   |   | 0 |  or N flag is set and V flag is clear. Provides a < test for signed comparison.
+ *                          
+ * Greater Than     1100    | 0 | 0 |   | 0 | Same as GE but Z flag must be clear. Provides > test for signed comparison.
+ *                          | 1 | 0 |   | 1 |
+ * Less or Equal    1101    | 0 |   |   | 1 | Same as LT but also true if Z flag is set.
+ *                          | 1 |   |   | 0 |
+ *                          |   | 1 |   |   |
+ * Always           1110    |   |   |   |   | Instruction always executes. Flags irrelevant.
+ * Never            1111    |   |   |   |   | Instruction never executes. Flags irrelevant.
+ *
+ * Rather than testing the flags one at a time, each row of this table is precomputed for all 16 values of NZCV
+ * (conditionTable in flags.c) so a condition check is a single lookup.
+ */
+bool shouldExecute(CPU *cpu, int conditionCode) {
+    bool execute = conditionPassed(cpu, conditionCode); // looks up the table in flags.c
+
+    if(VERBOSE) {
+        printf("\tshould execute?: %s - condition %X\n", execute? "true" : "false", conditionCode);
+    }
+    return execute; 
+}
+
+bool isImmediateValue(INSTRUCTION instruction) {
+    bool immediate = (instruction.data32 >> 25) & BITMASK_1_BIT;
+    if(TRACE)
+        printf("\tImmediate Bit:\t%s \n", immediate? "set" : "not set");
+    return immediate;
+}
+
+bool statusBitSet(INSTRUCTION instruction) {
+    bool updateStatus = (instruction.data32 >> 20) & BITMASK_1_BIT;
+    if(TRACE)
+        printf("\tStatus Bit:\t%s \n", updateStatus? "set" : "not set");
+    return updateStatus;
+}
+
+BYTE getRegisterNumber(INSTRUCTION instruction, int shiftAmount) {
+    BYTE regNo = (instruction.data32 >> shiftAmount) & BITMASK_4_BIT;
+    if(TRACE)
+        printf("\tRegister:\t%i \n", regNo);
+
+    return regNo;
+}
+
+/*
+ * B and BL. BL puts the address of the instruction after it in the link register, with the PSR (modes.c).
+ */
+void doBranch(CPU *cpu, const DECODED *decoded) {
+    REGISTER target = (cpu->registers[PROGRAM_COUNTER] + decoded->operand2) & PC_MASK;
+
+    if(TRACE)
+        printf("\t%s to %08X\n", decoded->link? "BL" : "B", target);
+    if(decoded->link)
+        cpu->registers[LINK_REGISTER] = pcWithPsr(cpu, cpu->registers[PROGRAM_COUNTER]);
+    cpu->registers[PROGRAM_COUNTER] = target;
+}
+
+/*
+ * Coprocessor instructions and the rest of the undefined instruction space take the undefined instruction trap, into
+ * supervisor mode with IRQs disabled. R14 is the address of the instruction after it, with the PSR, as for a SWI.
+ */
+void doUndefined(CPU *cpu, const DECODED *decoded) {
+    if(TRACE)
+        printf("\tUndefined instruction: %08X\n", decoded->instruction.data32);
+    enterException(cpu, MODE_SVC, UNDEFINED_VECTOR, cpu->registers[PROGRAM_COUNTER], STATUS_I);
+}
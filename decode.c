@@ -0,0 +1,263 @@
+/*
+ * Predecoded instruction cache.
+ *
+ * Each word of memory has a DECODED record alongside it. Decoding happens the first time the word is fetched, after that
+ * the condition, register numbers, opcode, operand 2 and handler are read straight from the record instead of being
+ * extracted from the instruction again. writeMemory() invalidates the record for the word it changes.
+ *
+ * The records are held per page of memory (see memory.h) and a page's records are only allocated once something in
+ * that page is executed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "shifter.h"
+
+
+/*
+ * A register operand 2 (or register offset): Rm, and the shift applied to it and which shifter kernel does that
+ */
+static void decodeShift(uint32_t data, DECODED *decoded) {
+    decoded->regM = data & BITMASK_4_BIT;
+    decoded->shiftType = (data >> 5) & BITMASK_2_BIT;
+    decoded->shiftByRegister = (data >> 4) & BITMASK_1_BIT;
+    decoded->shifter = SHIFTER_LSL + decoded->shiftType;
+    if(decoded->shiftByRegister) {
+        decoded->regS = (data >> 8) & BITMASK_4_BIT;
+    } else {
+        decoded->shiftAmount = (data >> 7) & BITMASK_5_BIT;
+        if(decoded->shiftAmount == 0 && decoded->shiftType == SHIFT_LSL)
+            decoded->shifter = SHIFTER_NONE;
+        else if(decoded->shiftAmount == 0 && decoded->shiftType == SHIFT_ROR)
+            decoded->shifter = SHIFTER_RRX;
+    }
+}
+
+/*
+ * Extracts the fields of an instruction into a DECODED record and picks the handler used to execute it.
+ */
+void decodeInstruction(INSTRUCTION instruction, DECODED *decoded) {
+    uint32_t data = instruction.data32;
+
+    memset(decoded, 0, sizeof(DECODED));
+    decoded->instruction = instruction;
+    decoded->condition = data >> COND_CODE_POS;
+    decoded->type = getInstructionType(instruction);
+
+    switch(decoded->type) {
+        case ALU:
+            decoded->opCode = (data >> OP_CODE_POS) & BITMASK_4_BIT;
+            decoded->immediate = isImmediateValue(instruction);
+            decoded->updateStatus = statusBitSet(instruction);
+            decoded->regN = getRegisterNumber(instruction, 16); // bits 16 to 19
+            decoded->regDest = getRegisterNumber(instruction, 12); // bits 12 to 15
+
+            if(decoded->immediate) {
+                // 8 bit value rotated right by twice the 4 bit rotate field
+                const IMMEDIATE *immediate = &immediateTable[data & 0xfff];
+                decoded->operand2 = immediate->value;
+                decoded->immediateCarry = immediate->carry;
+            } else {
+                decodeShift(data, decoded);
+            }
+            decoded->handler = aluHandlers[decoded->opCode];
+            decoded->variant = (decoded->opCode << 2) | (decoded->immediate << 1) | decoded->updateStatus;
+
+            if(decoded->regDest == PROGRAM_COUNTER) {
+                // MOV PC, LR and anything else that jumps, or TEQP and the other tests which write the PSR
+                decoded->handler = doWritingPc;
+                decoded->variant = (decoded->opCode >= OP_TST && decoded->opCode <= OP_CMN)? VARIANT_HANDLER
+                                                                                            : VARIANT_RETURN;
+            } else if((decoded->regN == PROGRAM_COUNTER && decoded->opCode != OP_MOV && decoded->opCode != OP_MVN)
+                    || (!decoded->immediate && (decoded->regM == PROGRAM_COUNTER
+                                                || (decoded->shiftByRegister && decoded->regS == PROGRAM_COUNTER)))) {
+                decoded->handler = doReadingPc;
+                decoded->variant = VARIANT_HANDLER;
+            }
+            break;
+        case BRANCH:
+            // the offset is in words from the instruction + 8, and the PC is already 4 on when it executes
+            decoded->operand2 = ((REGISTER)((int32_t)(data << 8) >> 6)) + 4;
+            decoded->link = (data >> 24) & BITMASK_1_BIT;
+            decoded->handler = doBranch;
+            decoded->variant = VARIANT_BRANCH;
+            break;
+        case DATA_TRANSFER:
+            decoded->regN = getRegisterNumber(instruction, 16);
+            decoded->variant = VARIANT_DATA_TRANSFER;
+            if(((data >> 25) & BITMASK_3_BIT) == 0x4) {
+                decoded->handler = doBlockTransfer;
+                if(((data >> 20) & BITMASK_1_BIT) && ((data >> PROGRAM_COUNTER) & BITMASK_1_BIT))
+                    decoded->variant = VARIANT_RETURN; // LDM {.., PC}
+            } else {
+                // the I bit is the other way round from data processing: 0 is a 12 bit immediate offset
+                decoded->regDest = getRegisterNumber(instruction, 12);
+                decoded->immediate = !isImmediateValue(instruction);
+                if(decoded->immediate)
+                    decoded->operand2 = data & 0xfff;
+                else
+                    decodeShift(data, decoded);
+                decoded->immediateCarry = SHIFTER_CARRY_UNCHANGED;
+                decoded->handler = doDataTransfer;
+                if(((data >> 20) & BITMASK_1_BIT) && decoded->regDest == PROGRAM_COUNTER)
+                    decoded->variant = VARIANT_RETURN; // LDR PC, ..
+
+            }
+            break;
+        case INTERUPT:
+            decoded->operand2 = data & 0xffffff; // the SWI number
+            decoded->handler = doInterupt;
+            decoded->variant = VARIANT_INTERUPT;
+            break;
+        default:
+            if((data & 0x0fc000f0) == 0x00000090) {
+                // MUL and MLA: Rd is in bits 16 to 19 and Rn in 12 to 15, the other way round from data processing
+                decoded->updateStatus = statusBitSet(instruction);
+                decoded->regDest = getRegisterNumber(instruction, 16);
+                decoded->regN = getRegisterNumber(instruction, 12);
+                decoded->regS = getRegisterNumber(instruction, 8);
+                decoded->regM = getRegisterNumber(instruction, 0);
+                decoded->handler = doMultiply;
+                decoded->variant = VARIANT_HANDLER;
+            } else {
+                decoded->handler = doUndefined;
+                decoded->variant = VARIANT_UNDEFINED;
+            }
+            break;
+    }
+}
+
+/*
+ * Superinstructions
+ *
+ * When an instruction is decoded, the ones after it in the same page are checked for a pattern the threaded
+ * interpreter can run as a single piece of code (ARMPIT_FUSION in libarmpit.h):
+ *
+ *      CMP/CMN/TST/TEQ then Bcc    the branch condition comes straight from the operands, not the flags
+ *      SUBS Rn, Rn, #n then BNE    a counted loop
+ *      MOV then ADD                both done in one go
+ *      a run with one condition    the condition is tested once for up to MAX_FUSED instructions
+ *
+ * The pattern is marked on the first record only, every instruction keeps its own record too, so the reference loop,
+ * single stepping and the JIT see the instructions one at a time, and so does the threaded interpreter whenever a
+ * fused group would hide a boundary it has to stop at. Only data processing which neither reads nor writes R15 and
+ * has a plain operand 2 (an immediate or a register with no shift) is fused, so no fused group can fault, store to
+ * memory or change mode part way through.
+ */
+static inline bool plainOperand(const DECODED *decoded) {
+    return decoded->immediate || decoded->shifter == SHIFTER_NONE;
+}
+
+// data processing with an ALU variant (so not reading R15) that doesn't write R15 either
+static inline bool simpleAlu(const DECODED *decoded) {
+    return decoded->type == ALU && decoded->variant < VARIANT_BRANCH && decoded->regDest != PROGRAM_COUNTER;
+}
+
+// nothing in a run may change the flags, and the tests and comparisons set them with or without the S bit
+static inline bool runMember(const DECODED *decoded, BYTE condition) {
+    return decoded->condition == condition && simpleAlu(decoded) && !decoded->updateStatus
+        && (decoded->opCode < OP_TST || decoded->opCode > OP_CMN);
+}
+
+static void fuseInstructions(CPU *cpu, REGISTER address, DECODED *decoded) {
+    uint32_t index = (address >> 2) & (WORDS_PER_PAGE - 1);
+    DECODED next;
+
+    if(cpu->noFusion || index == WORDS_PER_PAGE - 1)
+        return;
+    decodeInstruction((INSTRUCTION){ .data32 = memoryWord(cpu, address + 4) }, &next);
+
+    if(decoded->condition == CONDITION_ALWAYS) {
+        if(!simpleAlu(decoded) || !plainOperand(decoded))
+            return;
+        bool conditionalBranch = next.type == BRANCH && !next.link && next.condition < CONDITION_ALWAYS;
+
+        if(decoded->opCode >= OP_TST && decoded->opCode <= OP_CMN && conditionalBranch)
+            decoded->fusion = ARMPIT_FUSION_COMPARE_BRANCH;
+        else if(decoded->opCode == OP_SUB && decoded->updateStatus && decoded->immediate
+                && decoded->regN == decoded->regDest && conditionalBranch && next.condition == CONDITION_NOT_EQUAL)
+            decoded->fusion = ARMPIT_FUSION_COUNT_LOOP;
+        else if(decoded->opCode == OP_MOV && !decoded->updateStatus && simpleAlu(&next) && next.opCode == OP_ADD
+                && next.condition == CONDITION_ALWAYS && !next.updateStatus && plainOperand(&next))
+            decoded->fusion = ARMPIT_FUSION_MOVE_ADD;
+        else
+            return;
+        decoded->fusedLength = 2;
+    } else if(decoded->condition != CONDITION_NEVER && runMember(decoded, decoded->condition)
+              && runMember(&next, decoded->condition)) {
+        BYTE length = 2;
+        while(length < MAX_FUSED && index + length < WORDS_PER_PAGE) {
+            decodeInstruction((INSTRUCTION){ .data32 = memoryWord(cpu, address + 4 * length) }, &next);
+            if(!runMember(&next, decoded->condition))
+                break;
+            length++;
+        }
+        decoded->fusion = ARMPIT_FUSION_CONDITION_RUN;
+        decoded->fusedLength = length;
+    }
+}
+
+/*
+ * Returns the decoded record for the word at the given address, decoding it if needed.
+ */
+const DECODED *lookupDecoded(CPU *cpu, REGISTER address) {
+    PAGE *page = pageOf(cpu, address);
+
+    if(page->decoded == NULL) {
+        page->decoded = calloc(WORDS_PER_PAGE, sizeof(DECODED));
+        if(page->decoded == NULL) {
+            printf("Out of memory allocating the decode cache\n");
+            exit(EXIT_FAILURE);
+        }
+        page->flags |= PAGE_CODE;
+    }
+
+    DECODED *decoded = &page->decoded[(address >> 2) & (WORDS_PER_PAGE - 1)];
+
+    if(decoded->handler == NULL) {
+        INSTRUCTION instruction;
+        instruction.data32 = memoryWord(cpu, address);
+        decodeInstruction(instruction, decoded);
+        fuseInstructions(cpu, address, decoded);
+        if(cpu->threadedTargets != NULL)
+            decoded->threaded = cpu->threadedTargets[(decoded->fusedLength > 1)? VARIANT_FUSED : decoded->variant];
+    }
+    return decoded;
+}
+
+/*
+ * Also invalidates a fused group the word is part of, which starts on one of the words before it in the same page
+ */
+void invalidateDecoded(CPU *cpu, REGISTER address) {
+    PAGE *page = pageOf(cpu, address);
+
+    if(page->decoded != NULL) {
+        uint32_t index = (address >> 2) & (WORDS_PER_PAGE - 1);
+        page->decoded[index].handler = NULL;
+        for(uint32_t back = 1; back < MAX_FUSED && back <= index; back++) {
+            if(page->decoded[index - back].fusedLength > back)
+                page->decoded[index - back].handler = NULL;
+        }
+    }
+}
+
+/*
+ * The threaded interpreter hands over its table of label addresses the first time it runs. Records decoded before
+ * that don't have a target yet, so the cache is flushed.
+ */
+void setThreadedTargets(CPU *cpu, const void *const *targets) {
+    if(cpu->threadedTargets != targets) {
+        cpu->threadedTargets = targets;
+        flushDecodeCache(cpu);
+    }
+}
+
+void flushDecodeCache(CPU *cpu) {
+    for(uint32_t i = 0; i < (cpu->memorySize >> GUEST_PAGE_SHIFT); i++) {
+        if(cpu->pages[i].decoded != NULL)
+            memset(cpu->pages[i].decoded, 0, WORDS_PER_PAGE * sizeof(DECODED));
+    }
+}
@@ -0,0 +1,203 @@
+/*
+ * Built in devices for the bus (bus.c), each takes one page
+ *
+ * UART
+ *
+ *      +0x00  DATA     read: the next byte received, 0 if there isn't one    write: transmit the bottom byte
+ *      +0x04  STATUS   bit 0 a byte has been received, bit 1 ready to transmit (always), bit 2 the input has ended
+ *
+ * Transmitted bytes go into the same output buffer as the SWI host calls (swi.c), so the two can be mixed and come out
+ * in order. Received bytes are read from standard input a buffer at a time, without waiting: if nothing has been typed
+ * STATUS says so and DATA reads 0. Standard input should be read through the UART or OS_ReadC, not both, since
+ * OS_ReadC reads through stdio's buffer and the UART doesn't.
+ *
+ * Timer
+ *
+ *      +0x00  LOW      read: microseconds since the timer was attached or reset, and latches HIGH   write: reset to 0
+ *      +0x04  HIGH     the top 32 bits of the count at the last read of LOW
+ *      +0x08  INTERVAL raise the IRQ every this many cycles (instructions) from the write, 0 stops it
+ *      +0x0C  CLEAR    read: 1 if the timer's IRQ is raised   write: drop it
+ *
+ * The count is host time, the interval is machine time (scheduler.c), so a program interrupted by the timer does the
+ * same thing every run. The IRQ stays raised until the handler writes CLEAR.
+ *
+ * A byte access (LDRB, STRB) is an access to the register the byte is in, LDRB of DATA reads one byte.
+ */
+
+#define _POSIX_C_SOURCE 200809L // for clock_gettime when compiling with -std=c11
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memory.h"
+
+
+#define UART_DATA       0x00
+#define UART_STATUS     0x04
+
+#define UART_RECEIVED   (1u << 0)
+#define UART_TRANSMIT   (1u << 1)
+#define UART_ENDED      (1u << 2)
+
+#define UART_INPUT_SIZE 4096
+
+typedef struct UART {
+    CPU *cpu;
+    int input;              // file descriptor
+    BYTE buffer[UART_INPUT_SIZE];
+    uint32_t next;
+    uint32_t length;
+    bool ended;
+} UART;
+
+#define TIMER_LOW       0x00
+#define TIMER_HIGH      0x04
+#define TIMER_INTERVAL  0x08
+#define TIMER_CLEAR     0x0C
+
+typedef struct TIMER {
+    CPU *cpu;
+    uint64_t start;         // host microseconds
+    uint32_t high;
+    uint32_t interval;      // cycles, 0 when stopped
+    uint32_t source;        // interrupt source mask
+    bool raised;
+} TIMER;
+
+
+/*
+ * Refills the input buffer if it is empty and there is input waiting, true if there is a byte to read
+ */
+static bool uartReceived(UART *uart) {
+    if(uart->next < uart->length)
+        return true;
+    if(uart->ended)
+        return false;
+
+    flushOutput(uart->cpu); // a program waiting for input has usually just asked for it
+    struct pollfd waiting = { .fd = uart->input, .events = POLLIN };
+    if(poll(&waiting, 1, 0) <= 0)
+        return false;
+
+    ssize_t length = read(uart->input, uart->buffer, UART_INPUT_SIZE);
+    if(length <= 0) {
+        uart->ended = true;
+        return false;
+    }
+    uart->next = 0;
+    uart->length = (uint32_t)length;
+    return true;
+}
+
+static uint32_t readUart(void *context, uint32_t offset, int size) {
+    UART *uart = context;
+    (void)size;
+
+    switch(offset & ~3u) {
+        case UART_DATA:
+            return uartReceived(uart)? uart->buffer[uart->next++] : 0;
+        case UART_STATUS:
+            return (uartReceived(uart)? UART_RECEIVED : 0) | UART_TRANSMIT | (uart->ended? UART_ENDED : 0);
+        default:
+            return 0;
+    }
+}
+
+static void writeUart(void *context, uint32_t offset, uint32_t value, int size) {
+    UART *uart = context;
+    BYTE byte = (BYTE)value;
+    (void)size;
+
+    if((offset & ~3u) == UART_DATA)
+        writeOutput(uart->cpu, &byte, 1);
+}
+
+bool attachUart(CPU *cpu, REGISTER address) {
+    UART *uart = calloc(1, sizeof(UART));
+    if(uart == NULL)
+        return false;
+    uart->cpu = cpu;
+    uart->input = STDIN_FILENO;
+
+    if(!attachDevice(cpu, address, GUEST_PAGE_SIZE, readUart, writeUart, uart, true)) {
+        free(uart);
+        return false;
+    }
+    return true;
+}
+
+
+static uint64_t hostMicroseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static void timerTick(ARMPIT *cpu, void *context) {
+    TIMER *timer = context;
+
+    timer->raised = true;
+    setInterrupt(cpu, false, timer->source, true);
+    scheduleEvent(cpu, timer->interval, timerTick, timer);
+}
+
+static uint32_t readTimer(void *context, uint32_t offset, int size) {
+    TIMER *timer = context;
+    (void)size;
+
+    switch(offset & ~3u) {
+        case TIMER_LOW: {
+            uint64_t count = hostMicroseconds() - timer->start;
+            timer->high = (uint32_t)(count >> 32);
+            return (uint32_t)count;
+        }
+        case TIMER_HIGH:
+            return timer->high;
+        case TIMER_INTERVAL:
+            return timer->interval;
+        case TIMER_CLEAR:
+            return timer->raised? 1 : 0;
+        default:
+            return 0;
+    }
+}
+
+static void writeTimer(void *context, uint32_t offset, uint32_t value, int size) {
+    TIMER *timer = context;
+    (void)size;
+
+    switch(offset & ~3u) {
+        case TIMER_LOW:
+            timer->start = hostMicroseconds();
+            timer->high = 0;
+            break;
+        case TIMER_INTERVAL:
+            cancelEvents(timer->cpu, timerTick, timer);
+            timer->interval = value;
+            if(value != 0)
+                scheduleEvent(timer->cpu, value, timerTick, timer);
+            break;
+        case TIMER_CLEAR:
+            timer->raised = false;
+            setInterrupt(timer->cpu, false, timer->source, false);
+            break;
+    }
+}
+
+bool attachTimer(CPU *cpu, REGISTER address) {
+    TIMER *timer = calloc(1, sizeof(TIMER));
+    if(timer == NULL)
+        return false;
+    timer->cpu = cpu;
+    timer->start = hostMicroseconds();
+    timer->source = allocateInterruptSource(cpu);
+
+    if(!attachDevice(cpu, address, GUEST_PAGE_SIZE, readTimer, writeTimer, timer, true)) {
+        free(timer);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,85 @@
+/*
+ * Status register and the lazy evaluation of the NZCV flags (see flags.h)
+ */
+
+#include "flags.h"
+
+
+/*
+ * -------------------------------------------------------------------------------
+ *               Condition     NZCV values (bit n is set when the condition passes for NZCV = n)
+ *                  Code
+ * -------------------------------------------------------------------------------
+ */
+const uint16_t conditionTable[16] = {
+    0xF0F0, // Equal            0000    Z set
+    0x0F0F, // Not Equal        0001    Z clear
+    0xCCCC, // Carry Set        0010    C set
+    0x3333, // Carry Clear      0011    C clear
+    0xFF00, // Minus            0100    N set
+    0x00FF, // Plus             0101    N clear
+    0xAAAA, // Overflow Set     0110    V set
+    0x5555, // Overflow Clear   0111    V clear
+    0x0C0C, // Higher           1000    C set and Z clear
+    0xF3F3, // Lower or Same    1001    C clear or Z set
+    0xAA55, // Greater or Equal 1010    N equals V
+    0x55AA, // Less Than        1011    N not equal to V
+    0x0A05, // Greater Than     1100    Z clear and N equals V
+    0xF5FA, // Less or Equal    1101    Z set or N not equal to V
+    0xFFFF, // Always           1110
+    0x0000  // Never            1111
+};
+
+
+/*
+ * Works out the pending flags, writes them into the status register and returns NZCV (bits 7..4 of the register)
+ */
+BYTE materialiseFlags(CPU *cpu) {
+    const LAZY_FLAGS *flags = &cpu->flags;
+    BYTE status = cpu->statusRegister;
+    BYTE pending = flags->pending;
+
+    if(pending & FLAGS_NZ) {
+        status &= ~(STATUS_N | STATUS_Z);
+        status |= (flags->result >> 31)? STATUS_N : 0;
+        status |= (flags->result == 0)? STATUS_Z : 0;
+    }
+    if(pending & (FLAGS_C_ADD | FLAGS_C_SHIFTER)) {
+        status &= ~STATUS_C;
+        status |= carryFlag(cpu)? STATUS_C : 0;
+    }
+    if(pending & FLAGS_V) {
+        status &= ~STATUS_V;
+        status |= (((flags->op1 ^ flags->sum) & (flags->op2 ^ flags->sum)) >> 31)? STATUS_V : 0;
+    }
+
+    cpu->statusRegister = status;
+    cpu->flags.pending = 0;
+    return status >> 4;
+}
+
+BYTE getStatusRegister(CPU *cpu) {
+    materialiseFlags(cpu);
+    return cpu->statusRegister;
+}
+
+void setStatusRegister(CPU *cpu, BYTE status) {
+    cpu->flags.pending = 0;
+    cpu->statusRegister = status;
+}
+
+int isSet(CPU *cpu, int flag) {
+    return (getStatusRegister(cpu) & flag);
+}
+
+int isClear(CPU *cpu, int flag) {
+    return ((~getStatusRegister(cpu)) & flag);
+}
+
+void setFlag(CPU *cpu, int flag) {
+    cpu->statusRegister = getStatusRegister(cpu) | flag;
+}
+
+void clearFlag(CPU *cpu, int flag) {
+    cpu->statusRegister = getStatusRegister(cpu) & (~flag);
+}
@@ -0,0 +1,85 @@
+#ifndef __FLAGS_H__
+#define __FLAGS_H__
+
+#include "armpit.h"
+
+
+/*
+ * Lazy NZCV flags
+ *
+ * Most flag setting instructions have their flags overwritten by the next flag setting instruction before anything
+ * looks at them. So rather than working out N, Z, C and V every time, a flag setting instruction only records what it
+ * needs to (the result, and the operands of the addition for C and V) and marks those flags as pending. The flags are
+ * only worked out and written into the status register when a conditional instruction or a read of the status register
+ * needs them.
+ *
+ * A flag that isn't pending holds its value in the status register as normal.
+ */
+#define FLAGS_NZ            (1<<0) // N and Z come from result
+#define FLAGS_C_ADD         (1<<1) // C is the carry out of op1 + op2 (+ carry in) = sum
+#define FLAGS_C_SHIFTER     (1<<2) // C is the barrel shifter carry out held in carry
+#define FLAGS_V             (1<<3) // V is the overflow of op1 + op2 (+ carry in) = sum
+
+/*
+ * Each CPU holds a LAZY_FLAGS (declared in armpit.h):
+ *  result      result of the last flag setting operation
+ *  op1, op2    operands and result of the last flag setting addition
+ *  sum         (subtraction is recorded as an addition of NOT op2, so C is NOT borrow)
+ *  carry       shifter carry out of the last flag setting logical operation
+ *  pending     which flags are still to be worked out
+ */
+
+/*
+ * conditionTable[condition code] has bit n set if the condition passes when NZCV (status register bits 7..4) is n
+ */
+extern const uint16_t conditionTable[16];
+
+BYTE materialiseFlags(CPU *); // works out any pending flags and returns NZCV
+BYTE getStatusRegister(CPU *);
+void setStatusRegister(CPU *, BYTE);
+
+
+static inline BYTE getNZCV(CPU *cpu) {
+    return cpu->flags.pending? materialiseFlags(cpu) : (cpu->statusRegister >> 4);
+}
+
+static inline bool conditionPassed(CPU *cpu, int conditionCode) {
+    return (conditionTable[conditionCode] >> getNZCV(cpu)) & 1;
+}
+
+static inline int carryFlag(CPU *cpu) {
+    const LAZY_FLAGS *flags = &cpu->flags;
+    if(flags->pending & FLAGS_C_ADD)
+        return ((flags->op1 & flags->op2) | ((flags->op1 | flags->op2) & ~flags->sum)) >> 31;
+    if(flags->pending & FLAGS_C_SHIFTER)
+        return flags->carry;
+    return (cpu->statusRegister & STATUS_C)? 1 : 0;
+}
+
+/*
+ * Logical operations set N and Z from the result and C from the barrel shifter. V is unaffected.
+ */
+static inline void setLogicalFlags(CPU *cpu, REGISTER result, int carry) {
+    cpu->flags.result = result;
+    cpu->flags.carry = carry;
+    cpu->flags.pending = (cpu->flags.pending & FLAGS_V) | FLAGS_NZ | FLAGS_C_SHIFTER;
+}
+
+/*
+ * Every arithmetic operation is an addition: op1 + op2 + carryIn. Subtraction is done as op1 + NOT(op2) + 1 so that the
+ * C flag comes out as NOT borrow, which is how the ARM defines it.
+ */
+static inline REGISTER addWithCarry(CPU *cpu, REGISTER op1, REGISTER op2, int carryIn, bool updateStatus) {
+    REGISTER result = op1 + op2 + (REGISTER)carryIn;
+
+    if(updateStatus) {
+        cpu->flags.result = result;
+        cpu->flags.op1 = op1;
+        cpu->flags.op2 = op2;
+        cpu->flags.sum = result;
+        cpu->flags.pending = FLAGS_NZ | FLAGS_C_ADD | FLAGS_V;
+    }
+    return result;
+}
+
+#endif
@@ -0,0 +1,683 @@
+/*
+ * Basic block JIT compiler to x86-64.
+ *
+ * Starting from the PC, a run of data processing instructions is translated into native code and kept in an executable
+ * code cache, keyed by the address of its first instruction. A block ends at the first instruction the JIT can't
+ * translate (branches, data transfers, SWIs, anything that reads or writes R15, register specified shifts), which the
+ * dispatcher then runs through the interpreter before looking up the next block. Blocks also end at page boundaries so
+ * each block belongs to one page of memory.
+ *
+ * Register use inside translated code:
+ *  rdi      pointer to the CPU's registers[16]
+ *  rsi      pointer to the CPU's status register
+ *  rdx      instruction budget, decremented by the length of a block on entry
+ *  r8d      NZCV (bits 3..0), loaded by the entry trampoline and written back to the status register on exit
+ *  eax, ecx, r9 - r11 scratch
+ * Flag setting instructions compute NZCV from the host flags straight after the x86 instruction (x86 and ARM agree on N,
+ * Z and V, and on C for additions; for subtractions the ARM C flag is the inverse of the x86 borrow).
+ *
+ * A block that falls through to another translated block jumps straight into it rather than going back through the
+ * dispatcher. Writing to memory covered by a block throws the block away and unlinks anything chained to it.
+ *
+ * Translated code only refers to the registers and status register it is handed, but the chains between blocks are
+ * particular to one CPU's memory, so each CPU has its own code cache.
+ *
+ * Only built for x86-64 hosts, elsewhere runJit() falls back to the threaded interpreter.
+ */
+
+#define _DEFAULT_SOURCE // for MAP_ANONYMOUS when compiling with -std=c11
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flags.h"
+#include "memory.h"
+
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+
+#include <sys/mman.h>
+
+#define JIT_CODE_SIZE (1024 * 1024)
+#define JIT_MAX_BLOCK_LENGTH 64
+#define JIT_MAX_BLOCKS 16384
+
+// x86 register numbers
+#define EAX 0
+#define ECX 1
+#define EDX 2
+#define ESI 6
+#define EDI 7
+#define R8 8
+#define R9 9
+#define R10 10
+#define R11 11
+
+// x86 condition codes for setcc and jcc
+#define CC_O 0x0
+#define CC_C 0x2
+#define CC_NC 0x3
+#define CC_Z 0x4
+#define CC_S 0x8
+#define CC_L 0xc
+
+typedef enum CarrySource {
+    CARRY_UNCHANGED = 0,
+    CARRY_ZERO,
+    CARRY_ONE,
+    CARRY_IN_R11    // shifter carry out captured in r11b
+} CarrySource;
+
+typedef struct JIT_BLOCK JIT_BLOCK;
+
+struct JIT_BLOCK {
+    uint8_t *entry;
+    uint8_t *exitJump;      // rel32 of the jump at the end of the block, patched to chain to the next block
+    uint8_t *exitStub;      // code that returns to the dispatcher, the jump's original target
+    JIT_BLOCK *chainedTo;
+    REGISTER start;         // the block covers addresses start to end - 4
+    REGISTER end;
+    bool live;
+};
+
+typedef int64_t (*JIT_ENTER)(REGISTER *, BYTE *, int64_t, const void *);
+
+/*
+ * Each CPU has its own code cache
+ */
+struct JIT {
+    uint8_t *code;
+    size_t codeUsed;
+    JIT_ENTER enterBlock;   // the trampoline at the start of the code
+    size_t trampolineSize;
+    JIT_BLOCK *blockPool;   // JIT_MAX_BLOCKS of them
+    int blocksUsed;
+};
+
+static JIT_BLOCK untranslatable;                 // marks addresses the JIT has given up on
+
+
+static void emit8(JIT *jit, uint8_t byte) {
+    jit->code[jit->codeUsed++] = byte;
+}
+
+static void emit32(JIT *jit, uint32_t value) {
+    memcpy(&jit->code[jit->codeUsed], &value, 4);
+    jit->codeUsed += 4;
+}
+
+static void emitRex(JIT *jit, int w, int reg, int index, int base) {
+    uint8_t rex = 0x40 | (w << 3) | (((reg >> 3) & 1) << 2) | (((index >> 3) & 1) << 1) | ((base >> 3) & 1);
+    if(rex != 0x40)
+        emit8(jit, rex);
+}
+
+// op r/m32, r32 (register to register)
+static void emitRR(JIT *jit, uint8_t opcode, int rm, int reg) {
+    emitRex(jit, 0, reg, 0, rm);
+    emit8(jit, opcode);
+    emit8(jit, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// mov r32, [rdi + 4 * armRegister]
+static void emitLoadRegister(JIT *jit, int host, int armRegister) {
+    emitRex(jit, 0, host, 0, EDI);
+    emit8(jit, 0x8b);
+    emit8(jit, 0x40 | ((host & 7) << 3) | EDI);
+    emit8(jit, armRegister * 4);
+}
+
+// mov [rdi + 4 * armRegister], r32
+static void emitStoreRegister(JIT *jit, int armRegister, int host) {
+    emitRex(jit, 0, host, 0, EDI);
+    emit8(jit, 0x89);
+    emit8(jit, 0x40 | ((host & 7) << 3) | EDI);
+    emit8(jit, armRegister * 4);
+}
+
+// mov dword [rdi + 60], imm32
+static void emitStorePC(JIT *jit, REGISTER value) {
+    emit8(jit, 0xc7);
+    emit8(jit, 0x40 | EDI);
+    emit8(jit, 15 * 4);
+    emit32(jit, value);
+}
+
+static void emitMovImmediate(JIT *jit, int host, uint32_t value) {
+    emitRex(jit, 0, 0, 0, host);
+    emit8(jit, 0xb8 | (host & 7));
+    emit32(jit, value);
+}
+
+// group 2 shift by immediate: ext is 0 rol, 1 ror, 3 rcr, 4 shl, 5 shr, 7 sar
+static void emitShift(JIT *jit, int ext, int host, int amount) {
+    emitRex(jit, 0, 0, 0, host);
+    if(amount == 1) {
+        emit8(jit, 0xd1);
+        emit8(jit, 0xc0 | (ext << 3) | (host & 7));
+    } else {
+        emit8(jit, 0xc1);
+        emit8(jit, 0xc0 | (ext << 3) | (host & 7));
+        emit8(jit, amount);
+    }
+}
+
+// group 3 / group 1 with an 8 bit immediate
+static void emitGroupImmediate(JIT *jit, uint8_t opcode, int ext, int host, uint8_t value) {
+    emitRex(jit, 0, 0, 0, host);
+    emit8(jit, opcode);
+    emit8(jit, 0xc0 | (ext << 3) | (host & 7));
+    emit8(jit, value);
+}
+
+static void emitNot(JIT *jit, int host) {
+    emitRex(jit, 0, 0, 0, host);
+    emit8(jit, 0xf7);
+    emit8(jit, 0xc0 | (2 << 3) | (host & 7));
+}
+
+// bt r32, imm8
+static void emitBitTest(JIT *jit, int host, int bit) {
+    emitRex(jit, 0, 0, 0, host);
+    emit8(jit, 0x0f);
+    emit8(jit, 0xba);
+    emit8(jit, 0xc0 | (4 << 3) | (host & 7));
+    emit8(jit, bit);
+}
+
+// bt r32, r32
+static void emitBitTestRegister(JIT *jit, int host, int bit) {
+    emitRex(jit, 0, bit, 0, host);
+    emit8(jit, 0x0f);
+    emit8(jit, 0xa3);
+    emit8(jit, 0xc0 | ((bit & 7) << 3) | (host & 7));
+}
+
+static void emitSetcc(JIT *jit, int cc, int host) {
+    emitRex(jit, 0, 0, 0, host);
+    emit8(jit, 0x0f);
+    emit8(jit, 0x90 | cc);
+    emit8(jit, 0xc0 | (host & 7));
+}
+
+// movzx r32, r8 (same register)
+static void emitZeroExtend(JIT *jit, int host) {
+    emitRex(jit, 0, host, 0, host);
+    emit8(jit, 0x0f);
+    emit8(jit, 0xb6);
+    emit8(jit, 0xc0 | ((host & 7) << 3) | (host & 7));
+}
+
+// lea dst, [base + index * (1 << scale)]
+static void emitLea(JIT *jit, int dst, int base, int index, int scale) {
+    emitRex(jit, 0, dst, index, base);
+    emit8(jit, 0x8d);
+    emit8(jit, 0x04 | ((dst & 7) << 3));
+    emit8(jit, (scale << 6) | ((index & 7) << 3) | (base & 7));
+}
+
+// jcc/jmp rel32, returns where the offset is so it can be patched
+static uint8_t *emitJump(JIT *jit, int cc) {
+    if(cc < 0) {
+        emit8(jit, 0xe9);
+    } else {
+        emit8(jit, 0x0f);
+        emit8(jit, 0x80 | cc);
+    }
+    emit32(jit, 0);
+    return &jit->code[jit->codeUsed - 4];
+}
+
+static void patchJump(uint8_t *offset, const uint8_t *target) {
+    int32_t relative = (int32_t)(target - (offset + 4));
+    memcpy(offset, &relative, 4);
+}
+
+/*
+ * Writes NZCV from r8d back to the status register and returns the remaining budget to the dispatcher
+ */
+static void emitExit(JIT *jit) {
+    emit8(jit, 0x0f); emit8(jit, 0xb6); emit8(jit, 0x06);  // movzx eax, byte [rsi]
+    emitGroupImmediate(jit, 0x83, 4, EAX, 0x0f); // and eax, 0x0f
+    emitRR(jit, 0x89, ECX, R8);                  // mov ecx, r8d
+    emitShift(jit, 4, ECX, 4);                   // shl ecx, 4
+    emitRR(jit, 0x09, EAX, ECX);                 // or eax, ecx
+    emit8(jit, 0x88); emit8(jit, 0x06);               // mov [rsi], al
+    emit8(jit, 0x48); emit8(jit, 0x89); emit8(jit, 0xd0);  // mov rax, rdx
+    emit8(jit, 0xc3);                            // ret
+}
+
+static void emitTrampoline(JIT *jit) {
+    emit8(jit, 0x44); emit8(jit, 0x0f); emit8(jit, 0xb6); emit8(jit, 0x06); // movzx r8d, byte [rsi]
+    emitShift(jit, 5, R8, 4);                                // shr r8d, 4
+    emit8(jit, 0xff); emit8(jit, 0xe1);                           // jmp rcx
+}
+
+static bool isLogical(int opCode) {
+    switch(opCode) {
+        case OP_AND: case OP_EOR: case OP_TST: case OP_TEQ:
+        case OP_ORR: case OP_MOV: case OP_BIC: case OP_MVN:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool usesRegN(int opCode) {
+    return opCode != OP_MOV && opCode != OP_MVN;
+}
+
+static bool writesResult(int opCode) {
+    return opCode < OP_TST || opCode > OP_CMN;
+}
+
+static bool canTranslate(const DECODED *decoded) {
+    if(decoded->type != ALU)
+        return false;
+    if(decoded->regDest == 15 || (usesRegN(decoded->opCode) && decoded->regN == 15))
+        return false;
+    if(!decoded->immediate && (decoded->shiftByRegister || decoded->regM == 15))
+        return false;
+    return true;
+}
+
+/*
+ * Leaves operand 2 in ecx and says where the shifter carry out ended up
+ */
+static CarrySource emitOperand2(JIT *jit, const DECODED *decoded, bool needCarry) {
+    if(decoded->immediate) {
+        emitMovImmediate(jit, ECX, decoded->operand2);
+        if(decoded->immediateCarry == SHIFTER_CARRY_UNCHANGED)
+            return CARRY_UNCHANGED;
+        return decoded->immediateCarry? CARRY_ONE : CARRY_ZERO;
+    }
+
+    int amount = decoded->shiftAmount;
+    emitLoadRegister(jit, ECX, decoded->regM);
+
+    switch(decoded->shiftType) {
+        case SHIFT_LSL:
+            if(amount == 0)
+                return CARRY_UNCHANGED;
+            emitShift(jit, 4, ECX, amount);
+            break;
+        case SHIFT_LSR:
+            if(amount == 0) { // LSR #32
+                emitBitTest(jit, ECX, 31);
+                if(needCarry)
+                    emitSetcc(jit, CC_C, R11);
+                emitMovImmediate(jit, ECX, 0);
+                return CARRY_IN_R11;
+            }
+            emitShift(jit, 5, ECX, amount);
+            break;
+        case SHIFT_ASR:
+            if(amount == 0) { // ASR #32
+                emitBitTest(jit, ECX, 31);
+                if(needCarry)
+                    emitSetcc(jit, CC_C, R11);
+                emitShift(jit, 7, ECX, 31);
+                return CARRY_IN_R11;
+            }
+            emitShift(jit, 7, ECX, amount);
+            break;
+        case SHIFT_ROR:
+            if(amount == 0) { // RRX
+                emitBitTest(jit, R8, 1);
+                emitShift(jit, 3, ECX, 1);
+            } else {
+                emitShift(jit, 1, ECX, amount);
+            }
+            break;
+    }
+    if(needCarry)
+        emitSetcc(jit, CC_C, R11);
+    return CARRY_IN_R11;
+}
+
+static void emitInstruction(JIT *jit, const DECODED *decoded) {
+    int opCode = decoded->opCode;
+    bool logical = isLogical(opCode);
+    bool updateStatus = decoded->updateStatus || !writesResult(opCode);
+    bool borrow = false; // x86 carry is a borrow, so the ARM C flag is its inverse
+
+    CarrySource carry = emitOperand2(jit, decoded, updateStatus && logical);
+    if(usesRegN(opCode))
+        emitLoadRegister(jit, EAX, decoded->regN);
+
+    switch(opCode) {
+        case OP_AND:
+        case OP_TST:
+            emitRR(jit, 0x21, EAX, ECX);
+            break;
+        case OP_EOR:
+        case OP_TEQ:
+            emitRR(jit, 0x31, EAX, ECX);
+            break;
+        case OP_ORR:
+            emitRR(jit, 0x09, EAX, ECX);
+            break;
+        case OP_BIC:
+            emitNot(jit, ECX);
+            emitRR(jit, 0x21, EAX, ECX);
+            break;
+        case OP_MOV:
+            emitRR(jit, 0x89, EAX, ECX);
+            break;
+        case OP_MVN:
+            emitRR(jit, 0x89, EAX, ECX);
+            emitNot(jit, EAX);
+            break;
+        case OP_ADD:
+        case OP_CMN:
+            emitRR(jit, 0x01, EAX, ECX);
+            break;
+        case OP_SUB:
+        case OP_CMP:
+            emitRR(jit, 0x29, EAX, ECX);
+            borrow = true;
+            break;
+        case OP_RSB:
+            emitRR(jit, 0x29, ECX, EAX);
+            emitRR(jit, 0x89, EAX, ECX);
+            borrow = true;
+            break;
+        case OP_ADC:
+            emitBitTest(jit, R8, 1);
+            emitRR(jit, 0x11, EAX, ECX);
+            break;
+        case OP_SBC:
+            emitBitTest(jit, R8, 1);
+            emit8(jit, 0xf5); // cmc
+            emitRR(jit, 0x19, EAX, ECX);
+            borrow = true;
+            break;
+        case OP_RSC:
+            emitBitTest(jit, R8, 1);
+            emit8(jit, 0xf5); // cmc
+            emitRR(jit, 0x19, ECX, EAX);
+            emitRR(jit, 0x89, EAX, ECX);
+            borrow = true;
+            break;
+    }
+
+    if(updateStatus && logical) {
+        emitRR(jit, 0x85, EAX, EAX); // test eax, eax
+        emitSetcc(jit, CC_S, R9);
+        emitSetcc(jit, CC_Z, R10);
+        emitZeroExtend(jit, R9);
+        emitZeroExtend(jit, R10);
+        switch(carry) {
+            case CARRY_UNCHANGED:
+                emitGroupImmediate(jit, 0x83, 4, R8, 0x3); // keep C and V
+                break;
+            case CARRY_ZERO:
+                emitGroupImmediate(jit, 0x83, 4, R8, 0x1); // keep V
+                break;
+            case CARRY_ONE:
+                emitGroupImmediate(jit, 0x83, 4, R8, 0x1);
+                emitGroupImmediate(jit, 0x83, 1, R8, 0x2); // or r8d, 2
+                break;
+            case CARRY_IN_R11:
+                emitGroupImmediate(jit, 0x83, 4, R8, 0x1);
+                emitZeroExtend(jit, R11);
+                emitLea(jit, R8, R8, R11, 1);
+                break;
+        }
+        emitLea(jit, R8, R8, R10, 2);
+        emitLea(jit, R8, R8, R9, 3);
+    } else if(updateStatus) {
+        emitSetcc(jit, CC_S, R9);
+        emitSetcc(jit, CC_Z, R10);
+        emitSetcc(jit, borrow? CC_NC : CC_C, R11);
+        emitSetcc(jit, CC_O, ECX);
+        emitZeroExtend(jit, R9);
+        emitZeroExtend(jit, R10);
+        emitZeroExtend(jit, R11);
+        emitZeroExtend(jit, ECX);
+        emitLea(jit, R8, ECX, R11, 1);
+        emitLea(jit, R8, R8, R10, 2);
+        emitLea(jit, R8, R8, R9, 3);
+    }
+
+    if(writesResult(opCode))
+        emitStoreRegister(jit, decoded->regDest, EAX);
+}
+
+/*
+ * The block starting at an address is kept in the address's page
+ */
+static JIT_BLOCK **blockAt(CPU *cpu, REGISTER address) {
+    PAGE *page = pageOf(cpu, address);
+
+    if(page->jitBlocks == NULL) {
+        page->jitBlocks = calloc(WORDS_PER_PAGE, sizeof(void *));
+        if(page->jitBlocks == NULL) {
+            printf("Out of memory allocating JIT blocks\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return (JIT_BLOCK **)&page->jitBlocks[(address >> 2) & (WORDS_PER_PAGE - 1)];
+}
+
+static void flushJit(CPU *cpu) {
+    cpu->jit->codeUsed = cpu->jit->trampolineSize;
+    cpu->jit->blocksUsed = 0;
+    for(uint32_t i = 0; i < (cpu->memorySize >> GUEST_PAGE_SHIFT); i++) {
+        if(cpu->pages[i].jitBlocks != NULL)
+            memset(cpu->pages[i].jitBlocks, 0, WORDS_PER_PAGE * sizeof(void *));
+        cpu->pages[i].jitCoverage = 0;
+    }
+}
+
+static void chain(JIT_BLOCK *from, JIT_BLOCK *to) {
+    patchJump(from->exitJump, to->entry);
+    from->chainedTo = to;
+}
+
+/*
+ * Translates the block starting at position. Returns NULL if the first instruction can't be translated.
+ */
+static JIT_BLOCK *translate(CPU *cpu, REGISTER position) {
+    JIT *jit = cpu->jit;
+    REGISTER end = position;
+    REGISTER pageEnd = (position | (GUEST_PAGE_SIZE - 1)) + 1;
+    while(end != cpu->programEnd && end != pageEnd && end - position < JIT_MAX_BLOCK_LENGTH * 4 && canTranslate(lookupDecoded(cpu, end)))
+        end += 4;
+    if(end == position)
+        return NULL;
+
+    // worst case is roughly 100 bytes per instruction
+    if(jit->blocksUsed == JIT_MAX_BLOCKS || jit->codeUsed + (end - position) * 32 + 256 > JIT_CODE_SIZE)
+        flushJit(cpu);
+
+    JIT_BLOCK *block = &jit->blockPool[jit->blocksUsed++];
+    int count = (end - position) / 4;
+
+    block->start = position;
+    block->end = end;
+    block->chainedTo = NULL;
+    block->live = true;
+    block->entry = &jit->code[jit->codeUsed];
+
+    // cmp rdx, count / jl noRun / sub rdx, count
+    emit8(jit, 0x48); emit8(jit, 0x81); emit8(jit, 0xfa); emit32(jit, count);
+    uint8_t *noRun = emitJump(jit, CC_L);
+    emit8(jit, 0x48); emit8(jit, 0x81); emit8(jit, 0xea); emit32(jit, count);
+
+    for(REGISTER i = position; i != end; i += 4) {
+        const DECODED *decoded = lookupDecoded(cpu, i);
+        uint8_t *skip = NULL;
+
+        if(decoded->condition == CONDITION_NEVER)
+            continue;
+        if(decoded->condition != CONDITION_ALWAYS) {
+            emitMovImmediate(jit, EAX, conditionTable[decoded->condition]);
+            emitBitTestRegister(jit, EAX, R8);
+            skip = emitJump(jit, CC_NC);
+        }
+        emitInstruction(jit, decoded);
+        if(skip != NULL)
+            patchJump(skip, &jit->code[jit->codeUsed]);
+    }
+
+    block->exitJump = emitJump(jit, -1);
+    block->exitStub = &jit->code[jit->codeUsed];
+    patchJump(block->exitJump, block->exitStub);
+    emitStorePC(jit, end);
+    emitExit(jit);
+
+    patchJump(noRun, &jit->code[jit->codeUsed]);
+    emitStorePC(jit, position);
+    emitExit(jit);
+
+    *blockAt(cpu, position) = block;
+    pageOf(cpu, position)->jitCoverage++;
+
+    // link up with the blocks either side
+    JIT_BLOCK *next = *blockAt(cpu, end);
+    if(end != cpu->programEnd && next != NULL && next != &untranslatable)
+        chain(block, next);
+    for(int i = 0; i < jit->blocksUsed - 1; i++) {
+        if(jit->blockPool[i].live && jit->blockPool[i].end == position && jit->blockPool[i].chainedTo == NULL)
+            chain(&jit->blockPool[i], block);
+    }
+    return block;
+}
+
+static void discard(CPU *cpu, JIT_BLOCK *block) {
+    JIT *jit = cpu->jit;
+
+    block->live = false;
+    *blockAt(cpu, block->start) = NULL;
+    pageOf(cpu, block->start)->jitCoverage--;
+
+    for(int i = 0; i < jit->blocksUsed; i++) {
+        if(jit->blockPool[i].live && jit->blockPool[i].chainedTo == block) {
+            patchJump(jit->blockPool[i].exitJump, jit->blockPool[i].exitStub);
+            jit->blockPool[i].chainedTo = NULL;
+        }
+    }
+}
+
+/*
+ * Called for stores to pages that have been executed, throws away any block containing the word written
+ */
+void invalidateJit(CPU *cpu, REGISTER address) {
+    PAGE *page = pageOf(cpu, address);
+
+    if(cpu->jit == NULL || page->jitBlocks == NULL)
+        return;
+
+    JIT_BLOCK **slot = blockAt(cpu, address);
+    if(*slot == &untranslatable)
+        *slot = NULL;
+    if(page->jitCoverage == 0)
+        return;
+
+    address &= cpu->memoryMask;
+    for(int i = 0; i < cpu->jit->blocksUsed; i++) {
+        JIT_BLOCK *block = &cpu->jit->blockPool[i];
+        if(block->live && (block->start & cpu->memoryMask) <= address && address < ((block->end - 4) & cpu->memoryMask) + 4)
+            discard(cpu, block);
+    }
+}
+
+/*
+ * Sets up the CPU's code cache the first time it is called. Returns false if the host won't give us executable memory.
+ */
+bool jitAvailable(CPU *cpu) {
+    if(cpu->jit != NULL)
+        return true;
+
+    JIT *jit = calloc(1, sizeof(JIT));
+    if(jit == NULL)
+        return false;
+    jit->blockPool = calloc(JIT_MAX_BLOCKS, sizeof(JIT_BLOCK));
+    void *memory = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(jit->blockPool == NULL || memory == MAP_FAILED) {
+        if(memory != MAP_FAILED)
+            munmap(memory, JIT_CODE_SIZE);
+        free(jit->blockPool);
+        free(jit);
+        return false;
+    }
+
+    jit->code = memory;
+    jit->enterBlock = (JIT_ENTER)(void *)jit->code;
+    emitTrampoline(jit);
+    jit->trampolineSize = jit->codeUsed;
+    cpu->jit = jit;
+    flushJit(cpu);
+    return true;
+}
+
+void freeJit(CPU *cpu) {
+    if(cpu->jit == NULL)
+        return;
+    munmap(cpu->jit->code, JIT_CODE_SIZE);
+    free(cpu->jit->blockPool);
+    free(cpu->jit);
+    cpu->jit = NULL;
+}
+
+/*
+ * Runs until halt or until maxSteps instructions have been executed (0 means no limit), translating blocks as they are
+ * reached. Instructions which can't be translated are run by the interpreter.
+ */
+uint64_t runJit(CPU *cpu, uint64_t maxSteps) {
+    uint64_t executed = 0;
+
+    if(!jitAvailable(cpu))
+        return runThreaded(cpu, maxSteps);
+    if(maxSteps == 0 || maxSteps > INT64_MAX)
+        maxSteps = INT64_MAX;
+
+    while(executed < maxSteps && cpu->registers[PROGRAM_COUNTER] != cpu->programEnd) {
+        REGISTER position = cpu->registers[PROGRAM_COUNTER];
+        JIT_BLOCK *block = *blockAt(cpu, position);
+
+        if(block == NULL) {
+            block = translate(cpu, position);
+            *blockAt(cpu, position) = (block == NULL)? &untranslatable : block;
+        }
+
+        if(block != NULL && block != &untranslatable) {
+            int64_t budget = (int64_t)(maxSteps - executed);
+            getNZCV(cpu); // the translated code needs the flags up to date in the status register
+            int64_t remaining = cpu->jit->enterBlock(cpu->registers, &cpu->statusRegister, budget, block->entry);
+            if(remaining != budget) {
+                executed += budget - remaining;
+                continue;
+            }
+            // not enough budget left for the whole block, finish off in the interpreter
+        }
+
+        step(cpu);
+        executed++;
+    }
+    return executed;
+}
+
+#else
+
+void invalidateJit(CPU *cpu, REGISTER address) {
+    (void)cpu;
+    (void)address;
+}
+
+bool jitAvailable(CPU *cpu) {
+    (void)cpu;
+    return false;
+}
+
+void freeJit(CPU *cpu) {
+    (void)cpu;
+}
+
+uint64_t runJit(CPU *cpu, uint64_t maxSteps) {
+    return runThreaded(cpu, maxSteps);
+}
+
+#endif
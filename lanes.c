@@ -0,0 +1,411 @@
+/*
+ * Lane parallel runs of one program over many inputs (armpitRunLanes)
+ *
+ * A short kernel run over a great many independent inputs does the same instructions in the same order for nearly all
+ * of them. Here LANE_COUNT inputs run at once. Their registers and flags are held structure of arrays, one vector per
+ * register with an element per lane, so a data processing instruction is a handful of vector operations for every
+ * lane instead of one trip through an interpreter each.
+ *
+ * Each input goes into R0 upwards. The rest of the registers and the status register start as the machine has them,
+ * and once a lane halts the same registers are its output.
+ *
+ * Every lane has its own PC. Each step runs the instruction at the lowest PC of the lanes still running, for the
+ * lanes that are there, so lanes which branch different ways run one path and then the other and come back together
+ * where the paths meet (the end of an if, the exit of a loop). Condition codes become masks: a lane whose condition
+ * fails just moves on to the next instruction.
+ *
+ * Data processing (except with R15 as the destination, or read as anything but Rn), B, BL, LDR and LDRB run on the
+ * vectors, loads gathering a lane at a time. Anything else would need each lane to have memory of its own: a lane that
+ * reaches a store, block transfer, SWI or undefined instruction with its condition passing is finished on its own by
+ * the machine's engine, starting from memory as it was before the run and putting it back afterwards (snapshot.c),
+ * and so gets the same result it would running alone. Vector lanes never write memory.
+ *
+ * The vectors are the GCC/Clang vector extension, which compiles to what the target has: single 256 bit operations
+ * with -mavx2 (or -march=native), pairs of SSE2 ones for plain x86-64, NEON on ARM hosts. Other compilers, or building
+ * with -DARMPIT_NO_VECTOR_LANES, run every lane on its own.
+ *
+ * Loads from device pages read the device, a lane at a time, but events and interrupts (scheduler.c) only happen for
+ * lanes that run on their own. Taking the snapshot starts the machine's dirty page tracking afresh.
+ */
+
+#include <stdio.h>
+
+#include "flags.h"
+#include "memory.h"
+#include "shifter.h"
+
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(ARMPIT_NO_VECTOR_LANES)
+#define VECTOR_LANES 1
+#else
+#define VECTOR_LANES 0
+#endif
+
+#define LANE_COUNT  8
+#define LANE_BITS   { 1, 2, 4, 8, 16, 32, 64, 128 } // one per lane
+#define ALL_LANES   ((1u << LANE_COUNT) - 1)
+
+#if VECTOR_LANES
+typedef uint32_t LANES __attribute__((vector_size(4 * LANE_COUNT)));
+typedef int32_t SIGNED_LANES __attribute__((vector_size(4 * LANE_COUNT)));
+#else
+typedef uint32_t LANES[LANE_COUNT];
+#endif
+
+// single data transfer bits, as in transfer.c
+#define TRANSFER_PRE       (1u << 24)
+#define TRANSFER_UP        (1u << 23)
+#define TRANSFER_BYTE      (1u << 22)
+#define TRANSFER_WRITEBACK (1u << 21)
+#define TRANSFER_LOAD      (1u << 20)
+
+typedef struct GROUP {
+    LANES registers[16];    // R15 is the address of each lane's next instruction
+    LANES n, z, c, v;       // all ones where the flag is set
+    BYTE status;            // I, F and the mode, the same for every lane
+    uint32_t running;       // a bit per lane
+} GROUP;
+
+
+/*
+ * Finishes a lane on the machine's engine, then puts the machine back as it was before the run
+ */
+static uint64_t runAlone(CPU *cpu, const SNAPSHOT *start, GROUP *group, int lane) {
+    for(int i = 0; i < 16; i++)
+        cpu->registers[i] = group->registers[i][lane];
+    setStatusRegister(cpu, (BYTE)((group->n[lane] & STATUS_N) | (group->z[lane] & STATUS_Z)
+                                  | (group->c[lane] & STATUS_C) | (group->v[lane] & STATUS_V) | group->status));
+
+    uint64_t executed = runEngine(cpu, cpu->engine, 0);
+
+    for(int i = 0; i < 16; i++)
+        group->registers[i][lane] = cpu->registers[i];
+    restoreSnapshot(cpu, start);
+    group->running &= ~(1u << lane);
+    return executed;
+}
+
+
+#if VECTOR_LANES
+
+// these are macros rather than inline functions, and the functions below hand vectors back through a pointer, because
+// GCC warns about the ABI of any function that takes or returns a 256 bit vector when the target has no AVX
+#define SELECT(mask, a, b)  (((a) & (mask)) | ((b) & ~(mask)))     // a where mask is all ones, otherwise b
+#define TOP_BIT(value)      ((LANES)((SIGNED_LANES)(value) >> 31))  // all ones where bit 31 is set
+#define SPLAT(value)        ((LANES){ 0 } + (value))                // value in every lane
+#define LANE_MASK(bits)     ((LANES)((SPLAT(bits) & (LANES)LANE_BITS) != 0)) // all ones in the lanes of a bit mask
+
+
+// a bit for each lane where mask is all ones
+static inline uint32_t maskBits(const LANES *mask) {
+    const LANES which = LANE_BITS;
+    LANES bits = *mask & which;
+    uint32_t result = 0;
+    for(int lane = 0; lane < LANE_COUNT; lane++)
+        result |= bits[lane];
+    return result;
+}
+
+// a bit for each lane where values is value
+static inline uint32_t equalBits(const LANES *values, uint32_t value) {
+    LANES equal = (LANES)(*values == value);
+    return maskBits(&equal);
+}
+
+static void conditionMask(const GROUP *group, int condition, LANES *mask) {
+    switch(condition) {
+        case CONDITION_EQUAL:               *mask = group->z; break;
+        case CONDITION_NOT_EQUAL:           *mask = ~group->z; break;
+        case CONDITION_CARRY_SET:           *mask = group->c; break;
+        case CONDITION_CARRY_CLEAR:         *mask = ~group->c; break;
+        case CONDITION_MINUS:               *mask = group->n; break;
+        case CONDITION_PLUS:                *mask = ~group->n; break;
+        case CONDITION_OVERFLOW_SET:        *mask = group->v; break;
+        case CONDITION_OVERFLOW_CLEAR:      *mask = ~group->v; break;
+        case CONDITION_HIGHER:              *mask = group->c & ~group->z; break;
+        case CONDITION_LOWER_OR_SAME:       *mask = ~group->c | group->z; break;
+        case CONDITION_GREATER_OR_EQUAL:    *mask = ~(group->n ^ group->v); break;
+        case CONDITION_LESS_THAN:           *mask = group->n ^ group->v; break;
+        case CONDITION_GREATER_THAN:        *mask = ~group->z & ~(group->n ^ group->v); break;
+        case CONDITION_LESS_OR_EQUAL:       *mask = group->z | (group->n ^ group->v); break;
+        case CONDITION_ALWAYS:              *mask = SPLAT(~0u); break;
+        default:                            *mask = SPLAT(0); break;
+    }
+}
+
+/*
+ * True if the lanes can run the instruction together
+ */
+static bool vectorInstruction(const DECODED *decoded) {
+    uint32_t word = decoded->instruction.data32;
+
+    switch(decoded->type) {
+        case ALU:
+            // R15 as Rn is the same for every lane, as Rm it has each lane's flags in it
+            return decoded->regDest != PROGRAM_COUNTER
+                   && (decoded->immediate || (decoded->regM != PROGRAM_COUNTER
+                                              && !(decoded->shiftByRegister && (decoded->regS == PROGRAM_COUNTER
+                                                                                || decoded->regN == PROGRAM_COUNTER))));
+        case BRANCH:
+            return true;
+        case DATA_TRANSFER:
+            return decoded->handler == doDataTransfer && (word & TRANSFER_LOAD) && decoded->regDest != PROGRAM_COUNTER
+                   && (decoded->immediate || decoded->regM != PROGRAM_COUNTER);
+        default:
+            return false;
+    }
+}
+
+static inline void readRegister(const GROUP *group, int number, REGISTER pc, LANES *value) {
+    *value = (number == PROGRAM_COUNTER)? SPLAT(pc + 8) : group->registers[number];
+}
+
+static uint32_t shiftLane(int shifter, uint32_t value, uint32_t amount, int *carry) {
+    switch(shifter) {
+        case SHIFTER_LSL:   return shiftLSL(value, amount, carry);
+        case SHIFTER_LSR:   return shiftLSR(value, amount, carry);
+        case SHIFTER_ASR:   return shiftASR(value, amount, carry);
+        case SHIFTER_ROR:   return shiftROR(value, amount, carry);
+        default:            return shiftRRX(value, carry);
+    }
+}
+
+/*
+ * Operand 2 for every lane into value, carry holds the C flags on entry and the shifter carry out on return. Shifts by
+ * an immediate from 1 to 31 are vector shifts; RRX, the #32 forms and shifts by register go through the barrel shifter
+ * kernels a lane at a time.
+ */
+static void operand2(const GROUP *group, const DECODED *decoded, REGISTER pc, LANES *carry, LANES *value) {
+    if(decoded->immediate) {
+        if(decoded->immediateCarry != SHIFTER_CARRY_UNCHANGED)
+            *carry = SPLAT(decoded->immediateCarry? ~0u : 0);
+        *value = SPLAT(decoded->operand2);
+        return;
+    }
+
+    LANES shifted = group->registers[decoded->regM];
+    uint32_t amount = decoded->shiftAmount;
+    if(decoded->shifter == SHIFTER_NONE) {
+        *value = shifted;
+        return;
+    }
+    if(!decoded->shiftByRegister && amount != 0) {
+        switch(decoded->shifter) {
+            case SHIFTER_LSL:
+                *carry = TOP_BIT(shifted << (amount - 1));
+                *value = shifted << amount;
+                return;
+            case SHIFTER_LSR:
+                *carry = TOP_BIT(shifted << (32 - amount));
+                *value = shifted >> amount;
+                return;
+            case SHIFTER_ASR:
+                *carry = TOP_BIT(shifted << (32 - amount));
+                *value = (LANES)((SIGNED_LANES)shifted >> amount);
+                return;
+            case SHIFTER_ROR:
+                *value = (shifted >> amount) | (shifted << (32 - amount));
+                *carry = TOP_BIT(*value);
+                return;
+        }
+    }
+
+    LANES amounts = SPLAT(32); // LSR #0 and ASR #0
+    if(decoded->shiftByRegister)
+        readRegister(group, decoded->regS, pc, &amounts);
+    for(int lane = 0; lane < LANE_COUNT; lane++) {
+        int laneCarry = (*carry)[lane] & 1;
+        uint32_t laneAmount = decoded->shiftByRegister? amounts[lane] & BITMASK_8_BIT : amounts[lane];
+        shifted[lane] = shiftLane(decoded->shifter, shifted[lane], laneAmount, &laneCarry);
+        (*carry)[lane] = laneCarry? ~0u : 0;
+    }
+    *value = shifted;
+}
+
+static void vectorAlu(GROUP *group, const DECODED *decoded, REGISTER pc, uint32_t lanes) {
+    LANES mask = LANE_MASK(lanes);
+    LANES carry = group->c, a, b;
+    operand2(group, decoded, pc, &carry, &b);
+    readRegister(group, decoded->regN, pc, &a);
+    LANES result, x = a, y = b, carryIn = SPLAT(0);
+    bool arithmetic = true;
+
+    switch(decoded->opCode) {
+        case OP_AND: case OP_TST:   result = a & b; arithmetic = false; break;
+        case OP_EOR: case OP_TEQ:   result = a ^ b; arithmetic = false; break;
+        case OP_ORR:                result = a | b; arithmetic = false; break;
+        case OP_MOV:                result = b; arithmetic = false; break;
+        case OP_BIC:                result = a & ~b; arithmetic = false; break;
+        case OP_MVN:                result = ~b; arithmetic = false; break;
+        case OP_SUB: case OP_CMP:   y = ~b; carryIn = SPLAT(1); break;
+        case OP_RSB:                x = b; y = ~a; carryIn = SPLAT(1); break;
+        case OP_ADC:                carryIn = group->c & 1; break;
+        case OP_SBC:                y = ~b; carryIn = group->c & 1; break;
+        case OP_RSC:                x = b; y = ~a; carryIn = group->c & 1; break;
+        default:                    break; // ADD, CMN
+    }
+    if(arithmetic)
+        result = x + y + carryIn;
+
+    bool test = decoded->opCode >= OP_TST && decoded->opCode <= OP_CMN;
+    if(!test)
+        group->registers[decoded->regDest] = SELECT(mask, result, group->registers[decoded->regDest]);
+    if(decoded->updateStatus || test) { // the tests set the flags with or without the S bit, as doTST and the rest do
+        group->n = SELECT(mask, TOP_BIT(result), group->n);
+        group->z = SELECT(mask, (LANES)(result == 0), group->z);
+        if(arithmetic) {
+            group->c = SELECT(mask, TOP_BIT((x & y) | ((x | y) & ~result)), group->c);
+            group->v = SELECT(mask, TOP_BIT((x ^ result) & (y ^ result)), group->v);
+        } else {
+            group->c = SELECT(mask, carry, group->c);
+        }
+    }
+}
+
+static void vectorBranch(GROUP *group, const DECODED *decoded, REGISTER pc, uint32_t lanes) {
+    LANES mask = LANE_MASK(lanes);
+    if(decoded->link) {
+        // R14 is R15 with the PSR (modes.c), which has each lane's flags in it
+        LANES link = SPLAT(((pc + 4) & PC_MASK) | (REGISTER)(group->status & 0x0c) << 24 | (group->status & MODE_MASK))
+                     | (group->n & (1u << 31)) | (group->z & (1u << 30)) | (group->c & (1u << 29))
+                     | (group->v & (1u << 28));
+        group->registers[LINK_REGISTER] = SELECT(mask, link, group->registers[LINK_REGISTER]);
+    }
+    group->registers[PROGRAM_COUNTER] = SELECT(mask, SPLAT((pc + 4 + decoded->operand2) & PC_MASK),
+                                               group->registers[PROGRAM_COUNTER]);
+}
+
+// LDR and LDRB, as doDataTransfer() does them
+static void vectorLoad(CPU *cpu, GROUP *group, const DECODED *decoded, REGISTER pc, uint32_t lanes) {
+    uint32_t word = decoded->instruction.data32;
+    LANES carry = group->c, offset, base; // only RRX reads carry
+    operand2(group, decoded, pc, &carry, &offset);
+    readRegister(group, decoded->regN, pc, &base);
+    LANES indexed = (word & TRANSFER_UP)? base + offset : base - offset;
+    LANES address = (word & TRANSFER_PRE)? indexed : base;
+
+    if((!(word & TRANSFER_PRE) || (word & TRANSFER_WRITEBACK)) && decoded->regN != PROGRAM_COUNTER)
+        group->registers[decoded->regN] = SELECT(LANE_MASK(lanes), indexed, group->registers[decoded->regN]);
+
+    for(; lanes != 0; lanes &= lanes - 1) {
+        int lane = __builtin_ctz(lanes);
+        uint32_t value;
+        if(word & TRANSFER_BYTE) {
+            value = readMemoryByte(cpu, address[lane]);
+        } else {
+            int rotate = (address[lane] & 3) * 8;
+            value = readMemoryWord(cpu, address[lane]);
+            value = (value >> rotate) | (value << ((32 - rotate) & 31));
+        }
+        group->registers[decoded->regDest][lane] = value;
+    }
+}
+
+/*
+ * Runs the group until every lane has halted, returns the instructions executed (each lane's counted)
+ */
+static uint64_t runGroup(CPU *cpu, const SNAPSHOT *start, GROUP *group) {
+    uint64_t executed = 0;
+
+    while(group->running != 0) {
+        // nearly always the lanes are all at the same place
+        REGISTER pc = group->registers[PROGRAM_COUNTER][__builtin_ctz(group->running)];
+        uint32_t here = group->running & equalBits(&group->registers[PROGRAM_COUNTER], pc);
+        if(here != group->running) {
+            for(uint32_t lanes = group->running & ~here; lanes != 0; lanes &= lanes - 1) {
+                REGISTER lanePc = group->registers[PROGRAM_COUNTER][__builtin_ctz(lanes)];
+                pc = (lanePc < pc)? lanePc : pc;
+            }
+            here = group->running & equalBits(&group->registers[PROGRAM_COUNTER], pc);
+        }
+
+        const DECODED *decoded = lookupDecoded(cpu, pc);
+        uint32_t passing = here;
+        if(decoded->condition != CONDITION_ALWAYS) {
+            LANES condition;
+            conditionMask(group, decoded->condition, &condition);
+            passing &= maskBits(&condition);
+        }
+
+        if(passing != 0 && !vectorInstruction(decoded)) {
+            for(uint32_t lanes = passing; lanes != 0; lanes &= lanes - 1)
+                executed += runAlone(cpu, start, group, __builtin_ctz(lanes));
+            here &= ~passing;
+            passing = 0;
+        }
+
+        executed += (uint64_t)__builtin_popcount(here);
+        LANES mask = LANE_MASK(here);
+        group->registers[PROGRAM_COUNTER] = SELECT(mask, SPLAT(pc + 4), group->registers[PROGRAM_COUNTER]);
+        if(passing != 0) {
+            if(decoded->type == ALU)
+                vectorAlu(group, decoded, pc, passing);
+            else if(decoded->type == BRANCH)
+                vectorBranch(group, decoded, pc, passing);
+            else
+                vectorLoad(cpu, group, decoded, pc, passing);
+        }
+
+        group->running &= ~(here & equalBits(&group->registers[PROGRAM_COUNTER], cpu->programEnd));
+    }
+    return executed;
+}
+
+#else
+
+static uint64_t runGroup(CPU *cpu, const SNAPSHOT *start, GROUP *group) {
+    uint64_t executed = 0;
+    for(uint32_t lanes = group->running; lanes != 0; lanes &= lanes - 1)
+        executed += runAlone(cpu, start, group, __builtin_ctz(lanes));
+    return executed;
+}
+
+#endif
+
+
+/*
+ * Runs the loaded program once for each of count inputs, of width words each, and writes the same registers after each
+ * run to outputs. The machine is left as it was. Returns the instructions executed over all the runs.
+ */
+uint64_t runLanes(CPU *cpu, const uint32_t *inputs, uint32_t *outputs, uint64_t count, int width) {
+    if(width < 1 || width > 15) {
+        printf("Lane inputs must be 1 to 15 registers, not %d\n", width);
+        return 0;
+    }
+    SNAPSHOT *start = takeSnapshot(cpu);
+    if(start == NULL) {
+        printf("Out of memory taking a snapshot for the lanes\n");
+        return 0;
+    }
+
+    uint64_t executed = 0;
+    for(uint64_t first = 0; first < count; first += LANE_COUNT) {
+        uint32_t lanes = (count - first < LANE_COUNT)? (uint32_t)(count - first) : LANE_COUNT;
+        BYTE status = getStatusRegister(cpu);
+        GROUP group;
+
+        for(int lane = 0; lane < LANE_COUNT; lane++) {
+            for(int i = 0; i < 16; i++)
+                group.registers[i][lane] = (i < width && (uint32_t)lane < lanes)? inputs[(first + lane) * width + i]
+                                                                                 : cpu->registers[i];
+            group.n[lane] = (status & STATUS_N)? ~0u : 0;
+            group.z[lane] = (status & STATUS_Z)? ~0u : 0;
+            group.c[lane] = (status & STATUS_C)? ~0u : 0;
+            group.v[lane] = (status & STATUS_V)? ~0u : 0;
+        }
+        group.status = status & (STATUS_I | STATUS_F | MODE_MASK);
+        group.running = (cpu->registers[PROGRAM_COUNTER] == cpu->programEnd)? 0 : ALL_LANES >> (LANE_COUNT - lanes);
+
+        executed += runGroup(cpu, start, &group);
+
+        for(uint32_t lane = 0; lane < lanes; lane++) {
+            for(int i = 0; i < width; i++)
+                outputs[(first + lane) * width + i] = group.registers[i][lane];
+        }
+    }
+
+    restoreSnapshot(cpu, start);
+    freeSnapshot(start);
+    flushOutput(cpu);
+    return executed;
+}
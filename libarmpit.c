@@ -0,0 +1,221 @@
+/*
+ * The library interface (see libarmpit.h). These are thin wrappers over the CPU functions the rest of the emulator
+ * uses, which check what they are given since the caller is someone else's program.
+ */
+
+#include <stdlib.h>
+
+#include "libarmpit.h"
+#include "flags.h"
+#include "memory.h"
+#include "profile.h"
+#include "trace.h"
+
+
+/*
+ * A new machine has all registers and the status register clear, apart from SP which points at the top of memory (a
+ * full descending stack, so the first push goes just below). The halt address is 0 until a program is loaded.
+ */
+ARMPIT *armpitCreate(uint32_t memorySize) {
+    CPU *cpu = createCpu(memorySize);
+    if(cpu == NULL)
+        return NULL;
+
+    cpu->registers[STACK_POINTER] = cpu->memorySize;
+    return cpu;
+}
+
+void armpitDestroy(ARMPIT *cpu) {
+    destroyCpu(cpu);
+}
+
+bool armpitSetEngine(ARMPIT *cpu, ARMPIT_ENGINE engine) {
+    if((engine == ARMPIT_ENGINE_JIT && !jitAvailable(cpu)) || (engine == ARMPIT_ENGINE_AOT && cpu->aot == NULL)) {
+        cpu->engine = ARMPIT_ENGINE_THREADED;
+        return false;
+    }
+    cpu->engine = engine;
+    return true;
+}
+
+void armpitSetLogging(bool verbose, bool trace) {
+    VERBOSE = verbose;
+    TRACE = trace;
+}
+
+static bool inMemory(ARMPIT *cpu, uint32_t address, uint32_t size) {
+    return address <= cpu->memorySize && size <= cpu->memorySize - address;
+}
+
+/*
+ * Copies size bytes into guest memory at address. Any decoded or translated instructions in the range are thrown away.
+ */
+bool armpitMapMemory(ARMPIT *cpu, uint32_t address, const void *data, uint32_t size) {
+    if(!inMemory(cpu, address, size))
+        return false;
+    if(size == 0)
+        return true;
+
+    memcpy(cpu->memoryBase + address, data, size);
+    invalidateMemory(cpu, address, size);
+    return true;
+}
+
+bool armpitReadMemory(ARMPIT *cpu, uint32_t address, void *data, uint32_t size) {
+    if(!inMemory(cpu, address, size))
+        return false;
+    memcpy(data, cpu->memoryBase + address, size);
+    return true;
+}
+
+/*
+ * Loads a program and sets the PC to its start and the halt address to its end
+ */
+bool armpitLoadImage(ARMPIT *cpu, const char *fileName, uint32_t loadAddress) {
+    return loadImage(cpu, fileName, loadAddress);
+}
+
+void armpitSetHaltAddress(ARMPIT *cpu, uint32_t address) {
+    cpu->programEnd = address;
+}
+
+bool armpitLoadAot(ARMPIT *cpu, const char *fileName) {
+    return loadAot(cpu, fileName);
+}
+
+bool armpitAttachDevice(ARMPIT *cpu, uint32_t address, uint32_t size, ARMPIT_DEVICE_READ read,
+                        ARMPIT_DEVICE_WRITE write, void *context) {
+    return attachDevice(cpu, address, size, read, write, context, false);
+}
+
+bool armpitAttachUart(ARMPIT *cpu, uint32_t address) {
+    return attachUart(cpu, address);
+}
+
+bool armpitAttachTimer(ARMPIT *cpu, uint32_t address) {
+    return attachTimer(cpu, address);
+}
+
+void armpitScheduleEvent(ARMPIT *cpu, uint64_t delay, ARMPIT_EVENT callback, void *context) {
+    scheduleEvent(cpu, delay, callback, context);
+}
+
+void armpitCancelEvents(ARMPIT *cpu, ARMPIT_EVENT callback, void *context) {
+    cancelEvents(cpu, callback, context);
+}
+
+void armpitSetInterrupt(ARMPIT *cpu, bool fast, int source, bool raised) {
+    if(source >= 0 && source < 16)
+        setInterrupt(cpu, fast, 1u << source, raised);
+}
+
+uint64_t armpitRunLanes(ARMPIT *cpu, const uint32_t *inputs, uint32_t *outputs, uint64_t count, int registers) {
+    return runLanes(cpu, inputs, outputs, count, registers);
+}
+
+uint64_t armpitCycles(ARMPIT *cpu) {
+    return cpu->cycles;
+}
+
+static ARMPIT_RESULT stopResult(ARMPIT *cpu, uint64_t executed) {
+    ARMPIT_RESULT result;
+    result.executed = executed;
+    result.pc = cpu->registers[PROGRAM_COUNTER];
+    result.stop = (result.pc == cpu->programEnd)? ARMPIT_STOP_HALTED : ARMPIT_STOP_LIMIT;
+    return result;
+}
+
+ARMPIT_RESULT armpitRun(ARMPIT *cpu, uint64_t maxInstructions) {
+    uint64_t executed = runEngine(cpu, cpu->engine, maxInstructions);
+    flushOutput(cpu);
+    return stopResult(cpu, executed);
+}
+
+ARMPIT_RESULT armpitStep(ARMPIT *cpu) {
+    uint64_t executed = runEngine(cpu, ARMPIT_ENGINE_REFERENCE, 1); // so events and interrupts happen as they would
+    flushOutput(cpu);
+    return stopResult(cpu, executed);
+}
+
+uint32_t armpitExitCode(ARMPIT *cpu) {
+    return cpu->exitCode;
+}
+
+ARMPIT_SNAPSHOT *armpitSnapshot(ARMPIT *cpu) {
+    return takeSnapshot(cpu);
+}
+
+bool armpitReset(ARMPIT *cpu, const ARMPIT_SNAPSHOT *snapshot) {
+    return restoreSnapshot(cpu, snapshot);
+}
+
+void armpitFreeSnapshot(ARMPIT_SNAPSHOT *snapshot) {
+    freeSnapshot(snapshot);
+}
+
+bool armpitSaveCheckpoint(ARMPIT *cpu, const char *fileName) {
+    return saveCheckpoint(cpu, fileName);
+}
+
+ARMPIT *armpitRestoreCheckpoint(const char *fileName) {
+    return restoreCheckpoint(fileName);
+}
+
+/*
+ * Records decoded with the old setting have it built in, so changing it throws them away
+ */
+void armpitSetFusion(ARMPIT *cpu, bool enabled) {
+    if(cpu->noFusion == enabled) {
+        cpu->noFusion = !enabled;
+        flushDecodeCache(cpu);
+    }
+}
+
+uint64_t armpitFusionHits(ARMPIT *cpu, ARMPIT_FUSION fusion) {
+    return ((unsigned)fusion < ARMPIT_FUSION_COUNT)? cpu->fusionHits[fusion] : 0;
+}
+
+bool armpitStartProfile(ARMPIT *cpu) {
+    return startProfile(cpu);
+}
+
+void armpitReportProfile(ARMPIT *cpu, const char *foldedFile) {
+    reportProfile(cpu, foldedFile);
+}
+
+bool armpitStartTrace(ARMPIT *cpu, const char *fileName) {
+    return startTrace(cpu, fileName);
+}
+
+bool armpitTraceRange(ARMPIT *cpu, uint32_t start, uint32_t end) {
+    return start < end && addTraceRange(cpu, start, end);
+}
+
+void armpitStopTrace(ARMPIT *cpu) {
+    stopTrace(cpu);
+}
+
+uint32_t armpitGetRegister(ARMPIT *cpu, int number) {
+    return cpu->registers[number & 15];
+}
+
+void armpitSetRegister(ARMPIT *cpu, int number, uint32_t value) {
+    cpu->registers[number & 15] = value;
+}
+
+uint8_t armpitGetStatus(ARMPIT *cpu) {
+    return getStatusRegister(cpu);
+}
+
+void armpitSetStatus(ARMPIT *cpu, uint8_t status) {
+    switchMode(cpu, status);
+    setStatusRegister(cpu, status);
+}
+
+uint32_t armpitGetModeRegister(ARMPIT *cpu, int mode, int number) {
+    return *modeRegister(cpu, (BYTE)mode, number & 15);
+}
+
+void armpitSetModeRegister(ARMPIT *cpu, int mode, int number, uint32_t value) {
+    *modeRegister(cpu, (BYTE)mode, number & 15) = value;
+}
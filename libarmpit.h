@@ -0,0 +1,157 @@
+#ifndef __LIBARMPIT_H__
+#define __LIBARMPIT_H__
+
+/*
+ * libarmpit - the emulator as a library
+ *
+ * Link with libarmpit.a or libarmpit.so to run ARMv2 programs inside another program. Each ARMPIT is a complete
+ * machine (registers, status register and memory); any number can be created, and different machines can be run on
+ * different threads at the same time. A machine must only be used by one thread at a time.
+ *
+ *      ARMPIT *armpit = armpitCreate(1 << 20);
+ *      armpitLoadImage(armpit, "program.s", 0x8000);
+ *      ARMPIT_RESULT result = armpitRun(armpit, 0);
+ *      printf("R0 = %08X after %llu instructions\n", armpitGetRegister(armpit, 0), (unsigned long long)result.executed);
+ *      armpitDestroy(armpit);
+ *
+ * A program halts when the PC reaches its halt address, which loading an image sets to the end of the program.
+ * Nothing is printed while a program runs unless tracing is turned on with armpitSetLogging().
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(ARMPIT_BUILDING_LIBRARY) && defined(__GNUC__)
+#define ARMPIT_API __attribute__((visibility("default")))
+#else
+#define ARMPIT_API
+#endif
+
+typedef struct CPU ARMPIT;
+typedef struct SNAPSHOT ARMPIT_SNAPSHOT;
+
+typedef enum ARMPIT_ENGINE {
+    ARMPIT_ENGINE_REFERENCE = 0,    // decode and execute one instruction at a time (the default)
+    ARMPIT_ENGINE_THREADED,         // threaded interpreter
+    ARMPIT_ENGINE_JIT,              // translates to x86-64, the threaded interpreter on other hosts
+    ARMPIT_ENGINE_AOT               // code armpit-aot translated ahead of time, see armpitLoadAot()
+} ARMPIT_ENGINE;
+
+typedef enum ARMPIT_STOP {
+    ARMPIT_STOP_HALTED = 0,         // the PC reached the halt address
+    ARMPIT_STOP_LIMIT               // the instruction limit was reached first
+} ARMPIT_STOP;
+
+typedef struct ARMPIT_RESULT {
+    uint64_t executed;              // instructions executed (including those whose condition failed)
+    ARMPIT_STOP stop;
+    uint32_t pc;                    // where the program stopped
+} ARMPIT_RESULT;
+
+// instruction pairs and runs the threaded interpreter executes as one (superinstructions)
+typedef enum ARMPIT_FUSION {
+    ARMPIT_FUSION_COMPARE_BRANCH = 0, // CMP, CMN, TST or TEQ then a conditional branch
+    ARMPIT_FUSION_COUNT_LOOP,         // SUBS Rn, Rn, #n then BNE
+    ARMPIT_FUSION_MOVE_ADD,           // MOV then ADD, as in setting up an address
+    ARMPIT_FUSION_CONDITION_RUN,      // 2 to 8 data processing instructions with the same condition and no S bit
+    ARMPIT_FUSION_COUNT
+} ARMPIT_FUSION;
+
+// a device's registers, offset is from the start of the device and size is 1 (LDRB, STRB) or 4 (word aligned)
+typedef uint32_t (*ARMPIT_DEVICE_READ)(void *context, uint32_t offset, int size);
+typedef void (*ARMPIT_DEVICE_WRITE)(void *context, uint32_t offset, uint32_t value, int size);
+
+// called when a scheduled event is due, between instructions
+typedef void (*ARMPIT_EVENT)(ARMPIT *, void *context);
+
+#define ARMPIT_SP 13
+#define ARMPIT_LR 14
+#define ARMPIT_PC 15
+
+// Machines
+ARMPIT_API ARMPIT *armpitCreate(uint32_t memorySize); // a power of 2 from 4K to 64M, NULL if it can't be reserved
+ARMPIT_API void armpitDestroy(ARMPIT *);
+ARMPIT_API bool armpitSetEngine(ARMPIT *, ARMPIT_ENGINE); // false (and the threaded interpreter) if the JIT isn't
+                                                          // supported, or for AOT if nothing has been loaded
+ARMPIT_API void armpitSetLogging(bool verbose, bool trace); // for every machine, trace prints each instruction
+
+// Memory and programs
+ARMPIT_API bool armpitMapMemory(ARMPIT *, uint32_t address, const void *data, uint32_t size);
+ARMPIT_API bool armpitReadMemory(ARMPIT *, uint32_t address, void *data, uint32_t size);
+ARMPIT_API bool armpitLoadImage(ARMPIT *, const char *fileName, uint32_t loadAddress); // .s/.asm, ELF or flat binary
+ARMPIT_API void armpitSetHaltAddress(ARMPIT *, uint32_t);
+// Native code armpit-aot made from the image now in memory, for ARMPIT_ENGINE_AOT. False (and nothing loaded) if the
+// shared object can't be loaded or was made from a different image.
+ARMPIT_API bool armpitLoadAot(ARMPIT *, const char *fileName);
+
+// Devices, memory mapped over whole pages of memory. Loads and stores there call the device instead of using RAM.
+// Either function can be NULL (reads give 0, writes are ignored). A context stays the caller's to free.
+ARMPIT_API bool armpitAttachDevice(ARMPIT *, uint32_t address, uint32_t size, ARMPIT_DEVICE_READ, ARMPIT_DEVICE_WRITE,
+                                   void *context); // false if not whole pages inside memory or it overlaps another
+ARMPIT_API bool armpitAttachUart(ARMPIT *, uint32_t address); // standard input and output, one page (see devices.c)
+ARMPIT_API bool armpitAttachTimer(ARMPIT *, uint32_t address); // a microsecond counter and IRQ timer, one page
+
+// Events and interrupts. Time is counted in cycles, one per instruction executed. An event runs once, delay cycles
+// from now. An interrupt is taken between instructions while any of its sources (0 to 15) is raised and it isn't
+// disabled in the status register.
+ARMPIT_API void armpitScheduleEvent(ARMPIT *, uint64_t delay, ARMPIT_EVENT, void *context);
+ARMPIT_API void armpitCancelEvents(ARMPIT *, ARMPIT_EVENT, void *context); // every pending one with this context
+ARMPIT_API void armpitSetInterrupt(ARMPIT *, bool fast, int source, bool raised); // FIQ if fast, IRQ if not
+ARMPIT_API uint64_t armpitCycles(ARMPIT *);
+
+// Running
+ARMPIT_API ARMPIT_RESULT armpitRun(ARMPIT *, uint64_t maxInstructions); // 0 runs until halt
+ARMPIT_API ARMPIT_RESULT armpitStep(ARMPIT *);
+ARMPIT_API uint32_t armpitExitCode(ARMPIT *); // what the program gave OS_Exit, 0 if it didn't
+
+// Runs the program from the machine's current state once per input, several inputs at a time on vector registers
+// (see lanes.c). Input i is registers words from inputs + i * registers, which go in R0 upwards; the same registers
+// when the run halts go to outputs + i * registers. The machine is left as it was. Returns the instructions executed.
+ARMPIT_API uint64_t armpitRunLanes(ARMPIT *, const uint32_t *inputs, uint32_t *outputs, uint64_t count, int registers);
+
+// Fusion, on by default. The threaded interpreter runs common instruction pairs and runs as one, apart from where that
+// would hide an instruction boundary (the step limit or halt address falling inside, or profiling). Stepping, the
+// reference loop and the JIT always go one instruction at a time.
+ARMPIT_API void armpitSetFusion(ARMPIT *, bool);
+ARMPIT_API uint64_t armpitFusionHits(ARMPIT *, ARMPIT_FUSION); // times the pattern has run fused
+
+// Snapshots, for running a program again and again from the same state. A reset only costs as much as the pages the
+// machine has written since the snapshot was taken or last reset to.
+ARMPIT_API ARMPIT_SNAPSHOT *armpitSnapshot(ARMPIT *); // registers, status register, halt address, exit code and memory
+ARMPIT_API bool armpitReset(ARMPIT *, const ARMPIT_SNAPSHOT *); // false if taken with a different memory size
+ARMPIT_API void armpitFreeSnapshot(ARMPIT_SNAPSHOT *);
+
+// Checkpoints, a machine saved to a file. Restoring maps the saved memory from the file rather than reading it.
+ARMPIT_API bool armpitSaveCheckpoint(ARMPIT *, const char *fileName);
+ARMPIT_API ARMPIT *armpitRestoreCheckpoint(const char *fileName); // a new machine, NULL if the file can't be restored
+
+// Profiling, only available when the library is built with ARMPIT_PROFILER. A profiled machine counts every
+// instruction it runs by address, type and opcode and estimates ARM2 cycles; the JIT engine runs interpreted instead.
+ARMPIT_API bool armpitStartProfile(ARMPIT *); // false if the profiler isn't built in
+ARMPIT_API void armpitReportProfile(ARMPIT *, const char *foldedFile); // prints the report, NULL for no folded stacks
+
+// Tracing, a compressed binary record of each instruction executed, written to a file by a background thread and
+// read with armpit-trace. A traced machine runs the reference loop whatever its engine.
+ARMPIT_API bool armpitStartTrace(ARMPIT *, const char *fileName);
+ARMPIT_API bool armpitTraceRange(ARMPIT *, uint32_t start, uint32_t end); // only trace these addresses (up to 16 ranges)
+ARMPIT_API void armpitStopTrace(ARMPIT *); // finishes writing the file, armpitDestroy() does this too
+
+// Registers
+ARMPIT_API uint32_t armpitGetRegister(ARMPIT *, int);
+ARMPIT_API void armpitSetRegister(ARMPIT *, int, uint32_t);
+ARMPIT_API uint8_t armpitGetStatus(ARMPIT *); // N Z C V I F M1 M0 from bit 7 down
+ARMPIT_API void armpitSetStatus(ARMPIT *, uint8_t); // changing the mode swaps in its registers
+// a register as the mode (0 user, 1 FIQ, 2 IRQ, 3 supervisor) sees it, whether or not it is the current one
+ARMPIT_API uint32_t armpitGetModeRegister(ARMPIT *, int mode, int number);
+ARMPIT_API void armpitSetModeRegister(ARMPIT *, int mode, int number, uint32_t value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
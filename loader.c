@@ -0,0 +1,208 @@
+/*
+ * Program image loader for the -f option.
+ *
+ * Three kinds of image are understood:
+ *      ARM assembly source, any file ending .s or .asm, which is assembled to the load address (assembler.c).
+ *      32 bit little endian ARM ELF executables, whose PT_LOAD segments go to their own addresses and which start at
+ *      their entry point.
+ *      Anything else is taken to be a flat binary, loaded at the load address and started from its first word.
+ *
+ * The file is mapped rather than read. Wherever a segment's guest address and file offset are both aligned to the host
+ * page size its whole pages are mapped privately straight over the guest memory (copy on write, so the guest can still
+ * store to them and the file is never changed). Only a partial page at the end, or a segment that isn't aligned, is
+ * copied. Nothing is read from disk until the guest touches it, so a large image starts as quickly as a small one.
+ */
+
+#define _DEFAULT_SOURCE // for MAP_FIXED and sysconf when compiling with -std=c11
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <strings.h>    // for strcasecmp
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "memory.h"
+
+
+/*
+ * The parts of the ELF headers that are needed, as laid out in a 32 bit ELF file
+ */
+#define ELF_IDENT_SIZE  16
+#define ELF_CLASS_32    1       // e_ident[4]
+#define ELF_DATA_LSB    1       // e_ident[5], little endian
+#define ELF_TYPE_EXEC   2
+#define ELF_MACHINE_ARM 40
+#define ELF_PT_LOAD     1
+#define ELF_PF_X        1       // segment is executable
+
+typedef struct ELF_HEADER {
+    BYTE ident[ELF_IDENT_SIZE];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    uint32_t entry;
+    uint32_t programHeaderOffset;
+    uint32_t sectionHeaderOffset;
+    uint32_t flags;
+    uint16_t headerSize;
+    uint16_t programHeaderSize;
+    uint16_t programHeaderCount;
+    uint16_t sectionHeaderSize;
+    uint16_t sectionHeaderCount;
+    uint16_t sectionNameIndex;
+} ELF_HEADER;
+
+typedef struct ELF_PROGRAM_HEADER {
+    uint32_t type;
+    uint32_t offset;
+    uint32_t virtualAddress;
+    uint32_t physicalAddress;
+    uint32_t fileSize;
+    uint32_t memorySize;
+    uint32_t flags;
+    uint32_t align;
+} ELF_PROGRAM_HEADER;
+
+
+/*
+ * Puts fileSize bytes of the image at offset into guest memory at address and zeroes the rest of the segment, up to
+ * segmentSize, since the machine may have had something else loaded before. Anything already decoded or translated
+ * there is thrown away.
+ */
+static bool placeSegment(CPU *cpu, int fd, const BYTE *image, size_t imageSize, uint32_t offset, REGISTER address,
+                         uint32_t fileSize, uint32_t segmentSize) {
+    if(offset > imageSize || fileSize > imageSize - offset || fileSize > segmentSize) {
+        printf("Segment at %08X runs past the end of the file\n", address);
+        return false;
+    }
+    if(address > cpu->memorySize || segmentSize > cpu->memorySize - address) {
+        printf("Segment at %08X (%u bytes) doesn't fit in %u bytes of memory\n", address, segmentSize, cpu->memorySize);
+        return false;
+    }
+    for(REGISTER page = address >> GUEST_PAGE_SHIFT; segmentSize > 0 && page <= (address + segmentSize - 1) >> GUEST_PAGE_SHIFT; page++) {
+        if(cpu->pages[page].flags & PAGE_MMIO) {
+            printf("Segment at %08X (%u bytes) overlaps a device\n", address, segmentSize);
+            return false;
+        }
+    }
+
+    uint32_t hostPageSize = (uint32_t)sysconf(_SC_PAGESIZE);
+    uint32_t mapped = 0;
+
+    if(address % hostPageSize == 0 && offset % hostPageSize == 0) {
+        mapped = fileSize - (fileSize % hostPageSize);
+        if(mapped > 0 && mmap(cpu->memoryBase + address, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+                              offset) == MAP_FAILED) {
+            mapped = 0; // copy it instead
+        }
+    }
+    if(fileSize > mapped)
+        memcpy(cpu->memoryBase + address + mapped, image + offset + mapped, fileSize - mapped);
+    memset(cpu->memoryBase + address + fileSize, 0, segmentSize - fileSize);
+
+    if(VERBOSE)
+        printf("\tLoaded %u bytes at %08X (%u mapped, %u copied)\n", fileSize, address, mapped, fileSize - mapped);
+
+    invalidateMemory(cpu, address, segmentSize);
+    return true;
+}
+
+static bool hasExtension(const char *fileName, const char *extension) {
+    size_t length = strlen(fileName), extensionLength = strlen(extension);
+    return length > extensionLength && strcasecmp(fileName + length - extensionLength, extension) == 0;
+}
+
+static bool isElf(const BYTE *image, size_t imageSize) {
+    return imageSize >= sizeof(ELF_HEADER) && memcmp(image, "\177ELF", 4) == 0;
+}
+
+/*
+ * Loads the PT_LOAD segments of an ELF executable. The program runs from the entry point and halts at the end of the
+ * last executable segment.
+ */
+static bool loadElf(CPU *cpu, int fd, const BYTE *image, size_t imageSize) {
+    ELF_HEADER header;
+    memcpy(&header, image, sizeof(header));
+
+    if(header.ident[4] != ELF_CLASS_32 || header.ident[5] != ELF_DATA_LSB || header.machine != ELF_MACHINE_ARM
+            || header.type != ELF_TYPE_EXEC) {
+        printf("Only 32 bit little endian ARM ELF executables are supported\n");
+        return false;
+    }
+    if(header.programHeaderSize < sizeof(ELF_PROGRAM_HEADER) || header.programHeaderOffset > imageSize
+            || (size_t)header.programHeaderCount * header.programHeaderSize > imageSize - header.programHeaderOffset) {
+        printf("ELF program headers are missing or truncated\n");
+        return false;
+    }
+
+    REGISTER end = header.entry;
+    for(int i = 0; i < header.programHeaderCount; i++) {
+        ELF_PROGRAM_HEADER segment;
+        memcpy(&segment, image + header.programHeaderOffset + (size_t)i * header.programHeaderSize, sizeof(segment));
+
+        if(segment.type != ELF_PT_LOAD || segment.memorySize == 0)
+            continue;
+        if(!placeSegment(cpu, fd, image, imageSize, segment.offset, segment.virtualAddress, segment.fileSize, segment.memorySize))
+            return false;
+        if((segment.flags & ELF_PF_X) && segment.virtualAddress + segment.fileSize > end)
+            end = (segment.virtualAddress + segment.fileSize) & ~3u;
+    }
+
+    cpu->registers[PROGRAM_COUNTER] = header.entry;
+    cpu->programEnd = end;
+    return true;
+}
+
+/*
+ * Loads a program image, sets the PC to its first instruction and programEnd to where it halts
+ */
+bool loadImage(CPU *cpu, const char *fileName, REGISTER loadAddress) {
+    int fd = open(fileName, O_RDONLY);
+    if(fd < 0) {
+        printf("Error opening %s\n", fileName);
+        return false;
+    }
+
+    struct stat status;
+    if(fstat(fd, &status) != 0 || status.st_size > ADDRESS_SPACE_SIZE) {
+        printf("%s is too big to load\n", fileName);
+        close(fd);
+        return false;
+    }
+
+    size_t imageSize = (size_t)status.st_size;
+    const BYTE *image = NULL;
+    if(imageSize > 0) {
+        image = mmap(NULL, imageSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(image == MAP_FAILED) {
+            printf("Error mapping %s\n", fileName);
+            close(fd);
+            return false;
+        }
+    }
+
+    bool loaded;
+    if(hasExtension(fileName, ".s") || hasExtension(fileName, ".asm")) {
+        loaded = assemble(cpu, fileName, image? (const char *)image : "", imageSize, loadAddress);
+    } else if(isElf(image, imageSize)) {
+        loaded = loadElf(cpu, fd, image, imageSize);
+    } else {
+        loaded = placeSegment(cpu, fd, image, imageSize, 0, loadAddress, (uint32_t)imageSize, (uint32_t)imageSize);
+        cpu->registers[PROGRAM_COUNTER] = loadAddress;
+        cpu->programEnd = loadAddress + ((uint32_t)imageSize & ~3u);
+    }
+
+    if(loaded) {
+        snprintf(cpu->imageName, sizeof(cpu->imageName), "%s", fileName);
+        cpu->loadAddress = loadAddress;
+        cpu->entryPoint = cpu->registers[PROGRAM_COUNTER];
+    }
+
+    // the mappings placed in guest memory stay valid once the file is closed
+    if(image != NULL)
+        munmap((void *)image, imageSize);
+    close(fd);
+    return loaded;
+}
@@ -0,0 +1,128 @@
+/*
+ * Guest memory (see memory.h)
+ */
+
+#define _DEFAULT_SOURCE // for MAP_ANONYMOUS when compiling with -std=c11
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "memory.h"
+
+
+/*
+ * Reserves the guest memory. Nothing is allocated by the host until a page is first touched.
+ */
+bool initMemory(CPU *cpu, uint32_t size) {
+    if(size < GUEST_PAGE_SIZE || size > ADDRESS_SPACE_SIZE || (size & (size - 1)) != 0)
+        return false;
+
+    int mapFlags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    mapFlags |= MAP_NORESERVE;
+#endif
+    void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, mapFlags, -1, 0);
+    if(mapping == MAP_FAILED)
+        return false;
+
+    cpu->pages = calloc(size >> GUEST_PAGE_SHIFT, sizeof(PAGE));
+    cpu->dirtyPages = malloc((size >> GUEST_PAGE_SHIFT) * sizeof(uint32_t));
+    if(cpu->pages == NULL || cpu->dirtyPages == NULL) {
+        free(cpu->pages);
+        free(cpu->dirtyPages);
+        cpu->pages = NULL;
+        cpu->dirtyPages = NULL;
+        munmap(mapping, size);
+        return false;
+    }
+    cpu->dirtyCount = 0;
+
+    cpu->memoryBase = mapping;
+    cpu->memorySize = size;
+    cpu->memoryMask = size - 1;
+    return true;
+}
+
+/*
+ * Releases the guest memory and the per page decode caches and JIT block tables
+ */
+void freeMemory(CPU *cpu) {
+    if(cpu->pages != NULL) {
+        for(uint32_t i = 0; i < (cpu->memorySize >> GUEST_PAGE_SHIFT); i++) {
+            free(cpu->pages[i].decoded);
+            free(cpu->pages[i].jitBlocks);
+        }
+        free(cpu->pages);
+        cpu->pages = NULL;
+    }
+    free(cpu->dirtyPages);
+    cpu->dirtyPages = NULL;
+    if(cpu->memoryBase != NULL) {
+        munmap(cpu->memoryBase, cpu->memorySize);
+        cpu->memoryBase = NULL;
+    }
+}
+
+/*
+ * All stores go through here (or writeMemory for words) so that stale decoded or translated copies of the instructions
+ * in a page are never executed. Stores to pages which have never been executed only pay for the flag tests.
+ */
+void writeMemory(CPU *cpu, REGISTER address, INSTRUCTION i) {
+    PAGE *page = pageOf(cpu, address);
+
+    if(page->flags & PAGE_MMIO) {
+        busWrite(cpu, address & ~3u, i.data32, 4);
+        return;
+    }
+    address &= cpu->memoryMask & ~3u;
+    memcpy(cpu->memoryBase + address, &i.data32, 4);
+    markWritten(cpu, page);
+
+    if(page->flags & PAGE_CODE) {
+        invalidateDecoded(cpu, address);
+        invalidateJit(cpu, address);
+        invalidateAot(cpu, address);
+    }
+}
+
+void writeMemoryByte(CPU *cpu, REGISTER address, BYTE value) {
+    PAGE *page = pageOf(cpu, address);
+
+    if(page->flags & PAGE_MMIO) {
+        busWrite(cpu, address, value, 1);
+        return;
+    }
+    address &= cpu->memoryMask;
+    cpu->memoryBase[address] = value;
+    markWritten(cpu, page);
+
+    if(page->flags & PAGE_CODE) {
+        invalidateDecoded(cpu, address & ~3u);
+        invalidateJit(cpu, address & ~3u);
+        invalidateAot(cpu, address & ~3u);
+    }
+}
+
+/*
+ * For anything that puts data in guest memory directly rather than through the stores above: marks the pages written
+ * and throws away any decoded or translated instructions in the range.
+ */
+void invalidateMemory(CPU *cpu, REGISTER address, uint32_t size) {
+    if(size == 0)
+        return;
+
+    for(REGISTER page = address >> GUEST_PAGE_SHIFT; page <= (address + size - 1) >> GUEST_PAGE_SHIFT; page++) {
+        markWritten(cpu, &cpu->pages[page]);
+        if(!(cpu->pages[page].flags & PAGE_CODE))
+            continue;
+
+        REGISTER first = (page << GUEST_PAGE_SHIFT > (address & ~3u))? page << GUEST_PAGE_SHIFT : address & ~3u;
+        REGISTER last = ((page + 1) << GUEST_PAGE_SHIFT < address + size)? (page + 1) << GUEST_PAGE_SHIFT : address + size;
+        for(REGISTER word = first; word < last; word += 4) {
+            invalidateDecoded(cpu, word);
+            invalidateJit(cpu, word);
+            invalidateAot(cpu, word);
+        }
+    }
+}
@@ -0,0 +1,115 @@
+#ifndef __MEMORY_H__
+#define __MEMORY_H__
+
+#include <string.h>
+
+#include "armpit.h"
+
+
+/*
+ * Guest Address Space
+ *
+ * The ARMv2 has a 26 bit address space (64 MB). The whole of it is reserved up front as one anonymous mapping and the
+ * host only backs the pages the guest actually touches, so an untouched address space costs no RAM. Every access is a
+ * single index into the mapping, masked to the configured memory size (so addresses wrap around rather than running off
+ * the end).
+ *
+ * Each CPU has its own address space (memoryBase, memorySize, memoryMask and pages in the CPU). Alongside the memory
+ * there is a PAGE record per 4 KB page which holds the things that are only needed for some pages:
+ * the decode cache and JIT blocks for pages that have been executed, and a list of the pages written since the last
+ * snapshot.
+ *
+ * Pages can also belong to a device instead (PAGE_MMIO, see bus.c). Guest loads and stores test the page's flags and
+ * only go to the device bus for those, RAM accesses never search the devices. Instructions are always fetched from
+ * RAM (memoryWord()), so running code from a device's pages doesn't read its registers.
+ */
+#define ADDRESS_SPACE_SIZE (1 << 26)
+
+#define GUEST_PAGE_SHIFT 12
+#define GUEST_PAGE_SIZE (1 << GUEST_PAGE_SHIFT)
+#define WORDS_PER_PAGE (GUEST_PAGE_SIZE / 4)
+
+#define PAGE_CODE       (1<<0) // instructions in the page have been decoded or translated, stores have to invalidate them
+#define PAGE_WRITTEN    (1<<1) // the page has been written to
+#define PAGE_DIRTY      (1<<2) // written since the last snapshot was taken or restored, the page is on the dirty list
+#define PAGE_MMIO       (1<<3) // the page belongs to a device, loads and stores go to the bus instead of RAM
+
+struct PAGE {
+    DECODED *decoded;       // decode cache, one record per word, allocated the first time the page is executed
+    void **jitBlocks;       // JIT blocks starting at each word (jit.c), allocated the first time a block starts here
+    uint16_t jitCoverage;   // number of live JIT blocks containing words of this page
+    BYTE flags;
+};
+
+bool initMemory(CPU *, uint32_t); // size in bytes, a power of 2 no bigger than ADDRESS_SPACE_SIZE
+void freeMemory(CPU *);
+void writeMemoryByte(CPU *, REGISTER, BYTE);
+void invalidateMemory(CPU *, REGISTER, uint32_t); // after writing size bytes at address other than by a store
+
+// bus.c
+uint32_t busRead(CPU *, REGISTER, int); // address and size, 1 or 4 (word aligned)
+void busWrite(CPU *, REGISTER, uint32_t, int);
+bool attachDevice(CPU *, REGISTER, uint32_t, ARMPIT_DEVICE_READ, ARMPIT_DEVICE_WRITE, void *, bool); // address, size,
+                                                                    // read, write, context, free the context with the CPU
+void freeBus(CPU *);
+
+// devices.c
+bool attachUart(CPU *, REGISTER);
+bool attachTimer(CPU *, REGISTER);
+
+
+static inline PAGE *pageOf(CPU *cpu, REGISTER address) {
+    return &cpu->pages[(address & cpu->memoryMask) >> GUEST_PAGE_SHIFT];
+}
+
+/*
+ * Everything that stores to guest memory calls this for the page. The first store to a page after a snapshot puts
+ * the page on the dirty list, so resetting to the snapshot only has to look at those pages (snapshot.c).
+ */
+static inline void markWritten(CPU *cpu, PAGE *page) {
+    if(!(page->flags & PAGE_DIRTY)) {
+        page->flags |= PAGE_WRITTEN | PAGE_DIRTY;
+        cpu->dirtyPages[cpu->dirtyCount++] = (uint32_t)(page - cpu->pages);
+    }
+}
+
+/*
+ * Guest memory for size bytes (no more than a page) at address, for copying straight to or from, or NULL if the access
+ * has to be done a word at a time: it runs off the end of memory and wraps around, it touches a device's page, or it
+ * is a store to a page with decoded or translated instructions in it. Asking for a store marks the pages written.
+ */
+static inline BYTE *directMemory(CPU *cpu, REGISTER address, uint32_t size, bool store) {
+    address &= cpu->memoryMask;
+    if(address + size > cpu->memorySize)
+        return NULL;
+    PAGE *first = pageOf(cpu, address);
+    PAGE *last = pageOf(cpu, address + size - 1);
+    if((first->flags | last->flags) & (store? PAGE_MMIO | PAGE_CODE : PAGE_MMIO))
+        return NULL;
+    if(store) {
+        markWritten(cpu, first);
+        markWritten(cpu, last);
+    }
+    return cpu->memoryBase + address;
+}
+
+// the word of RAM at address, never a device register: instruction fetch, and the emulator looking at memory
+static inline uint32_t memoryWord(CPU *cpu, REGISTER address) {
+    uint32_t value;
+    memcpy(&value, cpu->memoryBase + (address & cpu->memoryMask & ~3u), 4);
+    return value;
+}
+
+static inline uint32_t readMemoryWord(CPU *cpu, REGISTER address) {
+    if(pageOf(cpu, address)->flags & PAGE_MMIO)
+        return busRead(cpu, address & ~3u, 4);
+    return memoryWord(cpu, address);
+}
+
+static inline BYTE readMemoryByte(CPU *cpu, REGISTER address) {
+    if(pageOf(cpu, address)->flags & PAGE_MMIO)
+        return (BYTE)busRead(cpu, address, 1);
+    return cpu->memoryBase[address & cpu->memoryMask];
+}
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * Processor modes and exception entry
+ *
+ * The ARMv2 has four modes, in the bottom two bits of the status register, and some of them have registers of their
+ * own which replace the user registers while the mode is current:
+ *
+ *      0  User         R0..R14
+ *      1  FIQ          R8..R14 banked, so a fast interrupt handler doesn't have to save any of them
+ *      2  IRQ          R13, R14 banked
+ *      3  Supervisor   R13, R14 banked
+ *
+ * cpu->registers always holds the registers of the current mode. The others wait in cpu->bankedRegisters, one row of
+ * R8..R14 per mode. Only the user row uses R8..R12, the user values of those while FIQ mode has them. Changing mode only
+ * copies the registers the two modes don't share: R13 and R14 between User, IRQ and Supervisor, R8..R14 into or out of
+ * FIQ mode.
+ *
+ * R15 holds the PC in bits 25..2 and the PSR in the rest: N Z C V I F in bits 31..26, the mode in bits 1..0. It is
+ * kept in cpu->registers[15] as the PC alone, with the PSR in cpu->statusRegister (flags.h), and put together only where
+ * an instruction sees both: R15 as a stored register, as Rm, and in the R14 of BL and exceptions. Writing R15 with
+ * MOVS, SUBS and the like, TEQP and the rest, or LDM with ^ restores the PSR from it, although user mode can only
+ * change the flags that way.
+ *
+ * Exceptions switch mode, save the address to return to with the PSR in the new mode's R14 (R15 in the form it is
+ * stored), disable IRQs (and FIQs for a fast interrupt) and jump to their vector:
+ *
+ *      0x08  SWI                       R14 is the instruction after the SWI
+ *      0x18  IRQ                       R14 is the next instruction + 4, handlers return with SUBS PC, R14, #4
+ *      0x1C  FIQ                       likewise
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "flags.h"
+#include "memory.h"
+
+
+#define FIRST_BANKED 8 // R8, the first register FIQ mode banks
+
+/*
+ * Where R<number> of mode is kept: in cpu->registers if it is one the current mode shares, otherwise in its bank
+ */
+REGISTER *modeRegister(CPU *cpu, BYTE mode, int number) {
+    BYTE current = cpu->statusRegister & MODE_MASK;
+
+    mode &= MODE_MASK;
+    if(number < FIRST_BANKED || number == PROGRAM_COUNTER)
+        return &cpu->registers[number];
+    if(number < STACK_POINTER && mode != MODE_FIQ)
+        mode = MODE_USER; // IRQ and SVC share the user R8..R12
+    if(mode == current || (number < STACK_POINTER && mode == MODE_USER && current != MODE_FIQ))
+        return &cpu->registers[number];
+    return &cpu->bankedRegisters[mode][number - FIRST_BANKED];
+}
+
+REGISTER pcWithPsr(CPU *cpu, REGISTER pc) {
+    BYTE status = getStatusRegister(cpu);
+    return (pc & PC_MASK) | (REGISTER)(status & 0xfc) << 24 | (status & MODE_MASK);
+}
+
+/*
+ * Sets the PSR from the bits of an R15 value, switching banks if the mode changes
+ */
+void restorePsr(CPU *cpu, REGISTER value) {
+    BYTE status = (BYTE)(((value >> 24) & 0xfc) | (value & MODE_MASK));
+    BYTE current = getStatusRegister(cpu);
+
+    if((current & MODE_MASK) == MODE_USER)
+        status = (status & 0xf0) | (current & 0x0f);
+    switchMode(cpu, status);
+    setStatusRegister(cpu, status);
+}
+
+void switchMode(CPU *cpu, BYTE mode) {
+    REGISTER *registers = cpu->registers;
+    BYTE current = cpu->statusRegister & MODE_MASK;
+
+    mode &= MODE_MASK;
+    if(mode == current)
+        return;
+
+    REGISTER *from = cpu->bankedRegisters[current];
+    REGISTER *to = cpu->bankedRegisters[mode];
+    REGISTER *user = cpu->bankedRegisters[MODE_USER];
+
+    if(current == MODE_FIQ || mode == MODE_FIQ) {
+        // R8..R12 change hands as well, the shared values live in the user row while FIQ mode has its own
+        memcpy(from, &registers[FIRST_BANKED], 7 * sizeof(REGISTER));
+        if(current == MODE_FIQ)
+            memcpy(&registers[FIRST_BANKED], user, 5 * sizeof(REGISTER));
+        else
+            memcpy(user, &registers[FIRST_BANKED], 5 * sizeof(REGISTER));
+        if(mode == MODE_FIQ)
+            memcpy(&registers[FIRST_BANKED], to, 7 * sizeof(REGISTER));
+        else
+            memcpy(&registers[STACK_POINTER], &to[STACK_POINTER - FIRST_BANKED], 2 * sizeof(REGISTER));
+    } else {
+        memcpy(&from[STACK_POINTER - FIRST_BANKED], &registers[STACK_POINTER], 2 * sizeof(REGISTER));
+        memcpy(&registers[STACK_POINTER], &to[STACK_POINTER - FIRST_BANKED], 2 * sizeof(REGISTER));
+    }
+
+    cpu->statusRegister = (cpu->statusRegister & ~MODE_MASK) | mode;
+    if(VERBOSE)
+        printf("\tMode %d\n", mode);
+}
+
+/*
+ * Takes an exception: returnAddress (with the PSR as it was) goes into the new mode's R14
+ */
+void enterException(CPU *cpu, BYTE mode, REGISTER vector, REGISTER returnAddress, BYTE disable) {
+    REGISTER link = pcWithPsr(cpu, returnAddress);
+
+    switchMode(cpu, mode);
+    cpu->statusRegister |= disable;
+    cpu->registers[LINK_REGISTER] = link;
+    cpu->registers[PROGRAM_COUNTER] = vector;
+}
@@ -0,0 +1,357 @@
+/*
+ * Guest profiler (see profile.h)
+ *
+ * For every instruction fetched it counts, by address, how many times it executed and how many times its condition
+ * failed, and estimates the cycles it took on an ARM2 (below). It also counts instructions by type and data processing
+ * instructions by opcode, and how often conditional instructions are skipped.
+ *
+ * Calls are followed with a shadow stack: a BL whose condition passes pushes its return address and moves down the
+ * call tree to the node for its target, and fetching the instruction at the return address of the innermost call pops
+ * it again (so MOV PC, LR and LDM {.., PC} returns both work without being recognised). Each instruction is counted
+ * against the call tree node it ran in, which is what the folded stacks are written from.
+ *
+ * The report is printed at exit by the command line, or by armpitReportProfile().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "profile.h"
+#include "memory.h"
+
+
+#ifdef ARMPIT_PROFILER
+
+#define PROFILE_STACK_DEPTH 1024   // calls nested deeper than this are counted against the deepest one
+#define HOT_SPOTS           20     // addresses listed in the report
+#define MULTIPLY            (UNDEFINED + 1) // multiplies decode as UNDEFINED, they're counted on their own after it
+
+typedef struct PROFILE_PAGE {
+    uint64_t executed[WORDS_PER_PAGE];
+    uint64_t skipped[WORDS_PER_PAGE];
+    uint64_t cycles[WORDS_PER_PAGE];
+} PROFILE_PAGE;
+
+typedef struct CALL_NODE {
+    REGISTER address;           // the function called, 0 for the root
+    uint32_t parent;
+    uint32_t firstChild;        // 0 for none (the root is never a child)
+    uint32_t nextSibling;
+    uint64_t instructions;      // executed in this function called from this path, not counting what it called
+} CALL_NODE;
+
+typedef struct FRAME {
+    uint32_t caller;            // call tree node to go back to
+    REGISTER returnAddress;
+} FRAME;
+
+struct PROFILE {
+    PROFILE_PAGE **pages;       // one per page of memory, allocated the first time an instruction there runs
+
+    uint64_t types[MULTIPLY + 1];
+    uint64_t opCodes[16];
+    uint64_t conditional, conditionalSkipped;
+    uint64_t sCycles, nCycles, iCycles;
+
+    CALL_NODE *nodes;
+    uint32_t nodeCount, nodeCapacity;
+    uint32_t current;
+    FRAME stack[PROFILE_STACK_DEPTH];
+    int depth;
+};
+
+
+/*
+ * ARM2 instruction timings, in sequential (S), non-sequential (N) and internal (I) cycles:
+ *
+ *      data processing         1S, +1I for a shift by register, +1S +1N if it writes the PC
+ *      LDR                     1S +1N +1I, +1S +1N if it loads the PC
+ *      STR                     2N
+ *      LDM of n registers      nS +1N +1I, +1S +1N if it loads the PC
+ *      STM of n registers      (n-1)S +2N
+ *      B, BL and SWI           2S +1N
+ *      MUL, MLA                1S + mI, where m is the number of 2 bit steps in Rs (1 to 16)
+ *      undefined instruction   2S +1N +1I
+ *      condition failed        1S
+ */
+static void estimateCycles(CPU *cpu, const DECODED *decoded, uint32_t *s, uint32_t *n, uint32_t *i) {
+    uint32_t word = decoded->instruction.data32;
+
+    *s = 0; *n = 0; *i = 0;
+    switch(decoded->type) {
+        case ALU:
+            *s = 1;
+            *i = decoded->shiftByRegister && !decoded->immediate;
+            if(decoded->regDest == PROGRAM_COUNTER && (decoded->opCode < OP_TST || decoded->opCode > OP_CMN)) {
+                *s += 1;
+                *n += 1;
+            }
+            break;
+        case DATA_TRANSFER:
+            if(((word >> 25) & 7) == 4) {
+                int count = __builtin_popcount(word & 0xffff);
+                if((word >> 20) & 1) {
+                    *s = (uint32_t)count; *n = 1; *i = 1;
+                    if((word >> PROGRAM_COUNTER) & 1) { *s += 1; *n += 1; }
+                } else {
+                    *s = count > 0? (uint32_t)count - 1 : 0; *n = 2;
+                }
+            } else if((word >> 20) & 1) {
+                *s = 1; *n = 1; *i = 1;
+                if(decoded->regDest == PROGRAM_COUNTER) { *s += 1; *n += 1; }
+            } else {
+                *n = 2;
+            }
+            break;
+        case BRANCH:
+        case INTERUPT:
+            *s = 2; *n = 1;
+            break;
+        default:
+            if((word & 0x0fc000f0) == 0x00000090) {
+                REGISTER rs = cpu->registers[(word >> 8) & 15];
+                *s = 1;
+                for(*i = 1; (rs >>= 2) != 0 && *i < 16; (*i)++)
+                    ;
+            } else {
+                *s = 2; *n = 1; *i = 1;
+            }
+            break;
+    }
+}
+
+static uint32_t childNode(PROFILE *profile, uint32_t parent, REGISTER address) {
+    for(uint32_t child = profile->nodes[parent].firstChild; child != 0; child = profile->nodes[child].nextSibling) {
+        if(profile->nodes[child].address == address)
+            return child;
+    }
+
+    if(profile->nodeCount == profile->nodeCapacity) {
+        CALL_NODE *nodes = realloc(profile->nodes, profile->nodeCapacity * 2 * sizeof(CALL_NODE));
+        if(nodes == NULL)
+            return parent; // carry on counting against the caller
+        profile->nodes = nodes;
+        profile->nodeCapacity *= 2;
+    }
+
+    uint32_t child = profile->nodeCount++;
+    profile->nodes[child] = (CALL_NODE){ address, parent, 0, profile->nodes[parent].firstChild, 0 };
+    profile->nodes[parent].firstChild = child;
+    return child;
+}
+
+void profileInstruction(CPU *cpu, const DECODED *decoded, bool passed) {
+    PROFILE *profile = cpu->profile;
+    REGISTER address = (cpu->registers[PROGRAM_COUNTER] - 4) & cpu->memoryMask;
+    PROFILE_PAGE **page = &profile->pages[address >> GUEST_PAGE_SHIFT];
+    uint32_t word = (address >> 2) & (WORDS_PER_PAGE - 1);
+
+    if(*page == NULL && (*page = calloc(1, sizeof(PROFILE_PAGE))) == NULL)
+        return;
+
+    while(profile->depth > 0 && address == profile->stack[profile->depth - 1].returnAddress)
+        profile->current = profile->stack[--profile->depth].caller;
+    profile->nodes[profile->current].instructions++;
+
+    if(decoded->condition != CONDITION_ALWAYS) {
+        profile->conditional++;
+        profile->conditionalSkipped += !passed;
+    }
+    if(!passed) {
+        (*page)->skipped[word]++;
+        (*page)->cycles[word]++;
+        profile->sCycles++;
+        return;
+    }
+
+    uint32_t s, n, i;
+    estimateCycles(cpu, decoded, &s, &n, &i);
+    (*page)->executed[word]++;
+    (*page)->cycles[word] += s + n + i;
+    profile->sCycles += s;
+    profile->nCycles += n;
+    profile->iCycles += i;
+
+    if(decoded->type == UNDEFINED && (decoded->instruction.data32 & 0x0fc000f0) == 0x00000090)
+        profile->types[MULTIPLY]++;
+    else
+        profile->types[decoded->type]++;
+    if(decoded->type == ALU)
+        profile->opCodes[decoded->opCode]++;
+
+    // BL, the target is PC + 8 + the sign extended offset in words
+    if(decoded->type == BRANCH && (decoded->instruction.data32 >> 24) & 1 && profile->depth < PROFILE_STACK_DEPTH) {
+        REGISTER target = address + 8 + (REGISTER)(((int32_t)(decoded->instruction.data32 << 8)) >> 6);
+        profile->stack[profile->depth++] = (FRAME){ profile->current, address + 4 };
+        profile->current = childNode(profile, profile->current, target & cpu->memoryMask);
+    }
+}
+
+bool startProfile(CPU *cpu) {
+    if(cpu->profile != NULL)
+        return true;
+
+    PROFILE *profile = calloc(1, sizeof(PROFILE));
+    if(profile == NULL)
+        return false;
+    profile->pages = calloc(cpu->memorySize >> GUEST_PAGE_SHIFT, sizeof(PROFILE_PAGE *));
+    profile->nodeCapacity = 256;
+    profile->nodes = malloc(profile->nodeCapacity * sizeof(CALL_NODE));
+    if(profile->pages == NULL || profile->nodes == NULL) {
+        free(profile->pages);
+        free(profile->nodes);
+        free(profile);
+        return false;
+    }
+
+    profile->nodes[0] = (CALL_NODE){ 0, 0, 0, 0, 0 };
+    profile->nodeCount = 1;
+    cpu->profile = profile;
+    return true;
+}
+
+void freeProfile(CPU *cpu) {
+    PROFILE *profile = cpu->profile;
+    if(profile == NULL)
+        return;
+
+    for(uint32_t i = 0; i < (cpu->memorySize >> GUEST_PAGE_SHIFT); i++)
+        free(profile->pages[i]);
+    free(profile->pages);
+    free(profile->nodes);
+    free(profile);
+    cpu->profile = NULL;
+}
+
+
+typedef struct HOT_SPOT {
+    REGISTER address;
+    uint64_t executed, skipped, cycles;
+} HOT_SPOT;
+
+static int compareHotSpots(const void *a, const void *b) {
+    uint64_t countA = ((const HOT_SPOT *)a)->executed + ((const HOT_SPOT *)a)->skipped;
+    uint64_t countB = ((const HOT_SPOT *)b)->executed + ((const HOT_SPOT *)b)->skipped;
+    return (countA < countB) - (countA > countB);
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+    return whole? 100.0 * (double)part / (double)whole : 0.0;
+}
+
+/*
+ * One line per call tree node with instructions of its own: the functions from the root down, separated by
+ * semicolons, then the count (the input format of flamegraph.pl)
+ */
+static void writeFoldedStacks(PROFILE *profile, FILE *file) {
+    uint32_t path[PROFILE_STACK_DEPTH + 1];
+
+    for(uint32_t node = 0; node < profile->nodeCount; node++) {
+        if(profile->nodes[node].instructions == 0)
+            continue;
+
+        int length = 0;
+        for(uint32_t n = node; n != 0 && length < PROFILE_STACK_DEPTH; n = profile->nodes[n].parent)
+            path[length++] = n;
+
+        fprintf(file, "start");
+        while(length > 0)
+            fprintf(file, ";%08X", profile->nodes[path[--length]].address);
+        fprintf(file, " %llu\n", (unsigned long long)profile->nodes[node].instructions);
+    }
+}
+
+void reportProfile(CPU *cpu, const char *foldedFile) {
+    PROFILE *profile = cpu->profile;
+    static const char *typeNames[] = { "ALU", "Branch", "Data Transfer", "Interupt", "Undefined", "Multiply" };
+    static const char *opCodeNames[] = { "AND", "EOR", "SUB", "RSB", "ADD", "ADC", "SBC", "RSC",
+                                         "TST", "TEQ", "CMP", "CMN", "ORR", "MOV", "BIC", "MVN" };
+    if(profile == NULL)
+        return;
+
+    // gather every address that ran
+    uint64_t executed = 0, skipped = 0;
+    size_t count = 0, capacity = 256;
+    HOT_SPOT *spots = malloc(capacity * sizeof(HOT_SPOT));
+
+    for(uint32_t p = 0; spots != NULL && p < (cpu->memorySize >> GUEST_PAGE_SHIFT); p++) {
+        PROFILE_PAGE *page = profile->pages[p];
+        for(uint32_t w = 0; page != NULL && w < WORDS_PER_PAGE; w++) {
+            if(page->executed[w] == 0 && page->skipped[w] == 0)
+                continue;
+            if(count == capacity) {
+                HOT_SPOT *grown = realloc(spots, capacity * 2 * sizeof(HOT_SPOT));
+                if(grown == NULL)
+                    break;
+                spots = grown;
+                capacity *= 2;
+            }
+            spots[count++] = (HOT_SPOT){ (p << GUEST_PAGE_SHIFT) + w * 4, page->executed[w], page->skipped[w],
+                                         page->cycles[w] };
+            executed += page->executed[w];
+            skipped += page->skipped[w];
+        }
+    }
+
+    uint64_t cycles = profile->sCycles + profile->nCycles + profile->iCycles;
+    printf("\nProfile\n");
+    printf("Instructions: %llu executed, %llu skipped\n", (unsigned long long)executed, (unsigned long long)skipped);
+    printf("Conditional instructions: %llu, %llu skipped (%.1f%%)\n", (unsigned long long)profile->conditional,
+           (unsigned long long)profile->conditionalSkipped, percent(profile->conditionalSkipped, profile->conditional));
+    printf("Estimated ARM2 cycles: %llu (%llu S, %llu N, %llu I), %.2f per instruction\n", (unsigned long long)cycles,
+           (unsigned long long)profile->sCycles, (unsigned long long)profile->nCycles,
+           (unsigned long long)profile->iCycles, (executed + skipped)? (double)cycles / (double)(executed + skipped) : 0.0);
+
+    printf("\nBy type:\n");
+    for(int i = 0; i <= MULTIPLY; i++) {
+        if(profile->types[i])
+            printf("  %-14s %12llu  %5.1f%%\n", typeNames[i], (unsigned long long)profile->types[i],
+                   percent(profile->types[i], executed));
+    }
+    printf("\nBy opcode:\n");
+    for(int i = 0; i < 16; i++) {
+        if(profile->opCodes[i])
+            printf("  %-14s %12llu  %5.1f%%\n", opCodeNames[i], (unsigned long long)profile->opCodes[i],
+                   percent(profile->opCodes[i], executed));
+    }
+
+    if(spots != NULL) {
+        qsort(spots, count, sizeof(HOT_SPOT), compareHotSpots);
+        printf("\nHot spots:\n  %-8s %-8s %12s %12s %12s %7s\n", "Address", "Word", "Executed", "Skipped", "Cycles", "Share");
+        for(size_t i = 0; i < count && i < HOT_SPOTS; i++) {
+            printf("  %08X %08X %12llu %12llu %12llu %6.1f%%\n", spots[i].address,
+                   memoryWord(cpu, spots[i].address), (unsigned long long)spots[i].executed,
+                   (unsigned long long)spots[i].skipped, (unsigned long long)spots[i].cycles,
+                   percent(spots[i].executed + spots[i].skipped, executed + skipped));
+        }
+        free(spots);
+    }
+
+    if(foldedFile != NULL) {
+        FILE *file = fopen(foldedFile, "w");
+        if(file == NULL) {
+            printf("Error creating %s\n", foldedFile);
+            return;
+        }
+        writeFoldedStacks(profile, file);
+        fclose(file);
+    }
+}
+
+#else
+
+bool startProfile(CPU *cpu) {
+    (void)cpu;
+    return false;
+}
+
+void reportProfile(CPU *cpu, const char *foldedFile) {
+    (void)cpu;
+    (void)foldedFile;
+}
+
+void freeProfile(CPU *cpu) {
+    (void)cpu;
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include "armpit.h"
+
+
+/*
+ * Guest Profiler
+ *
+ * Only built when ARMPIT_PROFILER is defined (cmake -DARMPIT_PROFILER=ON). Otherwise PROFILE() expands to nothing and
+ * the interpreters are exactly as they were.
+ *
+ * When it is built and a CPU has a profile (startProfile()), the reference loop and the threaded interpreter call
+ * PROFILE() for every instruction they fetch, before it executes, with whether its condition passed. The JIT can't be
+ * profiled, a profiled CPU runs the threaded interpreter instead.
+ */
+#ifdef ARMPIT_PROFILER
+
+void profileInstruction(CPU *, const DECODED *, bool); // instruction, condition passed
+
+// the instruction has been fetched, so it is at PC - 4
+#define PROFILE(cpu, decoded, passed) do { \
+        if((cpu)->profile != NULL) \
+            profileInstruction((cpu), (decoded), (passed)); \
+    } while(0)
+
+#else
+
+#define PROFILE(cpu, decoded, passed) do { } while(0)
+
+#endif
+
+bool startProfile(CPU *); // false if the profiler isn't built in
+void reportProfile(CPU *, const char *); // prints the report, and writes folded stacks to the file if it isn't NULL
+void freeProfile(CPU *);
+
+#endif
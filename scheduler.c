@@ -0,0 +1,209 @@
+/*
+ * Event scheduler and interrupt delivery
+ *
+ * Devices schedule events at a point on the machine's cycle counter (cpu->cycles, one cycle per instruction, including
+ * those skipped by their condition) and raise or drop interrupt lines. Pending events are kept in a binary min-heap
+ * ordered by deadline, ties going to the event scheduled first, so a program sees the same events at the same points
+ * every time it is run whatever the engine.
+ *
+ * Nothing is checked per instruction. Once a machine has a scheduler, armpitRun() runs the engine in slices which end
+ * at the next deadline, using the instruction limit every engine already has, and between slices runs the events that
+ * are due and takes an interrupt if a line is raised and not disabled (FIQ first). A slice is also never longer than
+ * SCHEDULER_QUANTUM, which is how soon an interrupt is noticed when the guest rather than an event caused it: a device
+ * register write raising a line, or the I bit being cleared while one is raised. A device reading cpu->cycles during a
+ * slice sees where the slice started.
+ *
+ * Interrupt lines are a mask of sources each, so several devices can share the IRQ. Sources 0..15 are for devices
+ * attached through the library (armpitSetInterrupt), 16..31 are given out to the built in devices.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "flags.h"
+#include "memory.h"
+
+
+#define SCHEDULER_QUANTUM   4096
+#define FIRST_DEVICE_SOURCE 16
+
+#define IRQ_VECTOR 0x18
+#define FIQ_VECTOR 0x1c
+
+typedef struct EVENT {
+    uint64_t when;
+    uint64_t order;         // breaks ties between events due at the same cycle
+    ARMPIT_EVENT callback;
+    void *context;
+} EVENT;
+
+struct SCHEDULER {
+    EVENT *heap;
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t scheduled;     // events ever scheduled, the order of the next one
+    uint32_t irqLines;      // raised sources
+    uint32_t fiqLines;
+    uint32_t sourcesUsed;   // sources given to built in devices
+};
+
+
+/*
+ * Machines only get a scheduler once something needs one, until then they run without slices. Attaching a device
+ * starts it, since the device may schedule events or raise interrupts in the middle of a run.
+ */
+SCHEDULER *startScheduler(CPU *cpu) {
+    if(cpu->scheduler == NULL)
+        cpu->scheduler = calloc(1, sizeof(SCHEDULER));
+    if(cpu->scheduler == NULL) {
+        printf("Out of memory allocating the scheduler\n");
+        exit(EXIT_FAILURE);
+    }
+    return cpu->scheduler;
+}
+
+static inline bool before(const EVENT *a, const EVENT *b) {
+    return a->when < b->when || (a->when == b->when && a->order < b->order);
+}
+
+static void siftDown(SCHEDULER *scheduler, uint32_t index) {
+    EVENT *heap = scheduler->heap;
+    for(;;) {
+        uint32_t smallest = index, left = 2 * index + 1, right = left + 1;
+        if(left < scheduler->count && before(&heap[left], &heap[smallest]))
+            smallest = left;
+        if(right < scheduler->count && before(&heap[right], &heap[smallest]))
+            smallest = right;
+        if(smallest == index)
+            return;
+        EVENT swap = heap[index];
+        heap[index] = heap[smallest];
+        heap[smallest] = swap;
+        index = smallest;
+    }
+}
+
+/*
+ * Calls callback with context delay cycles from now (at the end of the current slice if delay is 0)
+ */
+void scheduleEvent(CPU *cpu, uint64_t delay, ARMPIT_EVENT callback, void *context) {
+    SCHEDULER *scheduler = startScheduler(cpu);
+
+    if(scheduler->count == scheduler->capacity) {
+        uint32_t capacity = scheduler->capacity? scheduler->capacity * 2 : 16;
+        EVENT *heap = realloc(scheduler->heap, capacity * sizeof(EVENT));
+        if(heap == NULL) {
+            printf("Out of memory scheduling an event\n");
+            exit(EXIT_FAILURE);
+        }
+        scheduler->heap = heap;
+        scheduler->capacity = capacity;
+    }
+
+    // sift up
+    EVENT event = { cpu->cycles + delay, scheduler->scheduled++, callback, context };
+    uint32_t index = scheduler->count++;
+    while(index > 0 && before(&event, &scheduler->heap[(index - 1) / 2])) {
+        scheduler->heap[index] = scheduler->heap[(index - 1) / 2];
+        index = (index - 1) / 2;
+    }
+    scheduler->heap[index] = event;
+}
+
+/*
+ * Removes every pending event for callback with context
+ */
+void cancelEvents(CPU *cpu, ARMPIT_EVENT callback, void *context) {
+    SCHEDULER *scheduler = cpu->scheduler;
+    if(scheduler == NULL)
+        return;
+
+    uint32_t kept = 0;
+    for(uint32_t i = 0; i < scheduler->count; i++) {
+        if(scheduler->heap[i].callback != callback || scheduler->heap[i].context != context)
+            scheduler->heap[kept++] = scheduler->heap[i];
+    }
+    scheduler->count = kept;
+    for(uint32_t i = kept / 2; i-- > 0;)
+        siftDown(scheduler, i);
+}
+
+void setInterrupt(CPU *cpu, bool fast, uint32_t sources, bool raised) {
+    SCHEDULER *scheduler = startScheduler(cpu);
+    uint32_t *lines = fast? &scheduler->fiqLines : &scheduler->irqLines;
+    *lines = raised? (*lines | sources) : (*lines & ~sources);
+}
+
+/*
+ * An interrupt source for a built in device, 0 if they have all been given out
+ */
+uint32_t allocateInterruptSource(CPU *cpu) {
+    SCHEDULER *scheduler = startScheduler(cpu);
+    for(int source = FIRST_DEVICE_SOURCE; source < 32; source++) {
+        if(!(scheduler->sourcesUsed & (1u << source))) {
+            scheduler->sourcesUsed |= 1u << source;
+            return 1u << source;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Runs the events that are due and takes an interrupt if one is raised and enabled
+ */
+static void serviceEvents(CPU *cpu) {
+    SCHEDULER *scheduler = cpu->scheduler;
+
+    while(scheduler->count > 0 && scheduler->heap[0].when <= cpu->cycles) {
+        EVENT event = scheduler->heap[0];
+        scheduler->heap[0] = scheduler->heap[--scheduler->count];
+        siftDown(scheduler, 0);
+        event.callback(cpu, event.context); // which may schedule more
+    }
+
+    BYTE status = cpu->statusRegister; // I and F are never lazy
+    REGISTER next = cpu->registers[PROGRAM_COUNTER] + 4;
+    if(scheduler->fiqLines != 0 && !(status & STATUS_F)) {
+        if(VERBOSE)
+            printf("\tFIQ at %08X\n", cpu->registers[PROGRAM_COUNTER]);
+        enterException(cpu, MODE_FIQ, FIQ_VECTOR, next, STATUS_I | STATUS_F);
+    } else if(scheduler->irqLines != 0 && !(status & STATUS_I)) {
+        if(VERBOSE)
+            printf("\tIRQ at %08X\n", cpu->registers[PROGRAM_COUNTER]);
+        enterException(cpu, MODE_IRQ, IRQ_VECTOR, next, STATUS_I);
+    }
+}
+
+/*
+ * runEngine() for a machine with a scheduler: slices up to the next deadline, with the events and interrupts between
+ */
+uint64_t runScheduled(CPU *cpu, ARMPIT_ENGINE engine, uint64_t maxSteps) {
+    SCHEDULER *scheduler = cpu->scheduler;
+    uint64_t executed = 0;
+
+    if(maxSteps == 0)
+        maxSteps = UINT64_MAX;
+
+    while(executed < maxSteps && cpu->registers[PROGRAM_COUNTER] != cpu->programEnd) {
+        serviceEvents(cpu);
+        if(cpu->registers[PROGRAM_COUNTER] == cpu->programEnd)
+            break;
+
+        uint64_t slice = maxSteps - executed;
+        if(slice > SCHEDULER_QUANTUM)
+            slice = SCHEDULER_QUANTUM;
+        if(scheduler->count > 0 && scheduler->heap[0].when - cpu->cycles < slice)
+            slice = scheduler->heap[0].when - cpu->cycles; // serviceEvents() left nothing due, so this isn't 0
+
+        executed += runSlice(cpu, engine, slice);
+    }
+    return executed;
+}
+
+void freeScheduler(CPU *cpu) {
+    if(cpu->scheduler != NULL) {
+        free(cpu->scheduler->heap);
+        free(cpu->scheduler);
+        cpu->scheduler = NULL;
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef __SHIFTER_H__
+#define __SHIFTER_H__
+
+#include "armpit.h"
+
+
+/*
+ * Barrel Shifter
+ *
+ * Operand 2 of a data processing instruction is either an 8 bit immediate rotated right by twice a 4 bit field, or
+ * register Rm shifted by an immediate amount (bits 7..11) or by the bottom byte of register Rs:
+ *
+ *      LSL     logical shift left      carry out is the last bit shifted out, 0 past 32
+ *      LSR     logical shift right     carry out is the last bit shifted out, 0 past 32
+ *      ASR     arithmetic shift right  32 or more fills with the sign bit, which is also the carry out
+ *      ROR     rotate right            carry out is bit 31 of the result
+ *      RRX     33 bit rotate right through the carry flag (encoded as ROR #0)
+ *
+ * A shift by register of 0 leaves the value and the carry flag alone. Shifts by immediate can't encode 0 for LSR
+ * and ASR, #0 means #32 instead. The decoder works out which kernel an instruction needs (DECODED shifter) and the
+ * amount for immediate shifts, so a kernel only has to be given the value and the amount.
+ *
+ * The kernels have no branches: out of range amounts are clamped and the shift done in 64 bits, so the bits shifted
+ * out land where the carry can be read from, and "amount is 0, keep the carry" is a mask. This matters because the
+ * amount of a register shift comes from guest data, which a branch predictor does badly on.
+ */
+#define SHIFTER_NONE    0   // plain register, LSL #0
+#define SHIFTER_LSL     1
+#define SHIFTER_LSR     2
+#define SHIFTER_ASR     3
+#define SHIFTER_ROR     4
+#define SHIFTER_RRX     5
+
+// the new carry if amount is not 0, otherwise the old one
+static inline int shifterCarry(uint32_t amount, uint32_t shifted, int carry) {
+    uint32_t keep = (uint32_t)(amount == 0) - 1; // all ones if the bit was shifted
+    return (int)((shifted & keep) | ((uint32_t)carry & ~keep));
+}
+
+static inline REGISTER shiftLSL(REGISTER value, uint32_t amount, int *carry) {
+    uint32_t clamped = amount > 33? 33 : amount;
+    uint64_t wide = (uint64_t)value << clamped; // bit 32 is the last bit out
+    *carry = shifterCarry(amount, (uint32_t)(wide >> 32) & 1, *carry);
+    return (REGISTER)wide;
+}
+
+static inline REGISTER shiftLSR(REGISTER value, uint32_t amount, int *carry) {
+    uint32_t clamped = amount > 33? 33 : amount;
+    uint64_t wide = ((uint64_t)value << 32) >> clamped; // bit 31 is the last bit out
+    *carry = shifterCarry(amount, (uint32_t)(wide >> 31) & 1, *carry);
+    return (REGISTER)(wide >> 32);
+}
+
+static inline REGISTER shiftASR(REGISTER value, uint32_t amount, int *carry) {
+    uint32_t clamped = amount > 32? 32 : amount;
+    int64_t wide = (int64_t)((uint64_t)value << 32) >> clamped;
+    *carry = shifterCarry(amount, (uint32_t)(wide >> 31) & 1, *carry);
+    return (REGISTER)((uint64_t)wide >> 32);
+}
+
+static inline REGISTER shiftROR(REGISTER value, uint32_t amount, int *carry) {
+    uint32_t rotate = amount & 31;
+    REGISTER result = (value >> rotate) | (value << ((32 - rotate) & 31));
+    *carry = shifterCarry(amount, result >> 31, *carry);
+    return result;
+}
+
+static inline REGISTER shiftRRX(REGISTER value, int *carry) {
+    REGISTER result = (value >> 1) | ((uint32_t)*carry << 31);
+    *carry = value & 1;
+    return result;
+}
+
+
+/*
+ * Rotated immediates
+ *
+ * Every one of the 4096 immediate encodings (bits 0..11) with its value and its carry out, which is bit 31 of the
+ * value if it was rotated and SHIFTER_CARRY_UNCHANGED if not. The decoder looks immediates up here.
+ */
+typedef struct IMMEDIATE {
+    uint32_t value;
+    BYTE carry;
+} IMMEDIATE;
+
+extern const IMMEDIATE immediateTable[4096];
+
+#endif
@@ -0,0 +1,157 @@
+/*
+ * Snapshots of a CPU, for running the same program over and over from the same state.
+ *
+ * A snapshot holds the registers (every mode's), status register and halt address, and a copy of every page of memory that had been
+ * written when it was taken (every other page is still zero). Taking one costs a copy of the memory in use.
+ *
+ * Resetting to a snapshot is what has to be fast. From the moment a snapshot is taken (or reset to) every page that is
+ * written is marked dirty and added to the CPU's dirty list (markWritten in memory.h), so a reset only has to look at
+ * the pages on that list: the rest of memory is already the same as the snapshot. Within a dirty page that has
+ * instructions in it, only the words that actually differ are put back, so decoded and translated code that the run
+ * didn't touch survives the reset.
+ *
+ * The dirty list is only relative to the last snapshot the CPU was synchronised with. Resetting to any other snapshot
+ * compares every page that has been written, which is still correct but costs as much as memory in use.
+ */
+
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "flags.h"
+#include "memory.h"
+
+
+struct SNAPSHOT {
+    uint64_t serial;        // unique to this snapshot, see CPU.snapshotSerial
+    REGISTER registers[16];
+    BYTE statusRegister;
+    REGISTER bankedRegisters[4][7];
+    REGISTER programEnd;
+    uint32_t exitCode;      // 0 unless the snapshot was taken after OS_Exit
+    uint32_t memorySize;
+    BYTE **pages;           // copy of each page written when the snapshot was taken, NULL for the others
+    BYTE *data;             // all the copies in one block
+};
+
+static _Atomic uint64_t nextSerial = 1;
+static const BYTE zeroPage[GUEST_PAGE_SIZE];
+
+
+/*
+ * Starts tracking dirty pages afresh, relative to the snapshot with this serial number
+ */
+static void clearDirtyPages(CPU *cpu, uint64_t serial) {
+    for(uint32_t i = 0; i < cpu->dirtyCount; i++)
+        cpu->pages[cpu->dirtyPages[i]].flags &= ~PAGE_DIRTY;
+    cpu->dirtyCount = 0;
+    cpu->snapshotSerial = serial;
+}
+
+/*
+ * Returns NULL if there isn't the memory for the copy
+ */
+SNAPSHOT *takeSnapshot(CPU *cpu) {
+    uint32_t pageCount = cpu->memorySize >> GUEST_PAGE_SHIFT;
+    uint32_t written = 0;
+
+    for(uint32_t i = 0; i < pageCount; i++) {
+        if(cpu->pages[i].flags & PAGE_WRITTEN)
+            written++;
+    }
+
+    SNAPSHOT *snapshot = calloc(1, sizeof(SNAPSHOT));
+    if(snapshot == NULL)
+        return NULL;
+    snapshot->pages = calloc(pageCount, sizeof(BYTE *));
+    snapshot->data = malloc((size_t)written * GUEST_PAGE_SIZE + 1);
+    if(snapshot->pages == NULL || snapshot->data == NULL) {
+        freeSnapshot(snapshot);
+        return NULL;
+    }
+
+    BYTE *copy = snapshot->data;
+    for(uint32_t i = 0; i < pageCount; i++) {
+        if(cpu->pages[i].flags & PAGE_WRITTEN) {
+            memcpy(copy, cpu->memoryBase + ((size_t)i << GUEST_PAGE_SHIFT), GUEST_PAGE_SIZE);
+            snapshot->pages[i] = copy;
+            copy += GUEST_PAGE_SIZE;
+        }
+    }
+
+    memcpy(snapshot->registers, cpu->registers, sizeof(snapshot->registers));
+    snapshot->statusRegister = getStatusRegister(cpu);
+    memcpy(snapshot->bankedRegisters, cpu->bankedRegisters, sizeof(snapshot->bankedRegisters));
+    snapshot->programEnd = cpu->programEnd;
+    snapshot->exitCode = cpu->exitCode;
+    snapshot->memorySize = cpu->memorySize;
+    snapshot->serial = atomic_fetch_add(&nextSerial, 1);
+
+    clearDirtyPages(cpu, snapshot->serial);
+    return snapshot;
+}
+
+void freeSnapshot(SNAPSHOT *snapshot) {
+    if(snapshot == NULL)
+        return;
+    free(snapshot->pages);
+    free(snapshot->data);
+    free(snapshot);
+}
+
+/*
+ * Puts a page back the way it was. Pages with no instructions in them are simply copied, otherwise each word that
+ * differs is written back and its decoded and translated copies thrown away.
+ */
+static void restorePage(CPU *cpu, uint32_t index, const BYTE *saved) {
+    BYTE *memory = cpu->memoryBase + ((size_t)index << GUEST_PAGE_SHIFT);
+
+    if(memcmp(memory, saved, GUEST_PAGE_SIZE) == 0)
+        return;
+
+    if(!(cpu->pages[index].flags & PAGE_CODE)) {
+        memcpy(memory, saved, GUEST_PAGE_SIZE);
+        return;
+    }
+
+    for(uint32_t offset = 0; offset < GUEST_PAGE_SIZE; offset += 4) {
+        if(memcmp(memory + offset, saved + offset, 4) != 0) {
+            REGISTER address = (index << GUEST_PAGE_SHIFT) + offset;
+            memcpy(memory + offset, saved + offset, 4);
+            invalidateDecoded(cpu, address);
+            invalidateJit(cpu, address);
+            invalidateAot(cpu, address);
+        }
+    }
+}
+
+/*
+ * Returns false (and leaves the CPU alone) if the snapshot was taken of a CPU with a different memory size
+ */
+bool restoreSnapshot(CPU *cpu, const SNAPSHOT *snapshot) {
+    if(snapshot->memorySize != cpu->memorySize)
+        return false;
+
+    if(cpu->snapshotSerial == snapshot->serial) {
+        for(uint32_t i = 0; i < cpu->dirtyCount; i++) {
+            uint32_t index = cpu->dirtyPages[i];
+            restorePage(cpu, index, snapshot->pages[index]? snapshot->pages[index] : zeroPage);
+        }
+    } else {
+        for(uint32_t i = 0; i < (cpu->memorySize >> GUEST_PAGE_SHIFT); i++) {
+            if(snapshot->pages[i] != NULL || (cpu->pages[i].flags & PAGE_WRITTEN)) {
+                restorePage(cpu, i, snapshot->pages[i]? snapshot->pages[i] : zeroPage);
+                if(snapshot->pages[i] != NULL)
+                    cpu->pages[i].flags |= PAGE_WRITTEN;
+            }
+        }
+    }
+
+    memcpy(cpu->registers, snapshot->registers, sizeof(cpu->registers));
+    setStatusRegister(cpu, snapshot->statusRegister); // the banks are as they were for this mode
+    memcpy(cpu->bankedRegisters, snapshot->bankedRegisters, sizeof(cpu->bankedRegisters));
+    cpu->programEnd = snapshot->programEnd;
+    cpu->exitCode = snapshot->exitCode;
+
+    clearDirtyPages(cpu, snapshot->serial);
+    return true;
+}
@@ -0,0 +1,181 @@
+/*
+ * Software interupts (SWI)
+ *
+ * -------------------------------------------------------------------------------
+ * | Cond | 1111 | Comment field (SWI number)                                     |
+ * -------------------------------------------------------------------------------
+ *
+ * On an ARM2 a SWI switches to supervisor mode, disables IRQs, saves the return address with the PSR (R15 as it is
+ * stored) in R14 and jumps to the vector at 0x08. A guest with its own handler there gets exactly that.
+ *
+ * A small set of RISC OS calls are host calls instead, done by the emulator without going through the vector, so that
+ * a program can do I/O with nothing else loaded. Bit 17 (the X bit, return errors rather than raise them) is ignored,
+ * none of these can fail.
+ *
+ *      0x00  OS_WriteC             write the byte in R0
+ *      0x02  OS_Write0             write the zero terminated string at R0, R0 is left just after the terminator
+ *      0x03  OS_NewLine            write a line feed
+ *      0x04  OS_ReadC              read a byte into R0, C is set (and R0 is 27, escape) at the end of input
+ *      0x11  OS_Exit               halt, with R2 as the exit code if R1 is "ABEX"
+ *      0x42  OS_ReadMonotonicTime  R0 = centiseconds since the machine was created
+ *      0x46  OS_WriteN             write R1 bytes from R0
+ *
+ * Output is collected in a buffer, which the UART (devices.c) shares, and written with a single fwrite() when it
+ * fills, before reading input, when the program exits and when armpitRun() or armpitStep() return. Strings and blocks
+ * are copied straight out of guest memory a page at a time.
+ */
+
+#define _POSIX_C_SOURCE 200809L // for clock_gettime when compiling with -std=c11
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "flags.h"
+#include "memory.h"
+
+
+#define OS_WRITEC               0x00
+#define OS_WRITE0               0x02
+#define OS_NEWLINE              0x03
+#define OS_READC                0x04
+#define OS_EXIT                 0x11
+#define OS_READ_MONOTONIC_TIME  0x42
+#define OS_WRITEN               0x46
+
+#define SWI_X_BIT   (1u << 17)
+#define SWI_VECTOR  0x08
+#define ABEX        0x58454241  // "ABEX" in R1 says R2 is an exit code
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+
+uint64_t hostCentiseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 100 + (uint64_t)now.tv_nsec / 10000000;
+}
+
+void flushOutput(CPU *cpu) {
+    if(cpu->outputLength > 0) {
+        fwrite(cpu->output, 1, cpu->outputLength, stdout);
+        cpu->outputLength = 0;
+    }
+    fflush(stdout);
+}
+
+void freeOutput(CPU *cpu) {
+    flushOutput(cpu);
+    free(cpu->output);
+    cpu->output = NULL;
+}
+
+void writeOutput(CPU *cpu, const BYTE *data, uint32_t length) {
+    if(cpu->output == NULL)
+        cpu->output = malloc(OUTPUT_BUFFER_SIZE);
+    if(cpu->output == NULL || cpu->outputLength + length > OUTPUT_BUFFER_SIZE) {
+        flushOutput(cpu);
+        if(cpu->output == NULL || length > OUTPUT_BUFFER_SIZE) {
+            fwrite(data, 1, length, stdout); // too big to be worth buffering
+            return;
+        }
+    }
+    memcpy(cpu->output + cpu->outputLength, data, length);
+    cpu->outputLength += length;
+}
+
+/*
+ * Writes length bytes of guest memory from address, or up to a zero byte if terminated (returning the length
+ * including the zero). Memory that can't be read directly goes a byte at a time.
+ */
+static uint32_t writeGuest(CPU *cpu, REGISTER address, uint32_t length, bool terminated) {
+    uint32_t written = 0;
+
+    while(written < length) {
+        REGISTER at = address + written;
+        uint32_t chunk = GUEST_PAGE_SIZE - (at & (GUEST_PAGE_SIZE - 1));
+        if(chunk > length - written)
+            chunk = length - written;
+
+        const BYTE *data = directMemory(cpu, at, chunk, false);
+        if(data == NULL) {
+            BYTE byte = readMemoryByte(cpu, at);
+            if(terminated && byte == 0)
+                return written + 1;
+            writeOutput(cpu, &byte, 1);
+            written++;
+            continue;
+        }
+        if(terminated) {
+            const BYTE *end = memchr(data, 0, chunk);
+            if(end != NULL) {
+                writeOutput(cpu, data, (uint32_t)(end - data));
+                return written + (uint32_t)(end - data) + 1;
+            }
+        }
+        writeOutput(cpu, data, chunk);
+        written += chunk;
+    }
+    return written;
+}
+
+static void setCarry(CPU *cpu, bool carry) {
+    BYTE status = getStatusRegister(cpu);
+    setStatusRegister(cpu, carry? (status | STATUS_C) : (status & ~STATUS_C));
+}
+
+/*
+ * Runs a host call, false if number isn't one
+ */
+static bool hostCall(CPU *cpu, uint32_t number) {
+    REGISTER *registers = cpu->registers;
+    BYTE byte;
+
+    switch(number) {
+        case OS_WRITEC:
+            byte = (BYTE)registers[0];
+            writeOutput(cpu, &byte, 1);
+            break;
+        case OS_WRITE0:
+            // a string with no terminator stops after going once round memory
+            registers[0] += writeGuest(cpu, registers[0], cpu->memorySize, true);
+            break;
+        case OS_NEWLINE:
+            writeOutput(cpu, (const BYTE *)"\n", 1);
+            break;
+        case OS_READC: {
+            flushOutput(cpu); // show any prompt first
+            int c = getchar();
+            registers[0] = (c == EOF)? 27 : (REGISTER)c;
+            setCarry(cpu, c == EOF);
+            break;
+        }
+        case OS_EXIT:
+            flushOutput(cpu);
+            cpu->exitCode = (registers[1] == ABEX)? registers[2] : 0;
+            cpu->programEnd = registers[PROGRAM_COUNTER]; // every engine stops here
+            break;
+        case OS_READ_MONOTONIC_TIME:
+            registers[0] = (REGISTER)(hostCentiseconds() - cpu->clockStart);
+            break;
+        case OS_WRITEN:
+            writeGuest(cpu, registers[0], registers[1], false);
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+void doInterupt(CPU *cpu, const DECODED *decoded) {
+    uint32_t number = decoded->operand2 & ~SWI_X_BIT;
+
+    if(TRACE)
+        printf("\tSWI %06X\n", decoded->operand2);
+
+    if(hostCall(cpu, number))
+        return;
+
+    enterException(cpu, MODE_SVC, SWI_VECTOR, cpu->registers[PROGRAM_COUNTER], STATUS_I);
+}
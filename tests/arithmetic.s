@@ -0,0 +1,34 @@
+; Data processing: every opcode, shifts by immediate and by register, RRX, and the flags they set.
+; R0 is the seed, which the lane check varies.
+
+    ORR r0, r0, #1
+    MOV r3, #0
+    MOV r9, #0
+loop:
+    EOR r0, r0, r0, LSL #13         ; xorshift
+    EOR r0, r0, r0, LSR #17
+    EOR r0, r0, r0, LSL #5
+    AND r4, r0, #31
+    MOVS r5, r0, LSL r4
+    ADC r6, r6, r5, ASR r4
+    SBCS r7, r7, r0, ROR r4
+    RSC r8, r8, r0, LSR #32
+    RSBS r8, r8, r7, ASR #32
+    MOVS r10, r0, RRX
+    ADDCS r9, r9, #1
+    BIC r10, r10, r0, LSL #3
+    MVNMI r11, r10
+    TEQ r0, r11
+    ORRGT r12, r12, r0
+    EORLE r12, r12, r10
+    CMN r0, r12
+    SUBVS r1, r1, r0
+    ADDVC r1, r1, r0, LSR #2
+    TST r0, #0x80000000
+    ADDNE r2, r2, #3
+    SUBHI r2, r2, r4
+    SUBLS r2, r2, #1
+    ADD r3, r3, #1
+    CMP r3, #1000
+    BLT loop
+    SWI 0x11
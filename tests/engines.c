@@ -0,0 +1,291 @@
+/*
+ * armpit-engine-test - runs a program on every engine and checks each one against the reference loop.
+ *
+ * Compile and run using:
+ * 			cmake --build <build directory> && ctest --test-dir <build directory>
+ *
+ * ctest runs this once for each program in tests/ (see CMakeLists.txt). The program is run to its end with the
+ * reference loop, then on a new machine with each of the threaded interpreter, the JIT and the AOT engine (using code
+ * armpit-aot translates from it first). They have to finish with the same registers, status register, exit code and
+ * number of instructions executed. The same is done again stopping half way, so every engine is also checked stopping
+ * inside a block. Then the program is run over a set of inputs on vector lanes and each input's registers and the
+ * total number of instructions are checked against running it on its own with each input.
+ *
+ * Exits with 0 if everything agreed and 1 if anything didn't, printing what differed.
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fork and waitpid when compiling with -std=c11
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "libarmpit.h"
+
+
+#define MEMORY_SIZE     (1 << 24) // armpit-aot is told the same
+#define LANE_INPUTS     12      // more than one group of lanes, and a group that isn't full
+#define LANE_REGISTERS  15      // R0 to R14 in and out
+
+char USAGE[] = "\nUsage: armpit-engine-test [arguments] <program>\n\nArguments:\n --aot-tool <file>\tarmpit-aot, to translate the program for the AOT engine\n --cc <compiler>\tthe C compiler armpit-aot uses\n --work-dir <directory>\twhere the translation goes (default the current directory)\n --load-address <address>\twhere the program is loaded (default 0x8000)\n --timer <address>\tattach a timer at address (and don't run on lanes, which don't take interrupts)\n -h\t\thelp";
+
+#define OPTION_AOT_TOOL 256
+#define OPTION_CC 257
+#define OPTION_WORK_DIR 258
+#define OPTION_LOAD_ADDRESS 259
+#define OPTION_TIMER 260
+
+static const char *optString = "h";
+static const struct option longOptions[] = {
+    { "aot-tool", required_argument, NULL, OPTION_AOT_TOOL },
+    { "cc", required_argument, NULL, OPTION_CC },
+    { "work-dir", required_argument, NULL, OPTION_WORK_DIR },
+    { "load-address", required_argument, NULL, OPTION_LOAD_ADDRESS },
+    { "timer", required_argument, NULL, OPTION_TIMER },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+typedef struct RESULT {
+    uint32_t registers[16];
+    uint8_t status;
+    uint32_t exitCode;
+    uint64_t executed;
+} RESULT;
+
+static const char *programName;
+static uint32_t loadAddress = 0x8000;
+static long timerAddress = -1;
+
+
+static ARMPIT *loadProgram(void) {
+    ARMPIT *armpit = armpitCreate(MEMORY_SIZE);
+    if(armpit == NULL) {
+        printf("Unable to create a machine\n");
+        return NULL;
+    }
+    armpitSetRegister(armpit, ARMPIT_PC, loadAddress);
+    if(!armpitLoadImage(armpit, programName, loadAddress)
+            || (timerAddress >= 0 && !armpitAttachTimer(armpit, (uint32_t)timerAddress))) {
+        armpitDestroy(armpit);
+        return NULL;
+    }
+    return armpit;
+}
+
+static void saveResult(ARMPIT *armpit, uint64_t executed, RESULT *result) {
+    for(int i = 0; i < 16; i++)
+        result->registers[i] = armpitGetRegister(armpit, i);
+    result->status = armpitGetStatus(armpit);
+    result->exitCode = armpitExitCode(armpit);
+    result->executed = executed;
+}
+
+/*
+ * Runs the program on a new machine with the engine, for up to maxSteps instructions (0 to the end)
+ */
+static bool runProgram(ARMPIT_ENGINE engine, const char *aotFile, uint64_t maxSteps, RESULT *result) {
+    ARMPIT *armpit = loadProgram();
+    if(armpit == NULL)
+        return false;
+    if(aotFile != NULL && !armpitLoadAot(armpit, aotFile)) {
+        armpitDestroy(armpit);
+        return false;
+    }
+    if(!armpitSetEngine(armpit, engine) && engine == ARMPIT_ENGINE_JIT)
+        printf("  (the JIT isn't supported here, that is the threaded interpreter)\n");
+
+    saveResult(armpit, armpitRun(armpit, maxSteps).executed, result);
+    armpitDestroy(armpit);
+    return true;
+}
+
+static bool sameResult(const char *engineName, const RESULT *expected, const RESULT *got) {
+    bool same = true;
+
+    for(int i = 0; i < 16; i++) {
+        if(expected->registers[i] != got->registers[i]) {
+            printf("  %s: R%d is %08X, should be %08X\n", engineName, i, got->registers[i], expected->registers[i]);
+            same = false;
+        }
+    }
+    if(expected->status != got->status) {
+        printf("  %s: status register is %02X, should be %02X\n", engineName, got->status, expected->status);
+        same = false;
+    }
+    if(expected->exitCode != got->exitCode) {
+        printf("  %s: exit code is %u, should be %u\n", engineName, got->exitCode, expected->exitCode);
+        same = false;
+    }
+    if(expected->executed != got->executed) {
+        printf("  %s: executed %llu instructions, should be %llu\n", engineName, (unsigned long long)got->executed,
+               (unsigned long long)expected->executed);
+        same = false;
+    }
+    return same;
+}
+
+/*
+ * Runs armpit-aot on the program, returns false if it didn't make outputName
+ */
+static bool translate(const char *tool, const char *compiler, const char *outputName) {
+    char address[16], memorySize[16];
+    char *arguments[] = { (char *)tool, "-f", (char *)programName, "-o", (char *)outputName, "-m", memorySize,
+                          "--load-address", address, NULL, NULL, NULL };
+
+    snprintf(address, sizeof(address), "0x%X", loadAddress);
+    snprintf(memorySize, sizeof(memorySize), "%u", MEMORY_SIZE);
+    if(compiler != NULL) {
+        arguments[9] = "--cc";
+        arguments[10] = (char *)compiler;
+    }
+    fflush(stdout);
+
+    pid_t child = fork();
+    if(child < 0)
+        return false;
+    if(child == 0) {
+        execv(tool, arguments);
+        printf("Unable to run %s\n", tool);
+        _exit(127);
+    }
+    int status;
+    return waitpid(child, &status, 0) >= 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/*
+ * Each input is the registers the program starts with, with R0 and R1 changed, so that lanes go different ways
+ */
+static bool checkLanes(void) {
+    static uint32_t inputs[LANE_INPUTS][LANE_REGISTERS], outputs[LANE_INPUTS][LANE_REGISTERS];
+    uint64_t expectedExecuted = 0;
+    bool same = true;
+
+    ARMPIT *armpit = loadProgram();
+    if(armpit == NULL)
+        return false;
+    for(int i = 0; i < LANE_INPUTS; i++) {
+        for(int j = 0; j < LANE_REGISTERS; j++)
+            inputs[i][j] = armpitGetRegister(armpit, j);
+        inputs[i][0] ^= (uint32_t)i * 0x9e3779b9u;
+        inputs[i][1] += (uint32_t)i;
+    }
+    uint64_t executed = armpitRunLanes(armpit, &inputs[0][0], &outputs[0][0], LANE_INPUTS, LANE_REGISTERS);
+    armpitDestroy(armpit);
+
+    for(int i = 0; i < LANE_INPUTS; i++) {
+        if((armpit = loadProgram()) == NULL)
+            return false;
+        for(int j = 0; j < LANE_REGISTERS; j++)
+            armpitSetRegister(armpit, j, inputs[i][j]);
+        expectedExecuted += armpitRun(armpit, 0).executed;
+
+        for(int j = 0; j < LANE_REGISTERS; j++) {
+            if(outputs[i][j] != armpitGetRegister(armpit, j)) {
+                printf("  lanes: input %d R%d is %08X, should be %08X\n", i, j, outputs[i][j],
+                       armpitGetRegister(armpit, j));
+                same = false;
+            }
+        }
+        armpitDestroy(armpit);
+    }
+    if(executed != expectedExecuted) {
+        printf("  lanes: executed %llu instructions, should be %llu\n", (unsigned long long)executed,
+               (unsigned long long)expectedExecuted);
+        same = false;
+    }
+    return same;
+}
+
+int main(int argc, char *argv[]) {
+    const char *aotTool = NULL, *compiler = NULL, *workDirectory = ".";
+    char *endPtr;
+    int opt;
+
+    while((opt = getopt_long(argc, argv, optString, longOptions, NULL)) != -1) {
+        switch(opt) {
+            case OPTION_AOT_TOOL:
+                aotTool = optarg;
+                break;
+            case OPTION_CC:
+                compiler = optarg;
+                break;
+            case OPTION_WORK_DIR:
+                workDirectory = optarg;
+                break;
+            case OPTION_LOAD_ADDRESS:
+            case OPTION_TIMER: {
+                unsigned long value = strtoul(optarg, &endPtr, 0);
+                if(*optarg == '\0' || *endPtr != '\0') {
+                    printf("Invalid address: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                if(opt == OPTION_LOAD_ADDRESS)
+                    loadAddress = (uint32_t)value;
+                else
+                    timerAddress = (long)value;
+                break;
+            }
+            case 'h':
+                puts(USAGE);
+                return EXIT_SUCCESS;
+            default:
+                puts(USAGE);
+                return EXIT_FAILURE;
+        }
+    }
+    if(optind != argc - 1 || aotTool == NULL) {
+        puts(USAGE);
+        return EXIT_FAILURE;
+    }
+    programName = argv[optind];
+
+    static const struct { const char *name; ARMPIT_ENGINE engine; } engines[] = {
+        { "threaded", ARMPIT_ENGINE_THREADED }, { "jit", ARMPIT_ENGINE_JIT }, { "aot", ARMPIT_ENGINE_AOT }
+    };
+
+    // the translation is named after the program, in the working directory
+    const char *baseName = strrchr(programName, '/')? strrchr(programName, '/') + 1 : programName;
+    size_t length = strlen(workDirectory) + strlen(baseName) + 8;
+    char *aotFile = malloc(length);
+    if(aotFile == NULL)
+        return EXIT_FAILURE;
+    snprintf(aotFile, length, "%s/%s.so", workDirectory, baseName);
+    if(!translate(aotTool, compiler, aotFile)) {
+        printf("%s: armpit-aot failed\n", programName);
+        return EXIT_FAILURE;
+    }
+
+    RESULT expected, got;
+    bool passed = runProgram(ARMPIT_ENGINE_REFERENCE, NULL, 0, &expected);
+    if(!passed)
+        return EXIT_FAILURE;
+    printf("%s: %llu instructions\n", programName, (unsigned long long)expected.executed);
+
+    for(int stopEarly = 0; stopEarly <= 1; stopEarly++) {
+        uint64_t maxSteps = stopEarly? expected.executed / 2 + 1 : 0;
+        RESULT reference = expected;
+        if(stopEarly && !runProgram(ARMPIT_ENGINE_REFERENCE, NULL, maxSteps, &reference))
+            return EXIT_FAILURE;
+
+        for(size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+            char name[64];
+            snprintf(name, sizeof(name), "%s%s", engines[i].name, stopEarly? " stopping half way" : "");
+            bool aot = engines[i].engine == ARMPIT_ENGINE_AOT;
+            if(!runProgram(engines[i].engine, aot? aotFile : NULL, maxSteps, &got))
+                return EXIT_FAILURE;
+            passed &= sameResult(name, &reference, &got);
+        }
+    }
+
+    if(timerAddress < 0)
+        passed &= checkLanes();
+
+    remove(aotFile);
+    free(aotFile);
+    printf("%s\n", passed? "passed" : "FAILED");
+    return passed? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,24 @@
+; The undefined instruction trap, into supervisor mode and back. Loaded at 0 so the vectors are in place.
+
+    B start
+    B undefined
+    B start
+    B start
+    B start
+    B start
+    B start
+    B start
+start:
+    MOV r3, #0
+loop:
+    ADD r0, r0, #1
+    .word 0xE6000010                ; undefined
+    ADD r0, r0, #4
+    ADD r3, r3, #1
+    CMP r3, #50
+    BNE loop
+    SWI 0x11
+undefined:
+    MOV r1, r14
+    ADD r2, r2, #1
+    MOVS pc, r14
@@ -0,0 +1,46 @@
+; Loads and stores of words and bytes with every addressing form, block transfers, and calls with BL and MOV PC, LR.
+
+    MOV r1, #0
+    MOV r5, #0x10000
+    MOV r6, #0
+    MOV r9, #3
+    MOV r3, #0
+outer:
+    MOV r2, #0
+inner:
+    EOR r0, r0, r0, LSL #13
+    EOR r0, r0, r0, LSR #17
+    EOR r0, r0, r0, LSL #5
+    AND r7, r2, #63
+    STR r0, [r5, r7, LSL #2]
+    LDRB r8, [r5, r7]
+    ADDS r1, r1, r8
+    ADC r6, r6, #0
+    MOV r4, r0, ROR r9
+    RSBS r4, r4, r1, ASR r9
+    SBCS r6, r6, r4, LSL r9
+    STMFD sp!, {r0-r3}
+    BL function
+    LDMFD sp!, {r0-r3}
+    LDR r10, [r5], #4
+    STRB r10, [r5, #-3]!
+    LDR r11, [r5, #-1]              ; unaligned, rotated
+    EOR r12, r12, r11
+    SUB r5, r5, #1
+    ADD r2, r2, #1
+    CMP r2, #100
+    BLT inner
+    MOVS r11, r1, LSR #1
+    ADDCS r12, r12, #1
+    SUBS r9, r9, #1
+    ADDMI r9, r9, #4
+    ADD r3, r3, #1
+    CMP r3, #50
+    BNE outer
+    SWI 0x11
+
+function:
+    ADD r0, r0, r1
+    TEQ r0, r1
+    MOVEQ r0, #5
+    MOV pc, lr
@@ -0,0 +1,14 @@
+; MUL and MLA, with and without S.
+
+    ORR r1, r0, #6
+    MOV r2, #7
+    MOV r5, #100
+loop:
+    MUL r0, r1, r2
+    MLAS r3, r1, r2, r3
+    MULS r4, r3, r1
+    ADDMI r6, r6, #1
+    ADD r1, r1, r0
+    SUBS r5, r5, #1
+    BNE loop
+    SWI 0x11
@@ -0,0 +1,138 @@
+; Random data processing (R15 read as Rn and Rm too) and loads and stores around R12, generated once and kept.
+    MOV r12, #0x10000
+    MOV r11, #40
+    .word 0xE3A0082C
+    .word 0xE3A01B79
+    .word 0xE3A020ED
+    .word 0xE3A03EE6
+    .word 0xE3A047F8
+    .word 0xE3A051A8
+    .word 0xE3A06504
+    .word 0xE3A0739F
+    .word 0xE3A08BE5
+    .word 0xE3A09F02
+    .word 0xE3A0A7E3
+loop:
+    .word 0xE2E63C76
+    .word 0xE5CC210E
+    .word 0xE58C2154
+    .word 0xE58C3310
+    .word 0xE2A1401B
+    .word 0xE05455A5
+    .word 0xE5CC6025
+    .word 0xE1807339
+    .word 0x71717155
+    .word 0xE1745518
+    .word 0xE5CC714A
+    .word 0x159C32C0
+    .word 0x7080A935
+    .word 0xA59C2379
+    .word 0xE1B72EA9
+    .word 0xB1F74812
+    .word 0xA59C13EF
+    .word 0xE59C5046
+    .word 0x511F4025
+    .word 0xE5DC724F
+    .word 0xA37A4D12
+    .word 0xE5DC5122
+    .word 0xE37F4D55
+    .word 0xE5DC922A
+    .word 0x03CA3156
+    .word 0x30825B08
+    .word 0xE2C058E9
+    .word 0xD3798972
+    .word 0xE1362549
+    .word 0xE2C19007
+    .word 0xE299ADD0
+    .word 0x71992D4F
+    .word 0xE5DC4125
+    .word 0xE1C04886
+    .word 0xE024795F
+    .word 0x82642AC1
+    .word 0xB1DA5439
+    .word 0xE0660C66
+    .word 0xE2D1701A
+    .word 0x61F224E8
+    .word 0xE0243611
+    .word 0x60231E21
+    .word 0xE3A91376
+    .word 0xB2296DD0
+    .word 0xE3FA51C8
+    .word 0xE1314444
+    .word 0xD38F2AEE
+    .word 0xE0498A66
+    .word 0xE1862A13
+    .word 0xE3943B28
+    .word 0x6176A685
+    .word 0x62232FAE
+    .word 0x73776DB7
+    .word 0xE2C2AC57
+    .word 0x7112403A
+    .word 0xE59C03A7
+    .word 0xE5CC43A1
+    .word 0xB58C01D8
+    .word 0x93772223
+    .word 0xB0E3A8EA
+    .word 0xE1A00248
+    .word 0xE5CC01F2
+    .word 0x7026460A
+    .word 0xE3838A0B
+    .word 0x12A93B71
+    .word 0xE1840713
+    .word 0xE5DC2109
+    .word 0xE25A91F7
+    .word 0xE2D15A0B
+    .word 0xE5CCA10D
+    .word 0xE2046C3C
+    .word 0xE1342855
+    .word 0x80652614
+    .word 0xE1792912
+    .word 0xE3D16E44
+    .word 0x70BA0068
+    .word 0xE59C3002
+    .word 0xE3F768DD
+    .word 0x41755C8A
+    .word 0xE2F06CB4
+    .word 0xE0DA7C08
+    .word 0x10B50F49
+    .word 0xE1C28685
+    .word 0xE059907F
+    .word 0xE04A16C4
+    .word 0xE0685A70
+    .word 0xE1515158
+    .word 0xE1112D22
+    .word 0xE2F46A95
+    .word 0xE0789972
+    .word 0xE59C03E0
+    .word 0xE0573063
+    .word 0xE05525E1
+    .word 0xE2711A5F
+    .word 0xE0486B80
+    .word 0xE197175F
+    .word 0xC154290A
+    .word 0xE5CC01C3
+    .word 0xE0414C26
+    .word 0x317010C2
+    .word 0xE3830E2A
+    .word 0xE3108C91
+    .word 0x80260C66
+    .word 0xE5CC226C
+    .word 0x65CC3326
+    .word 0xE1F04221
+    .word 0xE3AA3FCD
+    .word 0x91C51610
+    .word 0xE37232E1
+    .word 0xE19547E8
+    .word 0x2013231F
+    .word 0xE2F80C55
+    .word 0xC1317C45
+    .word 0x45CC01B2
+    .word 0xE1326971
+    .word 0xE0251455
+    .word 0xE07047A6
+    .word 0x959C9119
+    .word 0xE59C03A5
+    .word 0xE59C034A
+    SUBS r11, r11, #1
+    BNE loop
+    SWI 0x11
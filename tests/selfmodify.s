@@ -0,0 +1,15 @@
+; Code that writes over an instruction of the loop it is running in, part way through.
+
+    MOV r4, #0x8000
+    LDR r5, [r4, #0x2C]             ; the replacement instruction below
+    MOV r3, #0
+loop:
+    ADD r3, r3, #1
+    CMP r3, #10
+    STREQ r5, [r4, #0x18]           ; over the ADD just after
+    ADD r6, r6, #1
+    CMP r3, #20
+    BNE loop
+    SWI 0x11
+    .word 0
+    .word 0xE2877001                ; ADD r7, r7, #1
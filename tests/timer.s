@@ -0,0 +1,31 @@
+; A timer IRQ every 1000 instructions, with the timer at 0x100000. Loaded at 0 so the vectors are in place.
+
+    B start
+    B start
+    B start
+    B start
+    B start
+    B start
+    B irq
+    B start
+start:
+    MOV r10, #0x100000
+    MOV r0, #1000
+    STR r0, [r10, #8]               ; interval
+    MOV r0, #1
+    MOV r3, #0
+    MOV r2, #0x10000
+loop:
+    EOR r0, r0, r0, LSL #13
+    EOR r0, r0, r0, LSR #17
+    EOR r0, r0, r0, LSL #5
+    ADD r1, r1, r0
+    ADD r3, r3, #1
+    CMP r3, r2
+    BNE loop
+    SWI 0x11
+irq:
+    ADD r9, r9, #1
+    EOR r1, r1, r9
+    STR r9, [r10, #0xC]             ; clear
+    SUBS pc, lr, #4
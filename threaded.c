@@ -0,0 +1,425 @@
+/*
+ * Threaded interpreter.
+ *
+ * An alternative to the reference loop in armpit.c which avoids its chain of switch statements (instruction type,
+ * condition code, opcode). Every decoded instruction carries the address of the code for its variant, one per
+ * (type, opcode, register/immediate operand 2, S bit), and each piece of code ends by fetching the next instruction and
+ * jumping straight to its variant. Having the indirect jump replicated at the end of every variant gives the branch
+ * predictor one jump per variant to learn instead of a single shared one.
+ *
+ * Computed goto (&&label) is a GCC/Clang extension, other compilers get a portable switch on the variant instead. Build
+ * with -DARMPIT_NO_COMPUTED_GOTO to force the switch version.
+ */
+
+#include <stdio.h>
+
+#include "flags.h"
+#include "memory.h"
+#include "profile.h"
+#include "shifter.h"
+
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(ARMPIT_NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO 1
+#else
+#define COMPUTED_GOTO 0
+#endif
+
+
+static inline REGISTER immediateOperand(const DECODED *decoded, int *carry) {
+    if(decoded->immediateCarry != SHIFTER_CARRY_UNCHANGED)
+        *carry = decoded->immediateCarry;
+    return decoded->operand2;
+}
+
+static inline REGISTER registerOperand(CPU *cpu, const DECODED *decoded, int *carry) {
+    // a plain register (LSL #0) needs no trip through the barrel shifter
+    if(decoded->shifter == SHIFTER_NONE)
+        return cpu->registers[decoded->regM];
+    return getOperand2(cpu, decoded, carry);
+}
+
+// for forms which don't set flags, the carry in is still needed by RRX
+static inline REGISTER plainRegisterOperand(CPU *cpu, const DECODED *decoded) {
+    if(decoded->shifter == SHIFTER_NONE)
+        return cpu->registers[decoded->regM];
+    int carry = carryFlag(cpu);
+    return getOperand2(cpu, decoded, &carry);
+}
+
+
+/*
+ * Names used in the operation expressions below:
+ *  N    - value of register Rn
+ *  OP2  - operand 2 after the barrel shifter
+ */
+#define N   cpu->registers[decoded->regN]
+#define RD  cpu->registers[decoded->regDest]
+
+/*
+ * Logical operations: RD = EXPR, the S form sets N and Z from the result and C from the shifter
+ */
+#define LOGICAL(OP, EXPR) \
+    TARGET(OP##_REG) { REGISTER OP2 = plainRegisterOperand(cpu, decoded); RD = (EXPR); NEXT(); } \
+    TARGET(OP##_REG_S) { int carry = carryFlag(cpu); REGISTER OP2 = registerOperand(cpu, decoded, &carry); REGISTER result = (EXPR); \
+                         RD = result; setLogicalFlags(cpu, result, carry); NEXT(); } \
+    TARGET(OP##_IMM) { REGISTER OP2 = decoded->operand2; RD = (EXPR); NEXT(); } \
+    TARGET(OP##_IMM_S) { int carry = carryFlag(cpu); REGISTER OP2 = immediateOperand(decoded, &carry); REGISTER result = (EXPR); \
+                         RD = result; setLogicalFlags(cpu, result, carry); NEXT(); }
+
+/*
+ * Logical tests (TST, TEQ) only set flags, with or without the S bit
+ */
+#define TEST(OP, EXPR) \
+    TARGET(OP##_REG) \
+    TARGET(OP##_REG_S) { int carry = carryFlag(cpu); REGISTER OP2 = registerOperand(cpu, decoded, &carry); setLogicalFlags(cpu, (EXPR), carry); NEXT(); } \
+    TARGET(OP##_IMM) \
+    TARGET(OP##_IMM_S) { int carry = carryFlag(cpu); REGISTER OP2 = immediateOperand(decoded, &carry); setLogicalFlags(cpu, (EXPR), carry); NEXT(); }
+
+/*
+ * Arithmetic operations: RD = A + B + CARRY_IN
+ */
+#define ARITHMETIC(OP, A, B, CARRY_IN) \
+    TARGET(OP##_REG) { REGISTER OP2 = plainRegisterOperand(cpu, decoded); \
+                       RD = addWithCarry(cpu, (A), (B), (CARRY_IN), false); NEXT(); } \
+    TARGET(OP##_REG_S) { int carry = carryFlag(cpu); REGISTER OP2 = registerOperand(cpu, decoded, &carry); \
+                         RD = addWithCarry(cpu, (A), (B), (CARRY_IN), true); NEXT(); } \
+    TARGET(OP##_IMM) { REGISTER OP2 = decoded->operand2; RD = addWithCarry(cpu, (A), (B), (CARRY_IN), false); NEXT(); } \
+    TARGET(OP##_IMM_S) { REGISTER OP2 = decoded->operand2; RD = addWithCarry(cpu, (A), (B), (CARRY_IN), true); NEXT(); }
+
+/*
+ * Comparisons (CMP, CMN) only set flags, with or without the S bit
+ */
+#define COMPARE(OP, A, B, CARRY_IN) \
+    TARGET(OP##_REG) \
+    TARGET(OP##_REG_S) { int carry = carryFlag(cpu); REGISTER OP2 = registerOperand(cpu, decoded, &carry); \
+                         addWithCarry(cpu, (A), (B), (CARRY_IN), true); NEXT(); } \
+    TARGET(OP##_IMM) \
+    TARGET(OP##_IMM_S) { REGISTER OP2 = decoded->operand2; addWithCarry(cpu, (A), (B), (CARRY_IN), true); NEXT(); }
+
+
+/*
+ * Control flow
+ *
+ * A taken branch goes straight to the decoded record of its target, which the branch record keeps (chained) after
+ * it is first taken, rather than looking the target up again every time. The target's record can have been
+ * invalidated since by a store; looking it up again decodes it in the same place.
+ *
+ * BL also pushes its return address, with the record of the instruction there, onto a small return stack. When a
+ * return (MOV PC, LR or a load of the PC) lands where the top of the stack says, that record is used; anything else is
+ * looked up. A misprediction costs no more than the lookup, so the stack just wraps when calls nest deeper.
+ */
+#define RETURN_STACK_SIZE 16 // a power of 2
+
+typedef struct RETURN_STACK {
+    REGISTER address[RETURN_STACK_SIZE];
+    const DECODED *record[RETURN_STACK_SIZE]; // NULL if not known
+    unsigned top;
+    unsigned depth;
+} RETURN_STACK;
+
+static inline const DECODED *takeBranch(CPU *cpu, const DECODED *decoded, RETURN_STACK *returns) {
+    REGISTER next = cpu->registers[PROGRAM_COUNTER];
+    REGISTER target = (next + decoded->operand2) & PC_MASK;
+
+    if(decoded->link) {
+        cpu->registers[LINK_REGISTER] = pcWithPsr(cpu, next);
+        returns->address[returns->top] = next;
+        returns->record[returns->top] = (next & (GUEST_PAGE_SIZE - 1))? decoded + 1 : NULL; // the next word, if in this page
+        returns->top = (returns->top + 1) & (RETURN_STACK_SIZE - 1);
+        returns->depth += returns->depth < RETURN_STACK_SIZE;
+    }
+    cpu->registers[PROGRAM_COUNTER] = target;
+
+    const DECODED *chained = decoded->chained;
+    if(chained == NULL || chained->handler == NULL) {
+        chained = lookupDecoded(cpu, target);
+        ((DECODED *)decoded)->chained = chained; // the records belong to the decode cache, they are only const to handlers
+    }
+    return chained;
+}
+
+static inline const DECODED *returnTarget(CPU *cpu, RETURN_STACK *returns) {
+    REGISTER pc = cpu->registers[PROGRAM_COUNTER];
+
+    if(returns->depth > 0) {
+        returns->depth--;
+        returns->top = (returns->top - 1) & (RETURN_STACK_SIZE - 1);
+        const DECODED *record = returns->record[returns->top];
+        if(returns->address[returns->top] == pc && record != NULL && record->handler != NULL)
+            return record;
+    }
+    return lookupDecoded(cpu, pc);
+}
+
+
+/*
+ * Superinstructions (see decode.c for the patterns)
+ *
+ * A fused group only runs as one when every instruction in it would have run anyway: the step limit isn't reached
+ * part way through, the halt address isn't inside it, and nothing is watching each instruction (the profiler). If it
+ * can't, the first instruction runs on its own as usual and the rest follow one at a time. Either way every
+ * instruction in the group is counted and leaves the registers and flags as it would on its own.
+ */
+static inline bool fusable(CPU *cpu, const DECODED *decoded, uint64_t executed, uint64_t maxSteps) {
+    REGISTER rest = 4 * (REGISTER)(decoded->fusedLength - 1); // the group after the first instruction, from the PC
+    return maxSteps - executed >= decoded->fusedLength - 1u
+        && (REGISTER)(cpu->programEnd - cpu->registers[PROGRAM_COUNTER]) >= rest
+        && cpu->profile == NULL;
+}
+
+// the record of the instruction at the PC, which is number in the group starting at decoded
+static inline const DECODED *groupRecord(CPU *cpu, const DECODED *decoded, int number) {
+    return (decoded[number].handler != NULL)? &decoded[number] : lookupDecoded(cpu, cpu->registers[PROGRAM_COUNTER]);
+}
+
+// the record of the instruction at the PC, which follows last
+static inline const DECODED *followingRecord(CPU *cpu, const DECODED *last) {
+    REGISTER pc = cpu->registers[PROGRAM_COUNTER];
+    return ((pc & (GUEST_PAGE_SIZE - 1)) != 0 && last[1].handler != NULL)? last + 1 : lookupDecoded(cpu, pc);
+}
+
+/*
+ * A branch's condition worked out from what the comparison before it compared, rather than from the flags it set.
+ * subtract is set for CMP and SUBS (a - b), for which the unsigned and signed orderings are just a compared with b.
+ */
+static inline bool comparisonPassed(CPU *cpu, BYTE condition, bool subtract, REGISTER a, REGISTER b, REGISTER result) {
+    switch(condition) {
+        case CONDITION_EQUAL:       return result == 0;
+        case CONDITION_NOT_EQUAL:   return result != 0;
+        case CONDITION_MINUS:       return (int32_t)result < 0;
+        case CONDITION_PLUS:        return (int32_t)result >= 0;
+    }
+    if(!subtract)
+        return conditionPassed(cpu, condition);
+    switch(condition) {
+        case CONDITION_CARRY_SET:           return a >= b;
+        case CONDITION_CARRY_CLEAR:         return a < b;
+        case CONDITION_HIGHER:              return a > b;
+        case CONDITION_LOWER_OR_SAME:       return a <= b;
+        case CONDITION_GREATER_OR_EQUAL:    return (int32_t)a >= (int32_t)b;
+        case CONDITION_LESS_THAN:           return (int32_t)a < (int32_t)b;
+        case CONDITION_GREATER_THAN:        return (int32_t)a > (int32_t)b;
+        case CONDITION_LESS_OR_EQUAL:       return (int32_t)a <= (int32_t)b;
+        default:                            return conditionPassed(cpu, condition); // VS, VC
+    }
+}
+
+/*
+ * Runs the rest of a fused group whose first instruction has been fetched and counted (and whose condition passed)
+ * and returns the record of the instruction after it.
+ */
+static inline const DECODED *runFused(CPU *cpu, const DECODED *decoded, RETURN_STACK *returns, uint64_t *executed) {
+    REGISTER *registers = cpu->registers;
+    const DECODED *second = groupRecord(cpu, decoded, 1);
+    REGISTER a = registers[decoded->regN];
+    REGISTER b = decoded->immediate? decoded->operand2 : registers[decoded->regM];
+    REGISTER result;
+    bool subtract = false;
+
+    cpu->fusionHits[decoded->fusion]++;
+    switch(decoded->fusion) {
+        case ARMPIT_FUSION_COMPARE_BRANCH:
+            if(decoded->opCode == OP_TST || decoded->opCode == OP_TEQ) {
+                int carry = carryFlag(cpu);
+                if(decoded->immediate)
+                    immediateOperand(decoded, &carry);
+                result = (decoded->opCode == OP_TST)? a & b : a ^ b;
+                setLogicalFlags(cpu, result, carry);
+            } else {
+                subtract = decoded->opCode == OP_CMP;
+                result = subtract? addWithCarry(cpu, a, ~b, 1, true) : addWithCarry(cpu, a, b, 0, true);
+            }
+            break;
+        case ARMPIT_FUSION_COUNT_LOOP:
+            result = registers[decoded->regDest] = addWithCarry(cpu, a, ~b, 1, true);
+            subtract = true;
+            break;
+        case ARMPIT_FUSION_MOVE_ADD:
+            registers[decoded->regDest] = b;
+            registers[second->regDest] = registers[second->regN]
+                                       + (second->immediate? second->operand2 : registers[second->regM]);
+            registers[PROGRAM_COUNTER] += 4;
+            (*executed)++;
+            return followingRecord(cpu, second);
+        default: { // ARMPIT_FUSION_CONDITION_RUN, none of which change the condition
+            const DECODED *member = decoded;
+            decoded->handler(cpu, decoded);
+            for(int number = 1; number < decoded->fusedLength; number++) {
+                member = (number == 1)? second : groupRecord(cpu, decoded, number);
+                registers[PROGRAM_COUNTER] += 4;
+                member->handler(cpu, member);
+            }
+            *executed += decoded->fusedLength - 1u;
+            return followingRecord(cpu, member);
+        }
+    }
+
+    // the conditional branch
+    registers[PROGRAM_COUNTER] += 4;
+    (*executed)++;
+    if(comparisonPassed(cpu, second->condition, subtract, a, b, result))
+        return takeBranch(cpu, second, returns);
+    return followingRecord(cpu, second);
+}
+
+// a run whose condition failed is skipped as a whole
+static inline void skipRun(CPU *cpu, const DECODED *decoded, uint64_t *executed) {
+    cpu->fusionHits[ARMPIT_FUSION_CONDITION_RUN]++;
+    cpu->registers[PROGRAM_COUNTER] += 4 * (REGISTER)(decoded->fusedLength - 1);
+    *executed += decoded->fusedLength - 1u;
+}
+
+#define SKIPPABLE_RUN(decoded) ((decoded)->fusedLength > 1 && (decoded)->fusion == ARMPIT_FUSION_CONDITION_RUN)
+
+
+#if COMPUTED_GOTO
+
+#define TARGET(name) name:
+
+// fetch the next instruction and jump straight to the code for its variant
+#define NEXT() DISPATCH(lookupDecoded(cpu, cpu->registers[PROGRAM_COUNTER]))
+#define CHAIN(record) do { const DECODED *next = (record); DISPATCH(next); } while(0)
+
+// go to the code for an instruction whose decoded record is already known
+#define DISPATCH(record) do { \
+        if(executed >= maxSteps || cpu->registers[PROGRAM_COUNTER] == cpu->programEnd) goto done; \
+        decoded = (record); \
+        cpu->registers[PROGRAM_COUNTER] += 4; \
+        executed++; \
+        if(decoded->condition != CONDITION_ALWAYS && !conditionPassed(cpu, decoded->condition)) { \
+            PROFILE(cpu, decoded, false); \
+            goto skipped; \
+        } \
+        PROFILE(cpu, decoded, true); \
+        goto *decoded->threaded; \
+    } while(0)
+
+#else
+
+#define TARGET(name) case VARIANT_##name:
+#define NEXT() continue
+#define CHAIN(record) { chained = (record); continue; }
+
+#endif
+
+
+/*
+ * Runs until halt or until maxSteps instructions have been executed (0 means no limit).
+ * Returns the number of instructions executed, including those skipped by their condition code.
+ */
+uint64_t runThreaded(CPU *cpu, uint64_t maxSteps) {
+    const DECODED *decoded;
+    uint64_t executed = 0;
+    RETURN_STACK returns = { .depth = 0, .top = 0 };
+
+    if(maxSteps == 0)
+        maxSteps = UINT64_MAX;
+
+#if COMPUTED_GOTO
+#define ALU_TARGETS(OP) &&OP##_REG, &&OP##_REG_S, &&OP##_IMM, &&OP##_IMM_S,
+    static const void *const targets[VARIANT_COUNT] = {
+        ALU_OPS(ALU_TARGETS)
+        &&BRANCH_TARGET,
+        &&RETURN_TARGET,
+        &&DATA_TRANSFER_TARGET,
+        &&HANDLER_TARGET,
+        &&INTERUPT_TARGET,
+        &&UNDEFINED_TARGET,
+        &&FUSED_TARGET
+    };
+#undef ALU_TARGETS
+    setThreadedTargets(cpu, targets);
+
+    NEXT();
+skipped:
+    if(SKIPPABLE_RUN(decoded) && fusable(cpu, decoded, executed, maxSteps))
+        skipRun(cpu, decoded, &executed);
+    NEXT();
+#else
+    const DECODED *chained = NULL; // set by CHAIN() when the next record is already known
+    for(;;) {
+        if(executed >= maxSteps || cpu->registers[PROGRAM_COUNTER] == cpu->programEnd)
+            break;
+        decoded = (chained != NULL)? chained : lookupDecoded(cpu, cpu->registers[PROGRAM_COUNTER]);
+        chained = NULL;
+        cpu->registers[PROGRAM_COUNTER] += 4;
+        executed++;
+        if(decoded->condition != CONDITION_ALWAYS && !conditionPassed(cpu, decoded->condition)) {
+            PROFILE(cpu, decoded, false);
+            if(SKIPPABLE_RUN(decoded) && fusable(cpu, decoded, executed, maxSteps))
+                skipRun(cpu, decoded, &executed);
+            continue;
+        }
+        PROFILE(cpu, decoded, true);
+
+        if(decoded->fusedLength > 1 && fusable(cpu, decoded, executed, maxSteps))
+            CHAIN(runFused(cpu, decoded, &returns, &executed));
+
+        switch(decoded->variant) {
+#endif
+
+    LOGICAL(AND, N & OP2)
+    LOGICAL(EOR, N ^ OP2)
+    ARITHMETIC(SUB, N, ~OP2, 1)
+    ARITHMETIC(RSB, OP2, ~N, 1)
+    ARITHMETIC(ADD, N, OP2, 0)
+    ARITHMETIC(ADC, N, OP2, carryFlag(cpu))
+    ARITHMETIC(SBC, N, ~OP2, carryFlag(cpu))
+    ARITHMETIC(RSC, OP2, ~N, carryFlag(cpu))
+    TEST(TST, N & OP2)
+    TEST(TEQ, N ^ OP2)
+    COMPARE(CMP, N, ~OP2, 1)
+    COMPARE(CMN, N, OP2, 0)
+    LOGICAL(ORR, N | OP2)
+    LOGICAL(MOV, OP2)
+    LOGICAL(BIC, N & ~OP2)
+    LOGICAL(MVN, ~OP2)
+
+#if COMPUTED_GOTO
+BRANCH_TARGET:
+    CHAIN(takeBranch(cpu, decoded, &returns));
+RETURN_TARGET:
+    decoded->handler(cpu, decoded);
+    CHAIN(returnTarget(cpu, &returns));
+DATA_TRANSFER_TARGET:
+    decoded->handler(cpu, decoded); // single or block
+    NEXT();
+HANDLER_TARGET:
+    decoded->handler(cpu, decoded);
+    NEXT();
+INTERUPT_TARGET:
+    doInterupt(cpu, decoded);
+    NEXT();
+UNDEFINED_TARGET:
+    doUndefined(cpu, decoded);
+    NEXT();
+FUSED_TARGET:
+    if(!fusable(cpu, decoded, executed, maxSteps))
+        goto *targets[decoded->variant];
+    CHAIN(runFused(cpu, decoded, &returns, &executed));
+done:
+#else
+        case VARIANT_BRANCH:
+            CHAIN(takeBranch(cpu, decoded, &returns));
+        case VARIANT_RETURN:
+            decoded->handler(cpu, decoded);
+            CHAIN(returnTarget(cpu, &returns));
+        case VARIANT_DATA_TRANSFER:
+            decoded->handler(cpu, decoded); // single or block
+            NEXT();
+        case VARIANT_HANDLER:
+            decoded->handler(cpu, decoded);
+            NEXT();
+        case VARIANT_INTERUPT:
+            doInterupt(cpu, decoded);
+            NEXT();
+        default:
+            doUndefined(cpu, decoded);
+            NEXT();
+        }
+    }
+#endif
+
+    return executed;
+}
@@ -0,0 +1,234 @@
+/*
+ * Execution trace (see trace.h for the record and file format)
+ */
+
+#define _POSIX_C_SOURCE 200809L // for nanosleep when compiling with -std=c11
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "trace.h"
+#include "flags.h"
+
+
+#define TRACE_RING_SIZE  (1 << 16)  // records, a power of 2
+#define TRACE_MAX_RANGES 16
+#define TRACE_FILE_BUFFER (1 << 20)
+
+typedef struct TRACE_RANGE {
+    REGISTER start;
+    REGISTER end;
+} TRACE_RANGE;
+
+struct TRACE_LOG {
+    TRACE_RECORD *ring;
+    TRACE_RANGE ranges[TRACE_MAX_RANGES];
+    int rangeCount;
+    bool gap;                   // the machine's side, an instruction was left out since the last record
+
+    // the producer and consumer each write their own index, kept on separate cache lines
+    _Alignas(64) _Atomic uint64_t head;     // next record the machine writes
+    _Alignas(64) _Atomic uint64_t tail;     // next record the writer reads
+    _Alignas(64) atomic_bool stopping;
+
+    // the writer thread's side
+    pthread_t writer;
+    FILE *file;
+    char *fileBuffer;
+    REGISTER nextAddress;       // encoder state, mirrored by the decoder
+    REGISTER registers[16];
+    BYTE status;
+    REGISTER cacheAddress[TRACE_WORD_CACHE];
+    uint32_t cacheWord[TRACE_WORD_CACHE];
+};
+
+
+static void putVarint(FILE *file, uint32_t value) {
+    while(value >= 0x80) {
+        putc((int)(value & 0x7f) | 0x80, file);
+        value >>= 7;
+    }
+    putc((int)value, file);
+}
+
+static void putSigned(FILE *file, uint32_t difference) {
+    putVarint(file, (difference << 1) ^ (uint32_t)((int32_t)difference >> 31)); // zigzag
+}
+
+static void encodeRecord(TRACE_LOG *trace, const TRACE_RECORD *record) {
+    FILE *file = trace->file;
+    uint32_t slot = (record->address >> 2) & (TRACE_WORD_CACHE - 1);
+    uint32_t changed = 0;
+    BYTE tag = (record->passed? TRACE_PASSED : 0) | (record->resync? TRACE_RESYNC : 0);
+
+    if(record->address != trace->nextAddress)
+        tag |= TRACE_JUMP;
+    if(trace->cacheAddress[slot] != record->address || trace->cacheWord[slot] != record->word)
+        tag |= TRACE_NEW_WORD;
+    if(record->status != trace->status)
+        tag |= TRACE_STATUS;
+    for(int i = 0; i < PROGRAM_COUNTER; i++) {
+        if(record->registers[i] != trace->registers[i])
+            changed |= 1u << i;
+    }
+    if(changed)
+        tag |= TRACE_REGISTERS;
+
+    putc(tag, file);
+    if(tag & TRACE_JUMP)
+        putSigned(file, record->address - trace->nextAddress);
+    if(tag & TRACE_NEW_WORD) {
+        for(int i = 0; i < 4; i++)
+            putc((int)(record->word >> (i * 8)) & 0xff, file);
+        trace->cacheAddress[slot] = record->address;
+        trace->cacheWord[slot] = record->word;
+    }
+    if(tag & TRACE_STATUS)
+        putc(record->status, file);
+    if(tag & TRACE_REGISTERS) {
+        putVarint(file, changed);
+        for(int i = 0; i < PROGRAM_COUNTER; i++) {
+            if(changed & (1u << i))
+                putSigned(file, record->registers[i] - trace->registers[i]);
+        }
+    }
+
+    trace->nextAddress = record->address + 4;
+    trace->status = record->status;
+    memcpy(trace->registers, record->registers, sizeof(trace->registers));
+}
+
+/*
+ * The writer thread, empties the ring until the trace is stopped and the ring is empty
+ */
+static void *writeTrace(void *argument) {
+    TRACE_LOG *trace = argument;
+    uint64_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+
+    for(;;) {
+        bool stopping = atomic_load_explicit(&trace->stopping, memory_order_acquire);
+        uint64_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+
+        if(tail == head) {
+            if(stopping)
+                break;
+            struct timespec pause = { 0, 100000 }; // 0.1ms, the ring holds far more than that
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        for(; tail != head; tail++)
+            encodeRecord(trace, &trace->ring[tail & (TRACE_RING_SIZE - 1)]);
+        atomic_store_explicit(&trace->tail, tail, memory_order_release);
+    }
+    return NULL;
+}
+
+bool startTrace(CPU *cpu, const char *fileName) {
+    if(cpu->traceLog != NULL)
+        stopTrace(cpu);
+
+    TRACE_LOG *trace = calloc(1, sizeof(TRACE_LOG));
+    if(trace == NULL)
+        return false;
+    trace->ring = malloc(TRACE_RING_SIZE * sizeof(TRACE_RECORD));
+    trace->fileBuffer = malloc(TRACE_FILE_BUFFER);
+    trace->file = fopen(fileName, "wb");
+    if(trace->ring == NULL || trace->fileBuffer == NULL || trace->file == NULL) {
+        printf("Error creating %s\n", fileName);
+        if(trace->file != NULL)
+            fclose(trace->file);
+        free(trace->ring);
+        free(trace->fileBuffer);
+        free(trace);
+        return false;
+    }
+    setvbuf(trace->file, trace->fileBuffer, _IOFBF, TRACE_FILE_BUFFER);
+
+    for(int i = 0; i < TRACE_WORD_CACHE; i++)
+        trace->cacheAddress[i] = 1; // never a word address, so nothing is cached
+    atomic_init(&trace->head, 0);
+    atomic_init(&trace->tail, 0);
+    atomic_init(&trace->stopping, false);
+
+    uint32_t header[2] = { TRACE_MAGIC, TRACE_VERSION };
+    for(int i = 0; i < 2; i++) {
+        for(int b = 0; b < 4; b++)
+            putc((int)(header[i] >> (b * 8)) & 0xff, trace->file);
+    }
+
+    if(pthread_create(&trace->writer, NULL, writeTrace, trace) != 0) {
+        printf("Unable to start the trace writer\n");
+        fclose(trace->file);
+        free(trace->ring);
+        free(trace->fileBuffer);
+        free(trace);
+        return false;
+    }
+
+    cpu->traceLog = trace;
+    return true;
+}
+
+bool addTraceRange(CPU *cpu, REGISTER start, REGISTER end) {
+    TRACE_LOG *trace = cpu->traceLog;
+    if(trace == NULL || trace->rangeCount == TRACE_MAX_RANGES)
+        return false;
+    trace->ranges[trace->rangeCount++] = (TRACE_RANGE){ start & cpu->memoryMask, end };
+    return true;
+}
+
+void stopTrace(CPU *cpu) {
+    TRACE_LOG *trace = cpu->traceLog;
+    if(trace == NULL)
+        return;
+
+    atomic_store_explicit(&trace->stopping, true, memory_order_release);
+    pthread_join(trace->writer, NULL);
+
+    if(ferror(trace->file) | fclose(trace->file))
+        printf("Error writing the trace, it is incomplete\n");
+    else if(VERBOSE)
+        printf("\tTraced %llu instructions\n", (unsigned long long)atomic_load(&trace->head));
+
+    free(trace->ring);
+    free(trace->fileBuffer);
+    free(trace);
+    cpu->traceLog = NULL;
+}
+
+void traceInstruction(CPU *cpu, REGISTER address, const DECODED *decoded, bool passed) {
+    TRACE_LOG *trace = cpu->traceLog;
+
+    if(trace->rangeCount > 0) {
+        int i;
+        for(i = 0; i < trace->rangeCount; i++) {
+            if(address >= trace->ranges[i].start && address < trace->ranges[i].end)
+                break;
+        }
+        if(i == trace->rangeCount) {
+            trace->gap = true;
+            return;
+        }
+    }
+
+    // only this thread writes head, and the writer only ever moves tail forward, so a full ring can only empty
+    uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    while(head - atomic_load_explicit(&trace->tail, memory_order_acquire) == TRACE_RING_SIZE)
+        sched_yield();
+
+    TRACE_RECORD *record = &trace->ring[head & (TRACE_RING_SIZE - 1)];
+    record->address = address;
+    record->word = decoded->instruction.data32;
+    record->status = getStatusRegister(cpu);
+    record->passed = passed;
+    record->resync = trace->gap;
+    trace->gap = false;
+    memcpy(record->registers, cpu->registers, sizeof(record->registers));
+    atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+}
@@ -0,0 +1,68 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "armpit.h"
+
+
+/*
+ * Execution Trace
+ *
+ * A binary record of every instruction a machine executes, for looking at afterwards with armpit-trace. It replaces
+ * reading the TRACE printf output, which is only meant for stepping through a program by hand.
+ *
+ * While a trace is running (startTrace()) the machine runs the reference loop whatever engine it was given, and
+ * step() calls traceInstruction() once each instruction has executed. That copies a fixed size TRACE_RECORD into a
+ * ring buffer and returns; a writer thread empties the ring, compresses the records and writes them to the file. The
+ * ring has a single producer (the thread running the machine) and a single consumer (the writer), so neither side
+ * takes a lock. If the writer falls behind the machine waits for it, no records are lost.
+ *
+ * Tracing can be limited to address ranges (addTraceRange()), to leave out loops that aren't of interest. With no
+ * ranges every instruction is traced. The first record traced after instructions were left out is marked resync.
+ */
+typedef struct TRACE_RECORD {
+    REGISTER address;           // of the instruction
+    uint32_t word;
+    BYTE status;                // status register after it executed
+    bool passed;                // condition passed
+    bool resync;                // instructions ran untraced since the last record
+    REGISTER registers[16];     // after it executed
+} TRACE_RECORD;
+
+bool startTrace(CPU *, const char *); // file name, false if it can't be created
+bool addTraceRange(CPU *, REGISTER, REGISTER); // start, end (exclusive), false once the table is full
+void stopTrace(CPU *); // writes out what is left in the ring and closes the file
+void traceInstruction(CPU *, REGISTER, const DECODED *, bool); // address, instruction, condition passed
+
+
+/*
+ * Trace File Format
+ *
+ * An 8 byte header (TRACE_MAGIC and TRACE_VERSION, 32 bits each, little endian), then one record per instruction. A
+ * record is a tag byte followed by the fields its bits say are present, in this order:
+ *
+ *      TRACE_JUMP          the address isn't 4 on from the last one: signed varint of the difference
+ *      TRACE_NEW_WORD      the word isn't the one last seen at an address with the same low 8 word address bits
+ *                          (a 256 entry cache kept by both sides): the word, 4 bytes little endian
+ *      TRACE_STATUS        the status register changed: the new value, 1 byte
+ *      TRACE_REGISTERS     registers changed: varint mask of which (R0 to R14), then a signed varint of the
+ *                          difference from the old value of each, lowest register first
+ *      TRACE_RESYNC        no fields, instructions that weren't traced ran before this one, so what changed since
+ *                          the last record isn't what this instruction changed (version 2 on)
+ *
+ * Varints are 7 bits a byte, least significant first, with the top bit set on all but the last byte. Signed values
+ * are zigzag encoded first, so small differences either way are short. The PC isn't recorded, it is the address of
+ * the next record. Everything starts at zero: the registers, the status register and the address before the first.
+ */
+#define TRACE_MAGIC     0x544d5241u // "ARMT"
+#define TRACE_VERSION   2
+
+#define TRACE_PASSED    (1<<0)
+#define TRACE_JUMP      (1<<1)
+#define TRACE_NEW_WORD  (1<<2)
+#define TRACE_STATUS    (1<<3)
+#define TRACE_REGISTERS (1<<4)
+#define TRACE_RESYNC    (1<<5)
+
+#define TRACE_WORD_CACHE 256
+
+#endif
@@ -0,0 +1,207 @@
+/*
+ * armpit-trace - prints a trace written with armpit --trace as text.
+ *
+ * Compile using:
+ * 			cmake --build <build directory> --target armpit-trace
+ *
+ * One line per instruction: its address, the instruction word, its condition and type, then either "skipped" if the
+ * condition failed or the registers it changed with their new values, and the flags if they changed. The first
+ * instruction traced after a gap (see --trace-range) is followed by a "registers now" line with every register and
+ * the flags instead, since untraced instructions changed them too. The file format is described in trace.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "trace.h"
+
+
+char USAGE[] = "\nUsage: armpit-trace [arguments] <trace file>\n\nArguments:\n -n, --count <N>\tonly print the first N instructions\n -s, --summary\tonly print the number of instructions, skipped instructions and jumps\n -h\t\thelp";
+
+static const char *optString = "n:sh";
+static const struct option longOptions[] = {
+    { "count", required_argument, NULL, 'n' },
+    { "summary", no_argument, NULL, 's' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static const char *conditionNames[] = { "EQ", "NE", "CS", "CC", "MI", "PL", "VS", "VC",
+                                        "HI", "LS", "GE", "LT", "GT", "LE", "AL", "NV" };
+static const char *typeNames[] = { "ALU", "Branch", "Data Transfer", "Interupt", "Undefined", "Multiply" };
+
+
+/*
+ * Reads a varint, false at the end of the file
+ */
+static bool getVarint(FILE *file, uint32_t *value) {
+    *value = 0;
+    for(int shift = 0; shift < 35; shift += 7) {
+        int c = getc(file);
+        if(c == EOF)
+            return false;
+        *value |= (uint32_t)(c & 0x7f) << shift;
+        if(!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static bool getSigned(FILE *file, uint32_t *value) {
+    if(!getVarint(file, value))
+        return false;
+    *value = (*value >> 1) ^ (0u - (*value & 1)); // undo the zigzag
+    return true;
+}
+
+/*
+ * Multiplies are UNDEFINED to getInstructionType(), they're named on their own
+ */
+static const char *typeName(INSTRUCTION instruction) {
+    if((instruction.data32 & 0x0fc000f0) == 0x00000090)
+        return typeNames[UNDEFINED + 1];
+    return typeNames[getInstructionType(instruction)];
+}
+
+static bool getWord(FILE *file, uint32_t *value) {
+    BYTE bytes[4];
+    if(fread(bytes, 1, 4, file) != 4)
+        return false;
+    *value = (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+    return true;
+}
+
+static void displayStatus(BYTE status) {
+    printf("  %c%c%c%c", (status & STATUS_N)? 'N' : 'n', (status & STATUS_Z)? 'Z' : 'z',
+           (status & STATUS_C)? 'C' : 'c', (status & STATUS_V)? 'V' : 'v');
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t maxRecords = UINT64_MAX;
+    bool summary = false;
+    char *endPtr;
+
+    int opt = getopt_long(argc, argv, optString, longOptions, NULL);
+    while(opt != -1) {
+        switch(opt) {
+            case 'n':
+                maxRecords = strtoull(optarg, &endPtr, 10);
+                if(*optarg == '\0' || *endPtr != '\0') {
+                    printf("Invalid count: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 's':
+                summary = true;
+                break;
+            case 'h':
+                puts(USAGE);
+                return EXIT_SUCCESS;
+            default:
+                puts(USAGE);
+                return EXIT_FAILURE;
+        }
+        opt = getopt_long(argc, argv, optString, longOptions, NULL);
+    }
+    if(optind != argc - 1) {
+        puts(USAGE);
+        return EXIT_FAILURE;
+    }
+
+    const char *fileName = argv[optind];
+    FILE *file = fopen(fileName, "rb");
+    if(file == NULL) {
+        printf("Error opening %s\n", fileName);
+        return EXIT_FAILURE;
+    }
+
+    uint32_t magic, version;
+    if(!getWord(file, &magic) || !getWord(file, &version) || magic != TRACE_MAGIC) {
+        printf("%s is not an ARMpit trace\n", fileName);
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+    if(version == 0 || version > TRACE_VERSION) {
+        printf("%s is a version %u trace, only versions up to %u are supported\n", fileName, version, TRACE_VERSION);
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+
+    // the same state the writer kept, see trace.h
+    REGISTER registers[16] = { 0 };
+    REGISTER nextAddress = 0;
+    BYTE status = 0;
+    uint32_t cacheWord[TRACE_WORD_CACHE] = { 0 };
+    uint64_t records = 0, skipped = 0, jumps = 0;
+    bool complete = true;
+    int tag;
+
+    while(records < maxRecords && (tag = getc(file)) != EOF) {
+        REGISTER address = nextAddress;
+        uint32_t value, changed = 0;
+
+        if(tag & TRACE_JUMP) {
+            complete = getSigned(file, &value);
+            address += value;
+            jumps++;
+        }
+
+        uint32_t slot = (address >> 2) & (TRACE_WORD_CACHE - 1);
+        if(complete && (tag & TRACE_NEW_WORD))
+            complete = getWord(file, &cacheWord[slot]);
+        if(complete && (tag & TRACE_STATUS)) {
+            int c = getc(file);
+            complete = c != EOF;
+            status = (BYTE)c;
+        }
+        if(complete && (tag & TRACE_REGISTERS)) {
+            complete = getVarint(file, &changed);
+            for(int i = 0; complete && i < PROGRAM_COUNTER; i++) {
+                if(changed & (1u << i)) {
+                    complete = getSigned(file, &value);
+                    registers[i] += value;
+                }
+            }
+        }
+        if(!complete)
+            break;
+
+        INSTRUCTION instruction = { .data32 = cacheWord[slot] };
+        records++;
+        skipped += !(tag & TRACE_PASSED);
+        nextAddress = address + 4;
+        if(summary)
+            continue;
+
+        printf("%08X  %08X  %s  %-13s", address, instruction.data32, conditionNames[instruction.data32 >> COND_CODE_POS],
+               typeName(instruction));
+        if(!(tag & TRACE_PASSED))
+            printf("  skipped");
+        if(tag & TRACE_RESYNC) {
+            printf("\n  registers now");
+            for(int i = 0; i < PROGRAM_COUNTER; i++)
+                printf("  R%d=%08X", i, registers[i]);
+            displayStatus(status);
+            printf("\n");
+            continue;
+        }
+        for(int i = 0; i < PROGRAM_COUNTER; i++) {
+            if(changed & (1u << i))
+                printf("  R%d=%08X", i, registers[i]);
+        }
+        if(tag & TRACE_STATUS)
+            displayStatus(status);
+        printf("\n");
+    }
+
+    if(!complete)
+        printf("%s ends part way through a record, the trace was not finished\n", fileName);
+    if(summary)
+        printf("%llu instructions, %llu skipped, %llu jumps\n", (unsigned long long)records,
+               (unsigned long long)skipped, (unsigned long long)jumps);
+
+    fclose(file);
+    return complete? EXIT_SUCCESS : EXIT_FAILURE;
+}
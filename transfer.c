@@ -0,0 +1,203 @@
+/*
+ * Data Transfer instructions (LDR, STR, LDM, STM)
+ *
+ * Single data transfer:
+ * -------------------------------------------------------------------------------
+ * | Cond | 01 | I | P | U | B | W | L | Rn | Rd | Offset                        |
+ * -------------------------------------------------------------------------------
+ *
+ * Block data transfer:
+ * -------------------------------------------------------------------------------
+ * | Cond | 100 | P | U | S | W | L | Rn | Register List                        |
+ * -------------------------------------------------------------------------------
+ *
+ *      P   pre (1) or post (0) index: add the offset before or after the transfer
+ *      U   up (1) or down (0): add or subtract the offset
+ *      B   byte (1) or word (0)
+ *      S   LDM with R15 in the list restores the PSR from it, otherwise the user mode registers are transferred
+ *          whatever the current mode (modes.c)
+ *      W   write the address back to Rn (always done when post indexed)
+ *      L   load (1) or store (0)
+ *
+ * The offset of a single transfer is a 12 bit immediate (I = 0) or a register shifted by an immediate amount, which
+ * the decoder has set up the same way as operand 2 of a data processing instruction, so getOperand2() gives it.
+ *
+ * Loads only read memory. Stores go through writeMemory() so that any decoded or translated copy of what they
+ * overwrite is thrown away, apart from block transfers to pages with no code in them, which go straight to memory
+ * (directMemory()). A block with a contiguous register list is then a single copy between memory and the registers.
+ */
+
+#include <stdio.h>
+
+#include "flags.h"
+#include "memory.h"
+
+
+#define TRANSFER_PRE       (1u << 24)
+#define TRANSFER_UP        (1u << 23)
+#define TRANSFER_BYTE      (1u << 22)
+#define TRANSFER_PSR       (1u << 22) // the S bit of a block transfer
+#define TRANSFER_WRITEBACK (1u << 21)
+#define TRANSFER_LOAD      (1u << 20)
+
+
+// R15 as a base register is the address of the instruction + 8
+static inline REGISTER baseRegister(CPU *cpu, int number) {
+    return (number == PROGRAM_COUNTER)? cpu->registers[PROGRAM_COUNTER] + 4 : cpu->registers[number];
+}
+
+/*
+ * R15 as STR and STM store it: the address of the instruction + 12, with the PSR in the bits the PC doesn't use
+ * (N Z C V I F in bits 31..26, the mode in bits 1..0)
+ */
+static inline REGISTER storedPc(CPU *cpu) {
+    return pcWithPsr(cpu, cpu->registers[PROGRAM_COUNTER] + 8);
+}
+
+/*
+ * A load into R15 only changes the PC, unless it is an LDM with the S bit set which also restores the PSR. User mode
+ * can only change the flags that way, not the interrupt disable bits or the mode.
+ */
+static void loadPc(CPU *cpu, REGISTER value, bool withPsr) {
+    cpu->registers[PROGRAM_COUNTER] = value & PC_MASK;
+    if(withPsr)
+        restorePsr(cpu, value);
+}
+
+void doDataTransfer(CPU *cpu, const DECODED *decoded) {
+    uint32_t word = decoded->instruction.data32;
+    int carry = carryFlag(cpu); // only RRX reads it, and the carry out is thrown away
+    REGISTER offset = getOperand2(cpu, decoded, &carry);
+    REGISTER base = baseRegister(cpu, decoded->regN);
+    REGISTER indexed = (word & TRANSFER_UP)? base + offset : base - offset;
+    REGISTER address = (word & TRANSFER_PRE)? indexed : base;
+
+    if(TRACE)
+        printf("\t%s%s R%d, %08X\n", (word & TRANSFER_LOAD)? "LDR" : "STR", (word & TRANSFER_BYTE)? "B" : "",
+               decoded->regDest, address);
+
+    // a store of Rn stores the value from before the write back
+    REGISTER value = (decoded->regDest == PROGRAM_COUNTER)? storedPc(cpu) : cpu->registers[decoded->regDest];
+
+    if((!(word & TRANSFER_PRE) || (word & TRANSFER_WRITEBACK)) && decoded->regN != PROGRAM_COUNTER)
+        cpu->registers[decoded->regN] = indexed;
+
+    if(word & TRANSFER_LOAD) {
+        if(word & TRANSFER_BYTE) {
+            value = readMemoryByte(cpu, address);
+        } else {
+            // an unaligned word load rotates the aligned word so the addressed byte is at the bottom
+            int rotate = (address & 3) * 8;
+            value = readMemoryWord(cpu, address);
+            value = (value >> rotate) | (value << ((32 - rotate) & 31));
+        }
+        if(decoded->regDest == PROGRAM_COUNTER)
+            loadPc(cpu, value, false);
+        else
+            cpu->registers[decoded->regDest] = value; // a load into Rn wins over the write back
+    } else if(word & TRANSFER_BYTE) {
+        writeMemoryByte(cpu, address, (BYTE)value);
+    } else {
+        writeMemory(cpu, address, (INSTRUCTION){ .data32 = value });
+    }
+}
+
+// true if the set bits are all next to each other
+static inline bool contiguous(uint32_t list) {
+    list >>= __builtin_ctz(list);
+    return (list & (list + 1)) == 0;
+}
+
+/*
+ * STM or LDM with S (without R15 in the list of an LDM) in a privileged mode, which transfers the user mode registers.
+ * They are found where they are rather than by switching mode and back; nothing in the way of copies is worth having
+ * for what is an interrupt handler saving or restoring a user context.
+ */
+static void transferUserRegisters(CPU *cpu, uint32_t word, uint32_t list, REGISTER address) {
+    for(; list != 0; list &= list - 1, address += 4) {
+        int number = __builtin_ctz(list);
+        REGISTER *user = modeRegister(cpu, MODE_USER, number);
+        if(word & TRANSFER_LOAD)
+            *user = readMemoryWord(cpu, address);
+        else
+            writeMemory(cpu, address, (INSTRUCTION){ .data32 = (number == PROGRAM_COUNTER)? storedPc(cpu) : *user });
+    }
+}
+
+/*
+ * The lowest register goes to or from the lowest address. With S, unless it is an LDM with R15 in the list, the user
+ * mode registers are transferred rather than the current mode's.
+ */
+void doBlockTransfer(CPU *cpu, const DECODED *decoded) {
+    uint32_t word = decoded->instruction.data32;
+    uint32_t list = word & 0xffff;
+    uint32_t others = list & 0x7fff; // everything but R15, which needs more than a copy
+    uint32_t count = (uint32_t)__builtin_popcount(list);
+    REGISTER *registers = cpu->registers;
+    int n = decoded->regN;
+
+    if(list == 0)
+        return;
+
+    REGISTER base = baseRegister(cpu, n);
+    REGISTER final = (word & TRANSFER_UP)? base + 4 * count : base - 4 * count;
+    REGISTER lowest = (word & TRANSFER_UP)? base : final;
+    if(!(word & TRANSFER_PRE) == !(word & TRANSFER_UP))
+        lowest += 4; // IB and DA, the first word is one along from the base
+    lowest &= ~3u;
+    bool writeBack = (word & TRANSFER_WRITEBACK) && n != PROGRAM_COUNTER;
+
+    if(TRACE)
+        printf("\t%s R%d, {%04X} at %08X\n", (word & TRANSFER_LOAD)? "LDM" : "STM", n, list, lowest);
+
+    if((word & TRANSFER_PSR) && (cpu->statusRegister & MODE_MASK) != MODE_USER
+            && !((word & TRANSFER_LOAD) && (list & (1u << PROGRAM_COUNTER)))) {
+        transferUserRegisters(cpu, word, list, lowest);
+        if(writeBack)
+            registers[n] = final; // of the current mode's Rn
+        return;
+    }
+
+    if(word & TRANSFER_LOAD) {
+        if(writeBack)
+            registers[n] = final; // if Rn is loaded that wins
+        const BYTE *memory = directMemory(cpu, lowest, 4 * count, false);
+        if(memory != NULL && others != 0 && contiguous(others)) {
+            memcpy(&registers[__builtin_ctz(others)], memory, 4 * (size_t)__builtin_popcount(others));
+        } else {
+            REGISTER address = lowest;
+            for(uint32_t remaining = others; remaining != 0; remaining &= remaining - 1, address += 4)
+                registers[__builtin_ctz(remaining)] = readMemoryWord(cpu, address);
+        }
+        if(list & (1u << PROGRAM_COUNTER))
+            loadPc(cpu, readMemoryWord(cpu, lowest + 4 * (count - 1)), (word & TRANSFER_PSR) != 0);
+        return;
+    }
+
+    // Rn is stored as it was if it is the first register in the list, otherwise as it is after the write back
+    if(writeBack && (list & ((1u << n) - 1)))
+        registers[n] = final;
+    REGISTER pc = (list & (1u << PROGRAM_COUNTER))? storedPc(cpu) : 0;
+
+    BYTE *memory = directMemory(cpu, lowest, 4 * count, true);
+    if(memory != NULL) {
+        if(others != 0 && contiguous(others)) {
+            memcpy(memory, &registers[__builtin_ctz(others)], 4 * (size_t)__builtin_popcount(others));
+        } else {
+            BYTE *next = memory;
+            for(uint32_t remaining = others; remaining != 0; remaining &= remaining - 1, next += 4)
+                memcpy(next, &registers[__builtin_ctz(remaining)], 4);
+        }
+        if(list & (1u << PROGRAM_COUNTER))
+            memcpy(memory + 4 * (count - 1), &pc, 4);
+    } else {
+        REGISTER address = lowest;
+        for(uint32_t remaining = others; remaining != 0; remaining &= remaining - 1, address += 4)
+            writeMemory(cpu, address, (INSTRUCTION){ .data32 = registers[__builtin_ctz(remaining)] });
+        if(list & (1u << PROGRAM_COUNTER))
+            writeMemory(cpu, address, (INSTRUCTION){ .data32 = pc });
+    }
+
+    if(writeBack)
+        registers[n] = final;
+}